@@ -0,0 +1,864 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Runs every encoder, the deflate backend that was built in, the pixel
+ * converter, the damage refinery and the resampler over a few synthetic
+ * desktop scenes and prints the results as JSON, one object per line of the
+ * "results" array.
+ *
+ * Scenes:
+ *  - typing: a few glyphs and a cursor change per frame
+ *  - scrolling: a text area moves up by one line per frame
+ *  - video: a window in the middle of the screen changes completely
+ *  - full: every pixel changes
+ */
+
+#include "rfb-proto.h"
+#include "vec.h"
+#include "neatvnc.h"
+#include "fb.h"
+#include "pixels.h"
+#include "enc-util.h"
+#include "raw-encoding.h"
+#include "zrle.h"
+#include "tight.h"
+#include "damage-refinery.h"
+#include "resampler.h"
+#include "buf-pool.h"
+#include "deflate.h"
+#include "rcbuf.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <aml.h>
+#include <pixman.h>
+#include <libdrm/drm_fourcc.h>
+
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+#define GLYPHS_PER_FRAME 4
+
+#define VIDEO_WIDTH 640
+#define VIDEO_HEIGHT 360
+
+enum scene_type {
+	SCENE_TYPING,
+	SCENE_SCROLLING,
+	SCENE_VIDEO,
+	SCENE_FULL,
+	SCENE_COUNT,
+};
+
+static const char* scene_names[SCENE_COUNT] = {
+	[SCENE_TYPING] = "typing",
+	[SCENE_SCROLLING] = "scrolling",
+	[SCENE_VIDEO] = "video",
+	[SCENE_FULL] = "full",
+};
+
+struct scene {
+	enum scene_type type;
+	struct nvnc_fb* fb;
+	uint32_t* pixels;
+	int width;
+	int height;
+	int frame;
+	uint32_t seed;
+	struct pixman_region16 damage;
+};
+
+struct bench_result {
+	int n_frames;
+	uint64_t time_us;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+
+struct bench_options {
+	int width;
+	int height;
+	int warmup;
+	int iterations;
+};
+
+static bool is_first_result = true;
+
+static uint64_t gettime_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static uint32_t scene_rand(struct scene* scene)
+{
+	// xorshift32
+	uint32_t x = scene->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	scene->seed = x;
+	return x;
+}
+
+static void scene_fill(struct scene* scene, int x, int y, int width,
+		int height, uint32_t colour)
+{
+	for (int j = y; j < y + height; ++j)
+		for (int i = x; i < x + width; ++i)
+			scene->pixels[i + j * scene->width] = colour;
+}
+
+/* Glyphs are random dark strokes on a light background, which is close enough
+ * to anti-aliased text as far as the encoders are concerned.
+ */
+static void scene_draw_glyph(struct scene* scene, int x, int y)
+{
+	for (int j = y; j < y + GLYPH_HEIGHT; ++j)
+		for (int i = x; i < x + GLYPH_WIDTH; ++i) {
+			uint32_t r = scene_rand(scene);
+			uint32_t v = (r & 3) ? 0xf0 : (r >> 8) & 0x7f;
+			scene->pixels[i + j * scene->width] =
+				v | v << 8 | v << 16;
+		}
+}
+
+static void scene_draw_desktop(struct scene* scene)
+{
+	for (int y = 0; y < scene->height; ++y)
+		for (int x = 0; x < scene->width; ++x)
+			scene->pixels[x + y * scene->width] =
+				(x * 255 / scene->width) << 16 |
+				(y * 255 / scene->height) << 8 | 0x80;
+
+	// A window with some text in it
+	int wx = scene->width / 8;
+	int wy = scene->height / 8;
+	int ww = scene->width * 3 / 4;
+	int wh = scene->height * 3 / 4;
+
+	scene_fill(scene, wx, wy, ww, wh, 0xf0f0f0);
+
+	for (int y = wy; y + GLYPH_HEIGHT <= wy + wh; y += GLYPH_HEIGHT * 2)
+		for (int x = wx; x + GLYPH_WIDTH <= wx + ww / 2;
+				x += GLYPH_WIDTH)
+			scene_draw_glyph(scene, x, y);
+}
+
+static int scene_init(struct scene* scene, enum scene_type type, int width,
+		int height)
+{
+	memset(scene, 0, sizeof(*scene));
+
+	scene->fb = nvnc_fb_new(width, height, DRM_FORMAT_XRGB8888, width);
+	if (!scene->fb)
+		return -1;
+
+	scene->type = type;
+	scene->pixels = nvnc_fb_get_addr(scene->fb);
+	scene->width = width;
+	scene->height = height;
+	scene->seed = 0x12345678;
+	pixman_region_init(&scene->damage);
+
+	scene_draw_desktop(scene);
+	return 0;
+}
+
+static void scene_destroy(struct scene* scene)
+{
+	pixman_region_fini(&scene->damage);
+	nvnc_fb_unref(scene->fb);
+}
+
+static void scene_step_typing(struct scene* scene)
+{
+	int wx = scene->width / 8;
+	int wy = scene->height / 8;
+	int columns = (scene->width * 3 / 4) / GLYPH_WIDTH;
+	int rows = (scene->height * 3 / 4) / GLYPH_HEIGHT;
+
+	for (int i = 0; i < GLYPHS_PER_FRAME; ++i) {
+		int n = scene->frame * GLYPHS_PER_FRAME + i;
+		int x = wx + (n % columns) * GLYPH_WIDTH;
+		int y = wy + ((n / columns) % rows) * GLYPH_HEIGHT;
+
+		scene_draw_glyph(scene, x, y);
+		pixman_region_union_rect(&scene->damage, &scene->damage, x, y,
+				GLYPH_WIDTH + 2, GLYPH_HEIGHT);
+	}
+}
+
+static void scene_step_scrolling(struct scene* scene)
+{
+	int wx = scene->width / 8;
+	int wy = scene->height / 8;
+	int ww = scene->width * 3 / 4;
+	int wh = scene->height * 3 / 4;
+
+	for (int y = wy; y < wy + wh - GLYPH_HEIGHT; ++y)
+		memmove(&scene->pixels[wx + y * scene->width],
+				&scene->pixels[wx + (y + GLYPH_HEIGHT) *
+				scene->width], ww * 4);
+
+	int last_line = wy + wh - GLYPH_HEIGHT;
+	scene_fill(scene, wx, last_line, ww, GLYPH_HEIGHT, 0xf0f0f0);
+	for (int x = wx; x + GLYPH_WIDTH <= wx + ww / 2; x += GLYPH_WIDTH)
+		scene_draw_glyph(scene, x, last_line);
+
+	pixman_region_union_rect(&scene->damage, &scene->damage, wx, wy, ww,
+			wh);
+}
+
+static void scene_step_video(struct scene* scene)
+{
+	int vw = scene->width < VIDEO_WIDTH ? scene->width : VIDEO_WIDTH;
+	int vh = scene->height < VIDEO_HEIGHT ? scene->height : VIDEO_HEIGHT;
+	int vx = (scene->width - vw) / 2;
+	int vy = (scene->height - vh) / 2;
+	int t = scene->frame * 4;
+
+	// Smooth moving gradients with a bit of noise, like camera footage
+	for (int y = 0; y < vh; ++y)
+		for (int x = 0; x < vw; ++x) {
+			uint32_t noise = scene_rand(scene) & 0x0f;
+			uint32_t r = ((x + t) & 0xff) ^ noise;
+			uint32_t g = ((y + t / 2) & 0xff) ^ noise;
+			uint32_t b = ((x + y) / 4 & 0xff) ^ noise;
+			scene->pixels[vx + x + (vy + y) * scene->width] =
+				r << 16 | g << 8 | b;
+		}
+
+	pixman_region_union_rect(&scene->damage, &scene->damage, vx, vy, vw,
+			vh);
+}
+
+static void scene_step_full(struct scene* scene)
+{
+	for (int i = 0; i < scene->width * scene->height; ++i)
+		scene->pixels[i] += 0x010101;
+
+	pixman_region_union_rect(&scene->damage, &scene->damage, 0, 0,
+			scene->width, scene->height);
+}
+
+static void scene_step(struct scene* scene)
+{
+	pixman_region_clear(&scene->damage);
+
+	switch (scene->type) {
+	case SCENE_TYPING: scene_step_typing(scene); break;
+	case SCENE_SCROLLING: scene_step_scrolling(scene); break;
+	case SCENE_VIDEO: scene_step_video(scene); break;
+	case SCENE_FULL: scene_step_full(scene); break;
+	case SCENE_COUNT: abort();
+	}
+
+	scene->frame++;
+}
+
+static uint64_t region_area(struct pixman_region16* region)
+{
+	int n_rects = 0;
+	struct pixman_box16* box = pixman_region_rectangles(region, &n_rects);
+
+	uint64_t area = 0;
+	for (int i = 0; i < n_rects; ++i)
+		area += (uint64_t)(box[i].x2 - box[i].x1) *
+			(box[i].y2 - box[i].y1);
+
+	return area;
+}
+
+static void print_result(const char* name, const char* scene,
+		const struct bench_result* result)
+{
+	double seconds = result->time_us / 1e6;
+	double ms_per_frame = result->time_us / 1e3 / result->n_frames;
+	double mb_per_s = seconds > 0 ? result->bytes_in / 1e6 / seconds : 0;
+	double ratio = result->bytes_in > 0 ?
+		(double)result->bytes_out / result->bytes_in : 0;
+
+	printf("%s\t\t{\"name\": \"%s\", \"scene\": \"%s\", \"frames\": %d, "
+			"\"ms_per_frame\": %.3f, \"mb_per_s\": %.1f, "
+			"\"compressed_ratio\": %.4f}",
+			is_first_result ? "" : ",\n", name, scene,
+			result->n_frames, ms_per_frame, mb_per_s, ratio);
+
+	is_first_result = false;
+}
+
+/* Encoders either finish synchronously or call back on the main thread, so
+ * the loop only needs to spin until the done flag is set.
+ */
+struct frame_wait {
+	bool is_done;
+	size_t len;
+	struct buf_pool* pool;
+};
+
+static void frame_wait_run(struct frame_wait* wait)
+{
+	while (!wait->is_done) {
+		aml_poll(aml_get_default(), -1);
+		aml_dispatch(aml_get_default());
+	}
+}
+
+static void on_frame_done(struct vec* frame, void* userdata)
+{
+	struct frame_wait* wait = userdata;
+
+	wait->len = frame ? frame->len : 0;
+	if (frame)
+		rcbuf_unref(buf_pool_rcbuf_from_vec(wait->pool, frame));
+
+	wait->is_done = true;
+}
+
+enum bench_encoder {
+	BENCH_RAW,
+	BENCH_ZRLE,
+	BENCH_TIGHT_LOSSLESS,
+#ifdef HAVE_JPEG
+	BENCH_TIGHT_JPEG,
+#endif
+	BENCH_ENCODER_COUNT,
+};
+
+static const char* encoder_names[BENCH_ENCODER_COUNT] = {
+	[BENCH_RAW] = "raw",
+	[BENCH_ZRLE] = "zrle",
+	[BENCH_TIGHT_LOSSLESS] = "tight-lossless",
+#ifdef HAVE_JPEG
+	[BENCH_TIGHT_JPEG] = "tight-jpeg",
+#endif
+};
+
+struct encoders {
+	struct buf_pool* pool;
+	struct rfb_pixel_format fmt;
+	struct zrle_encoder zrle;
+	struct tight_encoder tight;
+};
+
+static size_t encode_frame(struct encoders* enc, enum bench_encoder type,
+		struct scene* scene)
+{
+	struct frame_wait wait = { .pool = enc->pool };
+	struct vec frame;
+
+	switch (type) {
+	case BENCH_RAW:
+		if (buf_pool_acquire(enc->pool, &frame, 0) < 0)
+			return 0;
+		raw_encode_frame(&frame, &enc->fmt, scene->fb, &enc->fmt,
+				&scene->damage);
+		on_frame_done(&frame, &wait);
+		break;
+	case BENCH_ZRLE:
+		if (zrle_encoder_encode_frame(&enc->zrle, &enc->fmt, scene->fb,
+					&enc->fmt, &scene->damage,
+					on_frame_done, &wait) < 0)
+			return 0;
+		break;
+	case BENCH_TIGHT_LOSSLESS:
+		if (tight_encode_frame(&enc->tight, &enc->fmt, scene->fb,
+					&enc->fmt, &scene->damage, NULL,
+					TIGHT_QUALITY_LOSSLESS,
+					on_frame_done, &wait) < 0)
+			return 0;
+		break;
+#ifdef HAVE_JPEG
+	case BENCH_TIGHT_JPEG:
+		if (tight_encode_frame(&enc->tight, &enc->fmt, scene->fb,
+					&enc->fmt, &scene->damage, NULL,
+					TIGHT_QUALITY_JPEG_0 + 6,
+					on_frame_done, &wait) < 0)
+			return 0;
+		break;
+#endif
+	case BENCH_ENCODER_COUNT:
+		abort();
+	}
+
+	frame_wait_run(&wait);
+	return wait.len;
+}
+
+static int bench_encoder(const struct bench_options* options,
+		enum bench_encoder type, enum scene_type scene_type)
+{
+	struct encoders enc = { 0 };
+	struct scene scene;
+	int rc = -1;
+
+	if (scene_init(&scene, scene_type, options->width,
+				options->height) < 0)
+		return -1;
+
+	enc.pool = buf_pool_new(4);
+	if (!enc.pool)
+		goto pool_failure;
+
+	rfb_pixfmt_from_fourcc(&enc.fmt, DRM_FORMAT_XRGB8888);
+
+	if (zrle_encoder_init(&enc.zrle, enc.pool) < 0)
+		goto zrle_failure;
+
+	if (tight_encoder_init(&enc.tight, options->width, options->height,
+				enc.pool) < 0)
+		goto tight_failure;
+
+	struct bench_result result = { 0 };
+
+	for (int i = 0; i < options->warmup + options->iterations; ++i) {
+		scene_step(&scene);
+
+		uint64_t start = gettime_us();
+		size_t len = encode_frame(&enc, type, &scene);
+		uint64_t end = gettime_us();
+
+		if (i < options->warmup)
+			continue;
+
+		result.n_frames++;
+		result.time_us += end - start;
+		result.bytes_in += region_area(&scene.damage) * 4;
+		result.bytes_out += len;
+	}
+
+	print_result(encoder_names[type], scene_names[scene_type], &result);
+	rc = 0;
+
+	tight_encoder_destroy(&enc.tight);
+tight_failure:
+	zrle_encoder_destroy(&enc.zrle);
+zrle_failure:
+	buf_pool_unref(enc.pool);
+pool_failure:
+	scene_destroy(&scene);
+	return rc;
+}
+
+struct refine_wait {
+	bool is_done;
+	uint64_t area;
+};
+
+static void on_refined(struct pixman_region16* refined, void* userdata)
+{
+	struct refine_wait* wait = userdata;
+	wait->area = region_area(refined);
+	wait->is_done = true;
+}
+
+/* The compressed ratio of the refinery is the refined area over the hinted
+ * area.
+ */
+static int bench_damage_refine(const struct bench_options* options,
+		enum scene_type scene_type)
+{
+	struct damage_refinery refinery;
+	struct scene scene;
+
+	if (scene_init(&scene, scene_type, options->width,
+				options->height) < 0)
+		return -1;
+
+	if (damage_refinery_init(&refinery, options->width,
+				options->height) < 0) {
+		scene_destroy(&scene);
+		return -1;
+	}
+
+	// The first pass only fills in the hashes
+	struct pixman_region16 all;
+	pixman_region_init_rect(&all, 0, 0, options->width, options->height);
+	struct pixman_region16 refined;
+	pixman_region_init(&refined);
+	damage_refine(&refinery, &refined, &all, scene.fb);
+	pixman_region_fini(&all);
+
+	struct bench_result result = { 0 };
+
+	for (int i = 0; i < options->warmup + options->iterations; ++i) {
+		scene_step(&scene);
+
+		struct refine_wait wait = { 0 };
+
+		uint64_t start = gettime_us();
+		if (damage_refine_async(&refinery, &scene.damage, scene.fb,
+					on_refined, &wait) < 0) {
+			pixman_region_clear(&refined);
+			damage_refine(&refinery, &refined, &scene.damage,
+					scene.fb);
+			on_refined(&refined, &wait);
+		}
+
+		while (!wait.is_done) {
+			aml_poll(aml_get_default(), -1);
+			aml_dispatch(aml_get_default());
+		}
+		uint64_t end = gettime_us();
+
+		if (i < options->warmup)
+			continue;
+
+		uint64_t area = region_area(&scene.damage);
+
+		result.n_frames++;
+		result.time_us += end - start;
+		result.bytes_in += area * 4;
+		result.bytes_out += wait.area * 4;
+	}
+
+	print_result("damage-refine", scene_names[scene_type], &result);
+
+	pixman_region_fini(&refined);
+	damage_refinery_destroy(&refinery);
+	scene_destroy(&scene);
+	return 0;
+}
+
+struct resample_wait {
+	bool is_done;
+};
+
+static void on_resampled(struct nvnc_fb* fb, struct pixman_region16* damage,
+		void* userdata)
+{
+	struct resample_wait* wait = userdata;
+
+	// Hand the buffer straight back to the resampler's pool
+	nvnc_fb_hold(fb);
+	nvnc_fb_release(fb);
+
+	wait->is_done = true;
+}
+
+static int bench_resampler(const struct bench_options* options,
+		enum scene_type scene_type)
+{
+	struct scene scene;
+
+	if (scene_init(&scene, scene_type, options->width,
+				options->height) < 0)
+		return -1;
+
+	struct resampler* resampler = resampler_create();
+	if (!resampler) {
+		scene_destroy(&scene);
+		return -1;
+	}
+
+	nvnc_fb_set_transform(scene.fb, NVNC_TRANSFORM_90);
+
+	struct bench_result result = { 0 };
+
+	for (int i = 0; i < options->warmup + options->iterations; ++i) {
+		scene_step(&scene);
+
+		struct resample_wait wait = { 0 };
+
+		uint64_t start = gettime_us();
+		if (resampler_feed(resampler, scene.fb, &scene.damage,
+					on_resampled, &wait) < 0)
+			break;
+
+		while (!wait.is_done) {
+			aml_poll(aml_get_default(), -1);
+			aml_dispatch(aml_get_default());
+		}
+		uint64_t end = gettime_us();
+
+		if (i < options->warmup)
+			continue;
+
+		uint64_t bytes = region_area(&scene.damage) * 4;
+
+		result.n_frames++;
+		result.time_us += end - start;
+		result.bytes_in += bytes;
+		result.bytes_out += bytes;
+	}
+
+	print_result("resampler-90", scene_names[scene_type], &result);
+
+	resampler_destroy(resampler);
+	scene_destroy(&scene);
+	return 0;
+}
+
+/* Feeds the damaged pixels straight into a zlib stream, a rectangle at a time,
+ * to compare deflate backends without the encoders around them.
+ */
+static int bench_deflate(const struct bench_options* options,
+		enum scene_type scene_type, int level)
+{
+	struct scene scene;
+
+	if (scene_init(&scene, scene_type, options->width,
+				options->height) < 0)
+		return -1;
+
+	struct deflate_stream* zs = deflate_stream_new(level);
+	if (!zs) {
+		scene_destroy(&scene);
+		return -1;
+	}
+
+	struct vec dst;
+	if (vec_init(&dst, 4096) < 0) {
+		deflate_stream_destroy(zs);
+		scene_destroy(&scene);
+		return -1;
+	}
+
+	struct bench_result result = { 0 };
+	int rc = 0;
+
+	for (int i = 0; i < options->warmup + options->iterations; ++i) {
+		scene_step(&scene);
+		vec_clear(&dst);
+
+		int n_rects = 0;
+		struct pixman_box16* box =
+			pixman_region_rectangles(&scene.damage, &n_rects);
+
+		uint64_t start = gettime_us();
+		for (int r = 0; r < n_rects && rc == 0; ++r)
+			for (int y = box[r].y1; y < box[r].y2 && rc == 0; ++y)
+				rc = deflate_stream_compress(zs, &dst,
+						scene.pixels + box[r].x1 +
+						y * scene.width,
+						(box[r].x2 - box[r].x1) * 4,
+						y == box[r].y2 - 1);
+		uint64_t end = gettime_us();
+
+		if (rc < 0)
+			break;
+
+		if (i < options->warmup)
+			continue;
+
+		result.n_frames++;
+		result.time_us += end - start;
+		result.bytes_in += region_area(&scene.damage) * 4;
+		result.bytes_out += dst.len;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "deflate-%s-%d", deflate_stream_backend(),
+			level);
+	print_result(name, scene_names[scene_type], &result);
+
+	vec_destroy(&dst);
+	deflate_stream_destroy(zs);
+	scene_destroy(&scene);
+	return rc;
+}
+
+static void make_pixfmt(struct rfb_pixel_format* fmt, int bpp, int depth,
+		int r_bits, int g_bits, int b_bits, int r_shift, int g_shift,
+		int b_shift)
+{
+	memset(fmt, 0, sizeof(*fmt));
+	fmt->bits_per_pixel = bpp;
+	fmt->depth = depth;
+	fmt->true_colour_flag = 1;
+	fmt->red_max = (1 << r_bits) - 1;
+	fmt->green_max = (1 << g_bits) - 1;
+	fmt->blue_max = (1 << b_bits) - 1;
+	fmt->red_shift = r_shift;
+	fmt->green_shift = g_shift;
+	fmt->blue_shift = b_shift;
+}
+
+/* The ratio for pixel conversion is output over input bytes */
+static int bench_pixel_conversion(const struct bench_options* options)
+{
+	struct scene scene;
+
+	if (scene_init(&scene, SCENE_FULL, options->width,
+				options->height) < 0)
+		return -1;
+
+	struct rfb_pixel_format src_fmt;
+	rfb_pixfmt_from_fourcc(&src_fmt, DRM_FORMAT_XRGB8888);
+
+	struct {
+		const char* name;
+		struct rfb_pixel_format fmt;
+		int bytes_per_cpixel;
+	} targets[6];
+
+	targets[0].name = "pixel32-xrgb8888";
+	rfb_pixfmt_from_fourcc(&targets[0].fmt, DRM_FORMAT_XRGB8888);
+	targets[0].bytes_per_cpixel = 4;
+
+	targets[1].name = "pixel32-xbgr8888";
+	rfb_pixfmt_from_fourcc(&targets[1].fmt, DRM_FORMAT_XBGR8888);
+	targets[1].bytes_per_cpixel = 4;
+
+	targets[2].name = "pixel32-cpixel24";
+	rfb_pixfmt_from_fourcc(&targets[2].fmt, DRM_FORMAT_XBGR8888);
+	targets[2].bytes_per_cpixel = 3;
+
+	targets[3].name = "pixel32-rgb565";
+	make_pixfmt(&targets[3].fmt, 16, 16, 5, 6, 5, 11, 5, 0);
+	targets[3].bytes_per_cpixel = 2;
+
+	targets[4].name = "pixel32-rgb565-be";
+	make_pixfmt(&targets[4].fmt, 16, 16, 5, 6, 5, 11, 5, 0);
+	targets[4].fmt.big_endian_flag = 1;
+	targets[4].bytes_per_cpixel = 2;
+
+	targets[5].name = "pixel32-bgr233";
+	make_pixfmt(&targets[5].fmt, 8, 8, 3, 3, 2, 0, 3, 6);
+	targets[5].bytes_per_cpixel = 1;
+
+	size_t n_pixels = (size_t)options->width * options->height;
+	uint8_t* dst = malloc(n_pixels * 4);
+	if (!dst) {
+		scene_destroy(&scene);
+		return -1;
+	}
+
+	for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); ++t) {
+		struct bench_result result = { 0 };
+
+		for (int i = 0; i < options->warmup + options->iterations;
+				++i) {
+			uint64_t start = gettime_us();
+			pixel32_to_cpixel(dst, &targets[t].fmt, scene.pixels,
+					&src_fmt, targets[t].bytes_per_cpixel,
+					n_pixels);
+			uint64_t end = gettime_us();
+
+			if (i < options->warmup)
+				continue;
+
+			result.n_frames++;
+			result.time_us += end - start;
+			result.bytes_in += n_pixels * 4;
+			result.bytes_out += n_pixels *
+				targets[t].bytes_per_cpixel;
+		}
+
+		print_result(targets[t].name, "full", &result);
+	}
+
+	free(dst);
+	scene_destroy(&scene);
+	return 0;
+}
+
+static int usage(int r)
+{
+	fprintf(r ? stderr : stdout, "\
+Usage: encoder-bench [options]\n\
+\n\
+Options:\n\
+    -W, --width=<pixels>       Frame width. Default: 1920\n\
+    -H, --height=<pixels>      Frame height. Default: 1080\n\
+    -w, --warmup=<frames>      Frames to run before measuring. Default: 5\n\
+    -n, --iterations=<frames>  Frames to measure. Default: 50\n\
+    -h, --help                 Show this help.\n\
+\n");
+	return r;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench_options options = {
+		.width = 1920,
+		.height = 1080,
+		.warmup = 5,
+		.iterations = 50,
+	};
+
+	static const struct option long_options[] = {
+		{ "width", required_argument, NULL, 'W' },
+		{ "height", required_argument, NULL, 'H' },
+		{ "warmup", required_argument, NULL, 'w' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	for (;;) {
+		int c = getopt_long(argc, argv, "W:H:w:n:h", long_options,
+				NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'W': options.width = atoi(optarg); break;
+		case 'H': options.height = atoi(optarg); break;
+		case 'w': options.warmup = atoi(optarg); break;
+		case 'n': options.iterations = atoi(optarg); break;
+		case 'h': return usage(0);
+		default: return usage(1);
+		}
+	}
+
+	if (options.width <= 0 || options.height <= 0 ||
+			options.iterations <= 0 || options.warmup < 0)
+		return usage(1);
+
+	struct aml* aml = aml_new();
+	if (!aml)
+		return 1;
+
+	aml_set_default(aml);
+
+	int rc = 0;
+
+	printf("{\n\t\"width\": %d,\n\t\"height\": %d,\n\t\"warmup\": %d,\n"
+			"\t\"deflate\": \"%s\",\n\t\"results\": [\n",
+			options.width, options.height, options.warmup,
+			deflate_stream_backend());
+
+	for (int s = 0; s < SCENE_COUNT; ++s)
+		for (int e = 0; e < BENCH_ENCODER_COUNT; ++e)
+			rc |= bench_encoder(&options, e, s);
+
+	static const int deflate_levels[] = { 1, 6, 9 };
+	for (int s = 0; s < SCENE_COUNT; ++s)
+		for (size_t l = 0; l < sizeof(deflate_levels) /
+				sizeof(deflate_levels[0]); ++l)
+			rc |= bench_deflate(&options, s, deflate_levels[l]);
+
+	for (int s = 0; s < SCENE_COUNT; ++s)
+		rc |= bench_damage_refine(&options, s);
+
+	for (int s = 0; s < SCENE_COUNT; ++s)
+		rc |= bench_resampler(&options, s);
+
+	rc |= bench_pixel_conversion(&options);
+
+	printf("\n\t]\n}\n");
+
+	aml_unref(aml);
+	return rc ? 1 : 0;
+}
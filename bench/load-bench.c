@@ -0,0 +1,1189 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Runs a server with synthetic content and connects a number of headless
+ * clients to it over loopback. The clients take updates as fast as they come,
+ * but they don't decode them. The results are printed as JSON.
+ *
+ * The content is a box that moves across a background at a fixed frame rate.
+ * The background is a pattern, or an image if one is given.
+ *
+ * The latency of an update is the time from when the first frame that the
+ * previous update could not have covered was fed to the server until the
+ * update has been received.
+ *
+ * Server CPU time is what the process used, minus the clients and the
+ * generator. Memory is the growth of the resident set from before the clients
+ * connected until measuring starts, spread over the clients.
+ */
+
+#include "rfb-proto.h"
+#include "neatvnc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/param.h>
+#include <aml.h>
+#include <pixman.h>
+#include <libdrm/drm_fourcc.h>
+
+#define CLIENT_BUFFER_SIZE (64 * 1024)
+#define MAX_CLIENTS 1024
+
+/* Frames that clients can fall behind the generator by and still have their
+ * latency measured
+ */
+#define FRAME_RING_SIZE 4096
+
+#define BOX_SIZE 256
+
+struct pixfmt_desc {
+	const char* name;
+	struct rfb_pixel_format fmt;
+};
+
+static const struct pixfmt_desc pixel_formats[] = {
+	{ "rgb888", { 32, 24, 0, 1, 255, 255, 255, 16, 8, 0 } },
+	{ "bgr888", { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16 } },
+	{ "rgb565", { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 } },
+	{ "bgr233", { 8, 8, 0, 1, 7, 7, 3, 0, 3, 6 } },
+};
+
+struct bench_options {
+	int n_clients;
+	int width;
+	int height;
+	int fps;
+	int warmup;
+	int duration;
+	uint16_t port;
+	enum rfb_encodings encoding;
+	int quality;
+	int compression_level;
+	const struct pixfmt_desc* pixfmt;
+	int n_threads;
+	const char* image;
+};
+
+enum client_state {
+	CLIENT_VERSION,
+	CLIENT_SECURITY_TYPES,
+	CLIENT_SECURITY_RESULT,
+	CLIENT_SERVER_INIT,
+	CLIENT_MESSAGE,
+	CLIENT_RECT,
+	CLIENT_ZRLE,
+	CLIENT_TIGHT,
+	CLIENT_FAILED,
+};
+
+struct client {
+	int fd;
+	enum client_state state;
+
+	uint8_t buffer[CLIENT_BUFFER_SIZE];
+	size_t len;
+	/* Payload bytes that are thrown away as they arrive */
+	uint64_t skip;
+	/* The rectangle is done once its payload has been skipped */
+	bool is_rect_pending;
+
+	uint16_t width;
+	uint16_t height;
+	int n_rects;
+	struct rfb_server_fb_rect rect;
+
+	uint64_t last_update_time;
+	uint32_t frame_cursor;
+
+	uint64_t n_updates;
+	uint64_t n_bytes;
+	uint32_t* latencies;
+	size_t n_latencies;
+	size_t latencies_cap;
+};
+
+struct generator {
+	struct nvnc_display* display;
+	struct nvnc_fb_pool* pool;
+	pixman_image_t* canvas;
+	pixman_image_t* background;
+	int width;
+	int height;
+	int frame;
+	int box_x, box_y;
+	int dx, dy;
+	uint64_t cpu_time;
+};
+
+static struct bench_options options;
+static struct client* clients;
+static int client_tpixel;
+
+static uint64_t frame_times[FRAME_RING_SIZE];
+static atomic_uint n_frames;
+static atomic_bool is_measuring;
+static atomic_bool is_done;
+
+static uint64_t gettime_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static uint64_t getcputime_us(clockid_t clock)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static uint64_t get_process_cputime_us(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static uint64_t get_rss_kib(void)
+{
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (!file)
+		return 0;
+
+	unsigned long size = 0, resident = 0;
+	if (fscanf(file, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+
+	fclose(file);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Content */
+
+struct nvnc_fb* read_png_file(const char* filename);
+
+static pixman_image_t* load_background(int width, int height)
+{
+	pixman_image_t* image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+			width, height, NULL, 0);
+	if (!image)
+		return NULL;
+
+	uint32_t* pixels = pixman_image_get_data(image);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+			pixels[x + y * width] = ((x / 32 + y / 32) % 2) ?
+				0x00303030 : 0x00e0e0e0 ^ (x * 0x10101 / 8);
+
+#ifdef HAVE_LIBPNG
+	if (!options.image)
+		return image;
+
+	struct nvnc_fb* fb = read_png_file(options.image);
+	if (!fb) {
+		pixman_image_unref(image);
+		return NULL;
+	}
+
+	pixman_image_t* src = pixman_image_create_bits_no_clear(
+			PIXMAN_a8b8g8r8, nvnc_fb_get_width(fb),
+			nvnc_fb_get_height(fb), nvnc_fb_get_addr(fb),
+			nvnc_fb_get_stride(fb) * 4);
+	pixman_image_set_repeat(src, PIXMAN_REPEAT_NORMAL);
+	pixman_image_composite(PIXMAN_OP_SRC, src, NULL, image, 0, 0, 0, 0,
+			0, 0, width, height);
+	pixman_image_unref(src);
+	nvnc_fb_unref(fb);
+#endif
+
+	return image;
+}
+
+static void draw_box(struct generator* self)
+{
+	uint32_t* pixels = pixman_image_get_data(self->canvas);
+	int size = MIN(BOX_SIZE, MIN(self->width, self->height));
+	for (int y = 0; y < size; ++y)
+		for (int x = 0; x < size; ++x) {
+			uint32_t v = (x + self->frame * 4) ^ (y * 3);
+			pixels[self->box_x + x + (self->box_y + y) * self->width] =
+				(v & 0xff) << 16 | ((v * 7) & 0xff) << 8 |
+				(self->frame & 0xff);
+		}
+}
+
+static void move_box(struct generator* self, struct pixman_region16* damage)
+{
+	int size = MIN(BOX_SIZE, MIN(self->width, self->height));
+
+	pixman_region_union_rect(damage, damage, self->box_x, self->box_y,
+			size, size);
+
+	/* Whatever the box uncovers is background again */
+	pixman_image_composite(PIXMAN_OP_SRC, self->background, NULL,
+			self->canvas, self->box_x, self->box_y, 0, 0,
+			self->box_x, self->box_y, size, size);
+
+	self->box_x += self->dx;
+	self->box_y += self->dy;
+
+	if (self->box_x < 0 || self->box_x + size > self->width) {
+		self->dx = -self->dx;
+		self->box_x = MAX(0, MIN(self->box_x, self->width - size));
+	}
+
+	if (self->box_y < 0 || self->box_y + size > self->height) {
+		self->dy = -self->dy;
+		self->box_y = MAX(0, MIN(self->box_y, self->height - size));
+	}
+
+	pixman_region_union_rect(damage, damage, self->box_x, self->box_y,
+			size, size);
+}
+
+/* Only the parts of a buffer that have changed since it was last used are
+ * copied into it.
+ */
+struct buffer_damage {
+	struct pixman_region16 region;
+	struct buffer_damage* next;
+};
+
+static struct buffer_damage* buffer_damage_list;
+
+static void buffer_damage_destroy(void* userdata)
+{
+	struct buffer_damage* self = userdata;
+	struct buffer_damage** p = &buffer_damage_list;
+	while (*p != self)
+		p = &(*p)->next;
+	*p = self->next;
+
+	pixman_region_fini(&self->region);
+	free(self);
+}
+
+static void generator_feed(struct generator* self)
+{
+	uint64_t start = getcputime_us(CLOCK_THREAD_CPUTIME_ID);
+
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+
+	self->frame++;
+	move_box(self, &damage);
+	draw_box(self);
+
+	for (struct buffer_damage* p = buffer_damage_list; p; p = p->next)
+		pixman_region_union(&p->region, &p->region, &damage);
+
+	struct nvnc_fb* fb = nvnc_fb_pool_acquire(self->pool);
+	if (!fb)
+		goto done;
+
+	struct buffer_damage* buffer = nvnc_get_userdata(fb);
+	if (!buffer) {
+		buffer = calloc(1, sizeof(*buffer));
+		if (!buffer) {
+			nvnc_fb_pool_release(self->pool, fb);
+			goto done;
+		}
+
+		pixman_region_init_rect(&buffer->region, 0, 0, self->width,
+				self->height);
+		buffer->next = buffer_damage_list;
+		buffer_damage_list = buffer;
+		nvnc_set_userdata(fb, buffer, buffer_damage_destroy);
+	}
+
+	pixman_image_t* dst = pixman_image_create_bits_no_clear(
+			PIXMAN_x8r8g8b8, self->width, self->height,
+			nvnc_fb_get_addr(fb), nvnc_fb_get_stride(fb) * 4);
+	pixman_image_set_clip_region(dst, &buffer->region);
+	pixman_image_composite(PIXMAN_OP_SRC, self->canvas, NULL, dst, 0, 0,
+			0, 0, 0, 0, self->width, self->height);
+	pixman_image_unref(dst);
+	pixman_region_clear(&buffer->region);
+
+	self->cpu_time += getcputime_us(CLOCK_THREAD_CPUTIME_ID) - start;
+
+	unsigned int index = atomic_load(&n_frames);
+	frame_times[index % FRAME_RING_SIZE] = gettime_us();
+	atomic_store_explicit(&n_frames, index + 1, memory_order_release);
+
+	nvnc_display_feed_buffer(self->display, fb, &damage);
+	nvnc_fb_unref(fb);
+
+	pixman_region_fini(&damage);
+	return;
+
+done:
+	self->cpu_time += getcputime_us(CLOCK_THREAD_CPUTIME_ID) - start;
+	pixman_region_fini(&damage);
+}
+
+static void on_tick(void* obj)
+{
+	generator_feed(aml_get_userdata(obj));
+}
+
+/* Clients */
+
+static int client_send(struct client* self, const void* data, size_t len)
+{
+	ssize_t rc = send(self->fd, data, len, MSG_NOSIGNAL);
+	if (rc != (ssize_t)len) {
+		self->state = CLIENT_FAILED;
+		return -1;
+	}
+	return 0;
+}
+
+static void client_request_update(struct client* self, bool is_incremental)
+{
+	struct rfb_client_fb_update_req_msg msg = {
+		.type = RFB_CLIENT_TO_SERVER_FRAMEBUFFER_UPDATE_REQUEST,
+		.incremental = is_incremental,
+		.width = htons(self->width),
+		.height = htons(self->height),
+	};
+	client_send(self, &msg, sizeof(msg));
+}
+
+static void client_send_setup(struct client* self)
+{
+	struct {
+		uint8_t type;
+		uint8_t padding[3];
+		struct rfb_pixel_format fmt;
+	} RFB_PACKED pixfmt_msg = {
+		.type = RFB_CLIENT_TO_SERVER_SET_PIXEL_FORMAT,
+		.fmt = options.pixfmt->fmt,
+	};
+	pixfmt_msg.fmt.red_max = htons(pixfmt_msg.fmt.red_max);
+	pixfmt_msg.fmt.green_max = htons(pixfmt_msg.fmt.green_max);
+	pixfmt_msg.fmt.blue_max = htons(pixfmt_msg.fmt.blue_max);
+	client_send(self, &pixfmt_msg, sizeof(pixfmt_msg));
+
+	struct {
+		struct rfb_client_set_encodings_msg head;
+		int32_t encodings[3];
+	} RFB_PACKED encodings_msg = {
+		.head.type = RFB_CLIENT_TO_SERVER_SET_ENCODINGS,
+	};
+
+	int n = 0;
+	encodings_msg.encodings[n++] = htonl(options.encoding);
+	if (options.quality >= 0)
+		encodings_msg.encodings[n++] =
+			htonl(RFB_ENCODING_JPEG_LOWQ + options.quality);
+	if (options.compression_level >= 0)
+		encodings_msg.encodings[n++] =
+			htonl(RFB_ENCODING_COMPRESSION_LEVEL_0 +
+					options.compression_level);
+	encodings_msg.head.n_encodings = htons(n);
+	client_send(self, &encodings_msg,
+			sizeof(encodings_msg.head) + n * sizeof(int32_t));
+
+	client_request_update(self, false);
+}
+
+static void client_record_latency(struct client* self, uint32_t latency)
+{
+	if (self->n_latencies == self->latencies_cap) {
+		size_t cap = MAX(self->latencies_cap * 2, 1024);
+		uint32_t* latencies = realloc(self->latencies,
+				cap * sizeof(*latencies));
+		if (!latencies)
+			return;
+		self->latencies = latencies;
+		self->latencies_cap = cap;
+	}
+
+	self->latencies[self->n_latencies++] = latency;
+}
+
+static void client_update_done(struct client* self)
+{
+	uint64_t now = gettime_us();
+	unsigned int end = atomic_load_explicit(&n_frames,
+			memory_order_acquire);
+
+	if (end - self->frame_cursor > FRAME_RING_SIZE)
+		self->frame_cursor = end - FRAME_RING_SIZE;
+
+	while (self->frame_cursor != end && frame_times[self->frame_cursor %
+			FRAME_RING_SIZE] <= self->last_update_time)
+		self->frame_cursor++;
+
+	if (atomic_load(&is_measuring)) {
+		self->n_updates++;
+		if (self->frame_cursor != end)
+			client_record_latency(self, now - frame_times[
+					self->frame_cursor % FRAME_RING_SIZE]);
+	}
+
+	self->last_update_time = now;
+	client_request_update(self, true);
+}
+
+static uint16_t read_u16(const uint8_t* p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t read_u32(const uint8_t* p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Returns 1 if the length was read, or 0 if more data is needed */
+static int tight_read_length(const uint8_t* p, size_t len, size_t* n_read,
+		uint64_t* length)
+{
+	*length = 0;
+
+	for (size_t i = 0; i < 3; ++i) {
+		if (i >= len)
+			return 0;
+
+		uint32_t b = p[i];
+		*length |= (uint64_t)(i < 2 ? b & 0x7f : b) << (7 * i);
+
+		if (i == 2 || !(b & 0x80)) {
+			*n_read = i + 1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Finds out how long the head and the data of a Tight rectangle are. Returns
+ * 1 if it is known, 0 if more data is needed and -1 if it is invalid.
+ */
+static int tight_parse_head(const uint8_t* p, size_t len, uint16_t width,
+		uint16_t height, size_t* head_len, uint64_t* data_len)
+{
+	if (len < 1)
+		return 0;
+
+	int type = p[0] >> 4;
+	size_t n = 1;
+	uint64_t size = (uint64_t)width * height * client_tpixel;
+
+	if (type == 8) {
+		*head_len = 1;
+		*data_len = client_tpixel;
+		return 1;
+	}
+
+	if (type == 9) {
+		size_t n_read;
+		if (!tight_read_length(p + 1, len - 1, &n_read, data_len))
+			return 0;
+		*head_len = 1 + n_read;
+		return 1;
+	}
+
+	if (type > 9)
+		return -1;
+
+	int filter = 0;
+	if (type & 4) {
+		if (len < 2)
+			return 0;
+		filter = p[1];
+		n = 2;
+	}
+
+	switch (filter) {
+	case 0:
+	case 2:
+		break;
+	case 1:;
+		if (len < 3)
+			return 0;
+		int n_colours = p[2] + 1;
+		n = 3 + n_colours * client_tpixel;
+		size = n_colours == 2 ? (uint64_t)(width + 7) / 8 * height :
+			(uint64_t)width * height;
+		break;
+	default:
+		return -1;
+	}
+
+	if (size < 12) {
+		if (len < n)
+			return 0;
+		*head_len = n;
+		*data_len = size;
+		return 1;
+	}
+
+	if (len < n)
+		return 0;
+
+	size_t n_read;
+	if (!tight_read_length(p + n, len - n, &n_read, data_len))
+		return 0;
+
+	*head_len = n + n_read;
+	return 1;
+}
+
+static void client_rect_done(struct client* self)
+{
+	self->is_rect_pending = false;
+
+	if (--self->n_rects > 0) {
+		self->state = CLIENT_RECT;
+		return;
+	}
+
+	self->state = CLIENT_MESSAGE;
+	client_update_done(self);
+}
+
+/* Returns the number of bytes consumed, 0 if more data is needed or -1 on
+ * errors.
+ */
+static ssize_t client_parse(struct client* self, const uint8_t* p, size_t len)
+{
+	int bpp = options.pixfmt->fmt.bits_per_pixel / 8;
+
+	switch (self->state) {
+	case CLIENT_VERSION:
+		if (len < 12)
+			return 0;
+		if (client_send(self, "RFB 003.008\n", 12) < 0)
+			return -1;
+		self->state = CLIENT_SECURITY_TYPES;
+		return 12;
+	case CLIENT_SECURITY_TYPES:
+		if (len < 1 || len < 1 + (size_t)p[0])
+			return 0;
+		if (!memchr(p + 1, RFB_SECURITY_TYPE_NONE, p[0]))
+			return -1;
+		if (client_send(self, &(uint8_t){ RFB_SECURITY_TYPE_NONE },
+					1) < 0)
+			return -1;
+		self->state = CLIENT_SECURITY_RESULT;
+		return 1 + p[0];
+	case CLIENT_SECURITY_RESULT:
+		if (len < 4)
+			return 0;
+		if (read_u32(p) != RFB_SECURITY_HANDSHAKE_OK)
+			return -1;
+		/* Shared */
+		if (client_send(self, &(uint8_t){ 1 }, 1) < 0)
+			return -1;
+		self->state = CLIENT_SERVER_INIT;
+		return 4;
+	case CLIENT_SERVER_INIT:;
+		size_t head_len = sizeof(struct rfb_server_init_msg);
+		if (len < head_len || len < head_len + read_u32(p + 20))
+			return 0;
+		self->width = read_u16(p);
+		self->height = read_u16(p + 2);
+		self->state = CLIENT_MESSAGE;
+		client_send_setup(self);
+		return head_len + read_u32(p + 20);
+	case CLIENT_MESSAGE:
+		if (len < 1)
+			return 0;
+		switch (p[0]) {
+		case RFB_SERVER_TO_CLIENT_FRAMEBUFFER_UPDATE:
+			if (len < 4)
+				return 0;
+			self->n_rects = read_u16(p + 2);
+			if (self->n_rects == 0)
+				client_update_done(self);
+			else
+				self->state = CLIENT_RECT;
+			return 4;
+		case RFB_SERVER_TO_CLIENT_BELL:
+			return 1;
+		case RFB_SERVER_TO_CLIENT_SERVER_CUT_TEXT:
+			if (len < 8)
+				return 0;
+			self->skip = read_u32(p + 4);
+			return 8;
+		}
+		return -1;
+	case CLIENT_RECT:
+		if (len < 12)
+			return 0;
+		self->rect.x = read_u16(p);
+		self->rect.y = read_u16(p + 2);
+		self->rect.width = read_u16(p + 4);
+		self->rect.height = read_u16(p + 6);
+		self->rect.encoding = (int32_t)read_u32(p + 8);
+
+		switch (self->rect.encoding) {
+		case RFB_ENCODING_RAW:
+			self->skip = (uint64_t)self->rect.width *
+				self->rect.height * bpp;
+			self->is_rect_pending = true;
+			break;
+		case RFB_ENCODING_COPYRECT:
+			self->skip = 4;
+			self->is_rect_pending = true;
+			break;
+		case RFB_ENCODING_ZRLE:
+			self->state = CLIENT_ZRLE;
+			break;
+		case RFB_ENCODING_TIGHT:
+			self->state = CLIENT_TIGHT;
+			break;
+		default:
+			return -1;
+		}
+		return 12;
+	case CLIENT_ZRLE:
+		if (len < 4)
+			return 0;
+		self->skip = read_u32(p);
+		self->is_rect_pending = true;
+		return 4;
+	case CLIENT_TIGHT:;
+		size_t tight_head_len = 0;
+		int rc = tight_parse_head(p, len, self->rect.width,
+				self->rect.height, &tight_head_len, &self->skip);
+		if (rc <= 0)
+			return rc;
+		self->is_rect_pending = true;
+		return tight_head_len;
+	case CLIENT_FAILED:
+		break;
+	}
+
+	return -1;
+}
+
+static void client_on_readable(struct client* self)
+{
+	ssize_t n_read = recv(self->fd, self->buffer + self->len,
+			sizeof(self->buffer) - self->len, 0);
+	if (n_read < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n_read <= 0) {
+		self->state = CLIENT_FAILED;
+		return;
+	}
+
+	if (atomic_load(&is_measuring))
+		self->n_bytes += n_read;
+
+	self->len += n_read;
+	size_t index = 0;
+
+	for (;;) {
+		if (self->is_rect_pending && self->skip == 0)
+			client_rect_done(self);
+
+		if (index == self->len)
+			break;
+
+		size_t left = self->len - index;
+
+		if (self->skip > 0) {
+			size_t n = MIN(self->skip, left);
+			self->skip -= n;
+			index += n;
+			continue;
+		}
+
+		ssize_t rc = client_parse(self, self->buffer + index, left);
+		if (rc < 0) {
+			self->state = CLIENT_FAILED;
+			return;
+		}
+		if (rc == 0)
+			break;
+
+		index += rc;
+	}
+
+	memmove(self->buffer, self->buffer + index, self->len - index);
+	self->len -= index;
+}
+
+static int client_connect(struct client* self)
+{
+	self->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (self->fd < 0)
+		return -1;
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(options.port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	if (connect(self->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(self->fd);
+		self->fd = -1;
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt(self->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+static void* client_thread(void* userdata)
+{
+	struct pollfd* fds = calloc(options.n_clients, sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	for (int i = 0; i < options.n_clients; ++i) {
+		if (client_connect(&clients[i]) < 0)
+			clients[i].state = CLIENT_FAILED;
+		fds[i].fd = clients[i].fd;
+		fds[i].events = POLLIN;
+	}
+
+	while (!atomic_load(&is_done)) {
+		int rc = poll(fds, options.n_clients, 100);
+		if (rc < 0 && errno != EINTR)
+			break;
+
+		for (int i = 0; i < options.n_clients && rc > 0; ++i) {
+			if (!fds[i].revents)
+				continue;
+
+			struct client* client = &clients[i];
+			client_on_readable(client);
+
+			if (client->state == CLIENT_FAILED)
+				fds[i].fd = -1;
+		}
+	}
+
+	for (int i = 0; i < options.n_clients; ++i)
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+
+	free(fds);
+	return NULL;
+}
+
+/* Reporting */
+
+static int compare_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t* sorted, size_t n, int p)
+{
+	return n ? sorted[MIN(n - 1, n * p / 100)] : 0;
+}
+
+struct measurement {
+	uint64_t start_time;
+	uint64_t process_time;
+	uint64_t client_time;
+	uint64_t generator_time;
+};
+
+static void measure(struct measurement* dst, clockid_t client_clock,
+		const struct generator* generator)
+{
+	dst->start_time = gettime_us();
+	dst->process_time = get_process_cputime_us();
+	dst->client_time = getcputime_us(client_clock);
+	dst->generator_time = generator->cpu_time;
+}
+
+static void print_results(const struct measurement* start,
+		const struct measurement* end, uint64_t rss_per_client)
+{
+	double time = (end->start_time - start->start_time) / 1e6;
+	uint64_t server_time = (end->process_time - start->process_time) -
+		(end->client_time - start->client_time) -
+		(end->generator_time - start->generator_time);
+
+	size_t n_all = 0;
+	int n_failed = 0;
+	for (int i = 0; i < options.n_clients; ++i) {
+		n_all += clients[i].n_latencies;
+		n_failed += clients[i].state == CLIENT_FAILED;
+	}
+
+	uint32_t* all = malloc(MAX(n_all, 1) * sizeof(*all));
+	size_t n = 0;
+
+	printf("{\n\t\"clients\": %d,\n\t\"failed\": %d,\n"
+			"\t\"width\": %d,\n\t\"height\": %d,\n"
+			"\t\"fps\": %d,\n\t\"duration\": %.3f,\n"
+			"\t\"pixel_format\": \"%s\",\n",
+			options.n_clients, n_failed, options.width,
+			options.height, options.fps, time,
+			options.pixfmt->name);
+	printf("\t\"server_cpu_percent\": %.1f,\n"
+			"\t\"server_cpu_percent_per_client\": %.2f,\n"
+			"\t\"rss_kib_per_client\": %llu,\n",
+			server_time / 1e4 / time,
+			server_time / 1e4 / time / options.n_clients,
+			(unsigned long long)rss_per_client);
+	printf("\t\"results\": [\n");
+
+	for (int i = 0; i < options.n_clients; ++i) {
+		struct client* client = &clients[i];
+
+		qsort(client->latencies, client->n_latencies,
+				sizeof(*client->latencies), compare_u32);
+		if (all) {
+			memcpy(all + n, client->latencies,
+					client->n_latencies * sizeof(*all));
+			n += client->n_latencies;
+		}
+
+		printf("\t\t{ \"client\": %d, \"fps\": %.1f, \"kbps\": %.0f, "
+				"\"latency_p50_us\": %u, "
+				"\"latency_p90_us\": %u, "
+				"\"latency_p99_us\": %u }%s\n", i,
+				client->n_updates / time,
+				client->n_bytes * 8 / 1e3 / time,
+				percentile(client->latencies,
+					client->n_latencies, 50),
+				percentile(client->latencies,
+					client->n_latencies, 90),
+				percentile(client->latencies,
+					client->n_latencies, 99),
+				i + 1 < options.n_clients ? "," : "");
+	}
+
+	qsort(all, n, sizeof(*all), compare_u32);
+	printf("\t],\n\t\"latency_p50_us\": %u,\n\t\"latency_p90_us\": %u,\n"
+			"\t\"latency_p99_us\": %u,\n\t\"latency_max_us\": %u\n}\n",
+			percentile(all, n, 50), percentile(all, n, 90),
+			percentile(all, n, 99), n ? all[n - 1] : 0);
+
+	free(all);
+}
+
+/* Main */
+
+struct bench {
+	struct generator* generator;
+	pthread_t client_thread;
+	clockid_t client_clock;
+	struct measurement start;
+	struct measurement end;
+	uint64_t rss_baseline;
+	uint64_t rss_per_client;
+};
+
+static void on_end(void* obj)
+{
+	struct bench* bench = aml_get_userdata(obj);
+	measure(&bench->end, bench->client_clock, bench->generator);
+	atomic_store(&is_measuring, false);
+	aml_exit(aml_get_default());
+}
+
+static void on_warmed_up(void* obj)
+{
+	struct bench* bench = aml_get_userdata(obj);
+
+	uint64_t rss = get_rss_kib();
+	bench->rss_per_client = rss > bench->rss_baseline ?
+		(rss - bench->rss_baseline) / options.n_clients : 0;
+
+	measure(&bench->start, bench->client_clock, bench->generator);
+	atomic_store(&is_measuring, true);
+
+	struct aml_timer* timer = aml_timer_new(options.duration * 1000,
+			on_end, bench, NULL);
+	aml_start(aml_get_default(), timer);
+	aml_unref(timer);
+}
+
+static int parse_encoding(const char* name)
+{
+	if (strcmp(name, "raw") == 0)
+		options.encoding = RFB_ENCODING_RAW;
+	else if (strcmp(name, "zrle") == 0)
+		options.encoding = RFB_ENCODING_ZRLE;
+	else if (strcmp(name, "tight") == 0)
+		options.encoding = RFB_ENCODING_TIGHT;
+	else
+		return -1;
+	return 0;
+}
+
+static int parse_pixel_format(const char* name)
+{
+	for (size_t i = 0; i < sizeof(pixel_formats) /
+			sizeof(pixel_formats[0]); ++i)
+		if (strcmp(name, pixel_formats[i].name) == 0) {
+			options.pixfmt = &pixel_formats[i];
+			return 0;
+		}
+	return -1;
+}
+
+static int usage(int r)
+{
+	fprintf(r ? stderr : stdout, "\
+Usage: load-bench [options]\n\
+\n\
+Options:\n\
+    -n, --clients=<n>            Number of clients. Default: 8\n\
+    -e, --encoding=<name>        raw, zrle or tight. Default: tight\n\
+    -p, --pixel-format=<name>    rgb888, bgr888, rgb565 or bgr233.\n\
+                                 Default: rgb888\n\
+    -q, --quality=<0-9>          JPEG quality for Tight. Default: none\n\
+    -c, --compression=<0-9>      Compression level. Default: the server's\n\
+    -W, --width=<pixels>         Frame width. Default: 1920\n\
+    -H, --height=<pixels>        Frame height. Default: 1080\n\
+    -r, --rate=<fps>             Frames fed to the server per second.\n\
+                                 Default: 60\n\
+    -w, --warmup=<seconds>       Time to run before measuring. Default: 2\n\
+    -d, --duration=<seconds>     Time to measure. Default: 10\n\
+    -t, --threads=<n>            Client threads in the server, or -1 for\n\
+                                 one per CPU. Default: 0\n\
+    -P, --port=<port>            Loopback port. Default: 5950\n\
+    -i, --image=<file>           PNG image to use as the background.\n\
+    -h, --help                   Show this help.\n\
+\n");
+	return r;
+}
+
+int main(int argc, char* argv[])
+{
+	options = (struct bench_options){
+		.n_clients = 8,
+		.width = 1920,
+		.height = 1080,
+		.fps = 60,
+		.warmup = 2,
+		.duration = 10,
+		.port = 5950,
+		.encoding = RFB_ENCODING_TIGHT,
+		.quality = -1,
+		.compression_level = -1,
+		.pixfmt = &pixel_formats[0],
+	};
+
+	static const struct option long_options[] = {
+		{ "clients", required_argument, NULL, 'n' },
+		{ "encoding", required_argument, NULL, 'e' },
+		{ "pixel-format", required_argument, NULL, 'p' },
+		{ "quality", required_argument, NULL, 'q' },
+		{ "compression", required_argument, NULL, 'c' },
+		{ "width", required_argument, NULL, 'W' },
+		{ "height", required_argument, NULL, 'H' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "warmup", required_argument, NULL, 'w' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "port", required_argument, NULL, 'P' },
+		{ "image", required_argument, NULL, 'i' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	for (;;) {
+		int c = getopt_long(argc, argv, "n:e:p:q:c:W:H:r:w:d:t:P:i:h",
+				long_options, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'n': options.n_clients = atoi(optarg); break;
+		case 'e':
+			if (parse_encoding(optarg) < 0)
+				return usage(1);
+			break;
+		case 'p':
+			if (parse_pixel_format(optarg) < 0)
+				return usage(1);
+			break;
+		case 'q': options.quality = atoi(optarg); break;
+		case 'c': options.compression_level = atoi(optarg); break;
+		case 'W': options.width = atoi(optarg); break;
+		case 'H': options.height = atoi(optarg); break;
+		case 'r': options.fps = atoi(optarg); break;
+		case 'w': options.warmup = atoi(optarg); break;
+		case 'd': options.duration = atoi(optarg); break;
+		case 't': options.n_threads = atoi(optarg); break;
+		case 'P': options.port = atoi(optarg); break;
+		case 'i': options.image = optarg; break;
+		case 'h': return usage(0);
+		default: return usage(1);
+		}
+	}
+
+	if (options.n_clients <= 0 || options.n_clients > MAX_CLIENTS ||
+			options.width <= 0 || options.height <= 0 ||
+			options.fps <= 0 || options.warmup < 0 ||
+			options.duration <= 0 || options.quality > 9 ||
+			options.compression_level > 9)
+		return usage(1);
+
+#ifndef HAVE_LIBPNG
+	if (options.image) {
+		fprintf(stderr, "Built without PNG support\n");
+		return 1;
+	}
+#endif
+
+	const struct rfb_pixel_format* fmt = &options.pixfmt->fmt;
+	client_tpixel = fmt->bits_per_pixel == 32 && fmt->depth == 24 &&
+		fmt->red_max == 255 && fmt->green_max == 255 &&
+		fmt->blue_max == 255 ? 3 : fmt->bits_per_pixel / 8;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	int rc = 1;
+
+	/* Clients are set up before the baseline is taken, so that they don't
+	 * count towards the server's memory.
+	 */
+	clients = calloc(options.n_clients, sizeof(*clients));
+	if (!clients)
+		return 1;
+
+	for (int i = 0; i < options.n_clients; ++i) {
+		memset(clients[i].buffer, 0, sizeof(clients[i].buffer));
+		clients[i].fd = -1;
+	}
+
+	struct aml* aml = aml_new();
+	if (!aml)
+		goto aml_failure;
+
+	aml_set_default(aml);
+
+	struct generator generator = {
+		.width = options.width,
+		.height = options.height,
+		.dx = 7,
+		.dy = 5,
+	};
+
+	generator.canvas = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+			options.width, options.height, NULL, 0);
+	generator.background = load_background(options.width, options.height);
+	if (!generator.canvas || !generator.background)
+		goto image_failure;
+
+	pixman_image_composite(PIXMAN_OP_SRC, generator.background, NULL,
+			generator.canvas, 0, 0, 0, 0, 0, 0, options.width,
+			options.height);
+
+	generator.pool = nvnc_fb_pool_new(options.width, options.height,
+			DRM_FORMAT_XRGB8888, options.width);
+	if (!generator.pool)
+		goto pool_failure;
+
+	struct nvnc* server = nvnc_open("127.0.0.1", options.port);
+	if (!server) {
+		fprintf(stderr, "Failed to listen on port %d\n", options.port);
+		goto server_failure;
+	}
+
+	if (options.n_threads != 0 &&
+			nvnc_set_client_threads(server, options.n_threads) < 0)
+		goto display_failure;
+
+	generator.display = nvnc_display_new(0, 0);
+	if (!generator.display)
+		goto display_failure;
+
+	nvnc_add_display(server, generator.display);
+	nvnc_set_name(server, "load-bench");
+
+	/* Clients can't connect before there's a buffer */
+	generator_feed(&generator);
+
+	struct bench bench = {
+		.generator = &generator,
+		.rss_baseline = get_rss_kib(),
+	};
+
+	if (pthread_create(&bench.client_thread, NULL, client_thread,
+				NULL) != 0)
+		goto thread_failure;
+
+	pthread_getcpuclockid(bench.client_thread, &bench.client_clock);
+
+	struct aml_ticker* ticker = aml_ticker_new(1000 / options.fps,
+			on_tick, &generator, NULL);
+	aml_start(aml, ticker);
+
+	struct aml_timer* timer = aml_timer_new(options.warmup * 1000,
+			on_warmed_up, &bench, NULL);
+	aml_start(aml, timer);
+	aml_unref(timer);
+
+	aml_run(aml);
+
+	aml_stop(aml, ticker);
+	aml_unref(ticker);
+
+	atomic_store(&is_done, true);
+	pthread_join(bench.client_thread, NULL);
+
+	print_results(&bench.start, &bench.end, bench.rss_per_client);
+	rc = 0;
+
+thread_failure:
+	nvnc_remove_display(server, generator.display);
+	nvnc_display_unref(generator.display);
+display_failure:
+	nvnc_close(server);
+server_failure:
+	nvnc_fb_pool_unref(generator.pool);
+pool_failure:
+image_failure:
+	if (generator.background)
+		pixman_image_unref(generator.background);
+	if (generator.canvas)
+		pixman_image_unref(generator.canvas);
+	aml_unref(aml);
+aml_failure:
+	for (int i = 0; i < options.n_clients; ++i)
+		free(clients[i].latencies);
+	free(clients);
+	return rc;
+}
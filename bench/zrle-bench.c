@@ -17,6 +17,7 @@
 #include "zrle.h"
 #include "rfb-proto.h"
 #include "vec.h"
+#include "deflate.h"
 #include "neatvnc.h"
 #include "pixels.h"
 
@@ -68,13 +69,9 @@ static int run_benchmark(const char *image)
 	struct vec frame;
 	vec_init(&frame, stride * height * 3 / 2);
 
-	z_stream zs = { 0 };
-
-	deflateInit2(&zs, /* compression level: */ 1,
-			  /*            method: */ Z_DEFLATED,
-			  /*       window bits: */ 15,
-			  /*         mem level: */ 9,
-			  /*          strategy: */ Z_DEFAULT_STRATEGY);
+	struct deflate_stream* zs = deflate_stream_new(1);
+	if (!zs)
+		goto failure;
 
 	void *dummy = malloc(stride * height * 4);
 	if (!dummy)
@@ -91,11 +88,11 @@ static int run_benchmark(const char *image)
 	free(dummy);
 
 	start_time = gettime_us(CLOCK_PROCESS_CPUTIME_ID);
-	rc = zrle_encode_frame(&zs, &frame, &pixfmt, fb, &pixfmt, &region);
+	rc = zrle_encode_frame(zs, &frame, &pixfmt, fb, &pixfmt, &region);
 
 	end_time = gettime_us(CLOCK_PROCESS_CPUTIME_ID);
-	printf("Encoding %s took %"PRIu64" micro seconds\n", image,
-	       end_time - start_time);
+	printf("Encoding %s with %s took %"PRIu64" micro seconds\n", image,
+	       deflate_stream_backend(), end_time - start_time);
 
 	double orig_size = stride * height * 4;
 	double compressed_size = frame.len;
@@ -103,7 +100,7 @@ static int run_benchmark(const char *image)
 	double reduction = (orig_size - compressed_size) / orig_size;
 	printf("Size reduction: %.1f %%\n", reduction * 100.0);
 
-	deflateEnd(&zs);
+	deflate_stream_destroy(zs);
 
 	if (rc < 0)
 		goto failure;
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Plays a recorded session back to every client that connects, as it was
+ * sent to the client that it was recorded from. Whatever the clients send is
+ * ignored, so they must ask for the same things as the original client did.
+ * Sessions that were encrypted can't be played back.
+ *
+ * Each client is served by a process of its own. They all share the mapping
+ * of the recording.
+ */
+
+#include "fbs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static uint64_t gettime_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static int listen_tcp(const char* address, const char* port)
+{
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+
+	struct addrinfo* result;
+	if (getaddrinfo(address, port, &hints, &result) != 0)
+		return -1;
+
+	int fd = -1;
+	for (struct addrinfo* p = result; p; p = p->ai_next) {
+		fd = socket(p->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			continue;
+
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 &&
+				listen(fd, 16) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(result);
+	return fd;
+}
+
+/* Input is read and thrown away until the deadline, so that the client never
+ * blocks on a full socket.
+ */
+static int drain_input(int fd, uint64_t deadline)
+{
+	char buffer[4096];
+
+	for (;;) {
+		uint64_t now = gettime_us();
+		int timeout = now < deadline ? (deadline - now + 999) / 1000 : 0;
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int rc = poll(&pfd, 1, timeout);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -1;
+		if (rc == 0)
+			return 0;
+
+		ssize_t len = read(fd, buffer, sizeof(buffer));
+		if (len <= 0)
+			return -1;
+	}
+}
+
+static int write_all(int fd, const void* data, size_t len)
+{
+	const char* p = data;
+
+	while (len > 0) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN | POLLOUT };
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (pfd.revents & POLLIN && drain_input(fd, 0) < 0)
+			return -1;
+
+		if (!(pfd.revents & POLLOUT))
+			continue;
+
+		ssize_t rc = send(fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (rc < 0)
+			return -1;
+
+		p += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+/* A speed of 0 sends everything as fast as the client takes it */
+static int replay(struct fbs_reader* reader, int fd, double speed)
+{
+	struct fbs_block block;
+	uint64_t start_time = gettime_us();
+	uint64_t n_bytes = 0;
+	int rc;
+
+	fbs_reader_rewind(reader);
+
+	while ((rc = fbs_reader_next(reader, &block)) > 0) {
+		if (speed > 0) {
+			uint64_t deadline = start_time +
+				block.timestamp * 1000.0 / speed;
+			if (drain_input(fd, deadline) < 0)
+				return -1;
+		}
+
+		if (write_all(fd, block.data, block.len) < 0)
+			return -1;
+
+		n_bytes += block.len;
+	}
+
+	if (rc < 0)
+		fprintf(stderr, "The recording is truncated\n");
+
+	uint64_t time = gettime_us() - start_time;
+	printf("Replayed %llu bytes in %.3f s\n", (unsigned long long)n_bytes,
+			time / 1e6);
+	return rc;
+}
+
+static int usage(int rc)
+{
+	fprintf(rc == 0 ? stdout : stderr,
+"Usage: fbs-replay [options] <recording> [address] [port]\n"
+"\n"
+"    -s <speed>  Play back at this many times the recorded speed, or as fast\n"
+"                as possible if it is 0. The default is 1.\n"
+"    -h          Show help message and quit.\n");
+	return rc;
+}
+
+int main(int argc, char* argv[])
+{
+	double speed = 1.0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'h':
+			return usage(0);
+		default:
+			return usage(1);
+		}
+	}
+
+	if (optind >= argc)
+		return usage(1);
+
+	const char* path = argv[optind];
+	const char* address = optind + 1 < argc ? argv[optind + 1] : "127.0.0.1";
+	const char* port = optind + 2 < argc ? argv[optind + 2] : "5900";
+
+	struct fbs_reader reader;
+	if (fbs_reader_open(&reader, path) < 0) {
+		fprintf(stderr, "Failed to open recording %s\n", path);
+		return 1;
+	}
+
+	int server_fd = listen_tcp(address, port);
+	if (server_fd < 0) {
+		fprintf(stderr, "Failed to listen on %s:%s\n", address, port);
+		fbs_reader_close(&reader);
+		return 1;
+	}
+
+	/* Children are not waited for */
+	signal(SIGCHLD, SIG_IGN);
+
+	for (;;) {
+		int fd = accept(server_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(server_fd);
+			int rc = replay(&reader, fd, speed);
+			close(fd);
+			fflush(stdout);
+			_exit(rc < 0 ? 1 : 0);
+		}
+
+		if (pid < 0)
+			fprintf(stderr, "Failed to fork: %m\n");
+
+		close(fd);
+	}
+
+	close(server_fd);
+	fbs_reader_close(&reader);
+	return 0;
+}
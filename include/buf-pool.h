@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2019 - 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <unistd.h>
+#include <stdint.h>
+
+struct vec;
+struct rcbuf;
+
+/* Recycles the large output buffers that frames are encoded into. Buffers go
+ * back into the pool when the last reference to the rcbuf that was made from
+ * them is dropped, i.e. once the stream has sent the frame to every client that
+ * it was queued for.
+ *
+ * The pool must only be used from the main thread. It is reference counted,
+ * so rcbufs may outlive the server that created them.
+ */
+struct buf_pool;
+
+struct buf_pool* buf_pool_new(size_t max_free);
+void buf_pool_ref(struct buf_pool* self);
+void buf_pool_unref(struct buf_pool* self);
+
+/* Initialises dst with a pooled buffer of at least min_size bytes. New buffers
+ * are sized from the largest frame that has been seen so far.
+ */
+int buf_pool_acquire(struct buf_pool* self, struct vec* dst, size_t min_size);
+
+/* Takes over the buffer owned by frame. The buffer is returned to the pool
+ * when the rcbuf is freed. On failure, the buffer is freed.
+ */
+struct rcbuf* buf_pool_rcbuf_from_vec(struct buf_pool* self, struct vec* frame);
+
+/* The number of buffers and rcbufs that could not be taken from the pool.
+ * This stops going up once the pool has warmed up.
+ */
+uint64_t buf_pool_get_n_allocs(const struct buf_pool* self);
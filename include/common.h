@@ -18,23 +18,32 @@
 
 #include <stdbool.h>
 #include <pixman.h>
-#include <zlib.h>
 
 #include "rfb-proto.h"
 #include "sys/queue.h"
 
 #include "neatvnc.h"
 #include "tight.h"
+#include "zrle.h"
+#include "vec.h"
+#include "tile-bitmap.h"
+#include "desktop.h"
+#include "event-loop.h"
 #include "config.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 #ifdef ENABLE_TLS
 #include <gnutls/gnutls.h>
 #endif
 
 #define MAX_ENCODINGS 32
-#define MAX_OUTGOING_FRAMES 4
 #define MSG_BUFFER_SIZE 4096
+#define MSG_BUFFER_MAX_SIZE 65536
+#define MSG_BUFFER_MIN_READ 1024
 #define MAX_CUT_TEXT_SIZE 10000000
+#define MAX_FRAMES_IN_FLIGHT 2
 
 enum nvnc_client_state {
 	VNC_CLIENT_STATE_ERROR = -1,
@@ -54,6 +63,12 @@ struct stream;
 struct aml_handler;
 struct aml_idle;
 struct nvnc_display;
+struct nvnc_shard;
+struct damage_copy;
+struct open_h264;
+struct cursor_image;
+struct shm_buffer;
+struct tile_cache;
 
 struct nvnc_common {
 	void* userdata;
@@ -66,11 +81,22 @@ struct cut_text {
 	size_t index;
 };
 
+struct pointer_event {
+	uint16_t x, y;
+	enum nvnc_button_mask button_mask;
+};
+
+struct frame_in_flight {
+	uint64_t send_start_time;
+	uint64_t damage_time;
+};
+
 struct nvnc_client {
 	struct nvnc_common common;
 	int ref;
 	struct stream* net_stream;
 	struct nvnc* server;
+	struct nvnc_shard* shard;
 	enum nvnc_client_state state;
 	bool has_pixfmt;
 	struct rfb_pixel_format pixfmt;
@@ -78,28 +104,215 @@ struct nvnc_client {
 	size_t n_encodings;
 	LIST_ENTRY(nvnc_client) link;
 	struct pixman_region16 damage;
+	struct tile_bitmap damage_tiles;
 	int n_pending_requests;
+
+	/* What the update that is being encoded covers. It is given back to
+	 * the damage if the update does not make it out.
+	 */
+	struct pixman_region16 update_damage;
+
+	/* Updates go through two stages. The next frame is encoded while the
+	 * previous one is being sent, and damage that comes in while both
+	 * stages are busy is merged into whatever frame is encoded next.
+	 */
 	bool is_updating;
 	struct nvnc_fb* current_fb;
+	/* What has been sent of the current update ahead of the rest of it */
+	size_t update_chunk_bytes;
+	int n_update_parts_in_flight;
+	struct frame_in_flight frames_in_flight[MAX_FRAMES_IN_FLIGHT];
+	int n_frames_in_flight;
 	nvnc_client_fn cleanup_fn;
-	z_stream z_stream;
+	/* Encoders are set up the first time that the client needs them */
+	struct zrle_encoder zrle_encoder;
+	bool has_zrle_encoder;
 	struct tight_encoder tight_encoder;
+	bool has_tight_encoder;
+	/* The client's tight decoder has been used by a shared frame */
+	bool has_shared_tight_frame;
+	struct aml_work* update_work;
+#ifdef ENABLE_OPEN_H264
+	struct open_h264* open_h264;
+#endif
+#ifdef ENABLE_SHM
+	/* Pixels are copied into this instead of being encoded */
+	struct shm_buffer* shm;
+	bool is_shm_failed;
+#endif
+
+	/* Messages are parsed in place between buffer_index and buffer_len.
+	 * What's left over is only moved to the front when there's too little
+	 * room behind it. The buffer grows for messages that don't fit and for
+	 * bursts that fill it up in one read.
+	 */
 	size_t buffer_index;
 	size_t buffer_len;
-	uint8_t msg_buffer[MSG_BUFFER_SIZE];
+	size_t msg_buffer_size;
+	uint8_t* msg_buffer;
 	uint32_t known_width;
 	uint32_t known_height;
+	uint32_t known_layout_serial;
 	struct cut_text cut_text;
+
+	/* Motion is merged until the buttons change or the read is done */
+	struct pointer_event pending_pointer;
+	bool has_pending_pointer;
+
+	/* Where the pointer was last seen, for the tight encoder to start */
+	uint16_t pointer_x, pointer_y;
+	bool has_pointer;
+
 	bool is_qemu_key_ext_notified;
+	uint32_t cursor_serial;
+
+	/* Continuous updates are pushed without waiting for requests. They are
+	 * paced by fences that the client answers once it has processed
+	 * everything sent before them.
+	 */
+	bool is_continuous;
+	bool is_fence_announced;
+	bool is_continuous_announced;
+	bool is_end_of_continuous_pending;
+	int n_pings_in_flight;
+	bool has_sync_fence;
+	uint32_t sync_fence_flags;
+	uint8_t sync_fence_length;
+	uint8_t sync_fence_payload[RFB_FENCE_MAX_PAYLOAD];
+
+	/* CopyRects, in the order in which they must be applied. Pending ones
+	 * go out with the next update and are moved into update_copies when
+	 * it starts. They can only be sent once the client has been sent the
+	 * whole framebuffer.
+	 */
+	struct vec copies;
+	struct vec update_copies;
+	bool has_full_frame;
+
+	/* Send pacing. The drain rate is only sampled while there is a
+	 * backlog, as an idle link says nothing about its capacity.
+	 */
+	uint64_t pacing_time;
+	uint32_t pacing_delivered;
+	bool pacing_was_backlogged;
+	uint32_t drain_rate;
+	bool is_congested;
+	bool is_pacing_deferred;
+
+	/* Tiles that were sent as JPEG are sent again without loss once the
+	 * screen has been still for a while, a few at a time.
+	 */
+	uint64_t last_damage_time;
+	struct aml_timer* refresh_timer;
+	bool is_refresh_pending;
+	bool is_refreshing;
+
+	/* Adaptive compression. The round trip is timed from when a frame has
+	 * been written out until the client asks for more or answers the ping
+	 * that went with it. It grows as data queues up along the way.
+	 */
+	int adaptive_level;
+	int adaptive_quality;
+	uint64_t adaptive_time;
+	uint64_t rtt_probe_time;
+	uint32_t rtt;
+	uint32_t min_rtt;
+
+	/* Timestamps for the statistics, in microseconds. The damage time is
+	 * that of the oldest damage that has not been sent yet.
+	 */
+	struct nvnc_client_stats stats;
+	enum rfb_encodings update_encoding;
+	uint64_t damage_time;
+	uint64_t update_damage_time;
+	uint64_t update_start_time;
 };
 
 LIST_HEAD(nvnc_client_list, nvnc_client);
 
+/* A frame that has been (or is being) encoded for one client and may be handed
+ * as-is to every other client that has the same pixel format, encoding,
+ * quality and damage. Shared frames never depend on zlib history, i.e. tight
+ * frames reset every stream that they use.
+ *
+ * Keyframes cover the whole framebuffer and outlive the buffer that they were
+ * encoded from, so that clients that connect later can start out with them.
+ * Whatever has been damaged since is in stale and is sent after the keyframe.
+ * Tiles that could not be encoded are added to stale as well.
+ */
+struct shared_frame {
+	int ref;
+	struct nvnc_shard* shard;
+	struct rfb_pixel_format pixfmt;
+	struct rfb_pixel_format server_fmt;
+	enum rfb_encodings encoding;
+	enum tight_quality quality;
+	struct nvnc_fb* fb;
+	struct pixman_region16 damage;
+	struct vec frame;
+	struct rcbuf* payload;
+	bool is_done;
+	bool is_cached;
+	bool is_keyframe;
+	uint16_t width, height;
+	struct pixman_region16 stale;
+	struct vec waiters;
+	LIST_ENTRY(shared_frame) link;
+};
+
+LIST_HEAD(shared_frame_list, shared_frame);
+
+/* A group of clients that is served by one event loop. Nothing in a shard may
+ * be touched from other threads; they post to its queue instead. The main
+ * shard runs on the default loop and the others on threads of their own.
+ */
+struct nvnc_shard {
+	struct nvnc* server;
+	struct aml* aml;
+	struct loop_queue queue;
+	pthread_t thread;
+	bool has_thread;
+
+	/* Used by the main thread to balance new connections */
+	atomic_int n_clients;
+
+	/* The last frame serial that was published to this shard. Only the
+	 * main thread touches this.
+	 */
+	uint32_t fb_serial;
+
+	struct nvnc_client_list clients;
+
+	/* Threaded shards have a handle of their own for the display's
+	 * buffer. The main shard uses the display's directly.
+	 */
+	struct nvnc_fb* fb;
+
+	/* The serial is bumped for every new cursor image */
+	struct cursor_image* cursor;
+	uint32_t cursor_serial;
+
+	/* The layout that goes with the buffer */
+	struct desktop_layout layout;
+
+	/* The damage of the current frame, aligned to the tight tile grid */
+	struct tile_bitmap damage_tiles;
+
+	struct buf_pool* frame_pool;
+
+	/* Encoded JPEG tiles, shared by all tight encoders on the shard */
+	struct tile_cache* tile_cache;
+
+	struct shared_frame_list shared_frames;
+	struct tight_encoder shared_tight_encoder;
+	bool has_shared_tight_encoder;
+	bool is_shared_tight_busy;
+};
+
 struct nvnc {
 	struct nvnc_common common;
 	int fd;
 	struct aml_handler* poll_handle;
-	struct nvnc_client_list clients;
 	char name[256];
 	void* userdata;
 	nvnc_key_fn key_fn;
@@ -108,7 +321,33 @@ struct nvnc {
 	nvnc_fb_req_fn fb_req_fn;
 	nvnc_client_fn new_client_fn;
 	nvnc_cut_text_fn cut_text_fn;
-	struct nvnc_display* display;
+	bool is_pointer_coalescing;
+	struct nvnc_compression_policy compression_policy;
+	bool is_websocket;
+	bool is_unix;
+
+	/* Sessions are recorded to files in here if it is set */
+	char* recording_dir;
+	uint32_t next_recording_id;
+
+	struct nvnc_display* displays[DESKTOP_MAX_SCREENS];
+	int n_displays;
+	uint32_t next_display_id;
+
+	/* The buffer that clients see. It is the display's own buffer if there
+	 * is only one at the origin, but otherwise the displays are composed
+	 * into it.
+	 */
+	struct nvnc_fb* buffer;
+	struct desktop* desktop;
+	struct desktop_layout layout;
+
+	/* Bumped for every new frame from a display */
+	uint32_t fb_serial;
+
+	struct nvnc_shard main_shard;
+	struct nvnc_shard* shards;
+	int n_shards;
 
 #ifdef ENABLE_TLS
 	gnutls_certificate_credentials_t tls_creds;
@@ -117,5 +356,7 @@ struct nvnc {
 #endif
 };
 
-void nvnc__damage_region(struct nvnc* self,
-                         const struct pixman_region16* damage);
+/* The damage and copy are in the display's own coordinates */
+void nvnc__damage_region(struct nvnc* self, struct nvnc_display* display,
+                         const struct pixman_region16* damage,
+                         const struct damage_copy* copy);
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include "rfb-proto.h"
+
+#include <stdint.h>
+
+struct nvnc_fb;
+struct vec;
+
+/* A copy of a cursor image, so that it can be handed to other threads and
+ * encoded for every client in its own pixel format. An empty image hides the
+ * cursor.
+ */
+struct cursor_image {
+	uint16_t width;
+	uint16_t height;
+	uint16_t hotspot_x;
+	uint16_t hotspot_y;
+	struct rfb_pixel_format fmt;
+
+	/* A bit for each pixel that is to be drawn, rows padded to bytes */
+	uint8_t* mask;
+	uint32_t pixels[];
+};
+
+struct cursor_image* cursor_image_new(struct nvnc_fb* fb, uint16_t hotspot_x,
+		uint16_t hotspot_y);
+struct cursor_image* cursor_image_dup(const struct cursor_image* self);
+
+/* Appends the cursor as a rich cursor rect */
+int cursor_encode(struct vec* dst, const struct rfb_pixel_format* dst_fmt,
+		const struct cursor_image* cursor);
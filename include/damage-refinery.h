@@ -17,14 +17,66 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pixman.h>
+
+#include "tile-bitmap.h"
+
+#define DAMAGE_REFINERY_MAX_WORKERS 16
+#define DAMAGE_REFINERY_N_LEVELS 3
 
-struct pixman_region16;
 struct nvnc_fb;
+struct aml_work;
 
-struct damage_refinery {
+typedef void (*damage_refine_fn)(struct pixman_region16* refined,
+		void* userdata);
+
+struct damage_refinery_level {
+	uint32_t tile_size;
+	uint32_t grid_width;
+	uint32_t grid_height;
 	uint32_t* hashes;
+};
+
+/* The pixels in region were at (x - dx, y - dy) in the previous frame, so a
+ * client that still has the previous frame can copy them instead of having
+ * them encoded.
+ */
+struct damage_copy {
+	struct pixman_region16 region;
+	int dx, dy;
+};
+
+/* Tiles are hashed coarse to fine: the finer levels of a tile are only looked
+ * at if its hash has changed, and damage is reported in tiles of the finest
+ * level.
+ */
+struct damage_refinery {
+	struct damage_refinery_level levels[DAMAGE_REFINERY_N_LEVELS];
 	uint32_t width;
 	uint32_t height;
+
+	struct tile_bitmap hint_tiles;
+	struct tile_bitmap damaged_tiles;
+
+	/* The hashes that the damaged tiles of the finest level had before
+	 * they were last refined.
+	 */
+	uint32_t* old_hashes;
+	struct damage_copy copy;
+
+	/* Workers take whole rows of the coarsest tiles, so that no two
+	 * workers ever touch the same word in damaged_tiles.
+	 */
+	int n_workers;
+	struct aml_work* worker[DAMAGE_REFINERY_MAX_WORKERS];
+	uint32_t n_jobs;
+	atomic_uint next_row;
+
+	struct nvnc_fb* buffer;
+	damage_refine_fn on_done;
+	void* userdata;
 };
 
 int damage_refinery_init(struct damage_refinery* self, uint32_t width,
@@ -37,3 +89,23 @@ void damage_refine(struct damage_refinery* self,
 		struct pixman_region16* refined, 
 		struct pixman_region16* hint,
 		struct nvnc_fb* buffer);
+
+/* Hashes the hinted tiles on the worker threads and reports the refined damage
+ * on the main thread. The buffer must be kept alive and unchanged until
+ * on_done has been called, and only one refinement may run at a time.
+ */
+int damage_refine_async(struct damage_refinery* self,
+		struct pixman_region16* hint, struct nvnc_fb* buffer,
+		damage_refine_fn on_done, void* userdata);
+
+/* Returns the scrolled or moved part of the damage that was found by the last
+ * refinement, or NULL if there was none. The result is only valid until the
+ * next refinement is started.
+ */
+const struct damage_copy* damage_refinery_get_copy(
+		const struct damage_refinery* self);
+
+static inline bool damage_refinery_is_busy(const struct damage_refinery* self)
+{
+	return self->n_jobs > 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct vec;
+
+/* A zlib stream as the RFB encodings use it. The history carries over from
+ * one message to the next for as long as the stream lives, and every flush
+ * ends on a byte boundary. The backend is chosen at build time and all of
+ * them produce output that any zlib inflater can read.
+ */
+struct deflate_stream;
+
+/* The level goes from 0 to 9, like for zlib */
+struct deflate_stream* deflate_stream_new(int level);
+void deflate_stream_destroy(struct deflate_stream* self);
+
+/* The peer must be told to reset its inflater too */
+void deflate_stream_reset(struct deflate_stream* self);
+
+/* Only call this after a flush, so that nothing that is still pending gets
+ * compressed at the new level.
+ */
+int deflate_stream_set_level(struct deflate_stream* self, int level);
+
+/* Appends the compressed data to dst. With flush set, all of it is written
+ * out.
+ */
+int deflate_stream_compress(struct deflate_stream* self, struct vec* dst,
+		const void* src, size_t len, bool flush);
+
+const char* deflate_stream_backend(void);
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DESKTOP_MAX_SCREENS 16
+
+struct nvnc_fb;
+struct nvnc_display;
+struct pixman_region16;
+
+struct desktop_screen {
+	uint32_t id;
+	uint16_t x, y;
+	uint16_t width, height;
+};
+
+/* Where each display is on the desktop. Only displays that have a buffer are
+ * on it. The serial is bumped whenever anything changes.
+ */
+struct desktop_layout {
+	uint32_t serial;
+	uint16_t width, height;
+	int n_screens;
+	struct desktop_screen screens[DESKTOP_MAX_SCREENS];
+};
+
+/* Rebuilds the layout from the displays. The parts of the desktop that
+ * screens have moved to or away from are added to the damage.
+ */
+bool desktop_layout_update(struct desktop_layout* self,
+		struct nvnc_display* const* displays, int n_displays,
+		struct pixman_region16* damage);
+
+/* Composes the displays into one buffer for encoders that need the whole
+ * desktop in a single buffer. Buffers are reused, so only what has changed
+ * since a buffer was last composed is copied into it.
+ */
+struct desktop;
+
+struct desktop* desktop_new(void);
+void desktop_destroy(struct desktop* self);
+
+/* The damage is in desktop coordinates. It is also needed when the buffer
+ * is not composed, so that buffers that come back into use are brought up to
+ * date.
+ */
+void desktop_damage(struct desktop* self, struct pixman_region16* damage);
+
+/* The caller owns one reference to the buffer that is returned */
+struct nvnc_fb* desktop_compose(struct desktop* self,
+		const struct desktop_layout* layout,
+		struct nvnc_display* const* displays, int n_displays,
+		struct pixman_region16* damage);
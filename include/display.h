@@ -20,17 +20,40 @@
 #include "damage-refinery.h"
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <pixman.h>
 #include <pixels.h>
 
 struct nvnc;
 struct nvnc_fb;
 struct resampler;
+struct aml_timer;
 
 struct nvnc_display {
 	int ref;
 	struct nvnc* server;
+	uint32_t id;
 	uint16_t x_pos, y_pos;
 	struct nvnc_fb* buffer;
 	struct resampler* resampler;
+
+	/* The last GPU buffer that was fed, for encoders that can read it
+	 * without the copy into system memory.
+	 */
+	struct nvnc_fb* gpu_buffer;
 	struct damage_refinery damage_refinery;
+
+	/* Frames fed while the refinery is busy are coalesced here */
+	struct nvnc_fb* refining_fb;
+	struct nvnc_fb* pending_fb;
+	struct pixman_region16 pending_damage;
+
+	/* Buffers that are fed faster than the rate limit allows wait here
+	 * for the timer.
+	 */
+	uint32_t min_interval_us;
+	uint64_t last_feed_time;
+	struct aml_timer* feed_timer;
+	struct nvnc_fb* deferred_fb;
+	struct pixman_region16 deferred_damage;
 };
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include "vec.h"
+
+struct aml;
+struct aml_handler;
+
+/* Everything that is started on an event loop (streams, timers and the
+ * completion of worker jobs) belongs to the loop of the thread that started
+ * it. Threads other than the main thread set their own loop, so that code
+ * that runs on them picks the right one.
+ */
+struct aml* nvnc__get_loop(void);
+void nvnc__set_thread_loop(struct aml* aml);
+
+typedef void (*loop_queue_fn)(void* data);
+
+/* Lets any thread run functions on the thread that runs the given loop, in
+ * the order that they were posted.
+ */
+struct loop_queue {
+	pthread_mutex_t lock;
+	struct vec messages;
+	int fd;
+	struct aml_handler* handler;
+	struct aml* aml;
+};
+
+int loop_queue_init(struct loop_queue* self, struct aml* aml);
+void loop_queue_destroy(struct loop_queue* self);
+
+int loop_queue_post(struct loop_queue* self, loop_queue_fn fn, void* data);
+
+/* Runs everything that has been posted so far on the calling thread */
+void loop_queue_dispatch(struct loop_queue* self);
@@ -42,13 +42,34 @@ struct nvnc_fb {
 	/* main memory buffer attributes */
 	void* addr;
 	int32_t stride;
+	size_t mmap_size;
 
 	/* dmabuf attributes */
 	struct gbm_bo* bo;
 	void* bo_map_handle;
+	/* A mapping that is kept between frames is bracketed by dma-buf syncs
+	 * while the buffer is held, so that the CPU waits for the GPU and sees
+	 * what it rendered.
+	 */
+	int bo_fd;
+	bool is_bo_synced;
 };
 
+enum nvnc_fb_alloc_flags {
+	NVNC_FB_ALLOC_HUGEPAGES = 1 << 0,
+	NVNC_FB_ALLOC_PREFAULT = 1 << 1,
+};
+
+struct nvnc_fb* nvnc__fb_new(uint16_t width, uint16_t height,
+		uint32_t fourcc_format, uint16_t stride, uint32_t alloc_flags);
+
 void nvnc_fb_hold(struct nvnc_fb* fb);
 void nvnc_fb_release(struct nvnc_fb* fb);
 int nvnc_fb_map(struct nvnc_fb* fb);
 void nvnc_fb_unmap(struct nvnc_fb* fb);
+
+/* Dimensions of the buffer as it appears to clients, i.e. after the transform
+ * has been applied.
+ */
+uint16_t nvnc_fb_get_logical_width(const struct nvnc_fb* fb);
+uint16_t nvnc_fb_get_logical_height(const struct nvnc_fb* fb);
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Sessions are recorded in the FBS format of rfbproxy. The file starts with a
+ * version line, which is followed by a block for everything that was sent to
+ * the client. Each block is the length of the data, the data padded to four
+ * bytes and the time in milliseconds since the recording started. Numbers are
+ * big endian.
+ */
+#define FBS_VERSION "FBS 001.000\n"
+
+/* Blocks are written to the file by a worker of the event loop that appends
+ * them, so a writer must not be shared between loops.
+ */
+struct fbs_writer;
+
+struct fbs_writer* fbs_writer_open(const char* path);
+void fbs_writer_close(struct fbs_writer* self);
+int fbs_writer_append(struct fbs_writer* self, const void* data, size_t len);
+
+struct fbs_block {
+	const void* data;
+	uint32_t len;
+	uint32_t timestamp;
+};
+
+/* Recordings are mapped into memory, so that any number of readers can share
+ * the same pages.
+ */
+struct fbs_reader {
+	const uint8_t* addr;
+	size_t size;
+	size_t offset;
+};
+
+int fbs_reader_open(struct fbs_reader* self, const char* path);
+void fbs_reader_close(struct fbs_reader* self);
+void fbs_reader_rewind(struct fbs_reader* self);
+
+/* Returns 1 if a block was read, 0 at the end of the recording and -1 if the
+ * recording is truncated.
+ */
+int fbs_reader_next(struct fbs_reader* self, struct fbs_block* block);
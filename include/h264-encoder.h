@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct nvnc_fb;
+struct vec;
+
+/* Encodes dmabuf backed buffers on the GPU through VA-API. The buffers are
+ * imported as they are, so the pixels never pass through the CPU.
+ *
+ * None of these may be called from more than one thread at a time, but as
+ * they can block for a while, they are meant to run on a worker.
+ */
+struct h264_encoder;
+
+struct h264_encoder* h264_encoder_create(uint32_t width, uint32_t height,
+		uint32_t fourcc_format);
+void h264_encoder_destroy(struct h264_encoder* self);
+
+/* Makes the next frame an IDR frame, i.e. one that does not depend on any
+ * frame that came before it.
+ */
+void h264_encoder_request_keyframe(struct h264_encoder* self);
+
+/* Appends the encoded frame to dst as an Annex B byte stream. The buffer must
+ * be a GBM buffer object of the size and format that the encoder was created
+ * for.
+ */
+int h264_encoder_encode(struct h264_encoder* self, struct nvnc_fb* fb,
+		struct vec* dst);
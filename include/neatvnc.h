@@ -53,6 +53,63 @@ enum nvnc_transform {
 	NVNC_TRANSFORM_FLIPPED_270 = 7,
 };
 
+enum nvnc_fb_pool_flags {
+	/* Back buffers with huge pages where the system has them */
+	NVNC_FB_POOL_HUGEPAGES = 1 << 0,
+};
+
+struct nvnc_fb_pool_stats {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t n_free;
+	uint32_t n_in_use;
+	uint32_t max_in_use;
+};
+
+/* Times are in microseconds. The damage latency is the time from when a
+ * region was first damaged until the frame that covers it has been written to
+ * the socket.
+ *
+ * Frame buffers and send requests are pooled, and frame_allocs counts the
+ * ones that had to be allocated. Buffers are shared between the clients that
+ * are served by the same thread, so they are counted for all of them. Once
+ * the pools have warmed up, this should stop going up.
+ *
+ * refreshed_tiles counts the tight tiles that were sent again without loss
+ * after the screen came to rest, having been sent as JPEG before.
+ */
+struct nvnc_client_stats {
+	uint64_t frames_sent;
+	uint64_t frames_skipped;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t raw_bytes;
+	uint64_t zrle_bytes;
+	uint64_t tight_bytes;
+	uint64_t copy_rects;
+	uint64_t refreshed_tiles;
+	uint64_t encode_time;
+	uint64_t send_time;
+	uint32_t damage_latency;
+	uint32_t max_damage_latency;
+	uint32_t bytes_queued;
+	uint64_t frame_allocs;
+};
+
+/* With an adaptive policy, the zlib level and the JPEG quality are adjusted
+ * for each client between the given bounds, which go from 0 to 9. More CPU
+ * time is spent on compression while the link can't keep up, and less when it
+ * can. Otherwise, the levels that clients ask for are used, which is the
+ * default. JPEG is only ever used for clients that ask for it.
+ */
+struct nvnc_compression_policy {
+	bool is_adaptive;
+	int min_level;
+	int max_level;
+	int min_quality;
+	int max_quality;
+};
+
 typedef void (*nvnc_key_fn)(struct nvnc_client*, uint32_t key,
                             bool is_pressed);
 typedef void (*nvnc_pointer_fn)(struct nvnc_client*, uint16_t x, uint16_t y,
@@ -72,21 +129,52 @@ extern const char nvnc_version[];
 
 struct nvnc* nvnc_open(const char* addr, uint16_t port);
 struct nvnc* nvnc_open_unix(const char *addr);
+
+/* Accepts connections from WebSocket clients such as noVNC, without a proxy
+ * in between. VeNCrypt is not available on these connections, so TLS has to
+ * be provided in front of them.
+ */
+struct nvnc* nvnc_open_websocket(const char* addr, uint16_t port);
 void nvnc_close(struct nvnc* self);
 
 void nvnc_add_display(struct nvnc*, struct nvnc_display*);
 void nvnc_remove_display(struct nvnc*, struct nvnc_display*);
 
+/* Serves clients on n_threads event loops of their own, or one per CPU if
+ * n_threads is negative. Callbacks for a client are then made on that client's
+ * thread, so this should be set up along with the callbacks, before any clients
+ * connect.
+ */
+int nvnc_set_client_threads(struct nvnc* self, int n_threads);
+
 void nvnc_set_userdata(void* self, void* userdata, nvnc_cleanup_fn);
 void* nvnc_get_userdata(const void* self);
 
 struct nvnc* nvnc_client_get_server(const struct nvnc_client* client);
+void nvnc_client_get_stats(const struct nvnc_client* client,
+                           struct nvnc_client_stats* stats);
 
 void nvnc_set_name(struct nvnc* self, const char* name);
 
 void nvnc_set_key_fn(struct nvnc* self, nvnc_key_fn);
 void nvnc_set_key_code_fn(struct nvnc* self, nvnc_key_fn);
 void nvnc_set_pointer_fn(struct nvnc* self, nvnc_pointer_fn);
+
+/* Pointer events that arrive together are merged into one for each change of
+ * the buttons, so motion only reaches the pointer callback at its latest
+ * position. Key events are delivered in order with the pointer events.
+ */
+void nvnc_set_pointer_coalescing(struct nvnc* self, bool enable);
+
+/* Everything that is sent to clients that connect after this is recorded into
+ * an FBS file per client in the given directory, along with when it was sent.
+ * The recordings can be played back with fbs-replay. Recording is stopped for
+ * new clients by passing NULL.
+ */
+int nvnc_set_recording_dir(struct nvnc* self, const char* path);
+
+void nvnc_set_compression_policy(struct nvnc* self,
+		const struct nvnc_compression_policy* policy);
 void nvnc_set_fb_req_fn(struct nvnc* self, nvnc_fb_req_fn);
 void nvnc_set_new_client_fn(struct nvnc* self, nvnc_client_fn);
 void nvnc_set_client_cleanup_fn(struct nvnc_client* self, nvnc_client_fn fn);
@@ -123,6 +211,10 @@ struct nvnc_fb_pool* nvnc_fb_pool_new(uint16_t width, uint16_t height,
 				      uint32_t fourcc_format, uint16_t stride);
 bool nvnc_fb_pool_resize(struct nvnc_fb_pool*, uint16_t width, uint16_t height,
 			 uint32_t fourcc_format, uint16_t stride);
+void nvnc_fb_pool_set_flags(struct nvnc_fb_pool*, uint32_t flags);
+int nvnc_fb_pool_prefill(struct nvnc_fb_pool*, int n_buffers);
+void nvnc_fb_pool_get_stats(const struct nvnc_fb_pool*,
+			    struct nvnc_fb_pool_stats* stats);
 
 void nvnc_fb_pool_ref(struct nvnc_fb_pool*);
 void nvnc_fb_pool_unref(struct nvnc_fb_pool*);
@@ -139,4 +231,21 @@ struct nvnc* nvnc_display_get_server(const struct nvnc_display*);
 void nvnc_display_feed_buffer(struct nvnc_display*, struct nvnc_fb*,
 			      struct pixman_region16* damage);
 
+/* Caps how many fed buffers are processed per second. Damage from buffers that
+ * are fed in between is merged, and only the newest buffer is used. 0, the
+ * default, means that every buffer is processed right away.
+ */
+void nvnc_display_set_max_rate(struct nvnc_display*, uint32_t max_fps);
+
 void nvnc_send_cut_text(struct nvnc*, const char* text, uint32_t len);
+
+/* Clients that support the cursor pseudo-encoding draw this image on their
+ * own, so the cursor need not be part of the framebuffer for them. The image
+ * is copied, so the buffer may be reused right away. A NULL buffer hides the
+ * cursor.
+ */
+int nvnc_set_cursor(struct nvnc*, struct nvnc_fb*, uint16_t hotspot_x,
+                    uint16_t hotspot_y);
+
+/* Whether the cursor still has to be drawn into the framebuffer for a client */
+bool nvnc_client_supports_cursor(const struct nvnc_client* client);
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct nvnc_fb;
+struct vec;
+struct buf_pool;
+
+typedef void (*open_h264_done_fn)(struct vec* frame, void*);
+
+/* The Open H.264 encoding. Every frame covers the whole framebuffer and
+ * depends on the ones before it, so frames can't be shared between clients.
+ */
+struct open_h264;
+
+struct open_h264* open_h264_new(struct buf_pool* frame_pool);
+void open_h264_destroy(struct open_h264* self);
+
+/* The next frame is sent as a key frame, e.g. because the client may have
+ * lost track of the stream.
+ */
+void open_h264_request_keyframe(struct open_h264* self);
+
+/* Only GBM buffer objects can be encoded. The frame is handed to on_done,
+ * or NULL if encoding failed.
+ */
+int open_h264_encode_frame(struct open_h264* self, struct nvnc_fb* fb,
+		open_h264_done_fn on_done, void* userdata);
@@ -23,6 +23,26 @@
 
 struct rfb_pixel_format;
 
+/* Per-call parameters for the vectorised pixel32_to_cpixel() kernels */
+struct cpixel_conv {
+	uint32_t src_shift[3];
+	uint32_t src_max[3];
+	uint32_t src_bits[3];
+	uint32_t dst_bits[3];
+	uint32_t dst_shift[3];
+	size_t bytes_per_cpixel;
+	uint8_t shuffle[16];
+};
+
+typedef size_t (*pixel32_to_cpixel_kernel_fn)(uint8_t* restrict dst,
+		const uint32_t* restrict src, const struct cpixel_conv* conv,
+		size_t len);
+
+/* Selected at load time from the CPU features; NULL if none apply. */
+extern pixel32_to_cpixel_kernel_fn pixel32_to_cpixel_kernel;
+
+void cpixel_conv_init_shuffle(struct cpixel_conv* conv, bool big_endian);
+
 void pixel32_to_cpixel(uint8_t* restrict dst,
                        const struct rfb_pixel_format* dst_fmt,
                        const uint32_t* restrict src,
@@ -16,11 +16,37 @@
 
 #pragma once
 
+#include "region-simplify.h"
+
+#include <stddef.h>
+
 struct nvnc_fb;
 struct rfb_pixel_format;
 struct pixman_region16;
 struct vec;
 
+/* A frame that is encoded a part at a time. Every part is an update message of
+ * its own, so that other messages may be sent in between.
+ */
+struct raw_frame {
+	struct region_boxes boxes;
+	int box_index;
+	int row;
+};
+
+int raw_frame_init(struct raw_frame* self,
+                   const struct rfb_pixel_format* dst_fmt,
+                   struct pixman_region16* region);
+void raw_frame_finish(struct raw_frame* self);
+
+/* Appends to dst until it holds at least max_size bytes or the frame is done.
+ * Returns 1 if there is more to come, 0 when done or -1 on failure.
+ */
+int raw_frame_encode(struct raw_frame* self, struct vec* dst,
+                     const struct rfb_pixel_format* dst_fmt,
+                     struct nvnc_fb* src,
+                     const struct rfb_pixel_format* src_fmt, size_t max_size);
+
 int raw_encode_frame(struct vec* dst, const struct rfb_pixel_format* dst_fmt,
                      struct nvnc_fb* src,
                      const struct rfb_pixel_format* src_fmt,
@@ -17,14 +17,31 @@
 #pragma once
 
 #include <unistd.h>
+#include <stdbool.h>
+
+typedef void (*rcbuf_free_fn)(void* payload, void* userdata);
 
 struct rcbuf {
 	void* payload;
 	size_t size;
 	int ref;
+
+	/* Called instead of free() on the payload if set */
+	rcbuf_free_fn free_fn;
+	void* free_userdata;
+
+	/* Part of another object, which free_fn is left to deal with */
+	bool is_embedded;
 };
 
 struct rcbuf* rcbuf_new(void* payload, size_t size);
+struct rcbuf* rcbuf_new_with_free_fn(void* payload, size_t size,
+		rcbuf_free_fn free_fn, void* userdata);
+/* Sets up an rcbuf that lives inside another object, so that no allocation
+ * is needed. It must stay valid until free_fn has been called.
+ */
+void rcbuf_init_with_free_fn(struct rcbuf* self, void* payload, size_t size,
+		rcbuf_free_fn free_fn, void* userdata);
 struct rcbuf* rcbuf_from_string(const char* str);
 struct rcbuf* rcbuf_from_mem(const void* addr, size_t size);
 
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <pixman.h>
+
+/* Regions with up to this many boxes are simplified without allocating */
+#define REGION_SIMPLIFY_SMALL 128
+
+/* The estimated cost of encoding an area. Each rectangle has a fixed cost,
+ * such as its header, and each pixel in it costs the same. Only the ratio
+ * between the two matters.
+ */
+struct region_cost {
+	uint32_t rect;
+	uint32_t pixel;
+};
+
+struct region_boxes {
+	struct pixman_box16* boxes;
+	int n_boxes;
+	struct pixman_box16 small[REGION_SIMPLIFY_SMALL];
+};
+
+/* Turns the region into boxes to encode. Nearby boxes are merged into their
+ * bounding box where that is estimated to be cheaper than encoding them on
+ * their own. Merged boxes may overlap a little, but that is within what the
+ * cost allows for. There are never more than UINT16_MAX boxes.
+ */
+int region_simplify(struct region_boxes* dst, struct pixman_region16* region,
+		const struct region_cost* cost);
+void region_boxes_finish(struct region_boxes* self);
@@ -19,6 +19,7 @@
 #define RFB_VERSION_MESSAGE "RFB 003.008\n"
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -45,6 +46,9 @@ enum rfb_client_to_server_msg_type {
 	RFB_CLIENT_TO_SERVER_KEY_EVENT = 4,
 	RFB_CLIENT_TO_SERVER_POINTER_EVENT = 5,
 	RFB_CLIENT_TO_SERVER_CLIENT_CUT_TEXT = 6,
+	RFB_CLIENT_TO_SERVER_ENABLE_CONTINUOUS_UPDATES = 150,
+	RFB_CLIENT_TO_SERVER_FENCE = 248,
+	RFB_CLIENT_TO_SERVER_SET_DESKTOP_SIZE = 251,
 	RFB_CLIENT_TO_SERVER_QEMU = 255,
 };
 
@@ -60,18 +64,74 @@ enum rfb_encodings {
 	RFB_ENCODING_TIGHT = 7,
 	RFB_ENCODING_TRLE = 15,
 	RFB_ENCODING_ZRLE = 16,
+	RFB_ENCODING_OPEN_H264 = 50,
 	RFB_ENCODING_CURSOR = -239,
 	RFB_ENCODING_DESKTOPSIZE = -223,
 	RFB_ENCODING_JPEG_HIGHQ = -23,
 	RFB_ENCODING_JPEG_LOWQ = -32,
+	RFB_ENCODING_COMPRESSION_LEVEL_9 = -247,
+	RFB_ENCODING_COMPRESSION_LEVEL_0 = -256,
 	RFB_ENCODING_QEMU_EXT_KEY_EVENT = -258,
+	RFB_ENCODING_EXTENDED_DESKTOPSIZE = -308,
+	RFB_ENCODING_FENCE = -312,
+	RFB_ENCODING_CONTINUOUS_UPDATES = -313,
+
+	/* Private to neatvnc: clients on a unix socket get a shared buffer
+	 * with RFB_ENCODING_SHM_BUFFER and rectangles of RFB_ENCODING_SHM
+	 * say which parts of it have been updated. Those must be read before
+	 * the next update is requested.
+	 */
+	RFB_ENCODING_SHM = 0x4e565300,
+	RFB_ENCODING_SHM_BUFFER = 0x4e565301,
 };
 
+static inline bool rfb_encoding_is_jpeg_quality(enum rfb_encodings encoding)
+{
+	return encoding >= RFB_ENCODING_JPEG_LOWQ &&
+		encoding <= RFB_ENCODING_JPEG_HIGHQ;
+}
+
+static inline bool rfb_encoding_is_compression_level(
+		enum rfb_encodings encoding)
+{
+	return encoding >= RFB_ENCODING_COMPRESSION_LEVEL_0 &&
+		encoding <= RFB_ENCODING_COMPRESSION_LEVEL_9;
+}
+
 enum rfb_server_to_client_msg_type {
 	RFB_SERVER_TO_CLIENT_FRAMEBUFFER_UPDATE = 0,
 	RFB_SERVER_TO_CLIENT_SET_COLOUR_MAP_ENTRIES = 1,
 	RFB_SERVER_TO_CLIENT_BELL = 2,
 	RFB_SERVER_TO_CLIENT_SERVER_CUT_TEXT = 3,
+	RFB_SERVER_TO_CLIENT_END_OF_CONTINUOUS_UPDATES = 150,
+	RFB_SERVER_TO_CLIENT_FENCE = 248,
+};
+
+enum rfb_fence_flags {
+	RFB_FENCE_BLOCK_BEFORE = 1 << 0,
+	RFB_FENCE_BLOCK_AFTER = 1 << 1,
+	RFB_FENCE_SYNC_NEXT = 1 << 2,
+	RFB_FENCE_REQUEST = 1U << 31,
+};
+
+#define RFB_FENCE_MAX_PAYLOAD 64
+
+enum rfb_resize_reason {
+	RFB_RESIZE_REASON_SERVER = 0,
+	RFB_RESIZE_REASON_CLIENT = 1,
+	RFB_RESIZE_REASON_OTHER_CLIENT = 2,
+};
+
+enum rfb_resize_status {
+	RFB_RESIZE_STATUS_SUCCESS = 0,
+	RFB_RESIZE_STATUS_PROHIBITED = 1,
+	RFB_RESIZE_STATUS_OUT_OF_RESOURCES = 2,
+	RFB_RESIZE_STATUS_INVALID_LAYOUT = 3,
+};
+
+enum rfb_open_h264_flags {
+	RFB_OPEN_H264_RESET_CONTEXT = 1 << 0,
+	RFB_OPEN_H264_RESET_ALL_CONTEXTS = 1 << 1,
 };
 
 enum rfb_vencrypt_subtype {
@@ -147,6 +207,28 @@ struct rfb_client_qemu_key_event_msg {
 	uint32_t keycode;
 } RFB_PACKED;
 
+struct rfb_client_enable_continuous_updates_msg {
+	uint8_t type;
+	uint8_t enable_flag;
+	uint16_t x;
+	uint16_t y;
+	uint16_t width;
+	uint16_t height;
+} RFB_PACKED;
+
+struct rfb_fence_msg {
+	uint8_t type;
+	uint8_t padding[3];
+	uint32_t flags;
+	uint8_t length;
+	uint8_t payload[0];
+} RFB_PACKED;
+
+struct rfb_open_h264_msg_head {
+	uint32_t length;
+	uint32_t flags;
+} RFB_PACKED;
+
 struct rfb_client_pointer_event_msg {
 	uint8_t type;
 	uint8_t button_mask;
@@ -161,6 +243,41 @@ struct rfb_cut_text_msg {
 	char text[0];
 } RFB_PACKED;
 
+struct rfb_screen {
+	uint32_t id;
+	uint16_t x;
+	uint16_t y;
+	uint16_t width;
+	uint16_t height;
+	uint32_t flags;
+} RFB_PACKED;
+
+struct rfb_client_set_desktop_size_msg {
+	uint8_t type;
+	uint8_t padding;
+	uint16_t width;
+	uint16_t height;
+	uint8_t n_screens;
+	uint8_t padding2;
+	struct rfb_screen screens[0];
+} RFB_PACKED;
+
+/* Follows a rectangle header where x is the reason and y is the status */
+struct rfb_extended_desktop_size_msg {
+	uint8_t n_screens;
+	uint8_t padding[3];
+	struct rfb_screen screens[0];
+} RFB_PACKED;
+
+/* Follows an RFB_ENCODING_SHM_BUFFER rectangle that has the size of the buffer.
+ * The pixels are in the server's native format and its file descriptor is
+ * passed along with the message.
+ */
+struct rfb_shm_buffer_msg {
+	uint32_t stride;
+	uint32_t fourcc_format;
+} RFB_PACKED;
+
 struct rfb_server_fb_rect {
 	uint16_t x;
 	uint16_t y;
@@ -169,6 +286,11 @@ struct rfb_server_fb_rect {
 	int32_t encoding;
 } RFB_PACKED;
 
+struct rfb_copyrect {
+	uint16_t src_x;
+	uint16_t src_y;
+} RFB_PACKED;
+
 struct rfb_server_fb_update_msg {
 	uint8_t type;
 	uint8_t padding;
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct nvnc_fb;
+struct pixman_region16;
+
+/* A buffer in anonymous shared memory that is handed to local clients, so
+ * that pixels can be copied into it instead of being encoded and sent over
+ * the socket. It has the logical size of the framebuffer.
+ */
+struct shm_buffer {
+	int fd;
+	void* addr;
+	size_t size;
+	uint16_t width, height;
+	/* In bytes */
+	uint32_t stride;
+	uint32_t fourcc_format;
+};
+
+struct shm_buffer* shm_buffer_new(uint16_t width, uint16_t height,
+		uint32_t fourcc_format);
+void shm_buffer_destroy(struct shm_buffer* self);
+
+/* The region is in logical coordinates */
+int shm_buffer_copy(struct shm_buffer* self, struct nvnc_fb* src,
+		struct pixman_region16* region);
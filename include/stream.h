@@ -17,8 +17,10 @@
 #include "config.h"
 #include "sys/queue.h"
 #include "rcbuf.h"
+#include "websocket.h"
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #ifdef ENABLE_TLS
 #include <gnutls/gnutls.h>
@@ -49,14 +51,31 @@ enum stream_event {
 };
 
 struct stream;
+struct fbs_writer;
 
 typedef void (*stream_event_fn)(struct stream*, enum stream_event);
 typedef void (*stream_req_fn)(void*, enum stream_req_status);
 
 struct stream_req {
 	struct rcbuf* payload;
+	/* Number of bytes of the payload that have already been sent */
+	size_t offset;
 	stream_req_fn on_done;
 	void* userdata;
+	/* Passed to the other end along with the payload, or -1 */
+	int fd;
+	/* WebSocket streams send this in front of the payload. The offset
+	 * covers both.
+	 */
+	uint8_t ws_head[WS_MAX_HEAD_SIZE];
+	uint8_t ws_head_len;
+#ifdef ENABLE_ZEROCOPY
+	/* The payload has been handed to the kernel with MSG_ZEROCOPY and
+	 * must be kept alive until the send with id zc_id has completed.
+	 */
+	bool zc_pending;
+	uint32_t zc_id;
+#endif
 	TAILQ_ENTRY(stream_req) link;
 };
 
@@ -71,13 +90,50 @@ struct stream {
 	void* userdata;
 
 	struct stream_send_queue send_queue;
+	struct stream_send_queue spare_reqs;
+	size_t n_spare_reqs;
+	/* Requests that could not be taken from spare_reqs */
+	uint64_t n_req_allocs;
+
+#ifdef ENABLE_ZEROCOPY
+	bool has_zerocopy;
+	uint32_t zc_next_id;
+	/* Requests that have been sent but not yet released by the kernel */
+	struct stream_send_queue zc_queue;
+#endif
 
 #ifdef ENABLE_TLS
 	gnutls_session_t tls_session;
+
+	/* Records are corked for each flush. If the records could not all be
+	 * written out, the rest goes out before anything else is corked.
+	 */
+	bool is_tls_corked;
+	size_t tls_corked_bytes;
+
+	/* The kernel encrypts what is written to the socket */
+	bool has_ktls_send;
 #endif
 
-	uint32_t bytes_sent;
-	uint32_t bytes_received;
+	/* Everything that is sent or received is framed once the HTTP upgrade
+	 * is done. Nothing is sent before that.
+	 */
+	bool is_websocket;
+	bool is_ws_ready;
+	char* ws_request;
+	size_t ws_request_len;
+	struct ws_decoder ws_decoder;
+
+	/* Everything that is sent is also written to this, if it is set. The
+	 * stream owns it.
+	 */
+	struct fbs_writer* recorder;
+
+	/* Bytes in the send queue that have not been handed to the kernel */
+	size_t bytes_queued;
+
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
 };
 
 struct stream* stream_new(int fd, stream_event_fn on_event, void* userdata);
@@ -89,6 +145,23 @@ int stream_write(struct stream* self, const void* payload, size_t len,
 int stream_send(struct stream* self, struct rcbuf* payload,
                 stream_req_fn on_done, void* userdata);
 
+/* The file descriptor is attached to the first byte of the payload. This only
+ * works on plain unix sockets. The stream takes ownership of the file
+ * descriptor, even on failure.
+ */
+int stream_send_fd(struct stream* self, struct rcbuf* payload, int fd,
+                   stream_req_fn on_done, void* userdata);
+
+/* Returns the number of bytes that are still waiting in the kernel's send
+ * buffer, or 0 if that can't be determined on this platform.
+ */
+size_t stream_get_kernel_queued(const struct stream* self);
+
+/* Waits for an HTTP upgrade request before anything else is exchanged. The
+ * payloads are then sent as binary frames without being copied.
+ */
+int stream_upgrade_to_websocket(struct stream* self);
+
 #ifdef ENABLE_TLS
 int stream_upgrade_to_tls(struct stream* self, void* context);
 #endif
@@ -18,23 +18,38 @@
 
 #include "rfb-proto.h"
 #include "vec.h"
+#include "tile-bitmap.h"
 
 #include <unistd.h>
 #include <stdint.h>
-#include <zlib.h>
+#include <stdbool.h>
 #include <pthread.h>
+#include <stdatomic.h>
+
+/* Tight allows for at most 4 zlib streams per connection and each of the first
+ * workers owns one of them. The rest can only encode stateless (JPEG) tiles.
+ */
+#define TIGHT_MAX_STREAMS 4
+#define TIGHT_TILE_SIZE 64
+#define TIGHT_MAX_WORKERS 16
 
 struct tight_tile;
+struct deflate_stream;
+struct buf_pool;
+struct tile_cache;
 struct pixman_region16;
 struct aml_work;
 
 typedef void (*tight_done_fn)(struct vec* frame, void*);
 
+#define TIGHT_DEFAULT_COMPRESSION_LEVEL 1
+
 enum tight_quality {
 	TIGHT_QUALITY_UNSPEC = 0,
 	TIGHT_QUALITY_LOSSLESS,
-	TIGHT_QUALITY_LOW,
-	TIGHT_QUALITY_HIGH,
+	/* JPEG quality levels 0 - 9, as picked by the client */
+	TIGHT_QUALITY_JPEG_0,
+	TIGHT_QUALITY_JPEG_9 = TIGHT_QUALITY_JPEG_0 + 9,
 };
 
 struct tight_encoder {
@@ -45,17 +60,55 @@ struct tight_encoder {
 	enum tight_quality quality;
 
 	struct tight_tile* grid;
-
-	z_stream zs[4];
-	struct aml_work* zs_worker[4];
+	struct tile_bitmap damage_tiles;
+
+	/* Tiles that the client was last sent as JPEG */
+	struct tile_bitmap lossy_tiles;
+
+	/* Tiles that could not be encoded are left out of the frame. They are
+	 * collected here until the next frame is started, so that they can be
+	 * sent again.
+	 */
+	struct tile_bitmap failed_tiles;
+
+	/* Damaged tiles in the order in which they are sent. Workers take
+	 * tiles from the head of the queue until they reach the end of the
+	 * current pass.
+	 */
+	uint32_t* tile_queue;
+	uint32_t tile_queue_len;
+	atomic_uint tile_queue_head;
+	uint32_t pass_start;
+	uint32_t pass_end;
+
+	/* Large frames are sent in passes, starting with the tiles that are
+	 * closest to the focus, if there is somewhere to send them.
+	 */
+	tight_done_fn on_chunk;
+	bool has_focus;
+	uint16_t focus_x, focus_y;
+
+	int n_streams;
+	struct deflate_stream* zs[TIGHT_MAX_STREAMS];
+	bool zs_reset[TIGHT_MAX_STREAMS];
+	int zs_level;
+	int compression_level;
+
+	int n_workers;
+	struct aml_work* zs_worker[TIGHT_MAX_WORKERS];
+	struct aml_work* finisher;
 
 	struct rfb_pixel_format dfmt;
 	struct rfb_pixel_format sfmt;
+	/* The bits of a source pixel that make up its colour */
+	uint32_t colour_mask;
 	struct nvnc_fb* fb;
 
 	uint32_t n_rects;
 	uint32_t n_jobs;
 
+	struct buf_pool* frame_pool;
+	struct tile_cache* tile_cache;
 	struct vec dst;
 
 	tight_done_fn on_frame_done;
@@ -63,16 +116,55 @@ struct tight_encoder {
 };
 
 int tight_encoder_init(struct tight_encoder* self, uint32_t width,
-		uint32_t height);
+		uint32_t height, struct buf_pool* frame_pool);
 void tight_encoder_destroy(struct tight_encoder* self);
 
 int tight_encoder_resize(struct tight_encoder* self, uint32_t width,
 		uint32_t height);
 
+/* Make the next frame reset all zlib streams on both ends. This is used to
+ * bring the client's decoder back in sync with the encoder after it has
+ * received data that was encoded elsewhere.
+ */
+void tight_encoder_request_reset(struct tight_encoder* self);
+
+/* Keeps track of tiles that reached the client in a frame that was encoded
+ * elsewhere
+ */
+void tight_encoder_mark_sent(struct tight_encoder* self,
+		struct pixman_region16* region, bool is_lossy);
+
+/* Adds the tiles that were left out of the last frame to the region */
+void tight_encoder_get_failed_region(const struct tight_encoder* self,
+		struct pixman_region16* dst);
+
+/* Sets the zlib level (0 - 9) for the frames that follow */
+void tight_encoder_set_compression_level(struct tight_encoder* self,
+		int level);
+
+/* Lets the next frames be split into several framebuffer updates. All but the
+ * last one are handed to on_chunk as soon as they are ready, while the rest is
+ * still being encoded. NULL turns this off.
+ */
+void tight_encoder_set_progressive(struct tight_encoder* self,
+		tight_done_fn on_chunk);
+
+/* JPEG tiles are looked up in the cache before they are encoded and added to
+ * it afterwards. The cache may be shared with other encoders. NULL turns this
+ * off.
+ */
+void tight_encoder_set_tile_cache(struct tight_encoder* self,
+		struct tile_cache* cache);
+
+/* The point on the screen that the user is looking at, e.g. the pointer */
+void tight_encoder_set_focus(struct tight_encoder* self, uint16_t x,
+		uint16_t y);
+
 int tight_encode_frame(struct tight_encoder* self,
 		const struct rfb_pixel_format* dfmt,
 		struct nvnc_fb* src,
 		const struct rfb_pixel_format* sfmt,
 		struct pixman_region16* damage,
+		const struct tile_bitmap* damage_tiles,
 		enum tight_quality quality,
 		tight_done_fn on_done, void* userdata);
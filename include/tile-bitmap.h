@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct pixman_region16;
+
+/* A bit per tile, with each row of tiles starting on a new word so that rows
+ * can be scanned word by word.
+ */
+struct tile_bitmap {
+	uint64_t* words;
+	uint32_t width;
+	uint32_t height;
+	uint32_t words_per_row;
+	uint32_t tile_size;
+};
+
+int tile_bitmap_init(struct tile_bitmap* self, uint32_t width, uint32_t height,
+		uint32_t tile_size);
+int tile_bitmap_resize(struct tile_bitmap* self, uint32_t width,
+		uint32_t height);
+void tile_bitmap_destroy(struct tile_bitmap* self);
+
+void tile_bitmap_clear(struct tile_bitmap* self);
+void tile_bitmap_set_all(struct tile_bitmap* self);
+bool tile_bitmap_is_empty(const struct tile_bitmap* self);
+uint32_t tile_bitmap_count(const struct tile_bitmap* self);
+
+/* Marks every tile that overlaps with the given area (in pixels) */
+void tile_bitmap_add_rect(struct tile_bitmap* self, int x, int y, int width,
+		int height);
+void tile_bitmap_add_region(struct tile_bitmap* self,
+		struct pixman_region16* region);
+
+/* Tells whether any tile that overlaps with the given area is marked */
+bool tile_bitmap_test_rect(const struct tile_bitmap* self, int x, int y,
+		int width, int height);
+
+/* Returns -1 if the bitmaps do not have the same geometry */
+int tile_bitmap_or(struct tile_bitmap* dst, const struct tile_bitmap* src);
+
+/* Adds the area covered by the marked tiles to the region */
+void tile_bitmap_to_region(const struct tile_bitmap* self,
+		struct pixman_region16* dst);
+
+/* Finds the next marked tile at or after (x, y) in row-major order */
+bool tile_bitmap_next(const struct tile_bitmap* self, uint32_t* x,
+		uint32_t* y);
+
+static inline uint64_t* tile_bitmap__word(const struct tile_bitmap* self,
+		uint32_t x, uint32_t y)
+{
+	return &self->words[y * self->words_per_row + x / 64];
+}
+
+static inline void tile_bitmap_set(struct tile_bitmap* self, uint32_t x,
+		uint32_t y)
+{
+	*tile_bitmap__word(self, x, y) |= UINT64_C(1) << (x % 64);
+}
+
+static inline void tile_bitmap_unset(struct tile_bitmap* self, uint32_t x,
+		uint32_t y)
+{
+	*tile_bitmap__word(self, x, y) &= ~(UINT64_C(1) << (x % 64));
+}
+
+static inline bool tile_bitmap_test(const struct tile_bitmap* self, uint32_t x,
+		uint32_t y)
+{
+	return !!(*tile_bitmap__word(self, x, y) & (UINT64_C(1) << (x % 64)));
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <unistd.h>
+#include <stdint.h>
+
+struct vec;
+
+/* Keeps encoded tiles around by what they look like, so that content that
+ * comes back, e.g. after switching between windows, does not have to be
+ * compressed again. Only payloads that do not depend on any stream state, such
+ * as JPEG, can be cached.
+ *
+ * The least recently used tiles are dropped when the cache grows beyond its
+ * budget. Lookups and inserts may be done from any thread, but references are
+ * only taken and dropped on the thread that created the cache.
+ */
+struct tile_cache;
+
+struct tile_cache_key {
+	uint64_t hash;
+	uint32_t fourcc;
+	uint16_t width, height;
+	/* Anything else that the payload depends on, e.g. the quality */
+	uint32_t variant;
+};
+
+struct tile_cache* tile_cache_new(size_t max_size);
+void tile_cache_ref(struct tile_cache* self);
+void tile_cache_unref(struct tile_cache* self);
+
+/* Hashes a tile of 32 bit pixels, row by row */
+uint64_t tile_cache_hash(const uint32_t* pixels, int32_t stride,
+		uint32_t width, uint32_t height);
+
+/* Appends the cached payload to dst. Returns its size or -1 if the tile is not
+ * in the cache.
+ */
+ssize_t tile_cache_lookup(struct tile_cache* self,
+		const struct tile_cache_key* key, struct vec* dst);
+
+int tile_cache_insert(struct tile_cache* self,
+		const struct tile_cache_key* key, const void* data, size_t size);
@@ -18,8 +18,12 @@
 
 #include "neatvnc.h"
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <pixman.h>
 
+struct nvnc_fb;
+
 void nvnc_transform_to_pixman_transform(pixman_transform_t* dst,
 		enum nvnc_transform src, int width, int height);
 
@@ -29,3 +33,8 @@ void nvnc_transform_dimensions(enum nvnc_transform transform, uint32_t* width,
 void nvnc_transform_region(struct pixman_region16* dst,
 		struct pixman_region16* src, enum nvnc_transform transform,
 		int width, int height);
+
+bool nvnc_transform_is_90_degrees(enum nvnc_transform transform);
+
+void nvnc_transform_read_rect(uint32_t* dst, int dst_stride,
+		const struct nvnc_fb* fb, int x, int y, int width, int height);
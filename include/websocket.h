@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#define WS_HANDSHAKE_MAX_SIZE 4096
+#define WS_RESPONSE_MAX_SIZE 256
+#define WS_MAX_HEAD_SIZE 10
+#define WS_MAX_CONTROL_PAYLOAD 125
+
+enum ws_opcode {
+	WS_OPCODE_CONTINUATION = 0,
+	WS_OPCODE_TEXT = 1,
+	WS_OPCODE_BINARY = 2,
+	WS_OPCODE_CLOSE = 8,
+	WS_OPCODE_PING = 9,
+	WS_OPCODE_PONG = 10,
+};
+
+/* Writes the response to an HTTP upgrade request into dst. Returns the length
+ * of the response, 0 if the request is not complete yet or -1 if it is not a
+ * valid WebSocket upgrade.
+ */
+ssize_t ws_handshake(char* dst, size_t dst_size, const char* request,
+		size_t len);
+
+/* Server frames are never masked, so a head is all that goes in front of the
+ * payload.
+ */
+size_t ws_encode_frame_head(uint8_t* dst, enum ws_opcode opcode,
+		uint64_t payload_len);
+
+/* Returns < 0 to stop decoding */
+typedef int (*ws_control_fn)(enum ws_opcode, const uint8_t* payload,
+		size_t len, void* userdata);
+
+struct ws_decoder {
+	uint8_t head[WS_MAX_HEAD_SIZE + 4];
+	size_t head_len;
+	enum ws_opcode opcode;
+	uint64_t payload_left;
+	uint8_t mask[4];
+	size_t mask_index;
+	uint8_t control[WS_MAX_CONTROL_PAYLOAD];
+	size_t control_len;
+};
+
+/* Decodes client frames in place. The payload of data frames is unmasked and
+ * moved to the front of the buffer, and control frames are handed to
+ * on_control whole. Returns the number of payload bytes or -1 on errors.
+ */
+ssize_t ws_decode(struct ws_decoder* self, uint8_t* buffer, size_t len,
+		ws_control_fn on_control, void* userdata);
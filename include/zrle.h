@@ -16,16 +16,75 @@
 
 #pragma once
 
+#include "rfb-proto.h"
+#include "vec.h"
+
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
-#include <zlib.h>
+#include <stdatomic.h>
+
+#define ZRLE_MAX_WORKERS 16
+#define ZRLE_DEFAULT_COMPRESSION_LEVEL 1
 
 struct nvnc_fb;
-struct rfb_pixel_format;
 struct pixman_region16;
-struct vec;
+struct zrle_tile;
+struct deflate_stream;
+struct aml_work;
+struct buf_pool;
+
+typedef void (*zrle_done_fn)(struct vec* frame, void*);
+
+/* Tiles are packed in parallel by a set of workers while the zlib stream is
+ * fed strictly in tile order. One worker at a time drains all tiles that are
+ * ready, so no worker ever has to wait for another one.
+ */
+struct zrle_encoder {
+	struct deflate_stream* zs;
+	int zs_level;
+	int compression_level;
+
+	struct zrle_tile* tiles;
+	uint32_t n_tiles;
+	uint32_t tiles_cap;
+	atomic_uint tile_queue_head;
+
+	atomic_uint drain_requests;
+	uint32_t next_deflate;
+	size_t size_index;
+	atomic_bool failed;
+
+	int n_workers;
+	struct aml_work* worker[ZRLE_MAX_WORKERS];
+	uint32_t n_jobs;
+
+	struct rfb_pixel_format dfmt;
+	struct rfb_pixel_format sfmt;
+	struct nvnc_fb* fb;
+
+	struct buf_pool* frame_pool;
+	struct vec dst;
+
+	zrle_done_fn on_frame_done;
+	void* userdata;
+};
+
+int zrle_encoder_init(struct zrle_encoder* self, struct buf_pool* frame_pool);
+void zrle_encoder_destroy(struct zrle_encoder* self);
+
+/* Sets the zlib level (0 - 9) for the frames that follow */
+void zrle_encoder_set_compression_level(struct zrle_encoder* self, int level);
+
+int zrle_encoder_encode_frame(struct zrle_encoder* self,
+		const struct rfb_pixel_format* dst_fmt,
+		struct nvnc_fb* src,
+		const struct rfb_pixel_format* src_fmt,
+		struct pixman_region16* region,
+		zrle_done_fn on_done, void* userdata);
 
-int zrle_encode_frame(z_stream* zs, struct vec* dst,
+/* Serial version that encodes the whole frame on the calling thread */
+int zrle_encode_frame(struct deflate_stream* zs, struct vec* dst,
                       const struct rfb_pixel_format* dst_fmt,
                       struct nvnc_fb* src,
                       const struct rfb_pixel_format* src_fmt,
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "buf-pool.h"
+#include "rcbuf.h"
+#include "vec.h"
+
+#include "sys/queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BUF_POOL_MIN_SIZE 4096
+
+struct buf_pool_item {
+	struct buf_pool* pool;
+	void* data;
+	size_t cap;
+	struct rcbuf rcbuf;
+	TAILQ_ENTRY(buf_pool_item) link;
+};
+
+TAILQ_HEAD(buf_pool_queue, buf_pool_item);
+
+struct buf_pool {
+	int ref;
+
+	/* Items that hold a buffer that is ready to be reused */
+	struct buf_pool_queue free_bufs;
+	size_t n_free;
+	size_t max_free;
+
+	/* Items without a buffer, kept around so that wrapping a frame does
+	 * not allocate.
+	 */
+	struct buf_pool_queue spare_items;
+
+	size_t size_hint;
+
+	/* Buffers and items that had to be allocated */
+	uint64_t n_allocs;
+};
+
+struct buf_pool* buf_pool_new(size_t max_free)
+{
+	struct buf_pool* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->ref = 1;
+	self->max_free = max_free;
+	self->size_hint = BUF_POOL_MIN_SIZE;
+
+	TAILQ_INIT(&self->free_bufs);
+	TAILQ_INIT(&self->spare_items);
+
+	return self;
+}
+
+static void buf_pool__destroy_queue(struct buf_pool_queue* queue)
+{
+	while (!TAILQ_EMPTY(queue)) {
+		struct buf_pool_item* item = TAILQ_FIRST(queue);
+		TAILQ_REMOVE(queue, item, link);
+		free(item->data);
+		free(item);
+	}
+}
+
+static void buf_pool__destroy(struct buf_pool* self)
+{
+	buf_pool__destroy_queue(&self->free_bufs);
+	buf_pool__destroy_queue(&self->spare_items);
+	free(self);
+}
+
+void buf_pool_ref(struct buf_pool* self)
+{
+	self->ref++;
+}
+
+void buf_pool_unref(struct buf_pool* self)
+{
+	assert(self->ref > 0);
+
+	if (--self->ref == 0)
+		buf_pool__destroy(self);
+}
+
+int buf_pool_acquire(struct buf_pool* self, struct vec* dst, size_t min_size)
+{
+	struct buf_pool_item* item = TAILQ_FIRST(&self->free_bufs);
+
+	if (!item) {
+		size_t size = self->size_hint > min_size ?
+			self->size_hint : min_size;
+		self->n_allocs++;
+		return vec_init(dst, size);
+	}
+
+	TAILQ_REMOVE(&self->free_bufs, item, link);
+	self->n_free--;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->data = item->data;
+	dst->cap = item->cap;
+
+	item->data = NULL;
+	item->cap = 0;
+	TAILQ_INSERT_HEAD(&self->spare_items, item, link);
+
+	if (vec_reserve(dst, min_size) < 0) {
+		vec_destroy(dst);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void buf_pool__release(void* payload, void* userdata)
+{
+	struct buf_pool_item* item = userdata;
+	struct buf_pool* self = item->pool;
+
+	/* Recently used buffers are handed out first as they are most likely
+	 * to still be in the cache.
+	 */
+	if (self->n_free < self->max_free && self->ref > 1) {
+		TAILQ_INSERT_HEAD(&self->free_bufs, item, link);
+		self->n_free++;
+	} else {
+		TAILQ_INSERT_HEAD(&self->spare_items, item, link);
+		free(item->data);
+		item->data = NULL;
+		item->cap = 0;
+	}
+
+	buf_pool_unref(self);
+}
+
+struct rcbuf* buf_pool_rcbuf_from_vec(struct buf_pool* self, struct vec* frame)
+{
+	struct buf_pool_item* item = TAILQ_FIRST(&self->spare_items);
+	if (item) {
+		TAILQ_REMOVE(&self->spare_items, item, link);
+	} else {
+		item = calloc(1, sizeof(*item));
+		if (!item)
+			goto failure;
+		self->n_allocs++;
+	}
+
+	item->pool = self;
+	item->data = frame->data;
+	item->cap = frame->cap;
+
+	struct rcbuf* payload = &item->rcbuf;
+	rcbuf_init_with_free_fn(payload, frame->data, frame->len,
+			buf_pool__release, item);
+
+	/* Leave some headroom so that frames that are slightly larger than
+	 * the last one don't need to grow the buffer.
+	 */
+	size_t hint = frame->len + frame->len / 4;
+	if (hint > self->size_hint)
+		self->size_hint = hint;
+
+	buf_pool_ref(self);
+	memset(frame, 0, sizeof(*frame));
+	return payload;
+
+failure:
+	vec_destroy(frame);
+	memset(frame, 0, sizeof(*frame));
+	return NULL;
+}
+
+uint64_t buf_pool_get_n_allocs(const struct buf_pool* self)
+{
+	return self->n_allocs;
+}
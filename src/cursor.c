@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "cursor.h"
+#include "neatvnc.h"
+#include "fb.h"
+#include "pixels.h"
+#include "vec.h"
+#include "enc-util.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <libdrm/drm_fourcc.h>
+
+#define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
+
+/* Pixels with less alpha than this are left out of the mask */
+#define CURSOR_ALPHA_THRESHOLD 0x80
+
+static size_t cursor_image_size(uint16_t width, uint16_t height)
+{
+	return sizeof(struct cursor_image) + width * height * 4 +
+		UDIV_UP(width, 8) * height;
+}
+
+static bool get_alpha_shift(uint32_t fourcc, int* shift)
+{
+	switch (fourcc & ~DRM_FORMAT_BIG_ENDIAN) {
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_ABGR8888:
+		*shift = 24;
+		return true;
+	case DRM_FORMAT_RGBA8888:
+	case DRM_FORMAT_BGRA8888:
+		*shift = 0;
+		return true;
+	}
+
+	return false;
+}
+
+static void cursor_image_make_mask(struct cursor_image* self, uint32_t fourcc)
+{
+	int alpha_shift = 0;
+	bool has_alpha = get_alpha_shift(fourcc, &alpha_shift);
+	size_t mask_stride = UDIV_UP(self->width, 8);
+
+	memset(self->mask, has_alpha ? 0 : 0xff, mask_stride * self->height);
+	if (!has_alpha)
+		return;
+
+	for (int y = 0; y < self->height; ++y)
+		for (int x = 0; x < self->width; ++x) {
+			uint32_t px = self->pixels[x + y * self->width];
+			if (((px >> alpha_shift) & 0xff) < CURSOR_ALPHA_THRESHOLD)
+				continue;
+
+			self->mask[y * mask_stride + x / 8] |= 0x80 >> (x % 8);
+		}
+}
+
+struct cursor_image* cursor_image_new(struct nvnc_fb* fb, uint16_t hotspot_x,
+		uint16_t hotspot_y)
+{
+	uint16_t width = fb ? fb->width : 0;
+	uint16_t height = fb ? fb->height : 0;
+
+	if (fb && pixel_size_from_fourcc(fb->fourcc_format) != 4) {
+		log_error("Cursor images must have 32 bit pixels\n");
+		return NULL;
+	}
+
+	struct cursor_image* self = calloc(1, cursor_image_size(width, height));
+	if (!self)
+		return NULL;
+
+	self->width = width;
+	self->height = height;
+	self->hotspot_x = hotspot_x;
+	self->hotspot_y = hotspot_y;
+	self->mask = (uint8_t*)(self->pixels + width * height);
+
+	if (!fb)
+		return self;
+
+	if (nvnc_fb_map(fb) < 0)
+		goto failure;
+
+	rfb_pixfmt_from_fourcc(&self->fmt, fb->fourcc_format);
+
+	const uint32_t* src = fb->addr;
+	for (int y = 0; y < height; ++y)
+		memcpy(self->pixels + y * width, src + y * fb->stride,
+				width * 4);
+
+	nvnc_fb_unmap(fb);
+
+	cursor_image_make_mask(self, fb->fourcc_format);
+	return self;
+
+failure:
+	free(self);
+	return NULL;
+}
+
+struct cursor_image* cursor_image_dup(const struct cursor_image* self)
+{
+	size_t size = cursor_image_size(self->width, self->height);
+
+	struct cursor_image* copy = malloc(size);
+	if (!copy)
+		return NULL;
+
+	memcpy(copy, self, size);
+	copy->mask = (uint8_t*)(copy->pixels + copy->width * copy->height);
+	return copy;
+}
+
+int cursor_encode(struct vec* dst, const struct rfb_pixel_format* dst_fmt,
+		const struct cursor_image* cursor)
+{
+	if (encode_rect_head(dst, RFB_ENCODING_CURSOR, cursor->hotspot_x,
+				cursor->hotspot_y, cursor->width,
+				cursor->height) < 0)
+		return -1;
+
+	size_t n_pixels = cursor->width * cursor->height;
+	if (n_pixels == 0)
+		return 0;
+
+	size_t bpp = dst_fmt->bits_per_pixel / 8;
+	size_t mask_size = UDIV_UP(cursor->width, 8) * cursor->height;
+
+	if (vec_reserve(dst, dst->len + n_pixels * bpp + mask_size) < 0)
+		return -1;
+
+	pixel32_to_cpixel((uint8_t*)dst->data + dst->len, dst_fmt,
+			cursor->pixels, &cursor->fmt, bpp, n_pixels);
+	dst->len += n_pixels * bpp;
+
+	return vec_append(dst, cursor->mask, mask_size);
+}
@@ -17,32 +17,156 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <pixman.h>
+#include <aml.h>
 #include <sys/param.h>
 
 #include "fb.h"
 #include "damage-refinery.h"
 #include "murmurhash.h"
+#include "event-loop.h"
+#include "vec.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32C_ARM
+#endif
 
 #define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
 
 #define HASH_SEED 0
 
-int damage_refinery_init(struct damage_refinery* self, uint32_t width,
-		uint32_t height)
+/* Below this many hinted coarse tiles per worker, waking up another thread
+ * costs more than hashing the tiles.
+ */
+#define TILES_PER_JOB 16
+
+/* Motion is only looked for when at least this many fine tiles have changed.
+ * Smaller updates are cheap enough to encode as they are.
+ */
+#define MOTION_MIN_TILES 64
+
+/* The number of tile columns and rows that are searched for scrolled content */
+#define MOTION_N_SAMPLES 3
+
+#define MOTION_MAX_CANDIDATES 16
+#define MOTION_MIN_VOTES 3
+#define MOTION_MIN_AREA (64 * 64)
+
+typedef uint32_t (*damage_hash_fn)(const void* data, size_t len,
+		uint32_t seed);
+
+static damage_hash_fn damage_hash_row;
+
+static void do_damage_refine_work(void* obj);
+static void on_damage_refine_work_done(void* obj);
+
+static int damage_refinery_get_n_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return 1;
+
+	return MIN(n, DAMAGE_REFINERY_MAX_WORKERS);
+}
+
+static const uint32_t level_tile_size[DAMAGE_REFINERY_N_LEVELS] = {
+	128, 32, 8
+};
+
+#define COARSE_TILE_SIZE (level_tile_size[0])
+#define FINE_TILE_SIZE (level_tile_size[DAMAGE_REFINERY_N_LEVELS - 1])
+
+static void damage_refinery_destroy_tiles(struct damage_refinery* self)
+{
+	tile_bitmap_destroy(&self->damaged_tiles);
+	tile_bitmap_destroy(&self->hint_tiles);
+
+	free(self->old_hashes);
+	self->old_hashes = NULL;
+
+	for (int i = 0; i < DAMAGE_REFINERY_N_LEVELS; ++i) {
+		free(self->levels[i].hashes);
+		self->levels[i].hashes = NULL;
+	}
+}
+
+static int damage_refinery_init_tiles(struct damage_refinery* self,
+		uint32_t width, uint32_t height)
 {
 	self->width = width;
 	self->height = height;
 
-	uint32_t twidth = UDIV_UP(width, 32);
-	uint32_t theight = UDIV_UP(height, 32);
+	for (int i = 0; i < DAMAGE_REFINERY_N_LEVELS; ++i) {
+		struct damage_refinery_level* level = &self->levels[i];
+
+		level->tile_size = level_tile_size[i];
+		level->grid_width = UDIV_UP(width, level->tile_size);
+		level->grid_height = UDIV_UP(height, level->tile_size);
+
+		level->hashes = calloc(level->grid_width * level->grid_height,
+				sizeof(*level->hashes));
+		if (!level->hashes)
+			goto failure;
+	}
+
+	const struct damage_refinery_level* fine =
+		&self->levels[DAMAGE_REFINERY_N_LEVELS - 1];
+	self->old_hashes = calloc(fine->grid_width * fine->grid_height,
+			sizeof(*self->old_hashes));
+	if (!self->old_hashes)
+		goto failure;
 
-	self->hashes = calloc(twidth * theight, sizeof(*self->hashes));
-	if (!self->hashes)
+	if (tile_bitmap_init(&self->hint_tiles, width, height,
+				COARSE_TILE_SIZE) < 0)
+		goto failure;
+
+	if (tile_bitmap_init(&self->damaged_tiles, width, height,
+				FINE_TILE_SIZE) < 0)
+		goto failure;
+
+	return 0;
+
+failure:
+	damage_refinery_destroy_tiles(self);
+	return -1;
+}
+
+int damage_refinery_init(struct damage_refinery* self, uint32_t width,
+		uint32_t height)
+{
+	memset(self, 0, sizeof(*self));
+	pixman_region_init(&self->copy.region);
+
+	if (damage_refinery_init_tiles(self, width, height) < 0) {
+		pixman_region_fini(&self->copy.region);
 		return -1;
+	}
+
+	int n_workers = damage_refinery_get_n_workers();
+
+	for (self->n_workers = 0; self->n_workers < n_workers;
+			++self->n_workers) {
+		struct aml_work* work = aml_work_new(do_damage_refine_work,
+				on_damage_refine_work_done, self, NULL);
+		if (!work)
+			goto failure;
+
+		self->worker[self->n_workers] = work;
+	}
+
+	aml_require_workers(nvnc__get_loop(), self->n_workers);
 
 	return 0;
+
+failure:
+	damage_refinery_destroy(self);
+	return -1;
 }
 
 int damage_refinery_resize(struct damage_refinery* self, uint32_t width,
@@ -51,71 +175,478 @@ int damage_refinery_resize(struct damage_refinery* self, uint32_t width,
 	if (width == self->width && height == self->height)
 		return 0;
 
-	damage_refinery_destroy(self);
-	return damage_refinery_init(self, width, height);
+	assert(!damage_refinery_is_busy(self));
+
+	damage_refinery_destroy_tiles(self);
+	pixman_region_clear(&self->copy.region);
+	return damage_refinery_init_tiles(self, width, height);
 }
 
 void damage_refinery_destroy(struct damage_refinery* self)
 {
-	free(self->hashes);
+	for (int i = self->n_workers - 1; i >= 0; --i)
+		aml_unref(self->worker[i]);
+
+	damage_refinery_destroy_tiles(self);
+	pixman_region_fini(&self->copy.region);
 }
 
-static uint32_t damage_hash_tile(struct damage_refinery* self, uint32_t tx,
-		uint32_t ty, const struct nvnc_fb* buffer)
+static uint32_t damage_hash_row_murmur(const void* data, size_t len,
+		uint32_t seed)
+{
+	return murmurhash(data, len, seed);
+}
+
+/* The CRC is inverted on the way in and out, as usual, so that all-black
+ * tiles don't hash to the initial value of zero.
+ */
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t damage_hash_row_crc32c(const void* data, size_t len,
+		uint32_t seed)
+{
+	const uint8_t* p = data;
+	uint64_t crc = ~seed;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc = _mm_crc32_u64(crc, v);
+	}
+
+	for (; len > 0; --len, ++p)
+		crc = _mm_crc32_u8(crc, *p);
+
+	return ~(uint32_t)crc;
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARM
+static uint32_t damage_hash_row_crc32c(const void* data, size_t len,
+		uint32_t seed)
+{
+	const uint8_t* p = data;
+	uint32_t crc = ~seed;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+
+	for (; len > 0; --len, ++p)
+		crc = __crc32cb(crc, *p);
+
+	return ~crc;
+}
+#endif
+
+/* The hashes are only ever compared against hashes computed by the same
+ * process, so the function can be chosen per CPU. CRC32C has hardware support
+ * on both x86 and ARM and is several times faster than murmurhash.
+ */
+static void __attribute__((constructor)) damage_hash_init(void)
+{
+	damage_hash_row = damage_hash_row_murmur;
+
+#ifdef HAVE_CRC32C_SSE42
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		damage_hash_row = damage_hash_row_crc32c;
+#endif
+
+#ifdef HAVE_CRC32C_ARM
+	damage_hash_row = damage_hash_row_crc32c;
+#endif
+}
+
+static uint32_t damage_hash_block(const struct nvnc_fb* buffer, int x, int y,
+		int width, int height)
 {
 	uint32_t* pixels = buffer->addr;
 	int pixel_stride = buffer->stride;
 
-	int x_start = tx * 32;
-	int x_stop = MIN((tx + 1) * 32, self->width);
-	int y_start = ty * 32;
-	int y_stop = MIN((ty + 1) * 32, self->height);
-
-	uint32_t hash = 0;
+	uint32_t hash = HASH_SEED;
 
 	// TODO: Support different pixel sizes
-	for (int y = y_start; y < y_stop; ++y)
-		hash = murmurhash((void*)&(pixels[x_start + y * pixel_stride]),
-				4 * (x_stop - x_start), hash);
+	for (int row = y; row < y + height; ++row)
+		hash = damage_hash_row(&pixels[x + row * pixel_stride],
+				4 * width, hash);
 
 	return hash;
 }
 
-static uint32_t* damage_tile_hash_ptr(struct damage_refinery* self,
-		uint32_t tx, uint32_t ty)
+static uint32_t damage_hash_tile(struct damage_refinery* self,
+		const struct damage_refinery_level* level, uint32_t tx,
+		uint32_t ty, const struct nvnc_fb* buffer)
 {
-	uint32_t twidth = UDIV_UP(self->width, 32);
-	return &self->hashes[tx + ty * twidth];
+	int x_start = tx * level->tile_size;
+	int x_stop = MIN((tx + 1) * level->tile_size, self->width);
+	int y_start = ty * level->tile_size;
+	int y_stop = MIN((ty + 1) * level->tile_size, self->height);
+
+	return damage_hash_block(buffer, x_start, y_start, x_stop - x_start,
+			y_stop - y_start);
 }
 
-static void damage_refine_tile(struct damage_refinery* self,
-		struct pixman_region16* refined, uint32_t tx, uint32_t ty,
-		const struct nvnc_fb* buffer)
+static void damage_refine_tile(struct damage_refinery* self, int level_index,
+		uint32_t tx, uint32_t ty, const struct nvnc_fb* buffer)
 {
-	uint32_t hash = damage_hash_tile(self, tx, ty, buffer);
-	uint32_t* old_hash_ptr = damage_tile_hash_ptr(self, tx, ty);
-	int is_damaged = hash != *old_hash_ptr;
+	struct damage_refinery_level* level = &self->levels[level_index];
+
+	uint32_t hash = damage_hash_tile(self, level, tx, ty, buffer);
+	uint32_t* old_hash_ptr = &level->hashes[tx + ty * level->grid_width];
+	if (hash == *old_hash_ptr)
+		return;
+
+	if (level_index == DAMAGE_REFINERY_N_LEVELS - 1) {
+		self->old_hashes[tx + ty * level->grid_width] = *old_hash_ptr;
+		*old_hash_ptr = hash;
+		tile_bitmap_set(&self->damaged_tiles, tx, ty);
+		return;
+	}
+
 	*old_hash_ptr = hash;
 
-	if (is_damaged)
-		pixman_region_union_rect(refined, refined, tx * 32, ty * 32, 32,
-				32);
+	/* All children of a changed tile are rehashed, not only the hinted
+	 * ones, so that the finer hashes stay valid for as long as their
+	 * parent's hash does.
+	 */
+	const struct damage_refinery_level* next = level + 1;
+	uint32_t ratio = level->tile_size / next->tile_size;
+
+	uint32_t cx_stop = MIN((tx + 1) * ratio, next->grid_width);
+	uint32_t cy_stop = MIN((ty + 1) * ratio, next->grid_height);
+
+	for (uint32_t cy = ty * ratio; cy < cy_stop; ++cy)
+		for (uint32_t cx = tx * ratio; cx < cx_stop; ++cx)
+			damage_refine_tile(self, level_index + 1, cx, cy,
+					buffer);
+}
+
+static void damage_refine_row(struct damage_refinery* self, uint32_t row,
+		const struct nvnc_fb* buffer)
+{
+	uint32_t tx = 0, ty = row;
+	for (; tile_bitmap_next(&self->hint_tiles, &tx, &ty) && ty == row; ++tx)
+		damage_refine_tile(self, 0, tx, ty, buffer);
+}
+
+/* Returns the hash that a tile of the finest level had in the previous frame,
+ * or zero if it isn't known.
+ */
+static uint32_t damage_old_hash(const struct damage_refinery* self,
+		uint32_t tx, uint32_t ty)
+{
+	const struct damage_refinery_level* level =
+		&self->levels[DAMAGE_REFINERY_N_LEVELS - 1];
+	uint32_t index = tx + ty * level->grid_width;
+
+	return tile_bitmap_test(&self->damaged_tiles, tx, ty) ?
+		self->old_hashes[index] : level->hashes[index];
+}
+
+static bool damage_is_full_tile(const struct damage_refinery* self,
+		uint32_t tx, uint32_t ty)
+{
+	return (tx + 1) * FINE_TILE_SIZE <= self->width &&
+		(ty + 1) * FINE_TILE_SIZE <= self->height;
+}
+
+struct motion_anchor {
+	uint32_t hash;
+	uint32_t pos;
+};
+
+struct motion_candidate {
+	int dx, dy;
+	uint32_t votes;
+};
+
+static int motion_anchor_cmp(const void* a, const void* b)
+{
+	const struct motion_anchor* x = a;
+	const struct motion_anchor* y = b;
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static int motion_candidate_cmp(const void* a, const void* b)
+{
+	const struct motion_candidate* x = a;
+	const struct motion_candidate* y = b;
+	return x->votes > y->votes ? -1 : x->votes < y->votes;
+}
+
+/* Tiles that look the same as some other tile, like plain background, say
+ * nothing about where they came from, so only unique ones are kept.
+ */
+static size_t motion_anchors_make_unique(struct motion_anchor* anchors,
+		size_t n)
+{
+	qsort(anchors, n, sizeof(*anchors), motion_anchor_cmp);
+
+	size_t n_unique = 0;
+	for (size_t i = 0; i < n;) {
+		size_t j = i + 1;
+		while (j < n && anchors[j].hash == anchors[i].hash)
+			++j;
+
+		if (j == i + 1)
+			anchors[n_unique++] = anchors[i];
+
+		i = j;
+	}
+
+	return n_unique;
+}
+
+static void motion_vote(struct motion_candidate* candidates,
+		size_t* n_candidates, int dx, int dy)
+{
+	for (size_t i = 0; i < *n_candidates; ++i)
+		if (candidates[i].dx == dx && candidates[i].dy == dy) {
+			candidates[i].votes++;
+			return;
+		}
+
+	if (*n_candidates < MOTION_MAX_CANDIDATES)
+		candidates[(*n_candidates)++] = (struct motion_candidate){
+			.dx = dx, .dy = dy, .votes = 1,
+		};
+}
+
+/* The damaged tiles along one tile column (or row) of the previous frame are
+ * looked for at every pixel offset along the same column in the new frame.
+ * Finding one of them somewhere else says that the content has been shifted
+ * by that much.
+ */
+static void motion_search_line(struct damage_refinery* self,
+		const struct nvnc_fb* buffer, const pixman_box16_t* extents,
+		bool is_vertical, uint32_t line, struct motion_anchor* anchors,
+		struct motion_candidate* candidates, size_t* n_candidates)
+{
+	uint32_t ts = FINE_TILE_SIZE;
+	uint32_t start = (is_vertical ? extents->y1 : extents->x1) / ts;
+	uint32_t stop = UDIV_UP(is_vertical ? extents->y2 : extents->x2, ts);
+
+	size_t n_anchors = 0;
+	for (uint32_t pos = start; pos < stop; ++pos) {
+		uint32_t tx = is_vertical ? line : pos;
+		uint32_t ty = is_vertical ? pos : line;
+
+		if (!damage_is_full_tile(self, tx, ty) ||
+				!tile_bitmap_test(&self->damaged_tiles, tx, ty))
+			continue;
+
+		uint32_t hash = self->old_hashes[tx + ty *
+			self->levels[DAMAGE_REFINERY_N_LEVELS - 1].grid_width];
+		if (hash != 0)
+			anchors[n_anchors++] = (struct motion_anchor){
+				.hash = hash, .pos = pos,
+			};
+	}
+
+	n_anchors = motion_anchors_make_unique(anchors, n_anchors);
+	if (n_anchors == 0)
+		return;
+
+	uint32_t limit = (is_vertical ? self->height : self->width) - ts;
+	uint32_t p_start = is_vertical ? extents->y1 : extents->x1;
+	uint32_t p_stop = MIN(limit + 1,
+			(uint32_t)(is_vertical ? extents->y2 : extents->x2));
+
+	for (uint32_t p = p_start; p < p_stop; ++p) {
+		int x = is_vertical ? line * ts : p;
+		int y = is_vertical ? p : line * ts;
+
+		struct motion_anchor key = {
+			.hash = damage_hash_block(buffer, x, y, ts, ts),
+		};
+		struct motion_anchor* match = bsearch(&key, anchors, n_anchors,
+				sizeof(*anchors), motion_anchor_cmp);
+		if (!match)
+			continue;
+
+		int delta = (int)p - (int)(match->pos * ts);
+		if (delta == 0)
+			continue;
+
+		motion_vote(candidates, n_candidates,
+				is_vertical ? 0 : delta, is_vertical ? delta : 0);
+	}
 }
 
-static void tile_region_from_region(struct pixman_region16* dst,
-		struct pixman_region16* src)
+static bool motion_block_is_damaged(const struct damage_refinery* self,
+		int x, int y)
 {
+	uint32_t ts = FINE_TILE_SIZE;
+	uint32_t tx0 = x / ts, ty0 = y / ts;
+	uint32_t tx1 = (x + ts - 1) / ts, ty1 = (y + ts - 1) / ts;
+
+	return tile_bitmap_test(&self->damaged_tiles, tx0, ty0) ||
+		tile_bitmap_test(&self->damaged_tiles, tx1, ty0) ||
+		tile_bitmap_test(&self->damaged_tiles, tx0, ty1) ||
+		tile_bitmap_test(&self->damaged_tiles, tx1, ty1);
+}
+
+/* Every tile of the previous frame that could have been moved into the damage
+ * is checked at its new position. The ones that match make up the copy.
+ */
+static int motion_verify(struct damage_refinery* self,
+		const struct nvnc_fb* buffer, struct pixman_region16* refined,
+		const struct motion_candidate* candidate, struct vec* boxes)
+{
+	const pixman_box16_t* extents = pixman_region_extents(refined);
+	int ts = FINE_TILE_SIZE;
+	int dx = candidate->dx;
+	int dy = candidate->dy;
+
+	int x_start = MAX(extents->x1 - dx, 0) / ts;
+	int x_stop = MIN(UDIV_UP(extents->x2 - dx, ts), (int)(self->width / ts));
+	int y_start = MAX(extents->y1 - dy, 0) / ts;
+	int y_stop = MIN(UDIV_UP(extents->y2 - dy, ts), (int)(self->height / ts));
+
+	vec_clear(boxes);
+
+	for (int ty = y_start; ty < y_stop; ++ty)
+		for (int tx = x_start; tx < x_stop; ++tx) {
+			int x = tx * ts + dx;
+			int y = ty * ts + dy;
+
+			if (x < 0 || y < 0 || x + ts > (int)self->width ||
+					y + ts > (int)self->height)
+				continue;
+
+			if (!motion_block_is_damaged(self, x, y))
+				continue;
+
+			uint32_t old_hash = damage_old_hash(self, tx, ty);
+			if (old_hash == 0 || old_hash !=
+					damage_hash_block(buffer, x, y, ts, ts))
+				continue;
+
+			pixman_box16_t box = {
+				.x1 = x, .y1 = y, .x2 = x + ts, .y2 = y + ts,
+			};
+			if (vec_append(boxes, &box, sizeof(box)) < 0)
+				return -1;
+		}
+
+	struct pixman_region16* region = &self->copy.region;
+	pixman_region_fini(region);
+	pixman_region_init_rects(region, boxes->data,
+			boxes->len / sizeof(pixman_box16_t));
+	pixman_region_intersect(region, region, refined);
+
 	int n_rects = 0;
-	struct pixman_box16* rects = pixman_region_rectangles(src, &n_rects);
+	pixman_box16_t* rects = pixman_region_rectangles(region, &n_rects);
+
+	uint32_t area = 0;
+	for (int i = 0; i < n_rects; ++i)
+		area += (rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+
+	if (area < MOTION_MIN_AREA) {
+		pixman_region_clear(region);
+		return -1;
+	}
+
+	self->copy.dx = dx;
+	self->copy.dy = dy;
+	return 0;
+}
+
+/* Looks for vertical and horizontal shifts of the damaged content, which is
+ * what scrolling or dragging a window along one axis looks like.
+ */
+static void damage_detect_motion(struct damage_refinery* self,
+		struct pixman_region16* refined, const struct nvnc_fb* buffer)
+{
+	pixman_region_clear(&self->copy.region);
+
+	if (tile_bitmap_count(&self->damaged_tiles) < MOTION_MIN_TILES)
+		return;
+
+	const pixman_box16_t* extents = pixman_region_extents(refined);
+	uint32_t ts = FINE_TILE_SIZE;
+	uint32_t tx_start = extents->x1 / ts;
+	uint32_t tx_stop = MIN(extents->x2, self->width) / ts;
+	uint32_t ty_start = extents->y1 / ts;
+	uint32_t ty_stop = MIN(extents->y2, self->height) / ts;
+
+	if (tx_stop <= tx_start || ty_stop <= ty_start)
+		return;
+
+	const struct damage_refinery_level* fine =
+		&self->levels[DAMAGE_REFINERY_N_LEVELS - 1];
+	struct motion_anchor* anchors = malloc(MAX(fine->grid_width,
+				fine->grid_height) * sizeof(*anchors));
+	if (!anchors)
+		return;
+
+	struct motion_candidate candidates[MOTION_MAX_CANDIDATES];
+	size_t n_candidates = 0;
 
-	for (int i = 0; i < n_rects; ++i) {
-		int x1 = rects[i].x1 / 32;
-		int y1 = rects[i].y1 / 32;
-		int x2 = UDIV_UP(rects[i].x2, 32);
-		int y2 = UDIV_UP(rects[i].y2, 32);
+	for (int i = 1; i <= MOTION_N_SAMPLES; ++i) {
+		uint32_t tx = tx_start + (tx_stop - tx_start) * i /
+			(MOTION_N_SAMPLES + 1);
+		uint32_t ty = ty_start + (ty_stop - ty_start) * i /
+			(MOTION_N_SAMPLES + 1);
 
-		pixman_region_union_rect(dst, dst, x1, y1, x2 - x1, y2 - y1);
+		motion_search_line(self, buffer, extents, true, tx, anchors,
+				candidates, &n_candidates);
+		motion_search_line(self, buffer, extents, false, ty, anchors,
+				candidates, &n_candidates);
 	}
+
+	free(anchors);
+
+	qsort(candidates, n_candidates, sizeof(*candidates),
+			motion_candidate_cmp);
+
+	struct vec boxes;
+	if (vec_init(&boxes, 4096) < 0)
+		return;
+
+	for (size_t i = 0; i < MIN(n_candidates, 2); ++i) {
+		if (candidates[i].votes < MOTION_MIN_VOTES)
+			break;
+
+		if (motion_verify(self, buffer, refined, &candidates[i],
+					&boxes) == 0)
+			break;
+	}
+
+	vec_destroy(&boxes);
+}
+
+const struct damage_copy* damage_refinery_get_copy(
+		const struct damage_refinery* self)
+{
+	return pixman_region_not_empty((struct pixman_region16*)
+			&self->copy.region) ? &self->copy : NULL;
+}
+
+static void damage_refine_begin(struct damage_refinery* self,
+		struct pixman_region16* hint, struct nvnc_fb* buffer)
+{
+	assert(self->width == (uint32_t)buffer->width &&
+	       self->height == (uint32_t)buffer->height);
+
+	nvnc_fb_map(buffer);
+
+	tile_bitmap_clear(&self->hint_tiles);
+	tile_bitmap_clear(&self->damaged_tiles);
+	tile_bitmap_add_region(&self->hint_tiles, hint);
+}
+
+static void damage_refine_end(struct damage_refinery* self,
+		struct pixman_region16* refined, const struct nvnc_fb* buffer)
+{
+	tile_bitmap_to_region(&self->damaged_tiles, refined);
+	pixman_region_intersect_rect(refined, refined, 0, 0, self->width,
+			self->height);
+
+	damage_detect_motion(self, refined, buffer);
 }
 
 void damage_refine(struct damage_refinery* self,
@@ -123,25 +654,78 @@ void damage_refine(struct damage_refinery* self,
 		struct pixman_region16* hint,
 		struct nvnc_fb* buffer)
 {
-	assert(self->width == (uint32_t)buffer->width &&
-	       self->height == (uint32_t)buffer->height);
+	damage_refine_begin(self, hint, buffer);
 
-	nvnc_fb_map(buffer);
+	uint32_t theight = self->levels[0].grid_height;
+	for (uint32_t row = 0; row < theight; ++row)
+		damage_refine_row(self, row, buffer);
 
-	struct pixman_region16 tile_region;
-	pixman_region_init(&tile_region);
-	tile_region_from_region(&tile_region, hint);
+	damage_refine_end(self, refined, buffer);
+}
 
-	int n_rects = 0;
-	struct pixman_box16* rects = pixman_region_rectangles(&tile_region,
-			&n_rects);
+static void do_damage_refine_work(void* obj)
+{
+	struct damage_refinery* self = aml_get_userdata(obj);
+	uint32_t theight = self->levels[0].grid_height;
 
-	for (int i = 0; i < n_rects; ++i)
-		for (int ty = rects[i].y1; ty < rects[i].y2; ++ty)
-			for (int tx = rects[i].x1; tx < rects[i].x2; ++tx)
-				damage_refine_tile(self, refined, tx, ty, buffer);
+	/* Tile rows are handed out one at a time. Each row of the tile bitmap
+	 * has words of its own, so workers never write to the same word.
+	 */
+	for (;;) {
+		uint32_t row = atomic_fetch_add(&self->next_row, 1);
+		if (row >= theight)
+			break;
 
-	pixman_region_fini(&tile_region);
-	pixman_region_intersect_rect(refined, refined, 0, 0, self->width,
-			self->height);
+		damage_refine_row(self, row, self->buffer);
+	}
+}
+
+static void on_damage_refine_work_done(void* obj)
+{
+	struct damage_refinery* self = aml_get_userdata(obj);
+
+	if (--self->n_jobs != 0)
+		return;
+
+	struct pixman_region16 refined;
+	pixman_region_init(&refined);
+	damage_refine_end(self, &refined, self->buffer);
+
+	self->buffer = NULL;
+	self->on_done(&refined, self->userdata);
+
+	pixman_region_fini(&refined);
+}
+
+int damage_refine_async(struct damage_refinery* self,
+		struct pixman_region16* hint, struct nvnc_fb* buffer,
+		damage_refine_fn on_done, void* userdata)
+{
+	assert(!damage_refinery_is_busy(self));
+
+	damage_refine_begin(self, hint, buffer);
+
+	uint32_t n_tiles = tile_bitmap_count(&self->hint_tiles);
+	uint32_t n_jobs = MIN((uint32_t)self->n_workers,
+			n_tiles / TILES_PER_JOB + 1);
+
+	self->buffer = buffer;
+	self->on_done = on_done;
+	self->userdata = userdata;
+	atomic_store(&self->next_row, 0);
+
+	for (uint32_t i = 0; i < n_jobs; ++i) {
+		if (aml_start(nvnc__get_loop(), self->worker[i]) < 0)
+			break;
+
+		++self->n_jobs;
+	}
+
+	/* If any job got started, it covers all the rows on its own */
+	if (self->n_jobs == 0) {
+		self->buffer = NULL;
+		return -1;
+	}
+
+	return 0;
 }
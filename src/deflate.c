@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "deflate.h"
+#include "vec.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/param.h>
+
+#if defined(HAVE_ISAL)
+#include <isa-l/igzip_lib.h>
+#elif defined(HAVE_ZLIB_NG)
+#include <zlib-ng.h>
+#else
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_ISAL)
+
+/* ISA-L has four levels, where even the lowest one compresses. No level here
+ * maps to stored blocks, but those are only a win for data that doesn't
+ * compress at all.
+ */
+#define ISAL_MAX_LEVEL 3
+
+static const uint32_t isal_level_buf_sizes[ISAL_MAX_LEVEL + 1] = {
+	ISAL_DEF_LVL0_DEFAULT,
+	ISAL_DEF_LVL1_DEFAULT,
+	ISAL_DEF_LVL2_DEFAULT,
+	ISAL_DEF_LVL3_DEFAULT,
+};
+
+struct deflate_stream {
+	struct isal_zstream zs;
+	uint8_t* level_buf;
+	uint32_t level_buf_size;
+};
+
+static int isal_level_from_zlib(int level)
+{
+	return level <= 0 ? 0 : MIN((level + 2) / 3, ISAL_MAX_LEVEL);
+}
+
+int deflate_stream_set_level(struct deflate_stream* self, int level)
+{
+	int isal_level = isal_level_from_zlib(level);
+	uint32_t size = isal_level_buf_sizes[isal_level];
+
+	if (size > self->level_buf_size) {
+		uint8_t* buf = realloc(self->level_buf, size);
+		if (!buf)
+			return -1;
+
+		self->level_buf = buf;
+		self->level_buf_size = size;
+	}
+
+	self->zs.level = isal_level;
+	self->zs.level_buf = self->level_buf;
+	self->zs.level_buf_size = size;
+	return 0;
+}
+
+struct deflate_stream* deflate_stream_new(int level)
+{
+	struct deflate_stream* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	isal_deflate_init(&self->zs);
+	self->zs.gzip_flag = IGZIP_ZLIB;
+
+	if (deflate_stream_set_level(self, level) < 0) {
+		free(self);
+		return NULL;
+	}
+
+	return self;
+}
+
+void deflate_stream_destroy(struct deflate_stream* self)
+{
+	if (!self)
+		return;
+
+	free(self->level_buf);
+	free(self);
+}
+
+void deflate_stream_reset(struct deflate_stream* self)
+{
+	isal_deflate_reset(&self->zs);
+	self->zs.gzip_flag = IGZIP_ZLIB;
+}
+
+static size_t deflate_stream_bound(struct deflate_stream* self, size_t len)
+{
+	return len + (len >> 12) + (len >> 14) + 64;
+}
+
+static int deflate_stream_run(struct deflate_stream* self, struct vec* dst,
+		bool flush)
+{
+	struct isal_zstream* zs = &self->zs;
+	zs->flush = flush ? SYNC_FLUSH : NO_FLUSH;
+
+	do {
+		if (dst->len == dst->cap && vec_reserve(dst, dst->cap * 2) < 0)
+			return -1;
+
+		zs->next_out = (uint8_t*)dst->data + dst->len;
+		zs->avail_out = dst->cap - dst->len;
+
+		if (isal_deflate(zs) != COMP_OK)
+			return -1;
+
+		dst->len = zs->next_out - (uint8_t*)dst->data;
+	} while (zs->avail_out == 0);
+
+	return 0;
+}
+
+const char* deflate_stream_backend(void)
+{
+	return "isa-l";
+}
+
+#else
+
+/* zlib-ng has the same API as zlib, with its own prefix */
+#ifdef HAVE_ZLIB_NG
+#define Z(name) zng_##name
+typedef zng_stream deflate_z_stream;
+#else
+#define Z(name) name
+typedef z_stream deflate_z_stream;
+#endif
+
+struct deflate_stream {
+	deflate_z_stream zs;
+};
+
+struct deflate_stream* deflate_stream_new(int level)
+{
+	struct deflate_stream* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	int rc = Z(deflateInit2)(&self->zs,
+	                         /* compression level: */ level,
+	                         /*            method: */ Z_DEFLATED,
+	                         /*       window bits: */ 15,
+	                         /*         mem level: */ 9,
+	                         /*          strategy: */ Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK) {
+		free(self);
+		return NULL;
+	}
+
+	return self;
+}
+
+void deflate_stream_destroy(struct deflate_stream* self)
+{
+	if (!self)
+		return;
+
+	Z(deflateEnd)(&self->zs);
+	free(self);
+}
+
+void deflate_stream_reset(struct deflate_stream* self)
+{
+	Z(deflateReset)(&self->zs);
+}
+
+int deflate_stream_set_level(struct deflate_stream* self, int level)
+{
+	return Z(deflateParams)(&self->zs, level, Z_DEFAULT_STRATEGY) == Z_OK ?
+		0 : -1;
+}
+
+static size_t deflate_stream_bound(struct deflate_stream* self, size_t len)
+{
+	return Z(deflateBound)(&self->zs, len);
+}
+
+static int deflate_stream_run(struct deflate_stream* self, struct vec* dst,
+		bool flush)
+{
+	deflate_z_stream* zs = &self->zs;
+
+	do {
+		if (dst->len == dst->cap && vec_reserve(dst, dst->cap * 2) < 0)
+			return -1;
+
+		zs->next_out = (uint8_t*)dst->data + dst->len;
+		zs->avail_out = dst->cap - dst->len;
+
+		int r = Z(deflate)(zs, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+		if (r == Z_STREAM_ERROR)
+			return -1;
+
+		dst->len = zs->next_out - (uint8_t*)dst->data;
+	} while (zs->avail_out == 0);
+
+	return 0;
+}
+
+const char* deflate_stream_backend(void)
+{
+#ifdef HAVE_ZLIB_NG
+	return "zlib-ng";
+#else
+	return "zlib";
+#endif
+}
+
+#endif
+
+int deflate_stream_compress(struct deflate_stream* self, struct vec* dst,
+		const void* src, size_t len, bool flush)
+{
+	self->zs.next_in = (void*)src;
+	self->zs.avail_in = len;
+
+	/* The bound covers all of the input, so this normally runs only once */
+	if (vec_reserve(dst, dst->len + deflate_stream_bound(self, len) + 16) < 0)
+		return -1;
+
+	if (deflate_stream_run(self, dst, flush) < 0)
+		return -1;
+
+	assert(self->zs.avail_in == 0);
+	return 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "desktop.h"
+#include "display.h"
+#include "neatvnc.h"
+#include "fb.h"
+#include "pixels.h"
+#include "transform-util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pixman.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <libdrm/drm_fourcc.h>
+
+struct desktop_buffer {
+	struct pixman_region16 damage;
+	LIST_ENTRY(desktop_buffer) link;
+};
+
+LIST_HEAD(desktop_buffer_list, desktop_buffer);
+
+struct desktop {
+	struct nvnc_fb_pool* pool;
+	struct desktop_buffer_list buffers;
+	uint16_t width, height;
+};
+
+static bool desktop_screen_equal(const struct desktop_screen* a,
+		const struct desktop_screen* b)
+{
+	return a->id == b->id && a->x == b->x && a->y == b->y &&
+		a->width == b->width && a->height == b->height;
+}
+
+static bool desktop_layout_has_screen(const struct desktop_layout* self,
+		const struct desktop_screen* screen)
+{
+	for (int i = 0; i < self->n_screens; ++i)
+		if (desktop_screen_equal(&self->screens[i], screen))
+			return true;
+
+	return false;
+}
+
+static void desktop_layout_damage_changes(const struct desktop_layout* self,
+		const struct desktop_layout* other,
+		struct pixman_region16* damage)
+{
+	for (int i = 0; i < self->n_screens; ++i) {
+		const struct desktop_screen* screen = &self->screens[i];
+		if (!desktop_layout_has_screen(other, screen))
+			pixman_region_union_rect(damage, damage, screen->x,
+					screen->y, screen->width,
+					screen->height);
+	}
+}
+
+bool desktop_layout_update(struct desktop_layout* self,
+		struct nvnc_display* const* displays, int n_displays,
+		struct pixman_region16* damage)
+{
+	struct desktop_layout layout = { 0 };
+	uint32_t width = 0, height = 0;
+
+	for (int i = 0; i < n_displays; ++i) {
+		struct nvnc_display* display = displays[i];
+		if (!display->buffer)
+			continue;
+
+		struct desktop_screen* screen =
+			&layout.screens[layout.n_screens++];
+		screen->id = display->id;
+		screen->x = display->x_pos;
+		screen->y = display->y_pos;
+		screen->width = nvnc_fb_get_logical_width(display->buffer);
+		screen->height = nvnc_fb_get_logical_height(display->buffer);
+
+		width = MAX(width, (uint32_t)screen->x + screen->width);
+		height = MAX(height, (uint32_t)screen->y + screen->height);
+	}
+
+	layout.width = MIN(width, UINT16_MAX);
+	layout.height = MIN(height, UINT16_MAX);
+
+	bool is_changed = layout.n_screens != self->n_screens ||
+		layout.width != self->width || layout.height != self->height;
+	for (int i = 0; !is_changed && i < layout.n_screens; ++i)
+		is_changed = !desktop_screen_equal(&layout.screens[i],
+				&self->screens[i]);
+
+	if (!is_changed)
+		return false;
+
+	desktop_layout_damage_changes(self, &layout, damage);
+	desktop_layout_damage_changes(&layout, self, damage);
+
+	layout.serial = self->serial + 1;
+	*self = layout;
+	return true;
+}
+
+static void desktop_buffer_destroy(void* userdata)
+{
+	struct desktop_buffer* buffer = userdata;
+	LIST_REMOVE(buffer, link);
+	pixman_region_fini(&buffer->damage);
+	free(buffer);
+}
+
+struct desktop* desktop_new(void)
+{
+	struct desktop* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->pool = nvnc_fb_pool_new(0, 0, DRM_FORMAT_XRGB8888, 0);
+	if (!self->pool) {
+		free(self);
+		return NULL;
+	}
+
+	LIST_INIT(&self->buffers);
+
+	return self;
+}
+
+void desktop_destroy(struct desktop* self)
+{
+	if (!self)
+		return;
+
+	nvnc_fb_pool_unref(self->pool);
+	free(self);
+}
+
+void desktop_damage(struct desktop* self, struct pixman_region16* damage)
+{
+	struct desktop_buffer* buffer;
+	LIST_FOREACH(buffer, &self->buffers, link)
+		pixman_region_union(&buffer->damage, &buffer->damage, damage);
+}
+
+static int desktop_compose_screen(pixman_image_t* dstimg,
+		const struct desktop_screen* screen, struct nvnc_fb* src,
+		struct pixman_region16* clip)
+{
+	pixman_format_code_t src_fmt = 0;
+	if (!fourcc_to_pixman_fmt(&src_fmt, src->fourcc_format))
+		return -1;
+
+	pixman_image_t* srcimg = pixman_image_create_bits_no_clear(
+			src_fmt, src->width, src->height, src->addr,
+			nvnc_fb_get_pixel_size(src) * src->stride);
+	if (!srcimg)
+		return -1;
+
+	pixman_transform_t pxform;
+	nvnc_transform_to_pixman_transform(&pxform, src->transform,
+			src->width, src->height);
+	pixman_image_set_transform(srcimg, &pxform);
+
+	pixman_image_set_clip_region(dstimg, clip);
+
+	struct pixman_box16* ext = pixman_region_extents(clip);
+
+	pixman_image_composite(PIXMAN_OP_SRC, srcimg, NULL, dstimg,
+			ext->x1 - screen->x, ext->y1 - screen->y,
+			0, 0,
+			ext->x1, ext->y1,
+			ext->x2 - ext->x1, ext->y2 - ext->y1);
+
+	pixman_image_set_clip_region(dstimg, NULL);
+	pixman_image_unref(srcimg);
+	return 0;
+}
+
+struct nvnc_fb* desktop_compose(struct desktop* self,
+		const struct desktop_layout* layout,
+		struct nvnc_display* const* displays, int n_displays,
+		struct pixman_region16* damage)
+{
+	if (layout->width != self->width || layout->height != self->height) {
+		nvnc_fb_pool_resize(self->pool, layout->width, layout->height,
+				DRM_FORMAT_XRGB8888, layout->width);
+		self->width = layout->width;
+		self->height = layout->height;
+	}
+
+	desktop_damage(self, damage);
+
+	struct nvnc_fb* fb = nvnc_fb_pool_acquire(self->pool);
+	if (!fb)
+		return NULL;
+
+	struct desktop_buffer* buffer = nvnc_get_userdata(fb);
+	if (!buffer) {
+		buffer = calloc(1, sizeof(*buffer));
+		if (!buffer) {
+			nvnc_fb_pool_release(self->pool, fb);
+			return NULL;
+		}
+
+		/* This is a new buffer, so all of it must be composed */
+		pixman_region_init_rect(&buffer->damage, 0, 0, self->width,
+				self->height);
+
+		nvnc_set_userdata(fb, buffer, desktop_buffer_destroy);
+		LIST_INSERT_HEAD(&self->buffers, buffer, link);
+	}
+
+	pixman_image_t* dstimg = pixman_image_create_bits_no_clear(
+			PIXMAN_x8r8g8b8, fb->width, fb->height, fb->addr,
+			nvnc_fb_get_pixel_size(fb) * fb->stride);
+
+	/* Whatever no screen covers is left black */
+	struct pixman_region16 uncovered;
+	pixman_region_init(&uncovered);
+	pixman_region_intersect_rect(&uncovered, &buffer->damage, 0, 0,
+			self->width, self->height);
+
+	struct pixman_region16 clip;
+	pixman_region_init(&clip);
+
+	for (int i = 0; i < layout->n_screens; ++i) {
+		const struct desktop_screen* screen = &layout->screens[i];
+
+		struct nvnc_display* display = NULL;
+		for (int j = 0; j < n_displays && !display; ++j)
+			if (displays[j]->id == screen->id)
+				display = displays[j];
+
+		if (!display || !display->buffer)
+			continue;
+
+		pixman_region_intersect_rect(&clip, &buffer->damage,
+				screen->x, screen->y, screen->width,
+				screen->height);
+		if (!pixman_region_not_empty(&clip))
+			continue;
+
+		/* A screen in a format that cannot be composed is left black
+		 * rather than bringing down the whole desktop.
+		 */
+		if (desktop_compose_screen(dstimg, screen, display->buffer,
+					&clip) < 0)
+			continue;
+
+		pixman_region_subtract(&uncovered, &uncovered, &clip);
+	}
+
+	int n_boxes = 0;
+	pixman_box16_t* boxes = pixman_region_rectangles(&uncovered, &n_boxes);
+	if (n_boxes > 0)
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, dstimg,
+				&(pixman_color_t){ .alpha = 0xffff },
+				n_boxes, boxes);
+
+	pixman_region_fini(&clip);
+	pixman_region_fini(&uncovered);
+	pixman_image_unref(dstimg);
+
+	pixman_region_clear(&buffer->damage);
+	return fb;
+}
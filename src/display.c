@@ -20,17 +20,28 @@
 #include "fb.h"
 #include "resampler.h"
 #include "transform-util.h"
+#include "event-loop.h"
 
-#include <assert.h>
 #include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <aml.h>
 
 #define EXPORT __attribute__((visibility("default")))
 
-static void nvnc_display__on_resampler_done(struct nvnc_fb* fb,
-		struct pixman_region16* damage, void* userdata)
+#define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
+
+static uint64_t gettime_us(void)
 {
-	struct nvnc_display* self = userdata;
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
 
+static void nvnc_display__publish(struct nvnc_display* self,
+		struct nvnc_fb* fb, struct pixman_region16* damage,
+		const struct damage_copy* copy)
+{
 	if (self->buffer) {
 		nvnc_fb_release(self->buffer);
 		nvnc_fb_unref(self->buffer);
@@ -40,9 +51,16 @@ static void nvnc_display__on_resampler_done(struct nvnc_fb* fb,
 	nvnc_fb_ref(fb);
 	nvnc_fb_hold(fb);
 
-	// TODO: Shift according to display position
-	assert(self->server);
-	nvnc__damage_region(self->server, damage);
+	/* Displays that have been removed keep going until they're unreffed */
+	if (self->server)
+		nvnc__damage_region(self->server, self, damage, copy);
+}
+
+static void nvnc_display__on_resampler_done(struct nvnc_fb* fb,
+		struct pixman_region16* damage, void* userdata)
+{
+	struct nvnc_display* self = userdata;
+	nvnc_display__publish(self, fb, damage, NULL);
 }
 
 EXPORT
@@ -59,6 +77,9 @@ struct nvnc_display* nvnc_display_new(uint16_t x_pos, uint16_t y_pos)
 	if (damage_refinery_init(&self->damage_refinery, 0, 0) < 0)
 		goto refinery_failure;
 
+	pixman_region_init(&self->pending_damage);
+	pixman_region_init(&self->deferred_damage);
+
 	self->ref = 1;
 	self->x_pos = x_pos;
 	self->y_pos = y_pos;
@@ -73,12 +94,39 @@ resampler_failure:
 	return NULL;
 }
 
+static void nvnc_display__set_gpu_buffer(struct nvnc_display* self,
+		struct nvnc_fb* fb)
+{
+	if (self->gpu_buffer) {
+		nvnc_fb_release(self->gpu_buffer);
+		nvnc_fb_unref(self->gpu_buffer);
+	}
+
+	self->gpu_buffer = fb;
+
+	if (fb) {
+		nvnc_fb_ref(fb);
+		nvnc_fb_hold(fb);
+	}
+}
+
 static void nvnc__display_free(struct nvnc_display* self)
 {
+	if (self->pending_fb) {
+		nvnc_fb_release(self->pending_fb);
+		nvnc_fb_unref(self->pending_fb);
+	}
+	pixman_region_fini(&self->pending_damage);
+
+	/* The timer holds a reference, so nothing can be deferred here */
+	assert(!self->deferred_fb);
+	pixman_region_fini(&self->deferred_damage);
+
 	if (self->buffer) {
 		nvnc_fb_release(self->buffer);
 		nvnc_fb_unref(self->buffer);
 	}
+	nvnc_display__set_gpu_buffer(self, NULL);
 	damage_refinery_destroy(&self->damage_refinery);
 	resampler_destroy(self->resampler);
 	free(self);
@@ -103,24 +151,238 @@ struct nvnc* nvnc_display_get_server(const struct nvnc_display* self)
 	return self->server;
 }
 
-EXPORT
-void nvnc_display_feed_buffer(struct nvnc_display* self, struct nvnc_fb* fb,
-		struct pixman_region16* damage)
+static void nvnc_display__resample(struct nvnc_display* self,
+		struct nvnc_fb* fb, struct pixman_region16* refined_damage,
+		const struct damage_copy* copy)
+{
+	struct pixman_region16 transformed_damage;
+	pixman_region_init(&transformed_damage);
+	nvnc_transform_region(&transformed_damage, refined_damage,
+			fb->transform, fb->width, fb->height);
+
+	/* The encoders read 32 bit buffers through the transform, so those
+	 * don't need to be copied into an upright buffer first. Motion is
+	 * found in buffer coordinates, so it is only passed on when those are
+	 * the same as the client's.
+	 */
+	if (nvnc_fb_get_pixel_size(fb) == 4 && fb->type != NVNC_FB_GBM_BO)
+		nvnc_display__publish(self, fb, &transformed_damage,
+				fb->transform == NVNC_TRANSFORM_NORMAL ?
+				copy : NULL);
+	else
+		resampler_feed(self->resampler, fb, &transformed_damage,
+				nvnc_display__on_resampler_done, self);
+
+	pixman_region_fini(&transformed_damage);
+}
+
+static void nvnc_display__refine(struct nvnc_display* self,
+		struct nvnc_fb* fb, struct pixman_region16* damage);
+
+static void nvnc_display__on_refined(struct pixman_region16* refined,
+		void* userdata)
+{
+	struct nvnc_display* self = userdata;
+	struct nvnc_fb* fb = self->refining_fb;
+	self->refining_fb = NULL;
+
+	nvnc_display__resample(self, fb, refined,
+			damage_refinery_get_copy(&self->damage_refinery));
+
+	nvnc_fb_release(fb);
+	nvnc_fb_unref(fb);
+
+	struct nvnc_fb* pending = self->pending_fb;
+	if (pending) {
+		self->pending_fb = NULL;
+		nvnc_display__refine(self, pending, &self->pending_damage);
+		pixman_region_clear(&self->pending_damage);
+
+		nvnc_fb_release(pending);
+		nvnc_fb_unref(pending);
+	}
+
+	nvnc_display_unref(self);
+}
+
+static void nvnc_display__refine(struct nvnc_display* self,
+		struct nvnc_fb* fb, struct pixman_region16* damage)
 {
 	damage_refinery_resize(&self->damage_refinery, fb->width, fb->height);
 
-	// TODO: Run the refinery in a worker thread?
+	/* The buffer has to stay untouched until the workers are done with
+	 * it, and the display must outlive the job.
+	 */
+	nvnc_fb_ref(fb);
+	nvnc_fb_hold(fb);
+	nvnc_display_ref(self);
+	self->refining_fb = fb;
+
+	if (damage_refine_async(&self->damage_refinery, damage, fb,
+				nvnc_display__on_refined, self) == 0)
+		return;
+
+	self->refining_fb = NULL;
+	nvnc_display_unref(self);
+
 	struct pixman_region16 refined_damage;
 	pixman_region_init(&refined_damage);
 	damage_refine(&self->damage_refinery, &refined_damage, damage, fb);
 
+	nvnc_display__resample(self, fb, &refined_damage,
+			damage_refinery_get_copy(&self->damage_refinery));
+
+	pixman_region_fini(&refined_damage);
+
+	nvnc_fb_release(fb);
+	nvnc_fb_unref(fb);
+}
+
+static void nvnc_display__submit(struct nvnc_display* self,
+		struct nvnc_fb* fb, struct pixman_region16* damage)
+{
+	if (!damage_refinery_is_busy(&self->damage_refinery)) {
+		nvnc_display__refine(self, fb, damage);
+		return;
+	}
+
+	/* Only the newest buffer matters, but the damage of every skipped
+	 * buffer still has to be refined against it.
+	 */
+	if (self->pending_fb) {
+		nvnc_fb_release(self->pending_fb);
+		nvnc_fb_unref(self->pending_fb);
+	}
+
+	self->pending_fb = fb;
+	nvnc_fb_ref(fb);
+	nvnc_fb_hold(fb);
+
+	pixman_region_union(&self->pending_damage, &self->pending_damage,
+			damage);
+}
+
+static void nvnc_display__on_readback_done(struct nvnc_fb* fb,
+		struct pixman_region16* damage, void* userdata)
+{
+	struct nvnc_display* self = userdata;
+	nvnc_display__submit(self, fb, damage);
+}
+
+static void nvnc_display__process(struct nvnc_display* self,
+		struct nvnc_fb* fb, struct pixman_region16* damage)
+{
+	if (fb->type != NVNC_FB_GBM_BO) {
+		nvnc_display__set_gpu_buffer(self, NULL);
+		nvnc_display__submit(self, fb, damage);
+		return;
+	}
+
+	nvnc_display__set_gpu_buffer(self, fb);
+
+	/* GPU buffers are usually uncached or write-combined, so only the
+	 * damaged parts are read, once, into a system memory copy. Everything
+	 * else, including the damage refinery, works on that copy.
+	 */
 	struct pixman_region16 transformed_damage;
 	pixman_region_init(&transformed_damage);
-	nvnc_transform_region(&transformed_damage, &refined_damage,
-			fb->transform, fb->width, fb->height);
+	nvnc_transform_region(&transformed_damage, damage, fb->transform,
+			fb->width, fb->height);
 
 	resampler_feed(self->resampler, fb, &transformed_damage,
-			nvnc_display__on_resampler_done, self);
+			nvnc_display__on_readback_done, self);
 
-	pixman_region_fini(&refined_damage);
+	pixman_region_fini(&transformed_damage);
+}
+
+/* Processes the deferred buffer along with the damage of every buffer that it
+ * took the place of
+ */
+static void nvnc_display__process_deferred(struct nvnc_display* self)
+{
+	struct nvnc_fb* fb = self->deferred_fb;
+	self->deferred_fb = NULL;
+
+	aml_unref(self->feed_timer);
+	self->feed_timer = NULL;
+
+	self->last_feed_time = gettime_us();
+	nvnc_display__process(self, fb, &self->deferred_damage);
+	pixman_region_clear(&self->deferred_damage);
+
+	nvnc_fb_release(fb);
+	nvnc_fb_unref(fb);
+	nvnc_display_unref(self);
+}
+
+static void nvnc_display__on_feed_timeout(void* obj)
+{
+	struct nvnc_display* self = aml_get_userdata(obj);
+	nvnc_display__process_deferred(self);
+}
+
+static int nvnc_display__defer(struct nvnc_display* self, struct nvnc_fb* fb,
+		struct pixman_region16* damage, uint64_t now)
+{
+	if (!self->deferred_fb) {
+		uint64_t due = self->last_feed_time + self->min_interval_us;
+		struct aml_timer* timer = aml_timer_new(
+				UDIV_UP(due - now, 1000),
+				nvnc_display__on_feed_timeout, self, NULL);
+		if (!timer)
+			return -1;
+
+		nvnc_display_ref(self);
+
+		if (aml_start(nvnc__get_loop(), timer) < 0) {
+			nvnc_display_unref(self);
+			aml_unref(timer);
+			return -1;
+		}
+
+		self->feed_timer = timer;
+	} else {
+		nvnc_fb_release(self->deferred_fb);
+		nvnc_fb_unref(self->deferred_fb);
+	}
+
+	self->deferred_fb = fb;
+	nvnc_fb_ref(fb);
+	nvnc_fb_hold(fb);
+
+	pixman_region_union(&self->deferred_damage, &self->deferred_damage,
+			damage);
+	return 0;
+}
+
+EXPORT
+void nvnc_display_feed_buffer(struct nvnc_display* self, struct nvnc_fb* fb,
+		struct pixman_region16* damage)
+{
+	uint64_t now = gettime_us();
+	bool is_due = now - self->last_feed_time >= self->min_interval_us;
+
+	/* Buffers that come in before the interval is up are merged into one,
+	 * which is processed when the timer runs out. Once a buffer has been
+	 * deferred, the ones after it must be too, or the deferred one
+	 * would be processed after them.
+	 */
+	if ((self->deferred_fb || !is_due) &&
+			nvnc_display__defer(self, fb, damage, now) == 0)
+		return;
+
+	self->last_feed_time = now;
+	nvnc_display__process(self, fb, damage);
+}
+
+EXPORT
+void nvnc_display_set_max_rate(struct nvnc_display* self, uint32_t max_fps)
+{
+	self->min_interval_us = max_fps ? UDIV_UP(1000000, max_fps) : 0;
+
+	/* The timer was set for the old rate */
+	if (self->deferred_fb) {
+		aml_stop(nvnc__get_loop(), self->feed_timer);
+		nvnc_display__process_deferred(self);
+	}
 }
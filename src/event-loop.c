@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "event-loop.h"
+#include "vec.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <aml.h>
+#include <sys/eventfd.h>
+
+struct loop_message {
+	loop_queue_fn fn;
+	void* data;
+};
+
+static _Thread_local struct aml* thread_loop;
+
+struct aml* nvnc__get_loop(void)
+{
+	return thread_loop ? thread_loop : aml_get_default();
+}
+
+void nvnc__set_thread_loop(struct aml* aml)
+{
+	thread_loop = aml;
+}
+
+void loop_queue_dispatch(struct loop_queue* self)
+{
+	uint64_t counter;
+	if (read(self->fd, &counter, sizeof(counter)) < 0) {
+		// The counter was already zero. Nothing to worry about.
+	}
+
+	pthread_mutex_lock(&self->lock);
+	struct vec messages = self->messages;
+	vec_init(&self->messages, 0);
+	pthread_mutex_unlock(&self->lock);
+
+	struct loop_message* msg;
+	vec_for(msg, &messages)
+		msg->fn(msg->data);
+
+	vec_destroy(&messages);
+}
+
+static void on_loop_queue_event(void* obj)
+{
+	struct loop_queue* self = aml_get_userdata(obj);
+	loop_queue_dispatch(self);
+}
+
+int loop_queue_init(struct loop_queue* self, struct aml* aml)
+{
+	self->aml = aml;
+
+	if (vec_init(&self->messages, 0) < 0)
+		return -1;
+
+	self->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (self->fd < 0)
+		goto eventfd_failure;
+
+	self->handler = aml_handler_new(self->fd, on_loop_queue_event, self,
+			NULL);
+	if (!self->handler)
+		goto handler_failure;
+
+	if (aml_start(aml, self->handler) < 0)
+		goto start_failure;
+
+	pthread_mutex_init(&self->lock, NULL);
+	return 0;
+
+start_failure:
+	aml_unref(self->handler);
+handler_failure:
+	close(self->fd);
+eventfd_failure:
+	vec_destroy(&self->messages);
+	return -1;
+}
+
+void loop_queue_destroy(struct loop_queue* self)
+{
+	aml_stop(self->aml, self->handler);
+	aml_unref(self->handler);
+	close(self->fd);
+	vec_destroy(&self->messages);
+	pthread_mutex_destroy(&self->lock);
+}
+
+int loop_queue_post(struct loop_queue* self, loop_queue_fn fn, void* data)
+{
+	struct loop_message msg = {
+		.fn = fn,
+		.data = data,
+	};
+
+	pthread_mutex_lock(&self->lock);
+	int rc = vec_append(&self->messages, &msg, sizeof(msg));
+	pthread_mutex_unlock(&self->lock);
+	if (rc < 0)
+		return -1;
+
+	uint64_t one = 1;
+	if (write(self->fd, &one, sizeof(one)) < 0)
+		return -1;
+
+	return 0;
+}
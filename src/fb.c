@@ -18,25 +18,60 @@
 #include "pixels.h"
 #include "neatvnc.h"
 #include "logging.h"
+#include "transform-util.h"
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <stdatomic.h>
 
 #include "config.h"
 
 #ifdef HAVE_GBM
 #include <gbm.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+#include <libdrm/drm_fourcc.h>
 #endif
 
 #define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
 #define ALIGN_UP(n, a) (UDIV_UP(n, a) * a)
 #define EXPORT __attribute__((visibility("default")))
 
-EXPORT
-struct nvnc_fb* nvnc_fb_new(uint16_t width, uint16_t height,
-                            uint32_t fourcc_format, uint16_t stride)
+#define HUGEPAGE_SIZE (2 << 20)
+
+/* Huge pages cut down on TLB misses when the encoders sweep over a buffer.
+ * Explicit huge pages are used if some have been reserved, otherwise the
+ * kernel is asked to use transparent huge pages for the mapping.
+ */
+static void* nvnc__fb_alloc_hugepages(size_t size, uint32_t alloc_flags)
+{
+#if defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	if (alloc_flags & NVNC_FB_ALLOC_PREFAULT)
+		flags |= MAP_POPULATE;
+
+	void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			flags | MAP_HUGETLB, -1, 0);
+	if (addr != MAP_FAILED)
+		return addr;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	madvise(addr, size, MADV_HUGEPAGE);
+	return addr;
+#else
+	return NULL;
+#endif
+}
+
+struct nvnc_fb* nvnc__fb_new(uint16_t width, uint16_t height,
+		uint32_t fourcc_format, uint16_t stride, uint32_t alloc_flags)
 {
 	struct nvnc_fb* fb = calloc(1, sizeof(*fb));
 	if (!fb)
@@ -50,18 +85,39 @@ struct nvnc_fb* nvnc_fb_new(uint16_t width, uint16_t height,
 	fb->stride = stride;
 
 	size_t size = height * stride * 4; /* Assume 4 byte format for now */
+
+	if (alloc_flags & NVNC_FB_ALLOC_HUGEPAGES) {
+		size_t mmap_size = ALIGN_UP(size, HUGEPAGE_SIZE);
+		fb->addr = nvnc__fb_alloc_hugepages(mmap_size, alloc_flags);
+		if (fb->addr) {
+			fb->mmap_size = mmap_size;
+			return fb;
+		}
+	}
+
 	size_t alignment = MAX(4, sizeof(void*));
 	size_t aligned_size = ALIGN_UP(size, alignment);
 
 	fb->addr = aligned_alloc(alignment, aligned_size);
 	if (!fb->addr) {
 		free(fb);
-		fb = NULL;
+		return NULL;
 	}
 
+	/* Take the page faults now rather than in the middle of a frame */
+	if (alloc_flags & NVNC_FB_ALLOC_PREFAULT)
+		memset(fb->addr, 0, aligned_size);
+
 	return fb;
 }
 
+EXPORT
+struct nvnc_fb* nvnc_fb_new(uint16_t width, uint16_t height,
+                            uint32_t fourcc_format, uint16_t stride)
+{
+	return nvnc__fb_new(width, height, fourcc_format, stride, 0);
+}
+
 EXPORT
 struct nvnc_fb* nvnc_fb_from_buffer(void* buffer, uint16_t width, uint16_t height,
                             uint32_t fourcc_format, int32_t stride)
@@ -97,6 +153,7 @@ struct nvnc_fb* nvnc_fb_from_gbm_bo(struct gbm_bo* bo)
 	fb->height = gbm_bo_get_height(bo);
 	fb->fourcc_format = gbm_bo_get_format(bo);
 	fb->bo = bo;
+	fb->bo_fd = -1;
 
 	return fb;
 #else
@@ -153,6 +210,18 @@ enum nvnc_transform nvnc_fb_get_transform(const struct nvnc_fb* fb)
 	return fb->transform;
 }
 
+uint16_t nvnc_fb_get_logical_width(const struct nvnc_fb* fb)
+{
+	return nvnc_transform_is_90_degrees(fb->transform) ?
+		fb->height : fb->width;
+}
+
+uint16_t nvnc_fb_get_logical_height(const struct nvnc_fb* fb)
+{
+	return nvnc_transform_is_90_degrees(fb->transform) ?
+		fb->width : fb->height;
+}
+
 static void nvnc__fb_free(struct nvnc_fb* fb)
 {
 	nvnc_cleanup_fn cleanup = fb->common.cleanup_fn;
@@ -166,9 +235,16 @@ static void nvnc__fb_free(struct nvnc_fb* fb)
 		case NVNC_FB_UNSPEC:
 			abort();
 		case NVNC_FB_SIMPLE:
-			free(fb->addr);
+			if (fb->mmap_size)
+				munmap(fb->addr, fb->mmap_size);
+			else
+				free(fb->addr);
 			break;
 		case NVNC_FB_GBM_BO:
+#ifdef HAVE_GBM
+			if (fb->bo_fd >= 0)
+				close(fb->bo_fd);
+#endif
 			gbm_bo_destroy(fb->bo);
 			break;
 		}
@@ -207,12 +283,75 @@ void nvnc_fb_hold(struct nvnc_fb* fb)
 	fb->hold_count++;
 }
 
+/* A CPU mapping of a linear buffer is a plain view of its memory, so it can be
+ * kept for as long as the buffer lives. Unmapping is what would otherwise wait
+ * for the GPU and flush the caches, so that is done with dma-buf syncs around
+ * the reads of each frame instead. Other layouts may be detiled into a copy
+ * when they're mapped, so they have to be mapped again for every frame.
+ */
+static bool nvnc_fb__can_keep_mapping(const struct nvnc_fb* fb)
+{
+#ifdef HAVE_GBM
+	return fb->type == NVNC_FB_GBM_BO &&
+		gbm_bo_get_modifier(fb->bo) == DRM_FORMAT_MOD_LINEAR;
+#else
+	return false;
+#endif
+}
+
+#ifdef HAVE_GBM
+static int nvnc_fb__sync(struct nvnc_fb* fb, uint64_t flags)
+{
+	if (fb->bo_fd < 0)
+		fb->bo_fd = gbm_bo_get_fd(fb->bo);
+	if (fb->bo_fd < 0)
+		return -1;
+
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+
+	int rc;
+	do
+		rc = ioctl(fb->bo_fd, DMA_BUF_IOCTL_SYNC, &sync);
+	while (rc < 0 && (errno == EINTR || errno == EAGAIN));
+
+	return rc;
+}
+#endif
+
+static void nvnc_fb__begin_cpu_access(struct nvnc_fb* fb)
+{
+#ifdef HAVE_GBM
+	if (fb->is_bo_synced)
+		return;
+
+	if (nvnc_fb__sync(fb, DMA_BUF_SYNC_START) < 0)
+		log_debug("Failed to sync dma-buf for reading: %s\n",
+				strerror(errno));
+
+	fb->is_bo_synced = true;
+#endif
+}
+
+static void nvnc_fb__end_cpu_access(struct nvnc_fb* fb)
+{
+#ifdef HAVE_GBM
+	if (!fb->is_bo_synced)
+		return;
+
+	nvnc_fb__sync(fb, DMA_BUF_SYNC_END);
+	fb->is_bo_synced = false;
+#endif
+}
+
 void nvnc_fb_release(struct nvnc_fb* fb)
 {
 	if (--fb->hold_count != 0)
 		return;
 
-	nvnc_fb_unmap(fb);
+	if (nvnc_fb__can_keep_mapping(fb))
+		nvnc_fb__end_cpu_access(fb);
+	else
+		nvnc_fb_unmap(fb);
 
 	if (fb->on_release)
 		fb->on_release(fb, fb->release_context);
@@ -221,18 +360,25 @@ void nvnc_fb_release(struct nvnc_fb* fb)
 int nvnc_fb_map(struct nvnc_fb* fb)
 {
 #ifdef HAVE_GBM
-	if (fb->type != NVNC_FB_GBM_BO || fb->bo_map_handle)
+	if (fb->type != NVNC_FB_GBM_BO)
 		return 0;
 
-	uint32_t stride = 0;
-	fb->addr = gbm_bo_map(fb->bo, 0, 0, fb->width, fb->height,
-			GBM_BO_TRANSFER_READ, &stride, &fb->bo_map_handle);
-	fb->stride = stride / nvnc_fb_get_pixel_size(fb);
-	if (fb->addr)
-		return 0;
+	if (!fb->bo_map_handle) {
+		uint32_t stride = 0;
+		fb->addr = gbm_bo_map(fb->bo, 0, 0, fb->width, fb->height,
+				GBM_BO_TRANSFER_READ, &stride,
+				&fb->bo_map_handle);
+		fb->stride = stride / nvnc_fb_get_pixel_size(fb);
+		if (!fb->addr) {
+			fb->bo_map_handle = NULL;
+			return -1;
+		}
+	}
 
-	fb->bo_map_handle = NULL;
-	return -1;
+	if (nvnc_fb__can_keep_mapping(fb))
+		nvnc_fb__begin_cpu_access(fb);
+
+	return 0;
 #else
 	return 0;
 #endif
@@ -244,6 +390,8 @@ void nvnc_fb_unmap(struct nvnc_fb* fb)
 	if (fb->type != NVNC_FB_GBM_BO)
 		return;
 
+	nvnc_fb__end_cpu_access(fb);
+
 	if (fb->bo_map_handle)
 		gbm_bo_unmap(fb->bo, fb->bo_map_handle);
 
@@ -16,6 +16,7 @@
 
 #include "fb.h"
 #include "neatvnc.h"
+#include "logging.h"
 
 #include "sys/queue.h"
 
@@ -31,6 +32,8 @@ struct fbq_item {
 
 TAILQ_HEAD(fbq, fbq_item);
 
+static void nvnc_fb_pool__on_fb_release(struct nvnc_fb* fb, void* userdata);
+
 struct nvnc_fb_pool {
 	int ref;
 
@@ -40,6 +43,11 @@ struct nvnc_fb_pool {
 	uint16_t height;
 	int32_t stride;
 	uint32_t fourcc_format;
+
+	uint32_t flags;
+	int n_prefill;
+
+	struct nvnc_fb_pool_stats stats;
 };
 
 EXPORT
@@ -69,6 +77,8 @@ static void nvnc_fb_pool__destroy_fbs(struct nvnc_fb_pool* self)
 		nvnc_fb_unref(item->fb);
 		free(item);
 	}
+
+	self->stats.n_free = 0;
 }
 
 static void nvnc_fb_pool__destroy(struct nvnc_fb_pool* self)
@@ -93,9 +103,70 @@ bool nvnc_fb_pool_resize(struct nvnc_fb_pool* self, uint16_t width,
 	self->stride = stride;
 	self->fourcc_format = fourcc_format;
 
+	/* There must be no gap between a mode change and the first frames */
+	if (nvnc_fb_pool_prefill(self, self->n_prefill) < 0)
+		log_debug("Failed to prefill framebuffer pool\n");
+
 	return true;
 }
 
+EXPORT
+void nvnc_fb_pool_set_flags(struct nvnc_fb_pool* self, uint32_t flags)
+{
+	self->flags = flags;
+}
+
+static struct nvnc_fb* nvnc_fb_pool__alloc(struct nvnc_fb_pool* self,
+		uint32_t alloc_flags)
+{
+	if (self->flags & NVNC_FB_POOL_HUGEPAGES)
+		alloc_flags |= NVNC_FB_ALLOC_HUGEPAGES;
+
+	return nvnc__fb_new(self->width, self->height, self->fourcc_format,
+			self->stride, alloc_flags);
+}
+
+static void nvnc_fb_pool__push(struct nvnc_fb_pool* self, struct nvnc_fb* fb)
+{
+	struct fbq_item* item = calloc(1, sizeof(*item));
+	assert(item);
+	item->fb = fb;
+	TAILQ_INSERT_TAIL(&self->fbs, item, link);
+	self->stats.n_free++;
+}
+
+/* Allocates buffers up front, with their pages already faulted in, until
+ * there are at least n_buffers in the pool, counting those in use. The target
+ * is kept, so the pool is filled up again after it's been resized.
+ */
+EXPORT
+int nvnc_fb_pool_prefill(struct nvnc_fb_pool* self, int n_buffers)
+{
+	self->n_prefill = n_buffers;
+
+	if (self->width == 0 || self->height == 0)
+		return 0;
+
+	while ((int)(self->stats.n_free + self->stats.n_in_use) < n_buffers) {
+		struct nvnc_fb* fb = nvnc_fb_pool__alloc(self,
+				NVNC_FB_ALLOC_PREFAULT);
+		if (!fb)
+			return -1;
+
+		nvnc_fb_set_release_fn(fb, nvnc_fb_pool__on_fb_release, self);
+		nvnc_fb_pool__push(self, fb);
+	}
+
+	return 0;
+}
+
+EXPORT
+void nvnc_fb_pool_get_stats(const struct nvnc_fb_pool* self,
+		struct nvnc_fb_pool_stats* stats)
+{
+	*stats = self->stats;
+}
+
 EXPORT
 void nvnc_fb_pool_ref(struct nvnc_fb_pool* self)
 {
@@ -119,11 +190,12 @@ static void nvnc_fb_pool__on_fb_release(struct nvnc_fb* fb, void* userdata)
 
 static struct nvnc_fb* nvnc_fb_pool__acquire_new(struct nvnc_fb_pool* self)
 {
-	struct nvnc_fb* fb = nvnc_fb_new(self->width, self->height,
-			self->fourcc_format, self->stride);
+	struct nvnc_fb* fb = nvnc_fb_pool__alloc(self, 0);
 	if (!fb)
 		return NULL;
 
+	self->stats.misses++;
+
 	nvnc_fb_set_release_fn(fb, nvnc_fb_pool__on_fb_release, self);
 	nvnc_fb_pool_ref(self);
 
@@ -141,20 +213,34 @@ static struct nvnc_fb* nvnc_fb_pool__acquire_from_list(struct nvnc_fb_pool* self
 
 	nvnc_fb_pool_ref(self);
 
+	self->stats.n_free--;
+	self->stats.hits++;
+
 	return fb;
 }
 
 EXPORT
 struct nvnc_fb* nvnc_fb_pool_acquire(struct nvnc_fb_pool* self)
 {
-	return TAILQ_EMPTY(&self->fbs) ?
+	struct nvnc_fb* fb = TAILQ_EMPTY(&self->fbs) ?
 		nvnc_fb_pool__acquire_new(self) :
 		nvnc_fb_pool__acquire_from_list(self);
+	if (!fb)
+		return NULL;
+
+	self->stats.n_in_use++;
+	if (self->stats.n_in_use > self->stats.max_in_use)
+		self->stats.max_in_use = self->stats.n_in_use;
+
+	return fb;
 }
 
 EXPORT
 void nvnc_fb_pool_release(struct nvnc_fb_pool* self, struct nvnc_fb* fb)
 {
+	if (self->stats.n_in_use > 0)
+		self->stats.n_in_use--;
+
 	if (fb->width != self->width || fb->height != self->height ||
 			fb->fourcc_format != self->fourcc_format ||
 			fb->stride != self->stride) {
@@ -162,9 +248,5 @@ void nvnc_fb_pool_release(struct nvnc_fb_pool* self, struct nvnc_fb* fb)
 	}
 
 	nvnc_fb_ref(fb);
-	
-	struct fbq_item* item = calloc(1, sizeof(*item));
-	assert(item);
-	item->fb = fb;
-	TAILQ_INSERT_TAIL(&self->fbs, item, link);
+	nvnc_fb_pool__push(self, fb);
 }
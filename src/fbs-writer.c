@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fbs.h"
+#include "vec.h"
+#include "event-loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <aml.h>
+
+/* A recording that can't keep up with what is sent is stopped rather than
+ * being allowed to eat all the memory.
+ */
+#define FBS_MAX_PENDING_SIZE (64 * 1024 * 1024)
+
+/* Blocks are gathered in one buffer on the event loop while a worker writes
+ * out the other one, so that a slow disk never stalls the loop.
+ */
+struct fbs_writer {
+	FILE* file;
+	uint64_t start_time;
+
+	struct vec pending;
+	struct vec writing;
+
+	bool is_writing;
+	bool is_failed;
+	bool is_closing;
+
+	/* Only touched by the worker until it is done */
+	bool is_write_failed;
+};
+
+static int fbs_writer__schedule(struct fbs_writer* self);
+
+static uint64_t fbs__gettime_ms(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+struct fbs_writer* fbs_writer_open(const char* path)
+{
+	struct fbs_writer* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	if (vec_init(&self->pending, 4096) < 0)
+		goto pending_failure;
+
+	if (vec_init(&self->writing, 4096) < 0)
+		goto writing_failure;
+
+	self->file = fopen(path, "wbe");
+	if (!self->file)
+		goto open_failure;
+
+	if (fputs(FBS_VERSION, self->file) == EOF)
+		goto write_failure;
+
+	self->start_time = fbs__gettime_ms();
+	return self;
+
+write_failure:
+	fclose(self->file);
+	unlink(path);
+open_failure:
+	vec_destroy(&self->writing);
+writing_failure:
+	vec_destroy(&self->pending);
+pending_failure:
+	free(self);
+	return NULL;
+}
+
+static void fbs_writer__destroy(struct fbs_writer* self)
+{
+	fclose(self->file);
+	vec_destroy(&self->writing);
+	vec_destroy(&self->pending);
+	free(self);
+}
+
+void fbs_writer_close(struct fbs_writer* self)
+{
+	if (!self)
+		return;
+
+	/* What is being written still goes to the file. The writer is
+	 * destroyed once the worker is done.
+	 */
+	if (self->is_writing) {
+		self->is_closing = true;
+		return;
+	}
+
+	fbs_writer__destroy(self);
+}
+
+static void do_fbs_write(void* obj)
+{
+	struct fbs_writer* self = aml_get_userdata(obj);
+
+	if (fwrite(self->writing.data, 1, self->writing.len, self->file) !=
+			self->writing.len || fflush(self->file) != 0)
+		self->is_write_failed = true;
+}
+
+static void on_fbs_write_done(void* obj)
+{
+	struct fbs_writer* self = aml_get_userdata(obj);
+
+	self->is_writing = false;
+	self->is_failed = self->is_write_failed;
+	vec_clear(&self->writing);
+
+	if (!self->is_failed && fbs_writer__schedule(self) < 0)
+		self->is_failed = true;
+
+	if (self->is_closing && !self->is_writing)
+		fbs_writer__destroy(self);
+}
+
+static int fbs_writer__schedule(struct fbs_writer* self)
+{
+	if (self->is_writing || self->pending.len == 0)
+		return 0;
+
+	struct aml_work* work = aml_work_new(do_fbs_write, on_fbs_write_done,
+			self, NULL);
+	if (!work)
+		return -1;
+
+	struct vec tmp = self->writing;
+	self->writing = self->pending;
+	self->pending = tmp;
+
+	int rc = aml_start(nvnc__get_loop(), work);
+	aml_unref(work);
+	if (rc < 0) {
+		tmp = self->writing;
+		self->writing = self->pending;
+		self->pending = tmp;
+		return -1;
+	}
+
+	self->is_writing = true;
+	return 0;
+}
+
+int fbs_writer_append(struct fbs_writer* self, const void* data, size_t len)
+{
+	static const uint8_t padding[3] = { 0 };
+
+	if (self->is_failed || len > UINT32_MAX ||
+			self->pending.len + len > FBS_MAX_PENDING_SIZE)
+		return -1;
+
+	uint32_t head = htonl(len);
+	uint32_t timestamp = htonl(fbs__gettime_ms() - self->start_time);
+	size_t pad = (4 - len % 4) % 4;
+
+	if (vec_append(&self->pending, &head, sizeof(head)) < 0 ||
+			vec_append(&self->pending, data, len) < 0 ||
+			vec_append(&self->pending, padding, pad) < 0 ||
+			vec_append(&self->pending, &timestamp,
+				sizeof(timestamp)) < 0)
+		return -1;
+
+	return fbs_writer__schedule(self);
+}
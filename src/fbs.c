@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fbs.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int fbs_reader_open(struct fbs_reader* self, const char* path)
+{
+	memset(self, 0, sizeof(*self));
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < strlen(FBS_VERSION))
+		goto failure;
+
+	void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+
+	self->addr = addr;
+	self->size = st.st_size;
+
+	if (memcmp(self->addr, FBS_VERSION, strlen(FBS_VERSION)) != 0) {
+		fbs_reader_close(self);
+		return -1;
+	}
+
+	/* Blocks are read from front to back */
+	madvise(addr, self->size, MADV_SEQUENTIAL);
+
+	fbs_reader_rewind(self);
+	return 0;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+void fbs_reader_close(struct fbs_reader* self)
+{
+	if (self->addr)
+		munmap((void*)self->addr, self->size);
+	memset(self, 0, sizeof(*self));
+}
+
+void fbs_reader_rewind(struct fbs_reader* self)
+{
+	self->offset = strlen(FBS_VERSION);
+}
+
+static uint32_t fbs__read_u32(const uint8_t* src)
+{
+	uint32_t value;
+	memcpy(&value, src, sizeof(value));
+	return ntohl(value);
+}
+
+int fbs_reader_next(struct fbs_reader* self, struct fbs_block* block)
+{
+	size_t left = self->size - self->offset;
+	if (left == 0)
+		return 0;
+
+	if (left < 4)
+		return -1;
+
+	uint32_t len = fbs__read_u32(self->addr + self->offset);
+	size_t padded_len = ((size_t)len + 3) & ~(size_t)3;
+	if (left - 4 < padded_len + 4)
+		return -1;
+
+	block->data = self->addr + self->offset + 4;
+	block->len = len;
+	block->timestamp = fbs__read_u32(self->addr + self->offset + 4 +
+			padded_len);
+
+	self->offset += 4 + padded_len + 4;
+	return 1;
+}
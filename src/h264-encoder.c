@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "h264-encoder.h"
+#include "neatvnc.h"
+#include "fb.h"
+#include "vec.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <gbm.h>
+#include <libdrm/drm_fourcc.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
+#include <libavutil/opt.h>
+
+/* Open H.264 only allows for the constrained baseline profile */
+#define H264_PROFILE_CONSTRAINED_BASELINE 578
+
+struct h264_encoder {
+	uint32_t width;
+	uint32_t height;
+	uint32_t fourcc_format;
+
+	AVRational timebase;
+	AVRational sample_aspect_ratio;
+
+	/* type: AVHWDeviceContext */
+	AVBufferRef* hw_device_ctx;
+
+	/* type: AVHWFramesContext */
+	AVBufferRef* hw_frames_ctx;
+
+	AVCodecContext* codec_ctx;
+
+	AVFilterGraph* filter_graph;
+	AVFilterContext* filter_in;
+	AVFilterContext* filter_out;
+
+	AVPacket* packet;
+
+	bool next_frame_is_keyframe;
+};
+
+static enum AVPixelFormat drm_to_av_pixel_format(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+		return AV_PIX_FMT_BGR0;
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+		return AV_PIX_FMT_RGB0;
+	case DRM_FORMAT_RGBX8888:
+	case DRM_FORMAT_RGBA8888:
+		return AV_PIX_FMT_0BGR;
+	case DRM_FORMAT_BGRX8888:
+	case DRM_FORMAT_BGRA8888:
+		return AV_PIX_FMT_0RGB;
+	}
+
+	return AV_PIX_FMT_NONE;
+}
+
+static int64_t gettime_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
+static void drm_frame_desc_free(void* opaque, uint8_t* data)
+{
+	AVDRMFrameDescriptor* desc = (AVDRMFrameDescriptor*)data;
+
+	for (int i = 0; i < desc->nb_objects; ++i)
+		if (desc->objects[i].fd >= 0)
+			close(desc->objects[i].fd);
+
+	free(desc);
+}
+
+/* Wraps the buffer object's planes in a DRM PRIME frame, which the filter
+ * graph maps straight into a VA-API surface.
+ */
+static AVFrame* fb_to_avframe(struct nvnc_fb* fb)
+{
+	struct gbm_bo* bo = fb->bo;
+	int n_planes = gbm_bo_get_plane_count(bo);
+
+	if (n_planes > AV_DRM_MAX_PLANES)
+		return NULL;
+
+	AVDRMFrameDescriptor* desc = calloc(1, sizeof(*desc));
+	if (!desc)
+		return NULL;
+
+	desc->nb_objects = n_planes;
+	desc->nb_layers = 1;
+	desc->layers[0].format = gbm_bo_get_format(bo);
+	desc->layers[0].nb_planes = n_planes;
+
+	for (int i = 0; i < n_planes; ++i)
+		desc->objects[i].fd = -1;
+
+	for (int i = 0; i < n_planes; ++i) {
+		uint32_t stride = gbm_bo_get_stride_for_plane(bo, i);
+
+		desc->objects[i].fd = gbm_bo_get_fd_for_plane(bo, i);
+		if (desc->objects[i].fd < 0)
+			goto fd_failure;
+
+		desc->objects[i].size = stride * fb->height;
+		desc->objects[i].format_modifier = gbm_bo_get_modifier(bo);
+
+		desc->layers[0].planes[i].object_index = i;
+		desc->layers[0].planes[i].offset = gbm_bo_get_offset(bo, i);
+		desc->layers[0].planes[i].pitch = stride;
+	}
+
+	AVFrame* frame = av_frame_alloc();
+	if (!frame)
+		goto fd_failure;
+
+	AVBufferRef* desc_ref = av_buffer_create((uint8_t*)desc, sizeof(*desc),
+			drm_frame_desc_free, NULL, 0);
+	if (!desc_ref)
+		goto buffer_failure;
+
+	frame->width = fb->width;
+	frame->height = fb->height;
+	frame->format = AV_PIX_FMT_DRM_PRIME;
+	frame->sample_aspect_ratio = (AVRational){ 1, 1 };
+	frame->buf[0] = desc_ref;
+	frame->data[0] = desc_ref->data;
+
+	return frame;
+
+buffer_failure:
+	av_frame_free(&frame);
+fd_failure:
+	drm_frame_desc_free(NULL, (uint8_t*)desc);
+	return NULL;
+}
+
+static int h264_encoder__init_hw_frames_context(struct h264_encoder* self)
+{
+	self->hw_frames_ctx = av_hwframe_ctx_alloc(self->hw_device_ctx);
+	if (!self->hw_frames_ctx)
+		return -1;
+
+	AVHWFramesContext* c = (AVHWFramesContext*)self->hw_frames_ctx->data;
+	c->format = AV_PIX_FMT_DRM_PRIME;
+	c->sw_format = drm_to_av_pixel_format(self->fourcc_format);
+	c->width = self->width;
+	c->height = self->height;
+
+	if (av_hwframe_ctx_init(self->hw_frames_ctx) < 0) {
+		av_buffer_unref(&self->hw_frames_ctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int h264_encoder__init_buffersrc(struct h264_encoder* self)
+{
+	/* The real parameters are set below; these only need to get past the
+	 * argument checks.
+	 */
+	int rc = avfilter_graph_create_filter(&self->filter_in,
+			avfilter_get_by_name("buffer"), "in",
+			"width=1:height=1:pix_fmt=drm_prime:time_base=1/1",
+			NULL, self->filter_graph);
+	if (rc < 0)
+		return -1;
+
+	AVBufferSrcParameters* params = av_buffersrc_parameters_alloc();
+	if (!params)
+		return -1;
+
+	params->format = AV_PIX_FMT_DRM_PRIME;
+	params->width = self->width;
+	params->height = self->height;
+	params->sample_aspect_ratio = self->sample_aspect_ratio;
+	params->time_base = self->timebase;
+	params->hw_frames_ctx = self->hw_frames_ctx;
+
+	rc = av_buffersrc_parameters_set(self->filter_in, params);
+	av_free(params);
+
+	return rc < 0 ? -1 : 0;
+}
+
+/* Maps the frame into VA-API and converts it to NV12 on the GPU */
+static int h264_encoder__init_filters(struct h264_encoder* self)
+{
+	self->filter_graph = avfilter_graph_alloc();
+	if (!self->filter_graph)
+		return -1;
+
+	if (h264_encoder__init_buffersrc(self) < 0)
+		goto failure;
+
+	int rc = avfilter_graph_create_filter(&self->filter_out,
+			avfilter_get_by_name("buffersink"), "out", NULL, NULL,
+			self->filter_graph);
+	if (rc < 0)
+		goto failure;
+
+	AVFilterInOut* inputs = avfilter_inout_alloc();
+	AVFilterInOut* outputs = avfilter_inout_alloc();
+	if (!inputs || !outputs) {
+		avfilter_inout_free(&inputs);
+		avfilter_inout_free(&outputs);
+		goto failure;
+	}
+
+	inputs->name = av_strdup("in");
+	inputs->filter_ctx = self->filter_in;
+	inputs->pad_idx = 0;
+	inputs->next = NULL;
+
+	outputs->name = av_strdup("out");
+	outputs->filter_ctx = self->filter_out;
+	outputs->pad_idx = 0;
+	outputs->next = NULL;
+
+	rc = avfilter_graph_parse_ptr(self->filter_graph,
+			"hwmap=mode=direct:derive_device=vaapi"
+			",scale_vaapi=format=nv12:mode=fast",
+			&outputs, &inputs, NULL);
+	avfilter_inout_free(&inputs);
+	avfilter_inout_free(&outputs);
+	if (rc < 0)
+		goto failure;
+
+	for (unsigned int i = 0; i < self->filter_graph->nb_filters; ++i)
+		self->filter_graph->filters[i]->hw_device_ctx =
+			av_buffer_ref(self->hw_device_ctx);
+
+	if (avfilter_graph_config(self->filter_graph, NULL) < 0)
+		goto failure;
+
+	return 0;
+
+failure:
+	avfilter_graph_free(&self->filter_graph);
+	return -1;
+}
+
+static int h264_encoder__init_codec_context(struct h264_encoder* self,
+		const AVCodec* codec)
+{
+	self->codec_ctx = avcodec_alloc_context3(codec);
+	if (!self->codec_ctx)
+		return -1;
+
+	AVCodecContext* c = self->codec_ctx;
+	c->width = self->width;
+	c->height = self->height;
+	c->time_base = self->timebase;
+	c->sample_aspect_ratio = self->sample_aspect_ratio;
+	c->pix_fmt = AV_PIX_FMT_VAAPI;
+	c->gop_size = INT32_MAX; /* Key frames are picked by hand */
+	c->max_b_frames = 0; /* B-frames add a frame of latency */
+	c->profile = H264_PROFILE_CONSTRAINED_BASELINE;
+
+	AVBufferRef* frames_ctx = av_buffersink_get_hw_frames_ctx(
+			self->filter_out);
+	if (!frames_ctx)
+		return -1;
+
+	c->hw_frames_ctx = av_buffer_ref(frames_ctx);
+	return c->hw_frames_ctx ? 0 : -1;
+}
+
+struct h264_encoder* h264_encoder_create(uint32_t width, uint32_t height,
+		uint32_t fourcc_format)
+{
+	if (drm_to_av_pixel_format(fourcc_format) == AV_PIX_FMT_NONE) {
+		log_debug("Unsupported pixel format for H.264: %x\n",
+				fourcc_format);
+		return NULL;
+	}
+
+	const AVCodec* codec = avcodec_find_encoder_by_name("h264_vaapi");
+	if (!codec) {
+		log_error("The h264_vaapi encoder is not available\n");
+		return NULL;
+	}
+
+	struct h264_encoder* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->width = width;
+	self->height = height;
+	self->fourcc_format = fourcc_format;
+	self->timebase = (AVRational){ 1, 1000000 };
+	self->sample_aspect_ratio = (AVRational){ 1, 1 };
+	self->next_frame_is_keyframe = true;
+
+	if (av_hwdevice_ctx_create(&self->hw_device_ctx, AV_HWDEVICE_TYPE_DRM,
+				NULL, NULL, 0) < 0)
+		goto hw_device_failure;
+
+	if (h264_encoder__init_hw_frames_context(self) < 0)
+		goto hw_frames_failure;
+
+	if (h264_encoder__init_filters(self) < 0)
+		goto filter_failure;
+
+	if (h264_encoder__init_codec_context(self, codec) < 0)
+		goto codec_context_failure;
+
+	/* Each frame must come out before the next one goes in */
+	AVDictionary* opts = NULL;
+	av_dict_set_int(&opts, "async_depth", 1, 0);
+	int rc = avcodec_open2(self->codec_ctx, codec, &opts);
+	av_dict_free(&opts);
+	if (rc < 0)
+		goto codec_context_failure;
+
+	self->packet = av_packet_alloc();
+	if (!self->packet)
+		goto packet_failure;
+
+	return self;
+
+packet_failure:
+codec_context_failure:
+	avcodec_free_context(&self->codec_ctx);
+	avfilter_graph_free(&self->filter_graph);
+filter_failure:
+	av_buffer_unref(&self->hw_frames_ctx);
+hw_frames_failure:
+	av_buffer_unref(&self->hw_device_ctx);
+hw_device_failure:
+	log_error("Failed to set up H.264 encoding\n");
+	free(self);
+	return NULL;
+}
+
+void h264_encoder_destroy(struct h264_encoder* self)
+{
+	if (!self)
+		return;
+
+	av_packet_free(&self->packet);
+	avcodec_free_context(&self->codec_ctx);
+	avfilter_graph_free(&self->filter_graph);
+	av_buffer_unref(&self->hw_frames_ctx);
+	av_buffer_unref(&self->hw_device_ctx);
+	free(self);
+}
+
+void h264_encoder_request_keyframe(struct h264_encoder* self)
+{
+	self->next_frame_is_keyframe = true;
+}
+
+static int h264_encoder__receive_packets(struct h264_encoder* self,
+		struct vec* dst)
+{
+	while (1) {
+		int rc = avcodec_receive_packet(self->codec_ctx, self->packet);
+		if (rc == AVERROR(EAGAIN))
+			return 0;
+		if (rc < 0)
+			return -1;
+
+		rc = vec_append(dst, self->packet->data, self->packet->size);
+		av_packet_unref(self->packet);
+		if (rc < 0)
+			return -1;
+	}
+}
+
+int h264_encoder_encode(struct h264_encoder* self, struct nvnc_fb* fb,
+		struct vec* dst)
+{
+	assert(fb->type == NVNC_FB_GBM_BO);
+	assert(fb->width == self->width && fb->height == self->height);
+
+	AVFrame* frame = fb_to_avframe(fb);
+	if (!frame)
+		return -1;
+
+	frame->hw_frames_ctx = av_buffer_ref(self->hw_frames_ctx);
+	frame->pts = gettime_us();
+
+	/* The encoder turns a forced I-frame into an IDR frame */
+	frame->pict_type = self->next_frame_is_keyframe ?
+		AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+	AVFrame* filtered = av_frame_alloc();
+	if (!filtered)
+		goto filtered_failure;
+
+	int rc = av_buffersrc_add_frame_flags(self->filter_in, frame,
+			AV_BUFFERSRC_FLAG_KEEP_REF);
+	if (rc < 0)
+		goto failure;
+
+	rc = av_buffersink_get_frame(self->filter_out, filtered);
+	if (rc < 0)
+		goto failure;
+
+	filtered->pict_type = frame->pict_type;
+
+	rc = avcodec_send_frame(self->codec_ctx, filtered);
+	if (rc < 0)
+		goto failure;
+
+	if (h264_encoder__receive_packets(self, dst) < 0)
+		goto failure;
+
+	self->next_frame_is_keyframe = false;
+
+	av_frame_free(&filtered);
+	av_frame_free(&frame);
+	return 0;
+
+failure:
+	av_frame_free(&filtered);
+filtered_failure:
+	av_frame_free(&frame);
+	/* The client never sees this frame, so the next one can't refer to it */
+	self->next_frame_is_keyframe = true;
+	log_error("Failed to encode an H.264 frame\n");
+	return -1;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "open-h264.h"
+#include "h264-encoder.h"
+#include "rfb-proto.h"
+#include "neatvnc.h"
+#include "fb.h"
+#include "vec.h"
+#include "enc-util.h"
+#include "buf-pool.h"
+#include "event-loop.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <aml.h>
+
+struct open_h264 {
+	struct h264_encoder* encoder;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fourcc_format;
+
+	/* The client must drop its decoder state before the next frame */
+	bool needs_reset;
+	/* Set on the main thread and taken by the worker */
+	atomic_bool is_keyframe_requested;
+	bool failed;
+
+	struct buf_pool* frame_pool;
+	struct vec frame;
+	size_t head_index;
+	struct nvnc_fb* fb;
+
+	open_h264_done_fn on_done;
+	void* userdata;
+};
+
+struct open_h264* open_h264_new(struct buf_pool* frame_pool)
+{
+	struct open_h264* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->frame_pool = frame_pool;
+	buf_pool_ref(frame_pool);
+
+	return self;
+}
+
+void open_h264_destroy(struct open_h264* self)
+{
+	if (!self)
+		return;
+
+	h264_encoder_destroy(self->encoder);
+	buf_pool_unref(self->frame_pool);
+	free(self);
+}
+
+void open_h264_request_keyframe(struct open_h264* self)
+{
+	atomic_store(&self->is_keyframe_requested, true);
+}
+
+static void do_open_h264_work(void* obj)
+{
+	struct open_h264* self = aml_get_userdata(obj);
+	struct nvnc_fb* fb = self->fb;
+
+	/* Setting up VA-API takes a while, so it doesn't happen on the main
+	 * thread either.
+	 */
+	if (!self->encoder) {
+		self->encoder = h264_encoder_create(fb->width, fb->height,
+				fb->fourcc_format);
+		if (!self->encoder) {
+			self->failed = true;
+			return;
+		}
+
+		self->width = fb->width;
+		self->height = fb->height;
+		self->fourcc_format = fb->fourcc_format;
+		self->needs_reset = true;
+	}
+
+	bool is_keyframe = atomic_exchange(&self->is_keyframe_requested,
+			false);
+	if (is_keyframe)
+		h264_encoder_request_keyframe(self->encoder);
+
+	size_t data_index = self->frame.len;
+	if (h264_encoder_encode(self->encoder, fb, &self->frame) < 0 ||
+			self->frame.len == data_index) {
+		/* The request still stands for the next frame */
+		if (is_keyframe)
+			atomic_store(&self->is_keyframe_requested, true);
+		self->failed = true;
+	}
+}
+
+static void on_open_h264_work_done(void* obj)
+{
+	struct open_h264* self = aml_get_userdata(obj);
+
+	nvnc_fb_release(self->fb);
+	nvnc_fb_unref(self->fb);
+	self->fb = NULL;
+
+	if (self->failed) {
+		vec_destroy(&self->frame);
+		self->on_done(NULL, self->userdata);
+		return;
+	}
+
+	struct rfb_open_h264_msg_head head = {
+		.length = htonl(self->frame.len - self->head_index -
+				sizeof(head)),
+		.flags = htonl(self->needs_reset ?
+				RFB_OPEN_H264_RESET_CONTEXT : 0),
+	};
+	memcpy((uint8_t*)self->frame.data + self->head_index, &head,
+			sizeof(head));
+
+	self->needs_reset = false;
+
+	self->on_done(&self->frame, self->userdata);
+}
+
+int open_h264_encode_frame(struct open_h264* self, struct nvnc_fb* fb,
+		open_h264_done_fn on_done, void* userdata)
+{
+	if (fb->type != NVNC_FB_GBM_BO)
+		return -1;
+
+	/* A new encoder is made for the new size or format once the work
+	 * gets to it.
+	 */
+	if (self->encoder && (fb->width != self->width ||
+				fb->height != self->height ||
+				fb->fourcc_format != self->fourcc_format)) {
+		h264_encoder_destroy(self->encoder);
+		self->encoder = NULL;
+	}
+
+	if (buf_pool_acquire(self->frame_pool, &self->frame, 0) < 0)
+		return -1;
+
+	encode_rect_count(&self->frame, 1);
+	encode_rect_head(&self->frame, RFB_ENCODING_OPEN_H264, 0, 0,
+			fb->width, fb->height);
+
+	self->head_index = self->frame.len;
+	if (!vec_append_zero(&self->frame, sizeof(struct rfb_open_h264_msg_head)))
+		goto failure;
+
+	struct aml_work* work = aml_work_new(do_open_h264_work,
+			on_open_h264_work_done, self, NULL);
+	if (!work)
+		goto failure;
+
+	self->fb = fb;
+	self->failed = false;
+	self->on_done = on_done;
+	self->userdata = userdata;
+
+	/* The compositor must not draw into the buffer while the GPU reads it */
+	nvnc_fb_ref(fb);
+	nvnc_fb_hold(fb);
+
+	int rc = aml_start(nvnc__get_loop(), work);
+	aml_unref(work);
+	if (rc < 0) {
+		nvnc_fb_release(fb);
+		nvnc_fb_unref(fb);
+		self->fb = NULL;
+		goto failure;
+	}
+
+	return 0;
+
+failure:
+	vec_destroy(&self->frame);
+	return -1;
+}
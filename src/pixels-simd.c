@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Vectorised versions of the pixel32_to_cpixel() inner loop.
+ *
+ * Every kernel evaluates exactly the same shift/mask expression as the scalar
+ * code, only several pixels at a time, and then uses a byte shuffle to pack
+ * the resulting 32 bit values down to 4, 3, 2 or 1 byte cpixels in the
+ * requested byte order. This covers plain channel swizzles as well as the
+ * 24 bit, RGB565 and BGR233 cases with one code path.
+ *
+ * Kernels only process whole vectors and return the number of pixels that
+ * were converted. The caller finishes the tail with the scalar loop.
+ */
+
+#include "pixels.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+void cpixel_conv_init_shuffle(struct cpixel_conv* conv, bool big_endian)
+{
+	size_t bpp = conv->bytes_per_cpixel;
+
+	memset(conv->shuffle, 0x80, sizeof(conv->shuffle));
+
+	for (size_t i = 0; i < 4; ++i)
+		for (size_t k = 0; k < bpp; ++k)
+			conv->shuffle[i * bpp + k] =
+				i * 4 + (big_endian ? bpp - 1 - k : k);
+}
+
+#ifdef HAVE_X86_SIMD
+
+#define SSE_TARGET __attribute__((target("sse4.1")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+static inline SSE_TARGET void store_packed_128(uint8_t* dst, __m128i v,
+		size_t n_bytes)
+{
+	uint32_t tail;
+
+	switch (n_bytes) {
+	case 16:
+		_mm_storeu_si128((__m128i*)dst, v);
+		break;
+	case 12:
+		_mm_storel_epi64((__m128i*)dst, v);
+		tail = _mm_extract_epi32(v, 2);
+		memcpy(dst + 8, &tail, 4);
+		break;
+	case 8:
+		_mm_storel_epi64((__m128i*)dst, v);
+		break;
+	case 4:
+		tail = _mm_cvtsi128_si32(v);
+		memcpy(dst, &tail, 4);
+		break;
+	}
+}
+
+static inline SSE_TARGET __m128i convert_128(__m128i px,
+		const struct cpixel_conv* conv)
+{
+	__m128i cpx = _mm_setzero_si128();
+
+	for (int c = 0; c < 3; ++c) {
+		__m128i v = _mm_srl_epi32(px,
+				_mm_cvtsi32_si128(conv->src_shift[c]));
+		v = _mm_and_si128(v, _mm_set1_epi32(conv->src_max[c]));
+		v = _mm_sll_epi32(v, _mm_cvtsi32_si128(conv->dst_bits[c]));
+		v = _mm_srl_epi32(v, _mm_cvtsi32_si128(conv->src_bits[c]));
+		v = _mm_sll_epi32(v, _mm_cvtsi32_si128(conv->dst_shift[c]));
+		cpx = _mm_or_si128(cpx, v);
+	}
+
+	return cpx;
+}
+
+static SSE_TARGET size_t pixel32_to_cpixel_sse41(uint8_t* restrict dst,
+		const uint32_t* restrict src, const struct cpixel_conv* conv,
+		size_t len)
+{
+	size_t n_bytes = conv->bytes_per_cpixel * 4;
+	__m128i shuffle = _mm_loadu_si128((const __m128i*)conv->shuffle);
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i cpx = convert_128(px, conv);
+		cpx = _mm_shuffle_epi8(cpx, shuffle);
+		store_packed_128(dst, cpx, n_bytes);
+		dst += n_bytes;
+	}
+
+	return i;
+}
+
+static inline AVX2_TARGET __m256i convert_256(__m256i px,
+		const struct cpixel_conv* conv)
+{
+	__m256i cpx = _mm256_setzero_si256();
+
+	for (int c = 0; c < 3; ++c) {
+		__m256i v = _mm256_srl_epi32(px,
+				_mm_cvtsi32_si128(conv->src_shift[c]));
+		v = _mm256_and_si256(v, _mm256_set1_epi32(conv->src_max[c]));
+		v = _mm256_sll_epi32(v, _mm_cvtsi32_si128(conv->dst_bits[c]));
+		v = _mm256_srl_epi32(v, _mm_cvtsi32_si128(conv->src_bits[c]));
+		v = _mm256_sll_epi32(v, _mm_cvtsi32_si128(conv->dst_shift[c]));
+		cpx = _mm256_or_si256(cpx, v);
+	}
+
+	return cpx;
+}
+
+static AVX2_TARGET size_t pixel32_to_cpixel_avx2(uint8_t* restrict dst,
+		const uint32_t* restrict src, const struct cpixel_conv* conv,
+		size_t len)
+{
+	size_t n_bytes = conv->bytes_per_cpixel * 4;
+	__m256i shuffle = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i*)conv->shuffle));
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		__m256i px = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i cpx = convert_256(px, conv);
+
+		// The shuffle works within each 128 bit lane
+		cpx = _mm256_shuffle_epi8(cpx, shuffle);
+
+		store_packed_128(dst, _mm256_castsi256_si128(cpx), n_bytes);
+		dst += n_bytes;
+		store_packed_128(dst, _mm256_extracti128_si256(cpx, 1),
+				n_bytes);
+		dst += n_bytes;
+	}
+
+	return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+#ifdef HAVE_NEON
+
+static inline void store_packed_neon(uint8_t* dst, uint8x16_t v,
+		size_t n_bytes)
+{
+	switch (n_bytes) {
+	case 16:
+		vst1q_u8(dst, v);
+		break;
+	case 12:
+		vst1_u8(dst, vget_low_u8(v));
+		vst1q_lane_u32((uint32_t*)(void*)(dst + 8),
+				vreinterpretq_u32_u8(v), 2);
+		break;
+	case 8:
+		vst1_u8(dst, vget_low_u8(v));
+		break;
+	case 4:
+		vst1q_lane_u32((uint32_t*)(void*)dst,
+				vreinterpretq_u32_u8(v), 0);
+		break;
+	}
+}
+
+static size_t pixel32_to_cpixel_neon(uint8_t* restrict dst,
+		const uint32_t* restrict src, const struct cpixel_conv* conv,
+		size_t len)
+{
+	size_t n_bytes = conv->bytes_per_cpixel * 4;
+	uint8x16_t shuffle = vld1q_u8(conv->shuffle);
+	int32x4_t src_shift[3], dst_bits[3], src_bits[3], dst_shift[3];
+	uint32x4_t src_max[3];
+	size_t i;
+
+	// Negative shift counts shift to the right
+	for (int c = 0; c < 3; ++c) {
+		src_shift[c] = vdupq_n_s32(-(int32_t)conv->src_shift[c]);
+		src_max[c] = vdupq_n_u32(conv->src_max[c]);
+		dst_bits[c] = vdupq_n_s32(conv->dst_bits[c]);
+		src_bits[c] = vdupq_n_s32(-(int32_t)conv->src_bits[c]);
+		dst_shift[c] = vdupq_n_s32(conv->dst_shift[c]);
+	}
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		uint32x4_t px = vld1q_u32(src + i);
+		uint32x4_t cpx = vdupq_n_u32(0);
+
+		for (int c = 0; c < 3; ++c) {
+			uint32x4_t v = vshlq_u32(px, src_shift[c]);
+			v = vandq_u32(v, src_max[c]);
+			v = vshlq_u32(v, dst_bits[c]);
+			v = vshlq_u32(v, src_bits[c]);
+			v = vshlq_u32(v, dst_shift[c]);
+			cpx = vorrq_u32(cpx, v);
+		}
+
+		uint8x16_t packed = vqtbl1q_u8(vreinterpretq_u8_u32(cpx),
+				shuffle);
+		store_packed_neon(dst, packed, n_bytes);
+		dst += n_bytes;
+	}
+
+	return i;
+}
+
+#endif /* HAVE_NEON */
+
+static pixel32_to_cpixel_kernel_fn select_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return pixel32_to_cpixel_avx2;
+
+	if (__builtin_cpu_supports("sse4.1"))
+		return pixel32_to_cpixel_sse41;
+#endif
+
+#ifdef HAVE_NEON
+	return pixel32_to_cpixel_neon;
+#endif
+
+	return NULL;
+}
+
+pixel32_to_cpixel_kernel_fn pixel32_to_cpixel_kernel;
+
+/* The CPU does not change while we are running, so the kernel is picked
+ * once when the library is loaded and encoder threads can read the pointer
+ * without any synchronisation.
+ */
+static void __attribute__((constructor)) pixel32_to_cpixel_kernel_init(void)
+{
+	pixel32_to_cpixel_kernel = select_kernel();
+}
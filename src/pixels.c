@@ -58,6 +58,41 @@ void pixel32_to_cpixel(uint8_t* restrict dst,
 
 	uint32_t dst_endian_correction;
 
+	/* 24 bit cpixels are packed from the lowest used bits of the pixel */
+	if (bytes_per_cpixel == 3 && dst_fmt->bits_per_pixel == 32 &&
+			dst_fmt->depth <= 24) {
+		uint32_t min_dst_shift = dst_red_shift;
+		if (min_dst_shift > dst_green_shift)
+			min_dst_shift = dst_green_shift;
+		if (min_dst_shift > dst_blue_shift)
+			min_dst_shift = dst_blue_shift;
+
+		dst_red_shift -= min_dst_shift;
+		dst_green_shift -= min_dst_shift;
+		dst_blue_shift -= min_dst_shift;
+	}
+
+	if (pixel32_to_cpixel_kernel && len >= 4) {
+		struct cpixel_conv conv = {
+			.src_shift = { src_red_shift, src_green_shift,
+				src_blue_shift },
+			.src_max = { src_red_max, src_green_max, src_blue_max },
+			.src_bits = { src_red_bits, src_green_bits,
+				src_blue_bits },
+			.dst_bits = { dst_red_bits, dst_green_bits,
+				dst_blue_bits },
+			.dst_shift = { dst_red_shift, dst_green_shift,
+				dst_blue_shift },
+			.bytes_per_cpixel = bytes_per_cpixel,
+		};
+		cpixel_conv_init_shuffle(&conv, dst_fmt->big_endian_flag);
+
+		size_t done = pixel32_to_cpixel_kernel(dst, src, &conv, len);
+		dst += done * bytes_per_cpixel;
+		src += done;
+		len -= done;
+	}
+
 #define CONVERT_PIXELS(cpx, px)                                                \
 	{                                                                      \
 		uint32_t r, g, b;                                              \
@@ -97,18 +132,6 @@ void pixel32_to_cpixel(uint8_t* restrict dst,
 		}
 		break;
 	case 3:
-		if (dst_fmt->bits_per_pixel == 32 && dst_fmt->depth <= 24) {
-			uint32_t min_dst_shift = dst_red_shift;
-			if (min_dst_shift > dst_green_shift)
-				min_dst_shift = dst_green_shift;
-			if (min_dst_shift > dst_blue_shift)
-				min_dst_shift = dst_blue_shift;
-
-			dst_red_shift -= min_dst_shift;
-			dst_green_shift -= min_dst_shift;
-			dst_blue_shift -= min_dst_shift;
-		}
-
 		dst_endian_correction = dst_fmt->big_endian_flag ? 16 : 0;
 
 		while (len--) {
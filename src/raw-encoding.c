@@ -21,79 +21,166 @@
 #include "pixels.h"
 #include "raw-encoding.h"
 #include "enc-util.h"
+#include "transform-util.h"
+#include "region-simplify.h"
 
+#include <stdlib.h>
+#include <stdint.h>
 #include <pixman.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
 
+/* Transformed buffers are read this many rows at a time */
+#define RAW_STRIP_HEIGHT 16
+
+static void raw_encode_rows(uint8_t* dst,
+                            const struct rfb_pixel_format* dst_fmt,
+                            const uint32_t* src, int stride,
+                            const struct rfb_pixel_format* src_fmt,
+                            int width, int height)
+{
+	int bpp = dst_fmt->bits_per_pixel / 8;
+
+	for (int y = 0; y < height; ++y)
+		pixel32_to_cpixel(dst + y * width * bpp, dst_fmt,
+		                  src + y * stride, src_fmt, bpp, width);
+}
+
+/* Writes the pixels of the box without a rectangle header in front */
 static int raw_encode_box(struct vec* dst,
                           const struct rfb_pixel_format* dst_fmt,
                           const struct nvnc_fb* fb,
                           const struct rfb_pixel_format* src_fmt, int x_start,
-                          int y_start, int stride, int width, int height)
+                          int y_start, int width, int height)
 {
 	int rc = -1;
+	int bpp = dst_fmt->bits_per_pixel / 8;
 
-	rc = encode_rect_head(dst, RFB_ENCODING_RAW, x_start, y_start, width,
-			height);
+	rc = vec_reserve(dst, width * height * bpp + dst->len);
 	if (rc < 0)
 		return -1;
 
-	uint32_t* b = fb->addr;
+	uint8_t* d = (uint8_t*)dst->data + dst->len;
 
-	int bpp = dst_fmt->bits_per_pixel / 8;
+	if (fb->transform == NVNC_TRANSFORM_NORMAL) {
+		uint32_t* b = fb->addr;
+		raw_encode_rows(d, dst_fmt, b + x_start + y_start * fb->stride,
+		                fb->stride, src_fmt, width, height);
+		dst->len += width * height * bpp;
+		return 0;
+	}
 
-	rc = vec_reserve(dst, width * height * bpp + dst->len);
-	if (rc < 0)
+	uint32_t* strip = malloc(width * RAW_STRIP_HEIGHT * 4);
+	if (!strip)
 		return -1;
 
-	uint8_t* d = dst->data;
+	for (int y = 0; y < height; y += RAW_STRIP_HEIGHT) {
+		int strip_height = MIN(RAW_STRIP_HEIGHT, height - y);
 
-	for (int y = y_start; y < y_start + height; ++y) {
-		pixel32_to_cpixel(d + dst->len, dst_fmt,
-		                  b + x_start + y * stride, src_fmt,
-		                  bpp, width);
-		dst->len += width * bpp;
+		nvnc_transform_read_rect(strip, width, fb, x_start, y_start + y,
+		                         width, strip_height);
+		raw_encode_rows(d + y * width * bpp, dst_fmt, strip, width,
+		                src_fmt, width, strip_height);
 	}
 
+	dst->len += width * height * bpp;
+	free(strip);
 	return 0;
 }
 
-int raw_encode_frame(struct vec* dst, const struct rfb_pixel_format* dst_fmt,
-                     struct nvnc_fb* src,
-                     const struct rfb_pixel_format* src_fmt,
-                     struct pixman_region16* region)
+int raw_frame_init(struct raw_frame* self,
+                   const struct rfb_pixel_format* dst_fmt,
+                   struct pixman_region16* region)
 {
-	int rc = -1;
+	/* Every pixel in between is sent as it is, so boxes are only merged
+	 * when the gap costs less than a rectangle header.
+	 */
+	struct region_cost cost = {
+		.rect = sizeof(struct rfb_server_fb_rect),
+		.pixel = dst_fmt->bits_per_pixel / 8,
+	};
+
+	self->box_index = 0;
+	self->row = 0;
+
+	return region_simplify(&self->boxes, region, &cost);
+}
 
-	int n_rects = 0;
-	struct pixman_box16* box = pixman_region_rectangles(region, &n_rects);
-	if (n_rects > UINT16_MAX) {
-		box = pixman_region_extents(region);
-		n_rects = 1;
-	}
+void raw_frame_finish(struct raw_frame* self)
+{
+	region_boxes_finish(&self->boxes);
+}
 
-	rc = nvnc_fb_map(src);
-	if (rc < 0)
-		return -1;
+int raw_frame_encode(struct raw_frame* self, struct vec* dst,
+                     const struct rfb_pixel_format* dst_fmt,
+                     struct nvnc_fb* src,
+                     const struct rfb_pixel_format* src_fmt, size_t max_size)
+{
+	int bpp = dst_fmt->bits_per_pixel / 8;
 
-	rc = vec_reserve(dst, src->width * src->height * 4);
-	if (rc < 0)
+	if (nvnc_fb_map(src) < 0)
 		return -1;
 
-	rc = encode_rect_count(dst, n_rects);
-	if (rc < 0)
+	/* The count is filled in when the part is done */
+	size_t head_index = dst->len;
+	if (encode_rect_count(dst, 0) < 0)
 		return -1;
 
-	for (int i = 0; i < n_rects; ++i) {
-		int x = box[i].x1;
-		int y = box[i].y1;
-		int box_width = box[i].x2 - x;
-		int box_height = box[i].y2 - y;
+	uint32_t n_rects = 0;
+
+	while (self->box_index < self->boxes.n_boxes) {
+		struct pixman_box16* box = &self->boxes.boxes[self->box_index];
+		int x = box->x1;
+		int box_width = box->x2 - x;
+		int box_height = box->y2 - box->y1;
+
+		/* At least one row goes into each part. A box that is split
+		 * between parts gets a rectangle in each of them.
+		 */
+		size_t row_size = box_width * bpp;
+		size_t room = max_size > dst->len ? max_size - dst->len : 0;
+		int n_rows = MIN(MAX(room / MAX(row_size, 1), 1),
+				(size_t)(box_height - self->row));
+
+		if (encode_rect_head(dst, RFB_ENCODING_RAW, x,
+					box->y1 + self->row, box_width,
+					n_rows) < 0)
+			return -1;
 
-		rc = raw_encode_box(dst, dst_fmt, src, src_fmt, x, y,
-		                    src->stride, box_width, box_height);
-		if (rc < 0)
+		if (raw_encode_box(dst, dst_fmt, src, src_fmt, x,
+					box->y1 + self->row, box_width,
+					n_rows) < 0)
 			return -1;
+
+		++n_rects;
+
+		self->row += n_rows;
+		if (self->row == box_height) {
+			self->row = 0;
+			self->box_index++;
+		}
+
+		if (dst->len >= max_size)
+			break;
 	}
 
-	return 0;
+	struct rfb_server_fb_update_msg* head =
+		(void*)((uint8_t*)dst->data + head_index);
+	head->n_rects = htons(n_rects);
+
+	return self->box_index < self->boxes.n_boxes ? 1 : 0;
+}
+
+int raw_encode_frame(struct vec* dst, const struct rfb_pixel_format* dst_fmt,
+                     struct nvnc_fb* src,
+                     const struct rfb_pixel_format* src_fmt,
+                     struct pixman_region16* region)
+{
+	struct raw_frame frame;
+	if (raw_frame_init(&frame, dst_fmt, region) < 0)
+		return -1;
+
+	int rc = raw_frame_encode(&frame, dst, dst_fmt, src, src_fmt, SIZE_MAX);
+	raw_frame_finish(&frame);
+	return rc;
 }
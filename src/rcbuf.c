@@ -33,6 +33,31 @@ struct rcbuf* rcbuf_new(void* payload, size_t size)
 	return self;
 }
 
+struct rcbuf* rcbuf_new_with_free_fn(void* payload, size_t size,
+		rcbuf_free_fn free_fn, void* userdata)
+{
+	struct rcbuf* self = rcbuf_new(payload, size);
+	if (!self)
+		return NULL;
+
+	self->free_fn = free_fn;
+	self->free_userdata = userdata;
+
+	return self;
+}
+
+void rcbuf_init_with_free_fn(struct rcbuf* self, void* payload, size_t size,
+		rcbuf_free_fn free_fn, void* userdata)
+{
+	memset(self, 0, sizeof(*self));
+	self->ref = 1;
+	self->payload = payload;
+	self->size = size;
+	self->free_fn = free_fn;
+	self->free_userdata = userdata;
+	self->is_embedded = true;
+}
+
 struct rcbuf* rcbuf_from_string(const char* str)
 {
 	char* value = strdup(str);
@@ -66,6 +91,16 @@ void rcbuf_unref(struct rcbuf* self)
 	if (--self->ref > 0)
 		return;
 
-	free(self->payload);
+	/* free_fn may release the object that an embedded rcbuf is part of */
+	if (self->is_embedded) {
+		self->free_fn(self->payload, self->free_userdata);
+		return;
+	}
+
+	if (self->free_fn)
+		self->free_fn(self->payload, self->free_userdata);
+	else
+		free(self->payload);
+
 	free(self);
 }
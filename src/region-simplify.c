@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "region-simplify.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/param.h>
+
+/* Boxes that a new box is tried against. Pixman's boxes come in bands from
+ * top to bottom, so only the most recent ones are likely to be close by.
+ */
+#define REGION_SIMPLIFY_MAX_OPEN 32
+
+static int64_t box_area(const struct pixman_box16* box)
+{
+	return (int64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+static struct pixman_box16 box_union(const struct pixman_box16* a,
+		const struct pixman_box16* b)
+{
+	return (struct pixman_box16){
+		.x1 = MIN(a->x1, b->x1),
+		.y1 = MIN(a->y1, b->y1),
+		.x2 = MAX(a->x2, b->x2),
+		.y2 = MAX(a->y2, b->y2),
+	};
+}
+
+static int64_t box_overlap(const struct pixman_box16* a,
+		const struct pixman_box16* b)
+{
+	int width = MIN(a->x2, b->x2) - MAX(a->x1, b->x1);
+	int height = MIN(a->y2, b->y2) - MAX(a->y1, b->y1);
+	return width > 0 && height > 0 ? (int64_t)width * height : 0;
+}
+
+/* What is saved by encoding the bounding box instead of both boxes. The
+ * pixels in between are encoded for nothing, but there is one rectangle less.
+ */
+static int64_t merge_gain(const struct region_cost* cost,
+		const struct pixman_box16* a, const struct pixman_box16* b)
+{
+	struct pixman_box16 merged = box_union(a, b);
+	int64_t waste = box_area(&merged) - box_area(a) - box_area(b) +
+		box_overlap(a, b);
+	return (int64_t)cost->rect - waste * cost->pixel;
+}
+
+/* The boxes are merged in place. Merged boxes never end up ahead of the box
+ * that is being read, so nothing is overwritten before it has been read.
+ */
+static int simplify_boxes(struct pixman_box16* boxes, int n_boxes,
+		const struct region_cost* cost)
+{
+	/* Boxes that are further apart than this can never be merged */
+	int64_t max_gap = cost->pixel ? cost->rect / cost->pixel : INT64_MAX;
+
+	int n_out = 0;
+	int open_start = 0;
+
+	for (int i = 0; i < n_boxes; ++i) {
+		struct pixman_box16 box = boxes[i];
+
+		while (open_start < n_out &&
+				(n_out - open_start >= REGION_SIMPLIFY_MAX_OPEN ||
+				 boxes[open_start].y2 + max_gap < box.y1))
+			++open_start;
+
+		/* A merged box may be close enough to others to take them in
+		 * as well.
+		 */
+		for (;;) {
+			int best = -1;
+			int64_t best_gain = 0;
+
+			for (int j = open_start; j < n_out; ++j) {
+				int64_t gain = merge_gain(cost, &boxes[j], &box);
+				if (gain > best_gain) {
+					best_gain = gain;
+					best = j;
+				}
+			}
+
+			if (best < 0)
+				break;
+
+			box = box_union(&boxes[best], &box);
+			boxes[best] = boxes[--n_out];
+		}
+
+		boxes[n_out++] = box;
+	}
+
+	return n_out;
+}
+
+int region_simplify(struct region_boxes* dst, struct pixman_region16* region,
+		const struct region_cost* cost)
+{
+	int n_boxes = 0;
+	struct pixman_box16* src = pixman_region_rectangles(region, &n_boxes);
+
+	dst->boxes = dst->small;
+	dst->n_boxes = 0;
+
+	if (n_boxes > REGION_SIMPLIFY_SMALL) {
+		dst->boxes = malloc(n_boxes * sizeof(*dst->boxes));
+		if (!dst->boxes) {
+			dst->boxes = dst->small;
+			return -1;
+		}
+	}
+
+	memcpy(dst->boxes, src, n_boxes * sizeof(*dst->boxes));
+	dst->n_boxes = simplify_boxes(dst->boxes, n_boxes, cost);
+
+	if (dst->n_boxes > UINT16_MAX) {
+		dst->boxes[0] = *pixman_region_extents(region);
+		dst->n_boxes = 1;
+	}
+
+	return 0;
+}
+
+void region_boxes_finish(struct region_boxes* self)
+{
+	if (self->boxes != self->small)
+		free(self->boxes);
+	self->boxes = self->small;
+	self->n_boxes = 0;
+}
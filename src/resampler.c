@@ -19,13 +19,23 @@
 #include "fb.h"
 #include "transform-util.h"
 #include "pixels.h"
+#include "event-loop.h"
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <aml.h>
 #include <pixman.h>
 #include <assert.h>
+#include <sys/param.h>
 #include <libdrm/drm_fourcc.h>
 
+#define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
+
+#define RESAMPLER_MAX_BANDS 16
+
+/* Bands shorter than this aren't worth a trip through the thread pool */
+#define RESAMPLER_MIN_BAND_HEIGHT 64
+
 struct fb_side_data {
 	struct pixman_region16 buffer_damage;
 	LIST_ENTRY(fb_side_data) link;
@@ -36,9 +46,12 @@ LIST_HEAD(fb_side_data_list, fb_side_data);
 struct resampler {
 	struct nvnc_fb_pool *pool;
 	struct fb_side_data_list fb_side_data_list;
+	int n_workers;
 };
 
 struct resampler_work {
+	int ref;
+	int n_pending;
 	struct pixman_region16 frame_damage;
 	struct nvnc_fb* src;
 	struct nvnc_fb* dst;
@@ -46,6 +59,11 @@ struct resampler_work {
 	void* userdata;
 };
 
+struct resampler_band {
+	struct resampler_work* work;
+	struct pixman_region16 clip;
+};
+
 static void fb_side_data_destroy(void* userdata)
 {
 	struct fb_side_data* fb_side_data = userdata;
@@ -63,9 +81,10 @@ static void resampler_damage_all_buffers(struct resampler* self,
 				region);
 }
 
-static void resampler_work_free(void* userdata)
+static void resampler_work_unref(struct resampler_work* work)
 {
-	struct resampler_work* work = userdata;
+	if (--work->ref != 0)
+		return;
 
 	nvnc_fb_release(work->src);
 	nvnc_fb_unref(work->src);
@@ -77,6 +96,24 @@ static void resampler_work_free(void* userdata)
 	free(work);
 }
 
+static void resampler_band_free(void* userdata)
+{
+	struct resampler_band* band = userdata;
+
+	pixman_region_fini(&band->clip);
+	resampler_work_unref(band->work);
+	free(band);
+}
+
+static int resampler_get_n_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return 1;
+
+	return MIN(n, RESAMPLER_MAX_BANDS);
+}
+
 struct resampler* resampler_create(void)
 {
 	struct resampler* self = calloc(1, sizeof(*self));
@@ -91,6 +128,9 @@ struct resampler* resampler_create(void)
 
 	LIST_INIT(&self->fb_side_data_list);
 
+	self->n_workers = resampler_get_n_workers();
+	aml_require_workers(nvnc__get_loop(), self->n_workers);
+
 	return self;
 }
 
@@ -103,11 +143,11 @@ void resampler_destroy(struct resampler* self)
 static void do_work(void* handle)
 {
 	struct aml_work* work = handle;
-	struct resampler_work* ctx = aml_get_userdata(work);
+	struct resampler_band* band = aml_get_userdata(work);
+	struct resampler_work* ctx = band->work;
 
 	struct nvnc_fb* src = ctx->src;
 	struct nvnc_fb* dst = ctx->dst;
-	struct fb_side_data* dst_side_data = nvnc_get_userdata(dst);
 
 	assert(dst->transform == NVNC_TRANSFORM_NORMAL);
 
@@ -135,16 +175,19 @@ static void do_work(void* handle)
 
 	pixman_image_set_transform(srcimg, &pxform);
 
-	/* Side data contains the union of the buffer damage and the frame
-	 * damage.
+	/* The clip is this band's share of the union of the buffer damage and
+	 * the frame damage.
 	 */
-	pixman_image_set_clip_region(dstimg, &dst_side_data->buffer_damage);
+	pixman_image_set_clip_region(dstimg, &band->clip);
 
-	pixman_image_composite(PIXMAN_OP_OVER, srcimg, NULL, dstimg,
-			0, 0,
-			0, 0,
+	struct pixman_box16* ext = pixman_region_extents(&band->clip);
+
+	/* The framebuffer is opaque, so there's nothing to blend with */
+	pixman_image_composite(PIXMAN_OP_SRC, srcimg, NULL, dstimg,
+			ext->x1, ext->y1,
 			0, 0,
-			dst->width, dst->height);
+			ext->x1, ext->y1,
+			ext->x2 - ext->x1, ext->y2 - ext->y1);
 
 	pixman_image_unref(srcimg);
 	pixman_image_unref(dstimg);
@@ -153,34 +196,103 @@ static void do_work(void* handle)
 static void on_work_done(void* handle)
 {
 	struct aml_work* work = handle;
-	struct resampler_work* ctx = aml_get_userdata(work);
+	struct resampler_band* band = aml_get_userdata(work);
+	struct resampler_work* ctx = band->work;
 
-	ctx->on_done(ctx->dst, &ctx->frame_damage, ctx->userdata);
+	if (--ctx->n_pending == 0 && ctx->on_done)
+		ctx->on_done(ctx->dst, &ctx->frame_damage, ctx->userdata);
+}
+
+static int resampler_start_band(struct resampler_work* ctx,
+		struct pixman_region16* clip, int y, int height)
+{
+	struct resampler_band* band = calloc(1, sizeof(*band));
+	if (!band)
+		return -1;
+
+	pixman_region_init(&band->clip);
+	pixman_region_intersect_rect(&band->clip, clip, 0, y,
+			ctx->dst->width, height);
+
+	if (!pixman_region_not_empty(&band->clip)) {
+		pixman_region_fini(&band->clip);
+		free(band);
+		return 0;
+	}
+
+	band->work = ctx;
+	ctx->ref++;
+
+	struct aml_work* work = aml_work_new(do_work, on_work_done, band,
+			resampler_band_free);
+	if (!work) {
+		resampler_band_free(band);
+		return -1;
+	}
+
+	int rc = aml_start(nvnc__get_loop(), work);
+	aml_unref(work);
+	if (rc < 0)
+		return -1;
+
+	ctx->n_pending++;
+	return 0;
+}
+
+/* The damaged area is cut into horizontal bands that are composited by
+ * separate workers. Bands never overlap, so the workers don't need to
+ * synchronise, and the frame is done when the last band is.
+ */
+static int resampler_start_bands(struct resampler* self,
+		struct resampler_work* ctx, struct pixman_region16* clip)
+{
+	struct pixman_box16* ext = pixman_region_extents(clip);
+	int height = ext->y2 - ext->y1;
+
+	int n_bands = MIN(self->n_workers,
+			UDIV_UP(height, RESAMPLER_MIN_BAND_HEIGHT));
+	n_bands = MAX(n_bands, 1);
+
+	int band_height = UDIV_UP(height, n_bands);
+
+	for (int y = ext->y1; y < ext->y2; y += band_height)
+		if (resampler_start_band(ctx, clip, y, band_height) < 0)
+			return -1;
+
+	return 0;
 }
 
 int resampler_feed(struct resampler* self, struct nvnc_fb* fb,
 		struct pixman_region16* damage, resampler_fn on_done,
 		void* userdata)
 {
-	if (fb->transform == NVNC_TRANSFORM_NORMAL) {
+	/* GPU buffers are always copied, even if they're upright, so that
+	 * they are only read once.
+	 */
+	if (fb->transform == NVNC_TRANSFORM_NORMAL &&
+			fb->type != NVNC_FB_GBM_BO) {
 		on_done(fb, damage, userdata);
 		return 0;
 	}
 
+	if (nvnc_fb_map(fb) < 0)
+		return -1;
+
 	uint32_t width = fb->width;
 	uint32_t height = fb->height;
 
 	nvnc_transform_dimensions(fb->transform, &width, &height);
 	nvnc_fb_pool_resize(self->pool, width, height, fb->fourcc_format,
-			fb->stride);
+			width);
 
-	struct aml* aml = aml_get_default();
+	struct aml* aml = nvnc__get_loop();
 	assert(aml);
 
 	struct resampler_work* ctx = calloc(1, sizeof(*ctx));
 	if (!ctx)
 		return -1;
 
+	ctx->ref = 1;
 	pixman_region_init(&ctx->frame_damage);
 	pixman_region_copy(&ctx->frame_damage, damage);
 
@@ -188,7 +300,7 @@ int resampler_feed(struct resampler* self, struct nvnc_fb* fb,
 	if (!ctx->dst)
 		goto acquire_failure;
 
-	struct fb_side_data* fb_side_data = nvnc_get_userdata(fb);
+	struct fb_side_data* fb_side_data = nvnc_get_userdata(ctx->dst);
 	if (!fb_side_data) {
 		fb_side_data = calloc(1, sizeof(*fb_side_data));
 		if (!fb_side_data)
@@ -198,7 +310,7 @@ int resampler_feed(struct resampler* self, struct nvnc_fb* fb,
 		pixman_region_init_rect(&fb_side_data->buffer_damage, 0, 0,
 				width, height);
 
-		nvnc_set_userdata(fb, fb_side_data, fb_side_data_destroy);
+		nvnc_set_userdata(ctx->dst, fb_side_data, fb_side_data_destroy);
 		LIST_INSERT_HEAD(&self->fb_side_data_list, fb_side_data, link);
 	}
 
@@ -211,22 +323,37 @@ int resampler_feed(struct resampler* self, struct nvnc_fb* fb,
 	ctx->on_done = on_done;
 	ctx->userdata = userdata;
 
-	struct aml_work* work = aml_work_new(do_work, on_work_done, ctx,
-			resampler_work_free);
-	if (!work) {
-		resampler_work_free(ctx);
-		return -1;
+	/* Side data contains the union of the buffer damage and the frame
+	 * damage. All of it is brought up to date by this frame.
+	 */
+	struct pixman_region16 clip;
+	pixman_region_init(&clip);
+	pixman_region_copy(&clip, &fb_side_data->buffer_damage);
+	pixman_region_clear(&fb_side_data->buffer_damage);
+
+	int rc = resampler_start_bands(self, ctx, &clip);
+
+	/* Bands that did get started still finish, but the frame is dropped
+	 * and its damage is carried over to the next one.
+	 */
+	if (rc < 0) {
+		ctx->on_done = NULL;
+		pixman_region_union(&fb_side_data->buffer_damage,
+				&fb_side_data->buffer_damage, &clip);
 	}
 
-	nvnc_fb_map(fb);
+	pixman_region_fini(&clip);
 
-	int rc = aml_start(aml, work);
-	aml_unref(work);
+	if (ctx->n_pending == 0 && ctx->on_done)
+		ctx->on_done(ctx->dst, &ctx->frame_damage, ctx->userdata);
+
+	resampler_work_unref(ctx);
 	return rc;
 
 side_data_failure:
 	nvnc_fb_pool_release(self->pool, ctx->dst);
 acquire_failure:
+	pixman_region_fini(&ctx->frame_damage);
 	free(ctx);
 	return -1;
 }
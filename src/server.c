@@ -29,8 +29,19 @@
 #include "config.h"
 #include "logging.h"
 #include "usdt.h"
+#include "rcbuf.h"
+#include "buf-pool.h"
+#include "tile-cache.h"
+#include "event-loop.h"
+#include "damage-refinery.h"
+#include "enc-util.h"
+#include "cursor.h"
+#include "desktop.h"
+#include "fbs.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/queue.h>
 #include <sys/param.h>
@@ -40,15 +51,25 @@
 #include <pixman.h>
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netdb.h>
+#include <time.h>
 
 #ifdef ENABLE_TLS
 #include <gnutls/gnutls.h>
 #endif
 
+#ifdef ENABLE_OPEN_H264
+#include "open-h264.h"
+#endif
+
+#ifdef ENABLE_SHM
+#include "shm-buffer.h"
+#endif
+
 #ifndef DRM_FORMAT_INVALID
 #define DRM_FORMAT_INVALID 0
 #endif
@@ -59,17 +80,76 @@
 
 #define DEFAULT_NAME "Neat VNC"
 
+/* A new frame is held back while this much worth of data is still waiting to
+ * be delivered, so that what the client sees never lags too far behind.
+ */
+#define PACING_TARGET_LATENCY_MS 100
+#define PACING_MIN_BUDGET (64 * 1024)
+#define PACING_DEFAULT_BUDGET (1024 * 1024)
+#define PACING_RETRY_MS 10
+#define PACING_MIN_SAMPLE_MS 20
+
+/* Lossy tiles are refreshed once nothing has been damaged for this long, with
+ * no more than a share of the pacing budget going to each refresh.
+ */
+#define REFRESH_IDLE_US 250000
+#define REFRESH_INTERVAL_MS 100
+#define REFRESH_BUDGET_SHARE 4
+
+/* The adaptive compression levels move by one step at most this often. The
+ * round trip must be this much over the shortest seen to count as queuing.
+ */
+#define ADAPTIVE_INTERVAL_US 250000
+#define ADAPTIVE_RTT_SLACK_US 5000
+
+#define CLAMP(x, lo, hi) MIN(MAX(x, lo), hi)
+
+/* Enough to cover a few clients with one frame in flight each */
+#define FRAME_POOL_MAX_FREE 8
+
+/* Room for a couple screens worth of JPEG tiles per shard */
+#define TILE_CACHE_SIZE (16 * 1024 * 1024)
+
+#define MAX_CLIENT_THREADS 64
+
+/* Raw frames are written out in parts of about this size, and encoding waits
+ * while too many of them are still on their way.
+ */
+#define UPDATE_PART_SIZE (1024 * 1024)
+#define MAX_UPDATE_PARTS_IN_FLIGHT 2
+
+/* Full frames that are kept around for clients that connect later */
+#define SHARED_MAX_KEYFRAMES 4
+
+/* Motion that can't be queued within this many rectangles is encoded instead */
+#define MAX_PENDING_COPIES 256
+
+/* Continuous updates stall once this many frames have not been acknowledged */
+#define MAX_PINGS_IN_FLIGHT 3
+#define FENCE_PING_MARKER 0x70
+
 #define EXPORT __attribute__((visibility("default")))
 
+/* Raw updates are done on a worker. This is kept for the lifetime of the
+ * client, as only one update is encoded at a time.
+ */
 struct fb_update_work {
-	struct aml_work* work;
 	struct nvnc_client* client;
 	struct pixman_region16 region;
 	struct rfb_pixel_format server_fmt;
+	struct raw_frame raw;
 	struct vec frame;
 	struct nvnc_fb* fb;
+	/* > 0 while there are parts left to encode */
+	int encode_rc;
+	bool is_stalled;
 };
 
+struct copy_rect {
+	struct rfb_server_fb_rect rect;
+	struct rfb_copyrect copy;
+} RFB_PACKED;
+
 enum addrtype {
 	ADDRTYPE_TCP,
 	ADDRTYPE_UNIX,
@@ -78,12 +158,69 @@ enum addrtype {
 int schedule_client_update_fb(struct nvnc_client* client,
 		struct pixman_region16* damage);
 static int send_desktop_resize(struct nvnc_client* client, struct nvnc_fb* fb);
+#ifdef ENABLE_SHM
+static bool client_can_use_shm(const struct nvnc_client* client);
+static bool client_needs_shm_buffer(const struct nvnc_client* client,
+		const struct nvnc_fb* fb);
+static void client_damage_all(struct nvnc_client* client,
+		const struct nvnc_fb* fb);
+static int send_shm_buffer(struct nvnc_client* client, struct nvnc_fb* fb);
+static int send_shm_frame(struct nvnc_client* client, struct nvnc_fb* fb,
+		struct pixman_region16* damage);
+#endif
+static int send_extended_desktop_size(struct nvnc_client* client,
+		struct nvnc_fb* fb, enum rfb_resize_reason reason,
+		enum rfb_resize_status status);
+static bool client_needs_layout(const struct nvnc_client* client);
+static void server_set_buffer(struct nvnc* self, struct nvnc_fb* fb);
+#ifdef ENABLE_OPEN_H264
+static struct nvnc_display* server_get_single_display(const struct nvnc* self);
+#endif
 static int send_qemu_key_ext_frame(struct nvnc_client* client);
+static bool client_needs_cursor(const struct nvnc_client* client);
+static int send_cursor_update(struct nvnc_client* client);
+static void process_fb_update_requests(struct nvnc_client* client);
 static enum rfb_encodings choose_frame_encoding(struct nvnc_client* client);
 static enum tight_quality client_get_tight_quality(struct nvnc_client* client);
+static int client_get_compression_level(const struct nvnc_client* client);
+static void client_fail_update(struct nvnc_client* client);
 static void on_tight_encode_frame_done(struct vec* frame, void* userdata);
+static void on_tight_encode_chunk(struct vec* frame, void* userdata);
+static void on_zrle_encode_frame_done(struct vec* frame, void* userdata);
+#ifdef ENABLE_OPEN_H264
+static void on_open_h264_frame_done(struct vec* frame, void* userdata);
+static struct nvnc_fb* client_get_gpu_fb(struct nvnc_client* client);
+#endif
 static bool client_has_encoding(const struct nvnc_client* client,
 		enum rfb_encodings encoding);
+static void finish_fb_update(struct nvnc_client* client,
+		struct rcbuf* payload);
+static void client_send_copies_only(struct nvnc_client* client);
+static int schedule_shared_update(struct nvnc_client* client,
+		struct nvnc_fb* fb, const struct rfb_pixel_format* server_fmt,
+		struct pixman_region16* damage, enum rfb_encodings encoding,
+		enum tight_quality quality, bool is_keyframe);
+static bool is_encoding_shareable(enum rfb_encodings encoding);
+static bool client_has_peers(struct nvnc_client* client,
+		enum rfb_encodings encoding, enum tight_quality quality,
+		struct nvnc_fb* fb, struct pixman_region16* damage);
+static struct shared_frame* shared_frame_find(struct nvnc_shard* shard,
+		const struct rfb_pixel_format* pixfmt,
+		enum rfb_encodings encoding, enum tight_quality quality,
+		struct nvnc_fb* fb, struct pixman_region16* damage);
+static void shared_frames_invalidate(struct nvnc_shard* self);
+static void shared_frames_age(struct nvnc_shard* self,
+		struct pixman_region16* damage);
+static struct nvnc_fb* shard_get_fb(const struct nvnc_shard* self);
+static int shard_call(struct nvnc_shard* self, loop_queue_fn fn, void* data);
+static void shard_publish_frame(struct nvnc_shard* self, struct nvnc_fb* fb,
+		const struct pixman_region16* damage,
+		const struct damage_copy* copy);
+
+#define server_for_each_shard(shard, server)                                   \
+	for (int i_ = -1; i_ < (server)->n_shards &&                           \
+	     ((shard) = i_ < 0 ? &(server)->main_shard :                       \
+	      &(server)->shards[i_]); ++i_)
 
 #if defined(GIT_VERSION)
 EXPORT const char nvnc_version[] = GIT_VERSION;
@@ -113,11 +250,31 @@ static void client_close(struct nvnc_client* client)
 	}
 
 	LIST_REMOVE(client, link);
+	atomic_fetch_sub(&client->shard->n_clients, 1);
 	stream_destroy(client->net_stream);
-	tight_encoder_destroy(&client->tight_encoder);
-	deflateEnd(&client->z_stream);
+	if (client->update_work)
+		aml_unref(client->update_work);
+	if (client->refresh_timer) {
+		aml_stop(nvnc__get_loop(), client->refresh_timer);
+		aml_unref(client->refresh_timer);
+	}
+	if (client->has_tight_encoder)
+		tight_encoder_destroy(&client->tight_encoder);
+	if (client->has_zrle_encoder)
+		zrle_encoder_destroy(&client->zrle_encoder);
+#ifdef ENABLE_OPEN_H264
+	open_h264_destroy(client->open_h264);
+#endif
+#ifdef ENABLE_SHM
+	shm_buffer_destroy(client->shm);
+#endif
+	tile_bitmap_destroy(&client->damage_tiles);
 	pixman_region_fini(&client->damage);
+	pixman_region_fini(&client->update_damage);
+	vec_destroy(&client->copies);
+	vec_destroy(&client->update_copies);
 	free(client->cut_text.buffer);
+	free(client->msg_buffer);
 	free(client);
 }
 
@@ -134,6 +291,74 @@ static inline void client_ref(struct nvnc_client* client)
 	++client->ref;
 }
 
+static void send_end_of_continuous_updates(struct nvnc_client* client)
+{
+	uint8_t type = RFB_SERVER_TO_CLIENT_END_OF_CONTINUOUS_UPDATES;
+	stream_write(client->net_stream, &type, sizeof(type), NULL, NULL);
+}
+
+static void client_end_update(struct nvnc_client* client)
+{
+	client->is_updating = false;
+	assert(client->current_fb);
+	nvnc_fb_release(client->current_fb);
+	nvnc_fb_unref(client->current_fb);
+	client->current_fb = NULL;
+
+	/* No unrequested update may follow this, so it had to wait for the
+	 * one that was in flight.
+	 */
+	if (client->is_end_of_continuous_pending) {
+		send_end_of_continuous_updates(client);
+		client->is_end_of_continuous_pending = false;
+	}
+}
+
+static void send_fence(struct nvnc_client* client, uint32_t flags,
+		const uint8_t* payload, uint8_t length)
+{
+	uint8_t buffer[sizeof(struct rfb_fence_msg) + RFB_FENCE_MAX_PAYLOAD];
+	struct rfb_fence_msg* msg = (struct rfb_fence_msg*)buffer;
+
+	assert(length <= RFB_FENCE_MAX_PAYLOAD);
+
+	memset(msg, 0, sizeof(*msg));
+	msg->type = RFB_SERVER_TO_CLIENT_FENCE;
+	msg->flags = htonl(flags);
+	msg->length = length;
+	memcpy(msg->payload, payload, length);
+
+	stream_write(client->net_stream, buffer, sizeof(*msg) + length, NULL,
+			NULL);
+}
+
+/* The client answers this after it has processed the frame before it */
+static void send_fence_ping(struct nvnc_client* client)
+{
+	uint8_t marker = FENCE_PING_MARKER;
+	send_fence(client, RFB_FENCE_REQUEST | RFB_FENCE_BLOCK_BEFORE, &marker,
+			sizeof(marker));
+	client->n_pings_in_flight++;
+}
+
+static bool client_wants_update(const struct nvnc_client* client)
+{
+	if (client->n_pending_requests > 0)
+		return true;
+
+	return client->is_continuous &&
+		client->n_pings_in_flight < MAX_PINGS_IN_FLIGHT;
+}
+
+/* Returns true if another update may follow right away */
+static bool client_consume_request(struct nvnc_client* client)
+{
+	if (client->n_pending_requests > 0)
+		client->n_pending_requests--;
+
+	return client_wants_update(client);
+}
+
 static void close_after_write(void* userdata, enum stream_req_status status)
 {
 	struct nvnc_client* client = userdata;
@@ -142,7 +367,8 @@ static void close_after_write(void* userdata, enum stream_req_status status)
 	client_unref(client);
 }
 
-static int handle_unsupported_version(struct nvnc_client* client)
+static int refuse_connection(struct nvnc_client* client,
+                             const char* reason_string)
 {
 	char buffer[256];
 
@@ -150,8 +376,6 @@ static int handle_unsupported_version(struct nvnc_client* client)
 
 	struct rfb_error_reason* reason = (struct rfb_error_reason*)(buffer + 1);
 
-	static const char reason_string[] = "Unsupported version\n";
-
 	buffer[0] = 0; /* Number of security types is 0 on error */
 	reason->length = htonl(strlen(reason_string));
 	strcpy(reason->message, reason_string);
@@ -163,6 +387,11 @@ static int handle_unsupported_version(struct nvnc_client* client)
 	return 0;
 }
 
+static int handle_unsupported_version(struct nvnc_client* client)
+{
+	return refuse_connection(client, "Unsupported version\n");
+}
+
 static int on_version_message(struct nvnc_client* client)
 {
 	if (client->buffer_len - client->buffer_index < 12)
@@ -180,8 +409,16 @@ static int on_version_message(struct nvnc_client* client)
 	security.types[0] = RFB_SECURITY_TYPE_NONE;
 
 #ifdef ENABLE_TLS
-	if (client->server->auth_fn)
+	if (client->server->auth_fn) {
+		/* TLS can't be layered inside WebSocket framing, and falling
+		 * back to no security would skip authentication altogether.
+		 */
+		if (client->net_stream->is_websocket)
+			return refuse_connection(client,
+					"No authentication over WebSocket\n");
+
 		security.types[0] = RFB_SECURITY_TYPE_VENCRYPT;
+	}
 #endif
 
 	stream_write(client->net_stream, &security, sizeof(security), NULL,
@@ -361,42 +598,56 @@ static int on_security_message(struct nvnc_client* client)
 	return sizeof(type);
 }
 
-static void disconnect_all_other_clients(struct nvnc_client* client)
+static void shard_disconnect_clients(struct nvnc_shard* shard,
+		struct nvnc_client* except)
 {
 	struct nvnc_client* node;
 	struct nvnc_client* tmp;
 
-	LIST_FOREACH_SAFE (node, &client->server->clients, link, tmp)
-		if (node != client) {
+	LIST_FOREACH_SAFE (node, &shard->clients, link, tmp)
+		if (node != except) {
 			log_debug("disconnect other client %p (ref %d)\n",
 			          node, node->ref);
 			stream_close(node->net_stream);
 			client_unref(node);
 		}
+}
+
+static void on_shard_disconnect_clients(void* data)
+{
+	shard_disconnect_clients(data, NULL);
+}
+
+static void disconnect_all_other_clients(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+
+	shard_disconnect_clients(client->shard, client);
 
+	struct nvnc_shard* shard;
+	server_for_each_shard(shard, server)
+		if (shard != client->shard &&
+				shard_call(shard, on_shard_disconnect_clients,
+					shard) < 0)
+			log_error("Failed to disconnect clients on another loop\n");
 }
 
 static void send_server_init_message(struct nvnc_client* client)
 {
 	struct nvnc* server = client->server;
-	struct nvnc_display* display = server->display;
+	struct nvnc_fb* fb = shard_get_fb(client->shard);
 
 	size_t name_len = strlen(server->name);
 	size_t size = sizeof(struct rfb_server_init_msg) + name_len;
 
-	if (!display) {
-		log_debug("Tried to send init message, but no display has been added\n");
-		goto close;
-	}
-
-	if (!display->buffer) {
+	if (!fb) {
 		log_debug("Tried to send init message, but no framebuffers have been set\n");
 		goto close;
 	}
 
-	uint16_t width = nvnc_fb_get_width(display->buffer);
-	uint16_t height = nvnc_fb_get_height(display->buffer);
-	uint32_t fourcc = nvnc_fb_get_fourcc_format(display->buffer);
+	uint16_t width = nvnc_fb_get_logical_width(fb);
+	uint16_t height = nvnc_fb_get_logical_height(fb);
+	uint32_t fourcc = nvnc_fb_get_fourcc_format(fb);
 
 	struct rfb_server_init_msg* msg = calloc(1, size);
 	if (!msg)
@@ -473,6 +724,9 @@ static int on_client_set_pixel_format(struct nvnc_client* client)
 
 	client->has_pixfmt = true;
 
+	/* The cursor is sent again in the new format */
+	client->cursor_serial = 0;
+
 	return 4 + sizeof(struct rfb_pixel_format);
 }
 
@@ -500,205 +754,715 @@ static int on_client_set_encodings(struct nvnc_client* client)
 		case RFB_ENCODING_TIGHT:
 		case RFB_ENCODING_TRLE:
 		case RFB_ENCODING_ZRLE:
+		case RFB_ENCODING_OPEN_H264:
 		case RFB_ENCODING_CURSOR:
 		case RFB_ENCODING_DESKTOPSIZE:
+		case RFB_ENCODING_EXTENDED_DESKTOPSIZE:
 		case RFB_ENCODING_JPEG_HIGHQ:
 		case RFB_ENCODING_JPEG_LOWQ:
 		case RFB_ENCODING_QEMU_EXT_KEY_EVENT:
+		case RFB_ENCODING_FENCE:
+		case RFB_ENCODING_CONTINUOUS_UPDATES:
+#ifdef ENABLE_SHM
+		case RFB_ENCODING_SHM:
+#endif
 			client->encodings[n++] = encoding;
+			break;
+		default:
+			if (rfb_encoding_is_jpeg_quality(encoding) ||
+					rfb_encoding_is_compression_level(
+						encoding))
+				client->encodings[n++] = encoding;
 		}
 	}
 
 	client->n_encodings = n;
 
+	/* Clients learn that fences are supported from a fence of our own and
+	 * that continuous updates are from an end of continuous updates.
+	 */
+	if (!client->is_fence_announced &&
+			client_has_encoding(client, RFB_ENCODING_FENCE)) {
+		send_fence(client, RFB_FENCE_REQUEST, NULL, 0);
+		client->is_fence_announced = true;
+	}
+
+	if (client->is_fence_announced && !client->is_continuous_announced &&
+			client_has_encoding(client,
+				RFB_ENCODING_CONTINUOUS_UPDATES)) {
+		send_end_of_continuous_updates(client);
+		client->is_continuous_announced = true;
+	}
+
 	return sizeof(*msg) + 4 * n_encodings;
 }
 
-static void process_fb_update_requests(struct nvnc_client* client)
+static uint64_t gettime_ms(void)
 {
-	struct nvnc* server = client->server;
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
 
-	if (!server->display || !server->display->buffer)
-		return;
+static uint64_t gettime_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
 
-	if (client->net_stream->state == STREAM_STATE_CLOSED)
-		return;
+static void client_mark_damaged(struct nvnc_client* client, uint64_t now)
+{
+	if (!client->damage_time)
+		client->damage_time = now;
+}
 
-	if (!pixman_region_not_empty(&client->damage))
-		return;
+static void client_update_drain_rate(struct nvnc_client* client,
+		uint64_t now, size_t kernel_queued)
+{
+	struct stream* stream = client->net_stream;
+	uint32_t delivered = stream->bytes_sent - kernel_queued;
+	uint64_t dt = now - client->pacing_time;
 
-	if (client->is_updating || client->n_pending_requests == 0)
+	if (dt < PACING_MIN_SAMPLE_MS)
 		return;
 
-	struct nvnc_fb* fb = client->server->display->buffer;
-	assert(fb);
+	if (client->pacing_was_backlogged) {
+		uint64_t rate = (uint64_t)(delivered - client->pacing_delivered)
+			* 1000ULL / dt;
+		rate = MIN(rate, UINT32_MAX);
 
-	if (!client->has_pixfmt) {
-		rfb_pixfmt_from_fourcc(&client->pixfmt, fb->fourcc_format);
-		client->has_pixfmt = true;
+		client->drain_rate = client->drain_rate ?
+			(client->drain_rate * 3 + rate) / 4 : rate;
 	}
 
-	if (fb->width != client->known_width
-	    || fb->height != client->known_height) {
-		send_desktop_resize(client, fb);
+	client->pacing_time = now;
+	client->pacing_delivered = delivered;
+	client->pacing_was_backlogged =
+		kernel_queued + stream->bytes_queued > 0;
+}
 
-		if (--client->n_pending_requests <= 0)
-			return;
-	}
+static void client_start_rtt_probe(struct nvnc_client* client)
+{
+	if (!client->rtt_probe_time)
+		client->rtt_probe_time = gettime_us();
+}
 
-	if (server->key_code_fn && !client->is_qemu_key_ext_notified
-	    && client_has_encoding(client, RFB_ENCODING_QEMU_EXT_KEY_EVENT)) {
-		send_qemu_key_ext_frame(client);
-		client->is_qemu_key_ext_notified = true;
+static void client_end_rtt_probe(struct nvnc_client* client)
+{
+	if (!client->rtt_probe_time)
+		return;
 
-		if (--client->n_pending_requests <= 0)
-			return;
-	}
+	uint32_t rtt = MIN(gettime_us() - client->rtt_probe_time, UINT32_MAX);
+	client->rtt_probe_time = 0;
 
-	DTRACE_PROBE1(neatvnc, update_fb_start, client);
+	client->rtt = client->rtt ? (client->rtt * 3ULL + rtt) / 4 : rtt;
+	client->min_rtt = client->min_rtt ? MIN(client->min_rtt, rtt) : rtt;
+}
 
-	/* The client's damage is exchanged for an empty one */
-	struct pixman_region16 damage = client->damage;
-	pixman_region_init(&client->damage);
+/* The link is the bottleneck if frames take longer to get through it than to
+ * encode, or if they are piling up somewhere along the way.
+ */
+static void client_adapt_compression(struct nvnc_client* client,
+		size_t frame_size, uint64_t encode_time, uint64_t now)
+{
+	const struct nvnc_compression_policy* policy =
+		&client->server->compression_policy;
 
-	client->is_updating = true;
-	client->current_fb = fb;
-	nvnc_fb_hold(fb);
-	nvnc_fb_ref(fb);
+	if (!policy->is_adaptive ||
+			now - client->adaptive_time < ADAPTIVE_INTERVAL_US)
+		return;
 
-	int rc;
-	enum rfb_encodings encoding = choose_frame_encoding(client);
+	uint64_t send_time = client->drain_rate ?
+		frame_size * 1000000ULL / client->drain_rate : 0;
 
-	// TODO: Check the return value
-	struct rfb_pixel_format server_fmt;
-	rfb_pixfmt_from_fourcc(&server_fmt, fb->fourcc_format);
+	bool is_queuing = client->min_rtt &&
+		client->rtt > client->min_rtt * 2 + ADAPTIVE_RTT_SLACK_US;
 
-	switch (encoding) {
-	case RFB_ENCODING_RAW:
-	case RFB_ENCODING_ZRLE:
-		rc = schedule_client_update_fb(client, &damage);
-		break;
-	case RFB_ENCODING_TIGHT:
-		client_ref(client);
+	int step;
+	if (client->is_congested || is_queuing || send_time > encode_time * 2)
+		step = 1;
+	else if (send_time * 2 < encode_time)
+		step = -1;
+	else
+		return;
 
-		enum tight_quality quality = client_get_tight_quality(client);
-		rc = tight_encode_frame(&client->tight_encoder, &client->pixfmt,
-				fb, &server_fmt, &damage, quality,
-				on_tight_encode_frame_done, client);
+	int level = CLAMP(client->adaptive_level, policy->min_level,
+			policy->max_level);
+	int quality = CLAMP(client->adaptive_quality, policy->min_quality,
+			policy->max_quality);
 
-		if (rc < 0)
-			client_unref(client);
+	client->adaptive_level = CLAMP(level + step, policy->min_level,
+			policy->max_level);
+	client->adaptive_quality = CLAMP(quality - step, policy->min_quality,
+			policy->max_quality);
+	client->adaptive_time = now;
+}
 
-		pixman_region_fini(&damage);
-		break;
-	default:
-		rc = -1;
-		break;
-	}
+static size_t client_get_pacing_budget(const struct nvnc_client* client)
+{
+	if (!client->drain_rate)
+		return PACING_DEFAULT_BUDGET;
 
-	if (rc < 0) {
-		client->is_updating = false;
-		assert(client->current_fb);
-		nvnc_fb_release(client->current_fb);
-		nvnc_fb_unref(client->current_fb);
-		client->current_fb = NULL;
-	}
+	size_t budget = (uint64_t)client->drain_rate *
+		PACING_TARGET_LATENCY_MS / 1000;
+	return MAX(budget, PACING_MIN_BUDGET);
 }
 
-static int on_client_fb_update_request(struct nvnc_client* client)
+static void on_pacing_timeout(void* obj)
 {
-	struct nvnc* server = client->server;
+	struct nvnc_client* client = aml_get_userdata(obj);
+	client->is_pacing_deferred = false;
+	process_fb_update_requests(client);
+	client_unref(client);
+}
 
-	struct rfb_client_fb_update_req_msg* msg =
-	        (struct rfb_client_fb_update_req_msg*)(client->msg_buffer +
-	                                               client->buffer_index);
+static void client_defer_update(struct nvnc_client* client)
+{
+	if (client->is_pacing_deferred)
+		return;
 
-	if (client->buffer_len - client->buffer_index < sizeof(*msg))
-		return 0;
+	struct aml_timer* timer = aml_timer_new(PACING_RETRY_MS,
+			on_pacing_timeout, client, NULL);
+	if (!timer)
+		return;
 
-	int incremental = msg->incremental;
-	int x = ntohs(msg->x);
-	int y = ntohs(msg->y);
-	int width = ntohs(msg->width);
-	int height = ntohs(msg->height);
+	client_ref(client);
 
-	client->n_pending_requests++;
+	if (aml_start(nvnc__get_loop(), timer) < 0) {
+		client_unref(client);
+		aml_unref(timer);
+		return;
+	}
 
-	/* Note: The region sent from the client is ignored for incremental
-	 * updates. This avoids superfluous complexity.
-	 */
-	if (!incremental)
-		pixman_region_union_rect(&client->damage, &client->damage, x, y,
-		                         width, height);
+	aml_unref(timer);
+	client->is_pacing_deferred = true;
+}
 
-	DTRACE_PROBE1(neatvnc, update_fb_request, client);
+static bool client_is_idle(const struct nvnc_client* client)
+{
+	return !client->is_updating && client->n_frames_in_flight == 0 &&
+		!client->is_congested &&
+		!pixman_region_not_empty(
+				(struct pixman_region16*)&client->damage);
+}
 
-	nvnc_fb_req_fn fn = server->fb_req_fn;
-	if (fn)
-		fn(client, incremental, x, y, width, height);
+/* Lossless tiles compress to about half of their raw size */
+static uint32_t client_get_refresh_tile_budget(
+		const struct nvnc_client* client)
+{
+	size_t tile_size = TIGHT_TILE_SIZE * TIGHT_TILE_SIZE *
+		client->pixfmt.bits_per_pixel / 8 / 2;
+	size_t budget = client_get_pacing_budget(client) /
+		REFRESH_BUDGET_SHARE;
+	return MAX(budget / MAX(tile_size, 1), 1);
+}
 
-	process_fb_update_requests(client);
+static bool client_refresh_lossy_tiles(struct nvnc_client* client)
+{
+	struct tight_encoder* encoder = &client->tight_encoder;
+	const struct tile_bitmap* lossy = &encoder->lossy_tiles;
+
+	if (lossy->width != client->damage_tiles.width ||
+			lossy->height != client->damage_tiles.height)
+		return false;
+
+	uint32_t budget = client_get_refresh_tile_budget(client);
+	uint32_t n_tiles = 0;
+
+	uint32_t x = 0, y = 0;
+	for (; n_tiles < budget && tile_bitmap_next(lossy, &x, &y); ++x) {
+		pixman_region_union_rect(&client->damage, &client->damage,
+				x * TIGHT_TILE_SIZE, y * TIGHT_TILE_SIZE,
+				TIGHT_TILE_SIZE, TIGHT_TILE_SIZE);
+		tile_bitmap_set(&client->damage_tiles, x, y);
+		++n_tiles;
+	}
 
-	return sizeof(*msg);
+	pixman_region_intersect_rect(&client->damage, &client->damage, 0, 0,
+			encoder->width, encoder->height);
+
+	client->stats.refreshed_tiles += n_tiles;
+	return n_tiles > 0;
 }
 
-static int on_client_key_event(struct nvnc_client* client)
-{
-	struct nvnc* server = client->server;
+static void client_schedule_refresh(struct nvnc_client* client);
 
-	struct rfb_client_key_event_msg* msg =
-	        (struct rfb_client_key_event_msg*)(client->msg_buffer +
-	                                           client->buffer_index);
+static void on_refresh_timeout(void* obj)
+{
+	struct nvnc_client* client = aml_get_userdata(obj);
+	client->is_refresh_pending = false;
 
-	if (client->buffer_len - client->buffer_index < sizeof(*msg))
-		return 0;
+	if (client->net_stream->state == STREAM_STATE_CLOSED ||
+			!client_is_idle(client) ||
+			choose_frame_encoding(client) != RFB_ENCODING_TIGHT)
+		goto done;
 
-	int down_flag = msg->down_flag;
-	uint32_t keysym = ntohl(msg->key);
+	if (gettime_us() - client->last_damage_time < REFRESH_IDLE_US) {
+		client_schedule_refresh(client);
+		goto done;
+	}
 
-	nvnc_key_fn fn = server->key_fn;
-	if (fn)
-		fn(client, keysym, !!down_flag);
+	if (client_refresh_lossy_tiles(client)) {
+		client->is_refreshing = true;
+		process_fb_update_requests(client);
+	}
 
-	return sizeof(*msg);
+done:
+	client_unref(client);
 }
 
-static int on_client_qemu_key_event(struct nvnc_client* client)
+/* Called whenever the client has asked for an update that there is nothing
+ * to send for
+ */
+static void client_schedule_refresh(struct nvnc_client* client)
 {
-	struct nvnc* server = client->server;
-
-	struct rfb_client_qemu_key_event_msg* msg =
-	        (struct rfb_client_qemu_key_event_msg*)(client->msg_buffer +
-		                                        client->buffer_index);
+	if (client->is_refresh_pending || !client->has_tight_encoder)
+		return;
 
-	if (client->buffer_len - client->buffer_index < sizeof(*msg))
-		return 0;
+	if (tile_bitmap_is_empty(&client->tight_encoder.lossy_tiles))
+		return;
 
-	int down_flag = msg->down_flag;
-	uint32_t xt_keycode = ntohl(msg->keycode);
+	/* The same timer is started for every refresh */
+	if (!client->refresh_timer) {
+		client->refresh_timer = aml_timer_new(REFRESH_INTERVAL_MS,
+				on_refresh_timeout, client, NULL);
+		if (!client->refresh_timer)
+			return;
+	}
 
-	uint32_t evdev_keycode = code_map_qnum_to_linux[xt_keycode];
-	if (!evdev_keycode)
-		evdev_keycode = xt_keycode;
+	client_ref(client);
 
-	nvnc_key_fn fn = server->key_code_fn;
-	if (fn)
-		fn(client, evdev_keycode, !!down_flag);
+	if (aml_start(nvnc__get_loop(), client->refresh_timer) < 0) {
+		client_unref(client);
+		return;
+	}
 
-	return sizeof(*msg);
+	client->is_refresh_pending = true;
 }
 
-static int on_client_qemu_event(struct nvnc_client* client)
+/* Frames are held back while the link is saturated. Damage keeps piling up in
+ * the meantime, so the next frame covers everything that was skipped.
+ */
+static bool client_is_link_saturated(struct nvnc_client* client)
 {
-	if (client->buffer_len - client->buffer_index < 2)
-		return 0;
+	struct stream* stream = client->net_stream;
+	size_t kernel_queued = stream_get_kernel_queued(stream);
+	size_t queued = kernel_queued + stream->bytes_queued;
 
-	enum rfb_client_to_server_qemu_msg_type subtype =
-	        client->msg_buffer[client->buffer_index + 1];
+	client_update_drain_rate(client, gettime_ms(), kernel_queued);
 
-	switch (subtype) {
-	case RFB_CLIENT_TO_SERVER_QEMU_KEY_EVENT:
-		return on_client_qemu_key_event(client);
+	size_t budget = client_get_pacing_budget(client);
+
+	if (queued > budget) {
+		client->is_congested = true;
+		return true;
+	}
+
+	if (queued < budget / 4)
+		client->is_congested = false;
+
+	return false;
+}
+
+static int client_ensure_zrle_encoder(struct nvnc_client* client)
+{
+	if (client->has_zrle_encoder)
+		return 0;
+
+	if (zrle_encoder_init(&client->zrle_encoder,
+				client->shard->frame_pool) < 0)
+		return -1;
+
+	client->has_zrle_encoder = true;
+	return 0;
+}
+
+static int client_ensure_tight_encoder(struct nvnc_client* client,
+		uint32_t width, uint32_t height)
+{
+	if (client->has_tight_encoder)
+		return 0;
+
+	if (tight_encoder_init(&client->tight_encoder, width, height,
+				client->shard->frame_pool) < 0)
+		return -1;
+
+	tight_encoder_set_tile_cache(&client->tight_encoder,
+			client->shard->tile_cache);
+
+	/* A fresh encoder's streams don't match those of a decoder that
+	 * shared frames have been sent to.
+	 */
+	if (client->has_shared_tight_frame)
+		tight_encoder_request_reset(&client->tight_encoder);
+
+	client->has_tight_encoder = true;
+	return 0;
+}
+
+static void process_fb_update_requests(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+	struct nvnc_fb* fb = shard_get_fb(client->shard);
+
+	if (!fb)
+		return;
+
+	if (client->net_stream->state == STREAM_STATE_CLOSED)
+		return;
+
+	if (!pixman_region_not_empty(&client->damage) &&
+			client->copies.len == 0 && !client_needs_cursor(client))
+		return;
+
+	if (client->is_updating || !client_wants_update(client))
+		return;
+
+	if (client->n_frames_in_flight >= MAX_FRAMES_IN_FLIGHT)
+		return;
+
+	if (client->is_pacing_deferred)
+		return;
+
+	if (client_is_link_saturated(client)) {
+		DTRACE_PROBE1(neatvnc, update_fb_deferred, client);
+		client_defer_update(client);
+		return;
+	}
+
+	if (!client->has_pixfmt) {
+		rfb_pixfmt_from_fourcc(&client->pixfmt, fb->fourcc_format);
+		client->has_pixfmt = true;
+	}
+
+	if (nvnc_fb_get_logical_width(fb) != client->known_width
+	    || nvnc_fb_get_logical_height(fb) != client->known_height
+	    || client_needs_layout(client)) {
+		if (send_desktop_resize(client, fb) < 0)
+			return;
+
+		if (!client_consume_request(client))
+			return;
+	}
+
+	if (server->key_code_fn && !client->is_qemu_key_ext_notified
+	    && client_has_encoding(client, RFB_ENCODING_QEMU_EXT_KEY_EVENT)) {
+		send_qemu_key_ext_frame(client);
+		client->is_qemu_key_ext_notified = true;
+
+		if (!client_consume_request(client))
+			return;
+	}
+
+	if (client_needs_cursor(client) && send_cursor_update(client) == 0 &&
+			!client_consume_request(client))
+		return;
+
+#ifdef ENABLE_SHM
+	if (client_needs_shm_buffer(client, fb) &&
+			send_shm_buffer(client, fb) == 0 &&
+			!client_consume_request(client))
+		return;
+#endif
+
+	if (!pixman_region_not_empty(&client->damage) &&
+			client->copies.len == 0) {
+		client_schedule_refresh(client);
+		return;
+	}
+
+	DTRACE_PROBE1(neatvnc, update_fb_start, client);
+
+	/* The client's damage is exchanged for an empty one */
+	struct pixman_region16 damage = client->damage;
+	pixman_region_init(&client->damage);
+	pixman_region_copy(&client->update_damage, &damage);
+
+	struct vec copies = client->update_copies;
+	client->update_copies = client->copies;
+	client->copies = copies;
+	vec_clear(&client->copies);
+
+	bool is_full_frame = pixman_region_contains_rectangle(&damage,
+			&(pixman_box16_t){
+				.x2 = nvnc_fb_get_logical_width(fb),
+				.y2 = nvnc_fb_get_logical_height(fb),
+			}) == PIXMAN_REGION_IN;
+
+	/* Clients that are starting out can make do with a cached keyframe */
+	bool wants_keyframe = is_full_frame && !client->has_full_frame;
+	if (is_full_frame)
+		client->has_full_frame = true;
+
+	client->update_start_time = gettime_us();
+	client->update_damage_time = client->damage_time;
+	client->damage_time = 0;
+
+	client->is_updating = true;
+	client->current_fb = fb;
+	nvnc_fb_hold(fb);
+	nvnc_fb_ref(fb);
+
+	int rc;
+	enum rfb_encodings encoding = choose_frame_encoding(client);
+#ifdef ENABLE_OPEN_H264
+	/* The stream picks up where it left off, which is not what the client
+	 * has on screen if other encodings were used in between.
+	 */
+	if (encoding == RFB_ENCODING_OPEN_H264 && client->open_h264 &&
+			client->update_encoding != encoding)
+		open_h264_request_keyframe(client->open_h264);
+#endif
+	client->update_encoding = encoding;
+
+	if (!pixman_region_not_empty(&damage)) {
+		pixman_region_fini(&damage);
+		client_send_copies_only(client);
+		return;
+	}
+
+	enum tight_quality quality = TIGHT_QUALITY_UNSPEC;
+	if (encoding == RFB_ENCODING_TIGHT)
+		quality = client->is_refreshing ? TIGHT_QUALITY_LOSSLESS :
+			client_get_tight_quality(client);
+	client->is_refreshing = false;
+
+	// TODO: Check the return value
+	struct rfb_pixel_format server_fmt;
+	rfb_pixfmt_from_fourcc(&server_fmt, fb->fourcc_format);
+
+	if (is_encoding_shareable(encoding) && (wants_keyframe ||
+				client_has_peers(client, encoding, quality, fb,
+					&damage)) &&
+			schedule_shared_update(client, fb, &server_fmt, &damage,
+				encoding, quality, wants_keyframe) == 0) {
+		/* Anything that a keyframe has missed is already back in the
+		 * client's damage.
+		 */
+		tile_bitmap_clear(&client->damage_tiles);
+		tile_bitmap_add_region(&client->damage_tiles, &client->damage);
+		pixman_region_fini(&damage);
+		return;
+	}
+
+	switch (encoding) {
+	case RFB_ENCODING_RAW:
+		rc = schedule_client_update_fb(client, &damage);
+		break;
+	case RFB_ENCODING_ZRLE:
+		rc = client_ensure_zrle_encoder(client);
+		if (rc < 0) {
+			pixman_region_fini(&damage);
+			break;
+		}
+
+		client_ref(client);
+
+		zrle_encoder_set_compression_level(&client->zrle_encoder,
+				client_get_compression_level(client));
+		rc = zrle_encoder_encode_frame(&client->zrle_encoder,
+				&client->pixfmt, fb, &server_fmt, &damage,
+				on_zrle_encode_frame_done, client);
+
+		if (rc < 0)
+			client_unref(client);
+
+		pixman_region_fini(&damage);
+		break;
+	case RFB_ENCODING_TIGHT:
+		rc = client_ensure_tight_encoder(client,
+				nvnc_fb_get_logical_width(fb),
+				nvnc_fb_get_logical_height(fb));
+		if (rc < 0) {
+			pixman_region_fini(&damage);
+			break;
+		}
+
+		client_ref(client);
+
+		tight_encoder_set_compression_level(&client->tight_encoder,
+				client_get_compression_level(client));
+
+		tight_encoder_set_progressive(&client->tight_encoder,
+				on_tight_encode_chunk);
+		if (client->has_pointer)
+			tight_encoder_set_focus(&client->tight_encoder,
+					client->pointer_x, client->pointer_y);
+
+		rc = tight_encode_frame(&client->tight_encoder, &client->pixfmt,
+				fb, &server_fmt, &damage, &client->damage_tiles,
+				quality, on_tight_encode_frame_done, client);
+
+		if (rc < 0)
+			client_unref(client);
+
+		pixman_region_fini(&damage);
+		break;
+#ifdef ENABLE_OPEN_H264
+	case RFB_ENCODING_OPEN_H264:
+		pixman_region_fini(&damage);
+
+		if (!client->open_h264)
+			client->open_h264 = open_h264_new(
+					client->shard->frame_pool);
+		if (!client->open_h264) {
+			rc = -1;
+			break;
+		}
+
+		client_ref(client);
+
+		rc = open_h264_encode_frame(client->open_h264,
+				client_get_gpu_fb(client),
+				on_open_h264_frame_done, client);
+
+		if (rc < 0)
+			client_unref(client);
+		break;
+#endif
+#ifdef ENABLE_SHM
+	case RFB_ENCODING_SHM:
+		rc = send_shm_frame(client, fb, &damage);
+		pixman_region_fini(&damage);
+		break;
+#endif
+	default:
+		rc = -1;
+		break;
+	}
+
+	tile_bitmap_clear(&client->damage_tiles);
+
+	if (rc < 0) {
+#ifdef ENABLE_SHM
+		if (encoding == RFB_ENCODING_SHM)
+			client_damage_all(client, fb);
+#endif
+		client_fail_update(client);
+	}
+}
+
+static int on_client_fb_update_request(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+
+	struct rfb_client_fb_update_req_msg* msg =
+	        (struct rfb_client_fb_update_req_msg*)(client->msg_buffer +
+	                                               client->buffer_index);
+
+	if (client->buffer_len - client->buffer_index < sizeof(*msg))
+		return 0;
+
+	int incremental = msg->incremental;
+	int x = ntohs(msg->x);
+	int y = ntohs(msg->y);
+	int width = ntohs(msg->width);
+	int height = ntohs(msg->height);
+
+	client->n_pending_requests++;
+	client_end_rtt_probe(client);
+
+	/* Note: The region sent from the client is ignored for incremental
+	 * updates. This avoids superfluous complexity.
+	 */
+	if (!incremental) {
+#ifdef ENABLE_OPEN_H264
+		if (client->open_h264)
+			open_h264_request_keyframe(client->open_h264);
+#endif
+		pixman_region_union_rect(&client->damage, &client->damage, x, y,
+		                         width, height);
+		tile_bitmap_add_rect(&client->damage_tiles, x, y, width,
+				height);
+		client_mark_damaged(client, gettime_us());
+	}
+
+	DTRACE_PROBE1(neatvnc, update_fb_request, client);
+
+	nvnc_fb_req_fn fn = server->fb_req_fn;
+	if (fn)
+		fn(client, incremental, x, y, width, height);
+
+	process_fb_update_requests(client);
+
+	return sizeof(*msg);
+}
+
+static void client_flush_pointer(struct nvnc_client* client)
+{
+	if (!client->has_pending_pointer)
+		return;
+
+	client->has_pending_pointer = false;
+
+	struct pointer_event* event = &client->pending_pointer;
+	nvnc_pointer_fn fn = client->server->pointer_fn;
+	if (fn)
+		fn(client, event->x, event->y, event->button_mask);
+}
+
+static int on_client_key_event(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+
+	struct rfb_client_key_event_msg* msg =
+	        (struct rfb_client_key_event_msg*)(client->msg_buffer +
+	                                           client->buffer_index);
+
+	if (client->buffer_len - client->buffer_index < sizeof(*msg))
+		return 0;
+
+	int down_flag = msg->down_flag;
+	uint32_t keysym = ntohl(msg->key);
+
+	client_flush_pointer(client);
+
+	nvnc_key_fn fn = server->key_fn;
+	if (fn)
+		fn(client, keysym, !!down_flag);
+
+	return sizeof(*msg);
+}
+
+static int on_client_qemu_key_event(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+
+	struct rfb_client_qemu_key_event_msg* msg =
+	        (struct rfb_client_qemu_key_event_msg*)(client->msg_buffer +
+		                                        client->buffer_index);
+
+	if (client->buffer_len - client->buffer_index < sizeof(*msg))
+		return 0;
+
+	int down_flag = msg->down_flag;
+	uint32_t xt_keycode = ntohl(msg->keycode);
+
+	uint32_t evdev_keycode = code_map_qnum_to_linux[xt_keycode];
+	if (!evdev_keycode)
+		evdev_keycode = xt_keycode;
+
+	client_flush_pointer(client);
+
+	nvnc_key_fn fn = server->key_code_fn;
+	if (fn)
+		fn(client, evdev_keycode, !!down_flag);
+
+	return sizeof(*msg);
+}
+
+static int on_client_qemu_event(struct nvnc_client* client)
+{
+	if (client->buffer_len - client->buffer_index < 2)
+		return 0;
+
+	enum rfb_client_to_server_qemu_msg_type subtype =
+	        client->msg_buffer[client->buffer_index + 1];
+
+	switch (subtype) {
+	case RFB_CLIENT_TO_SERVER_QEMU_KEY_EVENT:
+		return on_client_qemu_key_event(client);
 	}
 
 	log_debug("Got uninterpretable qemu message from client: %p (ref %d)\n",
@@ -708,744 +1472,2839 @@ static int on_client_qemu_event(struct nvnc_client* client)
 	return 0;
 }
 
-static int on_client_pointer_event(struct nvnc_client* client)
+static int on_client_pointer_event(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+
+	struct rfb_client_pointer_event_msg* msg =
+	        (struct rfb_client_pointer_event_msg*)(client->msg_buffer +
+	                                               client->buffer_index);
+
+	if (client->buffer_len - client->buffer_index < sizeof(*msg))
+		return 0;
+
+	int button_mask = msg->button_mask;
+	uint16_t x = ntohs(msg->x);
+	uint16_t y = ntohs(msg->y);
+
+	client->pointer_x = x;
+	client->pointer_y = y;
+	client->has_pointer = true;
+
+	if (server->is_pointer_coalescing) {
+		if (client->has_pending_pointer && button_mask !=
+				client->pending_pointer.button_mask)
+			client_flush_pointer(client);
+
+		client->pending_pointer = (struct pointer_event){
+			.x = x,
+			.y = y,
+			.button_mask = button_mask,
+		};
+		client->has_pending_pointer = true;
+		return sizeof(*msg);
+	}
+
+	nvnc_pointer_fn fn = server->pointer_fn;
+	if (fn)
+		fn(client, x, y, button_mask);
+
+	return sizeof(*msg);
+}
+
+struct shard_cut_text {
+	struct nvnc_shard* shard;
+	uint32_t len;
+	char text[];
+};
+
+static void on_shard_cut_text(void* data)
+{
+	struct shard_cut_text* self = data;
+	struct rfb_cut_text_msg msg;
+
+	msg.type = RFB_SERVER_TO_CLIENT_SERVER_CUT_TEXT;
+	msg.length = htonl(self->len);
+
+	struct nvnc_client* client;
+	LIST_FOREACH (client, &self->shard->clients, link) {
+		stream_write(client->net_stream, &msg, sizeof(msg), NULL, NULL);
+		stream_write(client->net_stream, self->text, self->len, NULL,
+				NULL);
+	}
+
+	free(self);
+}
+
+struct shard_cursor {
+	struct nvnc_shard* shard;
+	struct cursor_image* image;
+};
+
+static void on_shard_cursor(void* data)
+{
+	struct shard_cursor* self = data;
+	struct nvnc_shard* shard = self->shard;
+
+	free(shard->cursor);
+	shard->cursor = self->image;
+	shard->cursor_serial++;
+
+	struct nvnc_client* client;
+	LIST_FOREACH (client, &shard->clients, link)
+		process_fb_update_requests(client);
+
+	free(self);
+}
+
+EXPORT
+int nvnc_set_cursor(struct nvnc* server, struct nvnc_fb* fb,
+		uint16_t hotspot_x, uint16_t hotspot_y)
+{
+	struct cursor_image* image = cursor_image_new(fb, hotspot_x, hotspot_y);
+	if (!image)
+		return -1;
+
+	int rc = 0;
+
+	/* Every shard gets a copy of its own */
+	struct nvnc_shard* shard;
+	server_for_each_shard(shard, server) {
+		struct shard_cursor* msg = calloc(1, sizeof(*msg));
+		if (!msg) {
+			rc = -1;
+			continue;
+		}
+
+		msg->shard = shard;
+		msg->image = cursor_image_dup(image);
+
+		if (!msg->image ||
+				shard_call(shard, on_shard_cursor, msg) < 0) {
+			free(msg->image);
+			free(msg);
+			rc = -1;
+		}
+	}
+
+	free(image);
+	return rc;
+}
+
+EXPORT
+bool nvnc_client_supports_cursor(const struct nvnc_client* client)
+{
+	return client_has_encoding(client, RFB_ENCODING_CURSOR);
+}
+
+EXPORT
+void nvnc_send_cut_text(struct nvnc* server, const char* text, uint32_t len)
+{
+	struct nvnc_shard* shard;
+	server_for_each_shard(shard, server) {
+		struct shard_cut_text* msg = malloc(sizeof(*msg) + len);
+		if (!msg)
+			continue;
+
+		msg->shard = shard;
+		msg->len = len;
+		memcpy(msg->text, text, len);
+
+		if (shard_call(shard, on_shard_cut_text, msg) < 0)
+			free(msg);
+	}
+}
+
+static int on_client_cut_text(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+	nvnc_cut_text_fn fn = server->cut_text_fn;
+	struct rfb_cut_text_msg* msg =
+	        (struct rfb_cut_text_msg*)(client->msg_buffer +
+	                                   client->buffer_index);
+
+	size_t left_to_process = client->buffer_len - client->buffer_index;
+
+	if (left_to_process < sizeof(*msg))
+		return 0;
+
+	uint32_t length = ntohl(msg->length);
+	uint32_t max_length = MAX_CUT_TEXT_SIZE;
+
+	/* Messages greater than this size are unsupported */
+	if (length > max_length) {
+		log_error("Copied text length (%d) is greater than max supported length (%d)\n",
+			length, max_length);
+		stream_close(client->net_stream);
+		client_unref(client);
+		return 0;
+	}
+
+	size_t msg_size = sizeof(*msg) + length;
+
+	if (msg_size <= left_to_process) {
+		if (fn)
+			fn(server, msg->text, length);
+
+		return msg_size;
+	}
+
+	assert(!client->cut_text.buffer);
+
+	client->cut_text.buffer = malloc(length);
+	if (!client->cut_text.buffer) {
+		log_error("OOM: %m\n");
+		stream_close(client->net_stream);
+		client_unref(client);
+		return 0;
+	}
+
+	size_t partial_size = left_to_process - sizeof(*msg);
+
+	memcpy(client->cut_text.buffer, msg->text, partial_size);
+
+	client->cut_text.length = length;
+	client->cut_text.index = partial_size;
+
+	return left_to_process;
+}
+
+static void process_big_cut_text(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+	nvnc_cut_text_fn fn = server->cut_text_fn;
+
+	assert(client->cut_text.length > client->cut_text.index);
+
+	void* start = client->cut_text.buffer + client->cut_text.index;
+	size_t space = client->cut_text.length - client->cut_text.index;
+
+	ssize_t n_read = stream_read(client->net_stream, start, space);
+
+	if (n_read == 0)
+		return;
+
+	if (n_read < 0) {
+		if (errno != EAGAIN) {
+			log_debug("Client connection error: %p (ref %d)\n",
+				  client, client->ref);
+			stream_close(client->net_stream);
+			client_unref(client);
+		}
+
+		return;
+	}
+
+	client->cut_text.index += n_read;
+
+	if (client->cut_text.index != client->cut_text.length)
+		return;
+
+	if (fn)
+		fn(server, client->cut_text.buffer, client->cut_text.length);
+
+	free(client->cut_text.buffer);
+	client->cut_text.buffer = NULL;
+}
+
+static int on_client_enable_continuous_updates(struct nvnc_client* client)
+{
+	struct rfb_client_enable_continuous_updates_msg* msg =
+		(struct rfb_client_enable_continuous_updates_msg*)(
+				client->msg_buffer + client->buffer_index);
+
+	if (client->buffer_len - client->buffer_index < sizeof(*msg))
+		return 0;
+
+	/* Note: The area is ignored, as it is for incremental update requests.
+	 * Continuous updates are only paced properly with fences, so they stay
+	 * off for clients that can't handle those.
+	 */
+	if (msg->enable_flag) {
+		if (client->is_fence_announced) {
+			client->is_continuous = true;
+			client->is_end_of_continuous_pending = false;
+			process_fb_update_requests(client);
+		}
+		return sizeof(*msg);
+	}
+
+	client->is_continuous = false;
+
+	if (client->is_updating)
+		client->is_end_of_continuous_pending = true;
+	else
+		send_end_of_continuous_updates(client);
+
+	return sizeof(*msg);
+}
+
+static int on_client_fence(struct nvnc_client* client)
+{
+	struct rfb_fence_msg* msg = (struct rfb_fence_msg*)(client->msg_buffer +
+			client->buffer_index);
+
+	if (client->buffer_len - client->buffer_index < sizeof(*msg))
+		return 0;
+
+	if (msg->length > RFB_FENCE_MAX_PAYLOAD) {
+		log_debug("Client sent a fence that was too long: %p\n",
+				client);
+		stream_close(client->net_stream);
+		client_unref(client);
+		return 0;
+	}
+
+	if (client->buffer_len - client->buffer_index <
+			sizeof(*msg) + msg->length)
+		return 0;
+
+	uint32_t flags = ntohl(msg->flags);
+
+	if (!(flags & RFB_FENCE_REQUEST)) {
+		if (msg->length == 1 && msg->payload[0] == FENCE_PING_MARKER &&
+				client->n_pings_in_flight > 0) {
+			client->n_pings_in_flight--;
+			client_end_rtt_probe(client);
+			process_fb_update_requests(client);
+		}
+		return sizeof(*msg) + msg->length;
+	}
+
+	/* Messages are handled in order, so everything before the fence has
+	 * already been dealt with.
+	 */
+	flags &= RFB_FENCE_BLOCK_BEFORE | RFB_FENCE_BLOCK_AFTER |
+		RFB_FENCE_SYNC_NEXT;
+
+	if (flags & RFB_FENCE_SYNC_NEXT) {
+		client->has_sync_fence = true;
+		client->sync_fence_flags = flags;
+		client->sync_fence_length = msg->length;
+		memcpy(client->sync_fence_payload, msg->payload, msg->length);
+	} else {
+		send_fence(client, flags, msg->payload, msg->length);
+	}
+
+	return sizeof(*msg) + msg->length;
+}
+
+static int on_client_set_desktop_size(struct nvnc_client* client)
+{
+	struct rfb_client_set_desktop_size_msg* msg =
+		(struct rfb_client_set_desktop_size_msg*)(client->msg_buffer +
+				client->buffer_index);
+
+	if (client->buffer_len - client->buffer_index < sizeof(*msg))
+		return 0;
+
+	size_t size = sizeof(*msg) + msg->n_screens * sizeof(msg->screens[0]);
+	if (client->buffer_len - client->buffer_index < size)
+		return 0;
+
+	/* The layout is up to the displays, so requests are turned down */
+	struct nvnc_fb* fb = shard_get_fb(client->shard);
+	if (fb && client_has_encoding(client,
+				RFB_ENCODING_EXTENDED_DESKTOPSIZE))
+		send_extended_desktop_size(client, fb,
+				RFB_RESIZE_REASON_CLIENT,
+				RFB_RESIZE_STATUS_PROHIBITED);
+
+	return size;
+}
+
+static int dispatch_client_message(struct nvnc_client* client)
+{
+	enum rfb_client_to_server_msg_type type =
+	        client->msg_buffer[client->buffer_index];
+
+	switch (type) {
+	case RFB_CLIENT_TO_SERVER_SET_PIXEL_FORMAT:
+		return on_client_set_pixel_format(client);
+	case RFB_CLIENT_TO_SERVER_SET_ENCODINGS:
+		return on_client_set_encodings(client);
+	case RFB_CLIENT_TO_SERVER_FRAMEBUFFER_UPDATE_REQUEST:
+		return on_client_fb_update_request(client);
+	case RFB_CLIENT_TO_SERVER_KEY_EVENT:
+		return on_client_key_event(client);
+	case RFB_CLIENT_TO_SERVER_POINTER_EVENT:
+		return on_client_pointer_event(client);
+	case RFB_CLIENT_TO_SERVER_CLIENT_CUT_TEXT:
+		return on_client_cut_text(client);
+	case RFB_CLIENT_TO_SERVER_ENABLE_CONTINUOUS_UPDATES:
+		return on_client_enable_continuous_updates(client);
+	case RFB_CLIENT_TO_SERVER_FENCE:
+		return on_client_fence(client);
+	case RFB_CLIENT_TO_SERVER_SET_DESKTOP_SIZE:
+		return on_client_set_desktop_size(client);
+	case RFB_CLIENT_TO_SERVER_QEMU:
+		return on_client_qemu_event(client);
+	}
+
+	log_debug("Got uninterpretable message from client: %p (ref %d)\n",
+	          client, client->ref);
+	stream_close(client->net_stream);
+	client_unref(client);
+	return 0;
+}
+
+static int on_client_message(struct nvnc_client* client)
+{
+	if (client->buffer_len - client->buffer_index < 1)
+		return 0;
+
+	if (!client->has_sync_fence)
+		return dispatch_client_message(client);
+
+	/* A fence with the sync-next flag is answered after the message that
+	 * follows it.
+	 */
+	uint32_t flags = client->sync_fence_flags;
+	uint8_t length = client->sync_fence_length;
+	uint8_t payload[RFB_FENCE_MAX_PAYLOAD];
+	memcpy(payload, client->sync_fence_payload, length);
+
+	client->has_sync_fence = false;
+
+	/* An incomplete message leaves the fence for the next attempt */
+	int rc = dispatch_client_message(client);
+	if (rc == 0) {
+		client->has_sync_fence = true;
+		return 0;
+	}
+
+	send_fence(client, flags, payload, length);
+	return rc;
+}
+
+static int try_read_client_message(struct nvnc_client* client)
+{
+	switch (client->state) {
+	case VNC_CLIENT_STATE_ERROR:
+		return client->buffer_len - client->buffer_index;
+	case VNC_CLIENT_STATE_WAITING_FOR_VERSION:
+		return on_version_message(client);
+	case VNC_CLIENT_STATE_WAITING_FOR_SECURITY:
+		return on_security_message(client);
+	case VNC_CLIENT_STATE_WAITING_FOR_INIT:
+		return on_init_message(client);
+#ifdef ENABLE_TLS
+	case VNC_CLIENT_STATE_WAITING_FOR_VENCRYPT_VERSION:
+		return on_vencrypt_version_message(client);
+	case VNC_CLIENT_STATE_WAITING_FOR_VENCRYPT_SUBTYPE:
+		return on_vencrypt_subtype_message(client);
+	case VNC_CLIENT_STATE_WAITING_FOR_VENCRYPT_PLAIN_AUTH:
+		return on_vencrypt_plain_auth_message(client);
+#endif
+	case VNC_CLIENT_STATE_READY:
+		return on_client_message(client);
+	}
+
+	abort();
+	return 0;
+}
+
+static int client_grow_input(struct nvnc_client* client)
+{
+	if (client->msg_buffer_size >= MSG_BUFFER_MAX_SIZE)
+		return -1;
+
+	size_t size = MIN(client->msg_buffer_size * 2, MSG_BUFFER_MAX_SIZE);
+	uint8_t* buffer = realloc(client->msg_buffer, size);
+	if (!buffer)
+		return -1;
+
+	client->msg_buffer = buffer;
+	client->msg_buffer_size = size;
+	return 0;
+}
+
+/* Makes room for a read of at least MSG_BUFFER_MIN_READ bytes, or whatever
+ * is left if the buffer can't grow any further.
+ */
+static int client_reserve_input(struct nvnc_client* client)
+{
+	if (client->msg_buffer_size - client->buffer_len >= MSG_BUFFER_MIN_READ)
+		return 0;
+
+	if (client->buffer_index > 0) {
+		client->buffer_len -= client->buffer_index;
+		memmove(client->msg_buffer,
+				client->msg_buffer + client->buffer_index,
+				client->buffer_len);
+		client->buffer_index = 0;
+
+		if (client->msg_buffer_size - client->buffer_len >=
+				MSG_BUFFER_MIN_READ)
+			return 0;
+	}
+
+	if (client_grow_input(client) == 0)
+		return 0;
+
+	return client->buffer_len < client->msg_buffer_size ? 0 : -1;
+}
+
+static void on_client_event(struct stream* stream, enum stream_event event)
+{
+	struct nvnc_client* client = stream->userdata;
+
+	assert(client->net_stream && client->net_stream == stream);
+
+	if (event == STREAM_EVENT_REMOTE_CLOSED) {
+		log_debug("Client %p (%d) hung up\n", client, client->ref);
+		stream_close(stream);
+		client_unref(client);
+		return;
+	}
+
+	if (client->cut_text.buffer) {
+		process_big_cut_text(client);
+		return;
+	}
+
+	if (client_reserve_input(client) < 0) {
+		log_error("Client message does not fit in %d bytes. Closing connection...\n",
+				MSG_BUFFER_MAX_SIZE);
+		stream_close(stream);
+		client_unref(client);
+		return;
+	}
+
+	void* start = client->msg_buffer + client->buffer_len;
+	size_t space = client->msg_buffer_size - client->buffer_len;
+	ssize_t n_read = stream_read(stream, start, space);
+
+	if (n_read == 0)
+		return;
+
+	if (n_read < 0) {
+		if (errno != EAGAIN) {
+			log_debug("Client connection error: %p (ref %d)\n",
+				  client, client->ref);
+			stream_close(stream);
+			client_unref(client);
+		}
+
+		return;
+	}
+
+	client->buffer_len += n_read;
+
+	/* There's probably more where that came from */
+	if ((size_t)n_read == space)
+		client_grow_input(client);
+
+	while (1) {
+		int rc = try_read_client_message(client);
+		if (rc == 0)
+			break;
+
+		client->buffer_index += rc;
+
+	}
+
+	if (client->net_stream->state != STREAM_STATE_CLOSED)
+		client_flush_pointer(client);
+
+	assert(client->buffer_index <= client->buffer_len);
+
+	if (client->buffer_index == client->buffer_len) {
+		client->buffer_index = 0;
+		client->buffer_len = 0;
+	}
+}
+
+/* The client takes over the recorder, which may be NULL */
+static void client_new(struct nvnc_shard* shard, int fd,
+		struct fbs_writer* recorder)
+{
+	struct nvnc_client* client = calloc(1, sizeof(*client));
+	if (!client)
+		goto alloc_failure;
+
+	client->ref = 1;
+	client->server = shard->server;
+	client->shard = shard;
+
+	client->msg_buffer = malloc(MSG_BUFFER_SIZE);
+	if (!client->msg_buffer) {
+		log_debug("OOM\n");
+		goto msg_buffer_failure;
+	}
+	client->msg_buffer_size = MSG_BUFFER_SIZE;
+
+	/* Adaptive compression starts out cheap and at full quality */
+	client->adaptive_quality = TIGHT_QUALITY_JPEG_9 - TIGHT_QUALITY_JPEG_0;
+
+	client->net_stream = stream_new(fd, on_client_event, client);
+	if (!client->net_stream) {
+		log_debug("OOM\n");
+		goto stream_failure;
+	}
+
+	client->net_stream->recorder = recorder;
+	recorder = NULL;
+
+	if (client->server->is_websocket &&
+			stream_upgrade_to_websocket(client->net_stream) < 0) {
+		log_debug("OOM\n");
+		goto websocket_failure;
+	}
+
+	struct nvnc_fb* fb = shard_get_fb(shard);
+	if (!fb) {
+		log_debug("No display buffer has been set\n");
+		goto buffer_failure;
+	}
+
+	int width = nvnc_fb_get_logical_width(fb);
+	int height = nvnc_fb_get_logical_height(fb);
+	if (tile_bitmap_init(&client->damage_tiles, width, height,
+				TIGHT_TILE_SIZE) < 0) {
+		log_debug("OOM\n");
+		goto damage_tiles_failure;
+	}
+
+	pixman_region_init(&client->damage);
+	pixman_region_init(&client->update_damage);
+	vec_init(&client->copies, 0);
+	vec_init(&client->update_copies, 0);
+
+	struct rcbuf* payload = rcbuf_from_string(RFB_VERSION_MESSAGE);
+	if (!payload) {
+		log_debug("OOM\n");
+		goto payload_failure;
+	}
+
+	stream_send(client->net_stream, payload, NULL, NULL);
+
+	LIST_INSERT_HEAD(&shard->clients, client, link);
+
+	client->state = VNC_CLIENT_STATE_WAITING_FOR_VERSION;
+
+	log_debug("New client connection: %p (ref %d)\n", client, client->ref);
+
+	return;
+
+payload_failure:
+	pixman_region_fini(&client->update_damage);
+	pixman_region_fini(&client->damage);
+	tile_bitmap_destroy(&client->damage_tiles);
+damage_tiles_failure:
+buffer_failure:
+websocket_failure:
+	stream_destroy(client->net_stream);
+stream_failure:
+	free(client->msg_buffer);
+msg_buffer_failure:
+	free(client);
+alloc_failure:
+	fbs_writer_close(recorder);
+	close(fd);
+	atomic_fetch_sub(&shard->n_clients, 1);
+}
+
+struct shard_connection {
+	struct nvnc_shard* shard;
+	int fd;
+	struct fbs_writer* recorder;
+};
+
+static void on_shard_connection(void* data)
+{
+	struct shard_connection* self = data;
+	client_new(self->shard, self->fd, self->recorder);
+	free(self);
+}
+
+static struct fbs_writer* server_open_recording(struct nvnc* server)
+{
+	if (!server->recording_dir)
+		return NULL;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/session-%lld-%u.fbs",
+			server->recording_dir, (long long)time(NULL),
+			server->next_recording_id++);
+
+	struct fbs_writer* recorder = fbs_writer_open(path);
+	if (!recorder)
+		log_error("Failed to open recording %s: %m\n", path);
+
+	return recorder;
+}
+
+static struct nvnc_shard* server_pick_shard(struct nvnc* server)
+{
+	if (server->n_shards == 0)
+		return &server->main_shard;
+
+	struct nvnc_shard* best = &server->shards[0];
+	for (int i = 1; i < server->n_shards; ++i)
+		if (atomic_load(&server->shards[i].n_clients) <
+				atomic_load(&best->n_clients))
+			best = &server->shards[i];
+
+	return best;
+}
+
+static void on_connection(void* obj)
+{
+	struct nvnc* server = aml_get_userdata(obj);
+
+	int fd = accept(server->fd, NULL, 0);
+	if (fd < 0) {
+		log_debug("Failed to accept a connection\n");
+		return;
+	}
+
+	struct nvnc_shard* shard = server_pick_shard(server);
+	atomic_fetch_add(&shard->n_clients, 1);
+
+	struct fbs_writer* recorder = server_open_recording(server);
+
+	if (!shard->has_thread) {
+		client_new(shard, fd, recorder);
+		return;
+	}
+
+	/* A shard only learns about frames that arrive after it was
+	 * started, so it may have to be brought up to date first.
+	 */
+	struct nvnc_fb* fb = server->buffer;
+	if (fb && shard->fb_serial != server->fb_serial) {
+		struct pixman_region16 empty;
+		pixman_region_init(&empty);
+		shard_publish_frame(shard, fb, &empty, NULL);
+		pixman_region_fini(&empty);
+	}
+
+	struct shard_connection* connection = calloc(1, sizeof(*connection));
+	if (!connection)
+		goto failure;
+
+	connection->shard = shard;
+	connection->fd = fd;
+	connection->recorder = recorder;
+
+	if (loop_queue_post(&shard->queue, on_shard_connection,
+				connection) < 0) {
+		free(connection);
+		goto failure;
+	}
+
+	return;
+
+failure:
+	log_error("Failed to hand a new connection over to its loop\n");
+	fbs_writer_close(recorder);
+	close(fd);
+	atomic_fetch_sub(&shard->n_clients, 1);
+}
+
+static struct nvnc_fb* shard_get_fb(const struct nvnc_shard* self)
+{
+	return self->has_thread ? self->fb : self->server->buffer;
+}
+
+/* Runs fn on the shard's loop, right away if that is the calling thread */
+static int shard_call(struct nvnc_shard* self, loop_queue_fn fn, void* data)
+{
+	if (nvnc__get_loop() == self->aml) {
+		fn(data);
+		return 0;
+	}
+
+	return loop_queue_post(&self->queue, fn, data);
+}
+
+static void on_shard_fb_returned(void* data)
+{
+	struct nvnc_fb* fb = data;
+	nvnc_fb_release(fb);
+	nvnc_fb_unref(fb);
+}
+
+struct shard_fb_ref {
+	struct nvnc* server;
+	struct nvnc_fb* fb;
+};
+
+static void on_shard_fb_unused(void* userdata)
+{
+	struct shard_fb_ref* ref = userdata;
+
+	if (loop_queue_post(&ref->server->main_shard.queue,
+				on_shard_fb_returned, ref->fb) < 0)
+		log_error("Failed to return a framebuffer to the main loop\n");
+
+	free(ref);
+}
+
+/* The reference and hold counts of a buffer are not atomic, so a threaded
+ * shard gets a handle of its own that points at the same pixels. The display's
+ * buffer is held on the main thread until the last user of that handle is
+ * gone.
+ *
+ * Displays normally stage GPU buffers into system memory before they get here.
+ * Any GPU buffer that does get here is mapped on the main thread, and the hold
+ * keeps the mapping alive for as long as the shard uses it.
+ */
+static struct nvnc_fb* shard_fb_new(struct nvnc* server, struct nvnc_fb* fb)
+{
+	switch (fb->type) {
+	case NVNC_FB_SIMPLE:
+		break;
+	case NVNC_FB_GBM_BO:
+		if (nvnc_fb_map(fb) < 0)
+			return NULL;
+		break;
+	default:
+		return NULL;
+	}
+
+	struct shard_fb_ref* ref = calloc(1, sizeof(*ref));
+	if (!ref)
+		return NULL;
+
+	struct nvnc_fb* handle = nvnc_fb_from_buffer(fb->addr, fb->width,
+			fb->height, fb->fourcc_format, fb->stride);
+	if (!handle) {
+		free(ref);
+		return NULL;
+	}
+
+	handle->transform = fb->transform;
+
+	ref->server = server;
+	ref->fb = fb;
+	nvnc_fb_ref(fb);
+	nvnc_fb_hold(fb);
+
+	nvnc_set_userdata(handle, ref, on_shard_fb_unused);
+	return handle;
+}
+
+struct shard_frame {
+	struct nvnc_shard* shard;
+	struct nvnc_fb* fb;
+	struct pixman_region16 damage;
+	struct damage_copy copy;
+	bool has_copy;
+	struct desktop_layout layout;
+};
+
+static void shard_damage_region(struct nvnc_shard* self,
+		const struct pixman_region16* damage,
+		const struct damage_copy* copy);
+
+static void on_shard_frame(void* data)
+{
+	struct shard_frame* frame = data;
+	struct nvnc_shard* shard = frame->shard;
+
+	if (shard->fb)
+		nvnc_fb_unref(shard->fb);
+	shard->fb = frame->fb;
+	shard->layout = frame->layout;
+
+	shard_damage_region(shard, &frame->damage,
+			frame->has_copy ? &frame->copy : NULL);
+
+	pixman_region_fini(&frame->copy.region);
+	pixman_region_fini(&frame->damage);
+	free(frame);
+}
+
+static void shard_publish_frame(struct nvnc_shard* self, struct nvnc_fb* fb,
+		const struct pixman_region16* damage,
+		const struct damage_copy* copy)
+{
+	struct nvnc* server = self->server;
+
+	struct shard_frame* frame = calloc(1, sizeof(*frame));
+	if (!frame)
+		goto alloc_failure;
+
+	frame->shard = self;
+	frame->layout = server->layout;
+	frame->fb = shard_fb_new(server, fb);
+	if (!frame->fb)
+		goto fb_failure;
+
+	pixman_region_init(&frame->damage);
+	pixman_region_copy(&frame->damage, (struct pixman_region16*)damage);
+
+	pixman_region_init(&frame->copy.region);
+	if (copy) {
+		pixman_region_copy(&frame->copy.region,
+				(struct pixman_region16*)&copy->region);
+		frame->copy.dx = copy->dx;
+		frame->copy.dy = copy->dy;
+		frame->has_copy = true;
+	}
+
+	if (loop_queue_post(&self->queue, on_shard_frame, frame) < 0)
+		goto post_failure;
+
+	self->fb_serial = server->fb_serial;
+	return;
+
+post_failure:
+	pixman_region_fini(&frame->copy.region);
+	pixman_region_fini(&frame->damage);
+	nvnc_fb_unref(frame->fb);
+fb_failure:
+	free(frame);
+alloc_failure:
+	log_error("Failed to publish a frame to a client loop\n");
+}
+
+static int shard_init(struct nvnc_shard* self, struct nvnc* server,
+		struct aml* aml)
+{
+	self->server = server;
+	self->aml = aml;
+
+	LIST_INIT(&self->clients);
+	LIST_INIT(&self->shared_frames);
+
+	if (tile_bitmap_init(&self->damage_tiles, 0, 0, TIGHT_TILE_SIZE) < 0)
+		return -1;
+
+	self->frame_pool = buf_pool_new(FRAME_POOL_MAX_FREE);
+	if (!self->frame_pool)
+		goto frame_pool_failure;
+
+	self->tile_cache = tile_cache_new(TILE_CACHE_SIZE);
+	if (!self->tile_cache)
+		goto tile_cache_failure;
+
+	if (loop_queue_init(&self->queue, aml) < 0)
+		goto queue_failure;
+
+	return 0;
+
+queue_failure:
+	tile_cache_unref(self->tile_cache);
+tile_cache_failure:
+	buf_pool_unref(self->frame_pool);
+frame_pool_failure:
+	tile_bitmap_destroy(&self->damage_tiles);
+	return -1;
+}
+
+/* Must run on the shard's own loop */
+static void shard_close_clients(struct nvnc_shard* self)
+{
+	struct nvnc_client* client;
+	struct nvnc_client* tmp;
+	LIST_FOREACH_SAFE (client, &self->clients, link, tmp)
+		client_unref(client);
+
+	shared_frames_invalidate(self);
+	if (self->has_shared_tight_encoder)
+		tight_encoder_destroy(&self->shared_tight_encoder);
+	self->has_shared_tight_encoder = false;
+
+	if (self->has_thread && self->fb)
+		nvnc_fb_unref(self->fb);
+	self->fb = NULL;
+}
+
+static void shard_destroy(struct nvnc_shard* self)
+{
+	free(self->cursor);
+	loop_queue_destroy(&self->queue);
+	tile_bitmap_destroy(&self->damage_tiles);
+	buf_pool_unref(self->frame_pool);
+	tile_cache_unref(self->tile_cache);
+}
+
+static void* shard_thread(void* userdata)
+{
+	struct nvnc_shard* self = userdata;
+	nvnc__set_thread_loop(self->aml);
+	aml_run(self->aml);
+	return NULL;
+}
+
+static int shard_start_thread(struct nvnc_shard* self, struct nvnc* server)
+{
+	struct aml* aml = aml_new();
+	if (!aml)
+		return -1;
+
+	if (shard_init(self, server, aml) < 0)
+		goto init_failure;
+
+	self->has_thread = true;
+
+	if (pthread_create(&self->thread, NULL, shard_thread, self) != 0)
+		goto thread_failure;
+
+	return 0;
+
+thread_failure:
+	shard_destroy(self);
+init_failure:
+	aml_unref(aml);
+	return -1;
+}
+
+static void on_shard_stop(void* data)
+{
+	struct nvnc_shard* self = data;
+	shard_close_clients(self);
+	aml_exit(self->aml);
+}
+
+static void shard_stop_thread(struct nvnc_shard* self)
+{
+	if (loop_queue_post(&self->queue, on_shard_stop, self) < 0) {
+		log_error("Failed to stop a client loop cleanly\n");
+		aml_exit(self->aml);
+	}
+
+	pthread_join(self->thread, NULL);
+
+	shard_destroy(self);
+	aml_unref(self->aml);
+}
+
+static int bind_address_tcp(const char* name, int port)
+{
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+
+	struct addrinfo* result;
+
+	char service[256];
+	snprintf(service, sizeof(service), "%d", port);
+
+	int rc = getaddrinfo(name, service, &hints, &result);
+	if (rc != 0)
+		return -1;
+
+	int fd = -1;
+
+	for (struct addrinfo* p = result; p != NULL; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) < 0)
+			goto failure;
+
+		if (bind(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+
+failure:
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(result);
+	return fd;
+}
+
+static int bind_address_unix(const char* name)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(name) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, name);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int bind_address(const char* name, uint16_t port, enum addrtype type)
+{
+	switch (type) {
+	case ADDRTYPE_TCP:
+		return bind_address_tcp(name, port);
+	case ADDRTYPE_UNIX:
+		return bind_address_unix(name);
+	}
+
+	log_error("unknown socket address type");
+	abort();
+}
+
+static struct nvnc* open_common(const char* address, uint16_t port, enum addrtype type)
+{
+	aml_require_workers(nvnc__get_loop(), -1);
+
+	struct nvnc* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	strcpy(self->name, DEFAULT_NAME);
+	self->is_unix = type == ADDRTYPE_UNIX;
+
+	self->desktop = desktop_new();
+	if (!self->desktop)
+		goto desktop_failure;
+
+	if (shard_init(&self->main_shard, self, aml_get_default()) < 0)
+		goto shard_failure;
+
+	self->fd = bind_address(address, port, type);
+	if (self->fd < 0)
+		goto bind_failure;
+
+	if (listen(self->fd, 16) < 0)
+		goto listen_failure;
+
+	self->poll_handle = aml_handler_new(self->fd, on_connection, self, NULL);
+	if (!self->poll_handle)
+		goto handle_failure;
+
+	if (aml_start(nvnc__get_loop(), self->poll_handle) < 0)
+		goto poll_start_failure;
+
+	return self;
+
+poll_start_failure:
+	aml_unref(self->poll_handle);
+handle_failure:
+listen_failure:
+	close(self->fd);
+	if (type == ADDRTYPE_UNIX) {
+		unlink(address);
+	}
+bind_failure:
+	shard_destroy(&self->main_shard);
+shard_failure:
+	desktop_destroy(self->desktop);
+desktop_failure:
+	free(self);
+
+	return NULL;
+}
+
+EXPORT
+struct nvnc* nvnc_open(const char* address, uint16_t port)
+{
+	return open_common(address, port, ADDRTYPE_TCP);
+}
+
+EXPORT
+struct nvnc* nvnc_open_unix(const char* address)
+{
+	return open_common(address, 0, ADDRTYPE_UNIX);
+}
+
+EXPORT
+struct nvnc* nvnc_open_websocket(const char* address, uint16_t port)
+{
+	struct nvnc* self = open_common(address, port, ADDRTYPE_TCP);
+	if (self)
+		self->is_websocket = true;
+	return self;
+}
+
+static void unlink_fd_path(int fd)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if (getsockname(fd, (struct sockaddr*)&addr, &addr_len) == 0) {
+		if (addr.sun_family == AF_UNIX) {
+			unlink(addr.sun_path);
+		}
+	}
+}
+
+EXPORT
+void nvnc_close(struct nvnc* self)
+{
+	nvnc_cleanup_fn cleanup = self->common.cleanup_fn;
+	if (cleanup)
+		cleanup(self->common.userdata);
+
+	for (int i = 0; i < self->n_displays; ++i) {
+		self->displays[i]->server = NULL;
+		nvnc_display_unref(self->displays[i]);
+	}
+
+	for (int i = 0; i < self->n_shards; ++i)
+		shard_stop_thread(&self->shards[i]);
+	free(self->shards);
+
+	shard_close_clients(&self->main_shard);
+
+	/* Buffers that the threads were done with are released here */
+	loop_queue_dispatch(&self->main_shard.queue);
+	server_set_buffer(self, NULL);
+	shard_destroy(&self->main_shard);
+	desktop_destroy(self->desktop);
+
+	aml_stop(nvnc__get_loop(), self->poll_handle);
+	unlink_fd_path(self->fd);
+	close(self->fd);
+
+#ifdef ENABLE_TLS
+	if (self->tls_creds) {
+		gnutls_certificate_free_credentials(self->tls_creds);
+		gnutls_global_deinit();
+	}
+#endif
+
+	aml_unref(self->poll_handle);
+	free(self->recording_dir);
+	free(self);
+}
+
+static void client_push_frame_in_flight(struct nvnc_client* client)
+{
+	assert(client->n_frames_in_flight < MAX_FRAMES_IN_FLIGHT);
+
+	struct frame_in_flight* frame =
+		&client->frames_in_flight[client->n_frames_in_flight++];
+	frame->send_start_time = gettime_us();
+	frame->damage_time = client->update_damage_time;
+}
+
+/* Frames are written out in the order in which they were queued */
+static void client_pop_frame_in_flight(struct nvnc_client* client,
+		struct frame_in_flight* dst)
+{
+	assert(client->n_frames_in_flight > 0);
+
+	*dst = client->frames_in_flight[0];
+	memmove(&client->frames_in_flight[0], &client->frames_in_flight[1],
+			--client->n_frames_in_flight *
+			sizeof(client->frames_in_flight[0]));
+}
+
+static void client_record_frame_sent(struct nvnc_client* client,
+		const struct frame_in_flight* frame)
+{
+	struct nvnc_client_stats* stats = &client->stats;
+	uint64_t now = gettime_us();
+	uint64_t send_time = now - frame->send_start_time;
+
+	stats->frames_sent++;
+	stats->send_time += send_time;
+
+	uint32_t latency = 0;
+	if (frame->damage_time) {
+		latency = MIN(now - frame->damage_time, UINT32_MAX);
+
+		stats->damage_latency = stats->damage_latency ?
+			((uint64_t)stats->damage_latency * 3 + latency) / 4 :
+			latency;
+		stats->max_damage_latency =
+			MAX(stats->max_damage_latency, latency);
+	}
+
+	DTRACE_PROBE3(neatvnc, write_fb_done, client, send_time, latency);
+}
+
+static void on_write_frame_done(void* userdata, enum stream_req_status status)
+{
+	struct nvnc_client* client = userdata;
+
+	struct frame_in_flight frame;
+	client_pop_frame_in_flight(client, &frame);
+	if (status == STREAM_REQ_DONE) {
+		client_record_frame_sent(client, &frame);
+		client_start_rtt_probe(client);
+	}
+
+	process_fb_update_requests(client);
+	client_unref(client);
+}
+
+#ifdef ENABLE_OPEN_H264
+/* GPU buffers are encoded as they were fed rather than from the copy that
+ * was read back for the other encoders. Only the main loop has those at hand.
+ */
+static struct nvnc_fb* client_get_gpu_fb(struct nvnc_client* client)
+{
+	struct nvnc_display* display =
+		server_get_single_display(client->server);
+	if (client->shard->has_thread || !display)
+		return NULL;
+
+	struct nvnc_fb* fb = display->gpu_buffer;
+	return fb && fb->transform == NVNC_TRANSFORM_NORMAL ? fb : NULL;
+}
+#endif
+
+static enum rfb_encodings choose_frame_encoding(struct nvnc_client* client)
+{
+	for (size_t i = 0; i < client->n_encodings; ++i)
+		switch (client->encodings[i]) {
+		case RFB_ENCODING_RAW:
+		case RFB_ENCODING_TIGHT:
+		case RFB_ENCODING_ZRLE:
+			return client->encodings[i];
+#ifdef ENABLE_OPEN_H264
+		case RFB_ENCODING_OPEN_H264:
+			if (client_get_gpu_fb(client))
+				return client->encodings[i];
+			break;
+#endif
+#ifdef ENABLE_SHM
+		case RFB_ENCODING_SHM:
+			if (client->shm && client_can_use_shm(client))
+				return client->encodings[i];
+			break;
+#endif
+		default:
+			break;
+		}
+
+	return RFB_ENCODING_RAW;
+}
+
+static enum tight_quality client_get_tight_quality(struct nvnc_client* client)
+{
+	const struct nvnc_compression_policy* policy =
+		&client->server->compression_policy;
+
+	if (client->pixfmt.bits_per_pixel != 16 &&
+	    client->pixfmt.bits_per_pixel != 32)
+		return TIGHT_QUALITY_LOSSLESS;
+
+	for (size_t i = 0; i < client->n_encodings; ++i) {
+		enum rfb_encodings encoding = client->encodings[i];
+		if (!rfb_encoding_is_jpeg_quality(encoding))
+			continue;
+
+		int level = encoding - RFB_ENCODING_JPEG_LOWQ;
+
+		/* Trade quality for frame rate on a congested link */
+		if (policy->is_adaptive)
+			level = CLAMP(client->adaptive_quality,
+					policy->min_quality,
+					policy->max_quality);
+		else if (client->is_congested)
+			level /= 2;
+
+		return TIGHT_QUALITY_JPEG_0 + level;
+	}
+
+	return TIGHT_QUALITY_LOSSLESS;
+}
+
+static int client_get_compression_level(const struct nvnc_client* client)
+{
+	const struct nvnc_compression_policy* policy =
+		&client->server->compression_policy;
+	if (policy->is_adaptive)
+		return CLAMP(client->adaptive_level, policy->min_level,
+				policy->max_level);
+
+	for (size_t i = 0; i < client->n_encodings; ++i) {
+		enum rfb_encodings encoding = client->encodings[i];
+		if (rfb_encoding_is_compression_level(encoding))
+			return encoding - RFB_ENCODING_COMPRESSION_LEVEL_0;
+	}
+
+	return TIGHT_DEFAULT_COMPRESSION_LEVEL;
+}
+
+static bool client_has_encoding(const struct nvnc_client* client,
+		enum rfb_encodings encoding)
+{
+	for (size_t i = 0; i < client->n_encodings; ++i)
+		if (client->encodings[i] == encoding)
+			return true;
+
+	return false;
+}
+
+static void do_client_update_fb(void* work)
+{
+	struct fb_update_work* update = aml_get_userdata(work);
+	struct nvnc_client* client = update->client;
+	struct nvnc_fb* fb = update->fb;
+
+	enum rfb_encodings encoding = choose_frame_encoding(client);
+
+	switch (encoding) {
+	case RFB_ENCODING_RAW:
+		update->encode_rc = raw_frame_encode(&update->raw,
+				&update->frame, &client->pixfmt, fb,
+				&update->server_fmt, UPDATE_PART_SIZE);
+		break;
+	case RFB_ENCODING_TIGHT:
+	case RFB_ENCODING_ZRLE:
+		abort();
+		break;
+	default:
+		break;
+	}
+}
+
+static struct rcbuf* rcbuf_from_frame(struct nvnc_shard* shard,
+		struct vec* frame)
+{
+	return buf_pool_rcbuf_from_vec(shard->frame_pool, frame);
+}
+
+static void client_record_frame_encoded(struct nvnc_client* client,
+		size_t size)
+{
+	struct nvnc_client_stats* stats = &client->stats;
+	uint64_t now = gettime_us();
+	uint64_t encode_time = now - client->update_start_time;
+
+	stats->encode_time += encode_time;
+	client_adapt_compression(client, size, encode_time, now);
+
+	switch (client->update_encoding) {
+	case RFB_ENCODING_RAW: stats->raw_bytes += size; break;
+	case RFB_ENCODING_ZRLE: stats->zrle_bytes += size; break;
+	case RFB_ENCODING_TIGHT: stats->tight_bytes += size; break;
+	default:;
+	}
+
+	DTRACE_PROBE4(neatvnc, encode_fb_done, client, client->update_encoding,
+			size, encode_time);
+}
+
+/* Queues the part of the region that the client can copy from where it was in
+ * the previous frame. The rectangles are ordered so that none of them is
+ * overwritten before it has been copied from.
+ */
+static int client_queue_copy(struct nvnc_client* client,
+		struct pixman_region16* region, int dx, int dy)
+{
+	int n_rects = 0;
+	pixman_box16_t* rects = pixman_region_rectangles(region, &n_rects);
+
+	size_t n_queued = client->copies.len / sizeof(struct copy_rect);
+	if (n_queued + n_rects > MAX_PENDING_COPIES)
+		return -1;
+
+	if (vec_reserve(&client->copies, client->copies.len +
+				n_rects * sizeof(struct copy_rect)) < 0)
+		return -1;
+
+	bool is_reversed = dy > 0 || (dy == 0 && dx > 0);
+
+	for (int i = 0; i < n_rects; ++i) {
+		const pixman_box16_t* box = &rects[is_reversed ?
+			n_rects - 1 - i : i];
+
+		struct copy_rect copy = {
+			.rect = {
+				.x = htons(box->x1),
+				.y = htons(box->y1),
+				.width = htons(box->x2 - box->x1),
+				.height = htons(box->y2 - box->y1),
+				.encoding = htonl(RFB_ENCODING_COPYRECT),
+			},
+			.copy = {
+				.src_x = htons(box->x1 - dx),
+				.src_y = htons(box->y1 - dy),
+			},
+		};
+		vec_append(&client->copies, &copy, sizeof(copy));
+	}
+
+	return 0;
+}
+
+static void client_add_damage(struct nvnc_client* client,
+		struct pixman_region16* region)
+{
+	pixman_region_union(&client->damage, &client->damage, region);
+	tile_bitmap_add_region(&client->damage_tiles, region);
+}
+
+/* Copies that could not be sent leave the client without the pixels that they
+ * were supposed to move, so those have to be encoded after all.
+ */
+static void client_restore_copies(struct nvnc_client* client)
+{
+	struct copy_rect* copy;
+	vec_for(copy, &client->update_copies) {
+		int x = ntohs(copy->rect.x);
+		int y = ntohs(copy->rect.y);
+		int width = ntohs(copy->rect.width);
+		int height = ntohs(copy->rect.height);
+
+		pixman_region_union_rect(&client->damage, &client->damage,
+				x, y, width, height);
+		tile_bitmap_add_rect(&client->damage_tiles, x, y, width,
+				height);
+	}
+
+	vec_clear(&client->update_copies);
+}
+
+/* Neither the copies nor the damage of an update that failed have reached the
+ * client, so they are sent with the next one instead.
+ */
+static void client_restore_update(struct nvnc_client* client)
+{
+	client_restore_copies(client);
+	client_add_damage(client, &client->update_damage);
+	pixman_region_clear(&client->update_damage);
+}
+
+/* The request that the update was for still stands, so it is tried again a
+ * little later, rather than right away, in case whatever failed has not gone
+ * away.
+ */
+static void client_fail_update(struct nvnc_client* client)
+{
+	client_restore_update(client);
+	client_end_update(client);
+	client_defer_update(client);
+}
+
+static void on_copy_payload_free(void* payload, void* userdata)
+{
+	rcbuf_unref(userdata);
+}
+
+/* JPEG artefacts move along with the pixels that are copied, so the tiles that
+ * they land on must be refreshed too. This is done once the copies are sent,
+ * when the encoder is not touching the tiles.
+ */
+static void client_copy_lossy_tiles(struct nvnc_client* client)
+{
+	if (!client->has_tight_encoder)
+		return;
+
+	struct tile_bitmap* lossy = &client->tight_encoder.lossy_tiles;
+
+	struct copy_rect* copy;
+	vec_for(copy, &client->update_copies) {
+		int x = ntohs(copy->rect.x);
+		int y = ntohs(copy->rect.y);
+		int width = ntohs(copy->rect.width);
+		int height = ntohs(copy->rect.height);
+
+		if (tile_bitmap_test_rect(lossy, ntohs(copy->copy.src_x),
+					ntohs(copy->copy.src_y), width, height))
+			tile_bitmap_add_rect(lossy, x, y, width, height);
+	}
+}
+
+/* The copies must be applied before the encoded rectangles, so they are sent
+ * in front of them, under a common header. What is left of the payload to be
+ * sent is returned, or NULL if the whole update has been queued.
+ */
+static struct rcbuf* client_write_copies(struct nvnc_client* client,
+		struct rcbuf* payload)
+{
+	struct rfb_server_fb_update_msg* payload_head = payload->payload;
+	struct vec* copies = &client->update_copies;
+	size_t n_copies = copies->len / sizeof(struct copy_rect);
+	size_t body_size = payload->size - sizeof(*payload_head);
+
+	struct rfb_server_fb_update_msg head = {
+		.type = RFB_SERVER_TO_CLIENT_FRAMEBUFFER_UPDATE,
+		.n_rects = htons(ntohs(payload_head->n_rects) + n_copies),
+	};
+
+	size_t prefix_size = sizeof(head) + copies->len;
+	uint8_t* prefix_data = malloc(prefix_size);
+	if (!prefix_data)
+		goto failure;
+
+	memcpy(prefix_data, &head, sizeof(head));
+	memcpy(prefix_data + sizeof(head), copies->data, copies->len);
+
+	struct rcbuf* prefix = rcbuf_new(prefix_data, prefix_size);
+	if (!prefix) {
+		free(prefix_data);
+		goto failure;
+	}
+
+	struct rcbuf* body = NULL;
+	if (body_size > 0) {
+		body = rcbuf_new_with_free_fn((uint8_t*)payload->payload +
+				sizeof(*payload_head), body_size,
+				on_copy_payload_free, payload);
+		if (!body) {
+			rcbuf_unref(prefix);
+			goto failure;
+		}
+	} else {
+		rcbuf_unref(payload);
+	}
+
+	stream_send(client->net_stream, prefix,
+			body ? NULL : on_write_frame_done, client);
+
+	client->stats.copy_rects += n_copies;
+	client_copy_lossy_tiles(client);
+	vec_clear(copies);
+	return body;
+
+failure:
+	client_restore_copies(client);
+	return payload;
+}
+
+static void finish_fb_update(struct nvnc_client* client, struct rcbuf* payload)
+{
+	client_ref(client);
+
+	if (payload)
+		client_record_frame_encoded(client,
+				payload->size + client->update_chunk_bytes);
+	client->update_chunk_bytes = 0;
+
+	bool is_sent = payload &&
+		client->net_stream->state != STREAM_STATE_CLOSED;
+
+	if (is_sent) {
+		DTRACE_PROBE1(neatvnc, send_fb_start, client);
+		client_push_frame_in_flight(client);
+		if (client->update_copies.len > 0)
+			payload = client_write_copies(client, payload);
+		if (payload)
+			stream_send(client->net_stream, payload,
+					on_write_frame_done, client);
+		if (client->is_continuous)
+			send_fence_ping(client);
+		DTRACE_PROBE1(neatvnc, send_fb_done, client);
+		pixman_region_clear(&client->update_damage);
+	} else {
+		if (payload)
+			rcbuf_unref(payload);
+		client_fail_update(client);
+		client_unref(client);
+		return;
+	}
+
+	/* The encoder is done with the buffer, so the next frame can be
+	 * encoded while this one is on its way.
+	 */
+	client_end_update(client);
+
+	if (client->n_pending_requests > 0)
+		client->n_pending_requests--;
+
+	DTRACE_PROBE1(neatvnc, update_fb_done, client);
+
+	process_fb_update_requests(client);
+}
+
+/* Sends an update with nothing in it but the copies that are pending */
+static void client_send_copies_only(struct nvnc_client* client)
+{
+	struct rfb_server_fb_update_msg head = {
+		.type = RFB_SERVER_TO_CLIENT_FRAMEBUFFER_UPDATE,
+	};
+
+	tile_bitmap_clear(&client->damage_tiles);
+	finish_fb_update(client, rcbuf_from_mem(&head, sizeof(head)));
+}
+
+static void on_tight_encode_frame_done(struct vec* frame, void* userdata)
+{
+	struct nvnc_client* client = userdata;
+
+	struct pixman_region16 failed;
+	pixman_region_init(&failed);
+	tight_encoder_get_failed_region(&client->tight_encoder, &failed);
+	client_add_damage(client, &failed);
+	pixman_region_fini(&failed);
+
+	finish_fb_update(client,
+			frame ? rcbuf_from_frame(client->shard, frame) : NULL);
+	client_unref(client);
+}
+
+static void client_resume_update_fb(struct fb_update_work* update);
+
+static void on_update_part_sent(void* userdata, enum stream_req_status status)
+{
+	struct nvnc_client* client = userdata;
+	client->n_update_parts_in_flight--;
+
+	struct fb_update_work* update = client->update_work ?
+		aml_get_userdata(client->update_work) : NULL;
+	if (update && update->is_stalled) {
+		update->is_stalled = false;
+		client_resume_update_fb(update);
+	}
+
+	client_unref(client);
+}
+
+/* The first parts of an update go out on their own, each as a complete update
+ * message, so anything else that is sent in the meantime lands in between
+ * them. Only the last part counts as the frame when it comes to pacing and
+ * statistics. Copies go in front of whatever is sent first.
+ */
+static void client_send_update_part(struct nvnc_client* client,
+		struct rcbuf* payload)
 {
-	struct nvnc* server = client->server;
+	if (client->net_stream->state == STREAM_STATE_CLOSED) {
+		rcbuf_unref(payload);
+		return;
+	}
 
-	struct rfb_client_pointer_event_msg* msg =
-	        (struct rfb_client_pointer_event_msg*)(client->msg_buffer +
-	                                               client->buffer_index);
+	client->update_chunk_bytes += payload->size;
 
-	if (client->buffer_len - client->buffer_index < sizeof(*msg))
-		return 0;
+	if (client->update_copies.len > 0)
+		payload = client_write_copies(client, payload);
+	if (!payload)
+		return;
 
-	int button_mask = msg->button_mask;
-	uint16_t x = ntohs(msg->x);
-	uint16_t y = ntohs(msg->y);
+	client_ref(client);
+	client->n_update_parts_in_flight++;
+	stream_send(client->net_stream, payload, on_update_part_sent, client);
+}
 
-	nvnc_pointer_fn fn = server->pointer_fn;
-	if (fn)
-		fn(client, x, y, button_mask);
+static void on_tight_encode_chunk(struct vec* frame, void* userdata)
+{
+	struct nvnc_client* client = userdata;
 
-	return sizeof(*msg);
+	/* Parts where every tile failed are left out */
+	const struct rfb_server_fb_update_msg* head = frame->data;
+	if (head->n_rects == 0) {
+		vec_destroy(frame);
+		return;
+	}
+
+	struct rcbuf* payload = rcbuf_from_frame(client->shard, frame);
+	if (payload)
+		client_send_update_part(client, payload);
 }
 
-EXPORT
-void nvnc_send_cut_text(struct nvnc* server, const char* text, uint32_t len)
+static void on_zrle_encode_frame_done(struct vec* frame, void* userdata)
 {
-	struct rfb_cut_text_msg msg;
-
-	msg.type = RFB_SERVER_TO_CLIENT_SERVER_CUT_TEXT;
-	msg.length = htonl(len);
+	struct nvnc_client* client = userdata;
+	finish_fb_update(client,
+			frame ? rcbuf_from_frame(client->shard, frame) : NULL);
+	client_unref(client);
+}
 
-	struct nvnc_client* client;
-	LIST_FOREACH (client, &server->clients, link) {
-		stream_write(client->net_stream, &msg, sizeof(msg), NULL, NULL);
-		stream_write(client->net_stream, text, len, NULL, NULL);
-	}
+#ifdef ENABLE_OPEN_H264
+static void on_open_h264_frame_done(struct vec* frame, void* userdata)
+{
+	struct nvnc_client* client = userdata;
+	finish_fb_update(client,
+			frame ? rcbuf_from_frame(client->shard, frame) : NULL);
+	client_unref(client);
 }
+#endif
 
-static int on_client_cut_text(struct nvnc_client* client)
+static void client_end_update_fb(struct fb_update_work* update,
+		struct rcbuf* payload)
 {
-	struct nvnc* server = client->server;
-	nvnc_cut_text_fn fn = server->cut_text_fn;
-	struct rfb_cut_text_msg* msg =
-	        (struct rfb_cut_text_msg*)(client->msg_buffer +
-	                                   client->buffer_index);
+	struct nvnc_client* client = update->client;
 
-	size_t left_to_process = client->buffer_len - client->buffer_index;
+	nvnc_fb_unref(update->fb);
+	raw_frame_finish(&update->raw);
+	pixman_region_fini(&update->region);
 
-	if (left_to_process < sizeof(*msg))
-		return 0;
+	finish_fb_update(client, payload);
+	client_unref(client);
+}
 
-	uint32_t length = ntohl(msg->length);
-	uint32_t max_length = MAX_CUT_TEXT_SIZE;
+static void client_resume_update_fb(struct fb_update_work* update)
+{
+	struct nvnc_client* client = update->client;
 
-	/* Messages greater than this size are unsupported */
-	if (length > max_length) {
-		log_error("Copied text length (%d) is greater than max supported length (%d)\n",
-			length, max_length);
-		stream_close(client->net_stream);
-		client_unref(client);
-		return 0;
+	if (aml_start(nvnc__get_loop(), client->update_work) < 0) {
+		vec_destroy(&update->frame);
+		client_end_update_fb(update, NULL);
 	}
+}
 
-	size_t msg_size = sizeof(*msg) + length;
+static void on_client_update_fb_done(void* work)
+{
+	struct fb_update_work* update = aml_get_userdata(work);
+	struct nvnc_client* client = update->client;
+	struct nvnc_shard* shard = client->shard;
+	struct vec* frame = &update->frame;
 
-	if (msg_size <= left_to_process) {
-		if (fn)
-			fn(server, msg->text, length);
+	if (update->encode_rc <= 0) {
+		struct rcbuf* payload = NULL;
+		if (update->encode_rc == 0)
+			payload = rcbuf_from_frame(shard, frame);
+		else
+			vec_destroy(frame);
 
-		return msg_size;
+		client_end_update_fb(update, payload);
+		return;
 	}
 
-	assert(!client->cut_text.buffer);
+	struct rcbuf* payload = rcbuf_from_frame(shard, frame);
+	if (!payload) {
+		client_end_update_fb(update, NULL);
+		return;
+	}
 
-	client->cut_text.buffer = malloc(length);
-	if (!client->cut_text.buffer) {
-		log_error("OOM: %m\n");
-		stream_close(client->net_stream);
-		client_unref(client);
-		return 0;
+	client_send_update_part(client, payload);
+
+	if (buf_pool_acquire(shard->frame_pool, frame, UPDATE_PART_SIZE) < 0) {
+		client_end_update_fb(update, NULL);
+		return;
 	}
 
-	size_t partial_size = left_to_process - sizeof(*msg);
+	if (client->n_update_parts_in_flight >= MAX_UPDATE_PARTS_IN_FLIGHT) {
+		update->is_stalled = true;
+		return;
+	}
 
-	memcpy(client->cut_text.buffer, msg->text, partial_size);
+	client_resume_update_fb(update);
+}
 
-	client->cut_text.length = length;
-	client->cut_text.index = partial_size;
+static int send_extended_desktop_size(struct nvnc_client* client,
+		struct nvnc_fb* fb, enum rfb_resize_reason reason,
+		enum rfb_resize_status status)
+{
+	const struct desktop_layout* layout = &client->shard->layout;
 
-	return left_to_process;
+	struct vec payload;
+	if (vec_init(&payload, 64) < 0)
+		return -1;
+
+	encode_rect_count(&payload, 1);
+	encode_rect_head(&payload, RFB_ENCODING_EXTENDED_DESKTOPSIZE, reason,
+			status, nvnc_fb_get_logical_width(fb),
+			nvnc_fb_get_logical_height(fb));
+
+	struct rfb_extended_desktop_size_msg head = {
+		.n_screens = layout->n_screens,
+	};
+	vec_append(&payload, &head, sizeof(head));
+
+	for (int i = 0; i < layout->n_screens; ++i) {
+		const struct desktop_screen* screen = &layout->screens[i];
+		struct rfb_screen msg = {
+			.id = htonl(screen->id),
+			.x = htons(screen->x),
+			.y = htons(screen->y),
+			.width = htons(screen->width),
+			.height = htons(screen->height),
+		};
+		vec_append(&payload, &msg, sizeof(msg));
+	}
+
+	struct rcbuf* buf = rcbuf_new(payload.data, payload.len);
+	if (!buf) {
+		vec_destroy(&payload);
+		return -1;
+	}
+
+	stream_send(client->net_stream, buf, NULL, NULL);
+	client->known_layout_serial = layout->serial;
+	return 0;
 }
 
-static void process_big_cut_text(struct nvnc_client* client)
+#ifdef ENABLE_SHM
+/* Nothing tells the server when the client is done reading from the buffer
+ * other than the next update request, so continuous updates can't use it.
+ */
+static bool client_can_use_shm(const struct nvnc_client* client)
 {
-	struct nvnc* server = client->server;
-	nvnc_cut_text_fn fn = server->cut_text_fn;
+	return client->server->is_unix && !client->is_shm_failed &&
+		!client->is_continuous &&
+		client->net_stream->state == STREAM_STATE_NORMAL &&
+		client_has_encoding(client, RFB_ENCODING_SHM);
+}
 
-	assert(client->cut_text.length > client->cut_text.index);
+static bool client_needs_shm_buffer(const struct nvnc_client* client,
+		const struct nvnc_fb* fb)
+{
+	if (!client_can_use_shm(client))
+		return false;
 
-	void* start = client->cut_text.buffer + client->cut_text.index;
-	size_t space = client->cut_text.length - client->cut_text.index;
+	const struct shm_buffer* shm = client->shm;
+	return !shm || shm->fourcc_format != fb->fourcc_format ||
+		shm->width != nvnc_fb_get_logical_width(fb) ||
+		shm->height != nvnc_fb_get_logical_height(fb);
+}
 
-	space = MIN(space, MSG_BUFFER_SIZE);
+/* The client's picture is thrown out whenever it switches between a shared
+ * buffer and encoded frames, so all of it must be sent again.
+ */
+static void client_damage_all(struct nvnc_client* client,
+		const struct nvnc_fb* fb)
+{
+	uint16_t width = nvnc_fb_get_logical_width(fb);
+	uint16_t height = nvnc_fb_get_logical_height(fb);
 
-	ssize_t n_read = stream_read(client->net_stream, start, space);
+	vec_clear(&client->copies);
+	pixman_region_union_rect(&client->damage, &client->damage, 0, 0,
+			width, height);
+	tile_bitmap_set_all(&client->damage_tiles);
+}
 
-	if (n_read == 0)
-		return;
+static int send_shm_buffer(struct nvnc_client* client, struct nvnc_fb* fb)
+{
+	uint16_t width = nvnc_fb_get_logical_width(fb);
+	uint16_t height = nvnc_fb_get_logical_height(fb);
 
-	if (n_read < 0) {
-		if (errno != EAGAIN) {
-			log_debug("Client connection error: %p (ref %d)\n",
-				  client, client->ref);
-			stream_close(client->net_stream);
-			client_unref(client);
-		}
+	shm_buffer_destroy(client->shm);
+	client->shm = shm_buffer_new(width, height, fb->fourcc_format);
+	if (!client->shm)
+		goto failure;
 
-		return;
+	int fd = fcntl(client->shm->fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		goto failure;
+
+	struct vec payload;
+	if (vec_init(&payload, 32) < 0) {
+		close(fd);
+		goto failure;
 	}
 
-	client->cut_text.index += n_read;
+	encode_rect_count(&payload, 1);
+	encode_rect_head(&payload, RFB_ENCODING_SHM_BUFFER, 0, 0, width,
+			height);
 
-	if (client->cut_text.index != client->cut_text.length)
-		return;
+	struct rfb_shm_buffer_msg msg = {
+		.stride = htonl(client->shm->stride),
+		.fourcc_format = htonl(client->shm->fourcc_format),
+	};
+	vec_append(&payload, &msg, sizeof(msg));
 
-	if (fn)
-		fn(server, client->cut_text.buffer, client->cut_text.length);
+	struct rcbuf* buf = rcbuf_new(payload.data, payload.len);
+	if (!buf) {
+		vec_destroy(&payload);
+		close(fd);
+		goto failure;
+	}
 
-	free(client->cut_text.buffer);
-	client->cut_text.buffer = NULL;
+	stream_send_fd(client->net_stream, buf, fd, NULL, NULL);
+
+	/* The new buffer starts out empty */
+	client_damage_all(client, fb);
+	return 0;
+
+failure:
+	/* The client gets encoded frames instead */
+	log_debug("Failed to set up a shared buffer for client %p\n", client);
+	shm_buffer_destroy(client->shm);
+	client->shm = NULL;
+	client->is_shm_failed = true;
+	client_damage_all(client, fb);
+	return -1;
 }
 
-static int on_client_message(struct nvnc_client* client)
+static int send_shm_frame(struct nvnc_client* client, struct nvnc_fb* fb,
+		struct pixman_region16* damage)
 {
-	if (client->buffer_len - client->buffer_index < 1)
-		return 0;
+	if (shm_buffer_copy(client->shm, fb, damage) < 0) {
+		client->is_shm_failed = true;
+		return -1;
+	}
 
-	enum rfb_client_to_server_msg_type type =
-	        client->msg_buffer[client->buffer_index];
+	int n_rects = 0;
+	struct pixman_box16* box = pixman_region_rectangles(damage, &n_rects);
 
-	switch (type) {
-	case RFB_CLIENT_TO_SERVER_SET_PIXEL_FORMAT:
-		return on_client_set_pixel_format(client);
-	case RFB_CLIENT_TO_SERVER_SET_ENCODINGS:
-		return on_client_set_encodings(client);
-	case RFB_CLIENT_TO_SERVER_FRAMEBUFFER_UPDATE_REQUEST:
-		return on_client_fb_update_request(client);
-	case RFB_CLIENT_TO_SERVER_KEY_EVENT:
-		return on_client_key_event(client);
-	case RFB_CLIENT_TO_SERVER_POINTER_EVENT:
-		return on_client_pointer_event(client);
-	case RFB_CLIENT_TO_SERVER_CLIENT_CUT_TEXT:
-		return on_client_cut_text(client);
-	case RFB_CLIENT_TO_SERVER_QEMU:
-		return on_client_qemu_event(client);
+	struct vec frame;
+	size_t size = sizeof(struct rfb_server_fb_update_msg) +
+		n_rects * sizeof(struct rfb_server_fb_rect);
+	if (vec_init(&frame, size) < 0)
+		return -1;
+
+	encode_rect_count(&frame, n_rects);
+	for (int i = 0; i < n_rects; ++i)
+		encode_rect_head(&frame, RFB_ENCODING_SHM, box[i].x1, box[i].y1,
+				box[i].x2 - box[i].x1, box[i].y2 - box[i].y1);
+
+	struct rcbuf* payload = rcbuf_new(frame.data, frame.len);
+	if (!payload) {
+		vec_destroy(&frame);
+		return -1;
 	}
 
-	log_debug("Got uninterpretable message from client: %p (ref %d)\n",
-	          client, client->ref);
-	stream_close(client->net_stream);
-	client_unref(client);
+	finish_fb_update(client, payload);
 	return 0;
 }
+#endif
 
-static int try_read_client_message(struct nvnc_client* client)
+static bool client_needs_layout(const struct nvnc_client* client)
 {
-	switch (client->state) {
-	case VNC_CLIENT_STATE_ERROR:
-		return client->buffer_len - client->buffer_index;
-	case VNC_CLIENT_STATE_WAITING_FOR_VERSION:
-		return on_version_message(client);
-	case VNC_CLIENT_STATE_WAITING_FOR_SECURITY:
-		return on_security_message(client);
-	case VNC_CLIENT_STATE_WAITING_FOR_INIT:
-		return on_init_message(client);
-#ifdef ENABLE_TLS
-	case VNC_CLIENT_STATE_WAITING_FOR_VENCRYPT_VERSION:
-		return on_vencrypt_version_message(client);
-	case VNC_CLIENT_STATE_WAITING_FOR_VENCRYPT_SUBTYPE:
-		return on_vencrypt_subtype_message(client);
-	case VNC_CLIENT_STATE_WAITING_FOR_VENCRYPT_PLAIN_AUTH:
-		return on_vencrypt_plain_auth_message(client);
-#endif
-	case VNC_CLIENT_STATE_READY:
-		return on_client_message(client);
+	return client->shard->layout.n_screens > 0 &&
+		client->known_layout_serial != client->shard->layout.serial &&
+		client_has_encoding(client, RFB_ENCODING_EXTENDED_DESKTOPSIZE);
+}
+
+static int send_desktop_resize(struct nvnc_client* client, struct nvnc_fb* fb)
+{
+	bool has_extended = client_has_encoding(client,
+			RFB_ENCODING_EXTENDED_DESKTOPSIZE) &&
+		client->shard->layout.n_screens > 0;
+
+	if (!has_extended && !client_has_encoding(client,
+				RFB_ENCODING_DESKTOPSIZE)) {
+		log_error("Client does not support desktop resizing. Closing connection...\n");
+		stream_close(client->net_stream);
+		client_unref(client);
+		return -1;
+	}
+
+	uint16_t width = nvnc_fb_get_logical_width(fb);
+	uint16_t height = nvnc_fb_get_logical_height(fb);
+
+	/* Screens that move around within the same desktop only damage what
+	 * they cover, so the rest of the desktop stays as it is.
+	 */
+	if (width != client->known_width || height != client->known_height) {
+		client->known_width = width;
+		client->known_height = height;
+
+		/* Nothing that was on the screen before the resize can be
+		 * copied
+		 */
+		vec_clear(&client->copies);
+		client->has_full_frame = false;
+
+		if (client->has_tight_encoder)
+			tight_encoder_resize(&client->tight_encoder, width,
+					height);
+
+		pixman_region_union_rect(&client->damage, &client->damage, 0, 0,
+				width, height);
+
+		tile_bitmap_resize(&client->damage_tiles, width, height);
+		tile_bitmap_set_all(&client->damage_tiles);
 	}
 
-	abort();
+	if (has_extended)
+		return send_extended_desktop_size(client, fb,
+				RFB_RESIZE_REASON_SERVER,
+				RFB_RESIZE_STATUS_SUCCESS);
+
+	struct rfb_server_fb_update_msg head = {
+		.type = RFB_SERVER_TO_CLIENT_FRAMEBUFFER_UPDATE,
+		.n_rects = htons(1),
+	};
+
+	struct rfb_server_fb_rect rect = {
+		.encoding = htonl(RFB_ENCODING_DESKTOPSIZE),
+		.width = htons(width),
+		.height = htons(height),
+	};
+
+	stream_write(client->net_stream, &head, sizeof(head), NULL, NULL);
+	stream_write(client->net_stream, &rect, sizeof(rect), NULL, NULL);
+	return 0;
+}
+
+static bool client_needs_cursor(const struct nvnc_client* client)
+{
+	const struct nvnc_shard* shard = client->shard;
+	return shard->cursor && client->cursor_serial != shard->cursor_serial &&
+		client_has_encoding(client, RFB_ENCODING_CURSOR);
+}
+
+static int send_cursor_update(struct nvnc_client* client)
+{
+	struct vec payload;
+	if (vec_init(&payload, 4096) < 0)
+		return -1;
+
+	encode_rect_count(&payload, 1);
+
+	if (cursor_encode(&payload, &client->pixfmt, client->shard->cursor) < 0)
+		goto failure;
+
+	struct rcbuf* buf = rcbuf_new(payload.data, payload.len);
+	if (!buf)
+		goto failure;
+
+	stream_send(client->net_stream, buf, NULL, NULL);
+	client->cursor_serial = client->shard->cursor_serial;
+	return 0;
+
+failure:
+	vec_destroy(&payload);
+	return -1;
+}
+
+static int send_qemu_key_ext_frame(struct nvnc_client* client)
+{
+	struct rfb_server_fb_update_msg head = {
+		.type = RFB_SERVER_TO_CLIENT_FRAMEBUFFER_UPDATE,
+		.n_rects = htons(1),
+	};
+
+	struct rfb_server_fb_rect rect = {
+		.encoding = htonl(RFB_ENCODING_QEMU_EXT_KEY_EVENT),
+	};
+
+	stream_write(client->net_stream, &head, sizeof(head), NULL, NULL);
+	stream_write(client->net_stream, &rect, sizeof(rect), NULL, NULL);
 	return 0;
 }
 
-static void on_client_event(struct stream* stream, enum stream_event event)
+static struct fb_update_work* client_get_update_work(
+		struct nvnc_client* client)
 {
-	struct nvnc_client* client = stream->userdata;
+	if (client->update_work)
+		return aml_get_userdata(client->update_work);
 
-	assert(client->net_stream && client->net_stream == stream);
+	struct fb_update_work* work = calloc(1, sizeof(*work));
+	if (!work)
+		return NULL;
 
-	if (event == STREAM_EVENT_REMOTE_CLOSED) {
-		log_debug("Client %p (%d) hung up\n", client, client->ref);
-		stream_close(stream);
-		client_unref(client);
-		return;
-	}
+	work->client = client;
 
-	if (client->cut_text.buffer) {
-		process_big_cut_text(client);
-		return;
+	client->update_work = aml_work_new(do_client_update_fb,
+			on_client_update_fb_done, work, free);
+	if (!client->update_work) {
+		free(work);
+		return NULL;
 	}
 
-	assert(client->buffer_index == 0);
+	return work;
+}
 
-	void* start = client->msg_buffer + client->buffer_len;
-	size_t space = MSG_BUFFER_SIZE - client->buffer_len;
-	ssize_t n_read = stream_read(stream, start, space);
+int schedule_client_update_fb(struct nvnc_client* client,
+		struct pixman_region16* damage)
+{
+	struct nvnc_fb* fb = shard_get_fb(client->shard);
+	assert(fb);
 
-	if (n_read == 0)
-		return;
+	struct fb_update_work* work = client_get_update_work(client);
+	if (!work)
+		return -1;
 
-	if (n_read < 0) {
-		if (errno != EAGAIN) {
-			log_debug("Client connection error: %p (ref %d)\n",
-				  client, client->ref);
-			stream_close(stream);
-			client_unref(client);
-		}
+	if (rfb_pixfmt_from_fourcc(&work->server_fmt, fb->fourcc_format) < 0)
+		return -1;
 
-		return;
+	if (raw_frame_init(&work->raw, &client->pixfmt, damage) < 0)
+		return -1;
+
+	int rc = buf_pool_acquire(client->shard->frame_pool, &work->frame,
+			UPDATE_PART_SIZE);
+	if (rc < 0) {
+		raw_frame_finish(&work->raw);
+		return -1;
 	}
 
-	client->buffer_len += n_read;
+	work->fb = fb;
+	work->region = *damage;
+	work->encode_rc = -1;
+	work->is_stalled = false;
 
-	while (1) {
-		int rc = try_read_client_message(client);
-		if (rc == 0)
-			break;
+	client_ref(client);
+	nvnc_fb_ref(fb);
 
-		client->buffer_index += rc;
+	rc = aml_start(nvnc__get_loop(), client->update_work);
+	if (rc < 0)
+		goto start_failure;
 
-	}
+	return 0;
 
-	assert(client->buffer_index <= client->buffer_len);
+start_failure:
+	nvnc_fb_unref(fb);
+	client_unref(client);
+	pixman_region_fini(&work->region);
+	raw_frame_finish(&work->raw);
+	vec_destroy(&work->frame);
+	return -1;
+}
 
-	client->buffer_len -= client->buffer_index;
-	memmove(client->msg_buffer, client->msg_buffer + client->buffer_index,
-	        client->buffer_len);
-	client->buffer_index = 0;
+static bool pixfmt_equal(const struct rfb_pixel_format* a,
+		const struct rfb_pixel_format* b)
+{
+	return a->bits_per_pixel == b->bits_per_pixel &&
+		a->depth == b->depth &&
+		a->big_endian_flag == b->big_endian_flag &&
+		a->true_colour_flag == b->true_colour_flag &&
+		a->red_max == b->red_max &&
+		a->green_max == b->green_max &&
+		a->blue_max == b->blue_max &&
+		a->red_shift == b->red_shift &&
+		a->green_shift == b->green_shift &&
+		a->blue_shift == b->blue_shift;
 }
 
-static void on_connection(void* obj)
+/* ZRLE has a single zlib stream per connection that cannot be reset, so its
+ * output always depends on everything that the client has received before.
+ */
+static bool is_encoding_shareable(enum rfb_encodings encoding)
 {
-	struct nvnc* server = aml_get_userdata(obj);
+	switch (encoding) {
+	case RFB_ENCODING_RAW:
+	case RFB_ENCODING_TIGHT:
+		return true;
+	default:
+		break;
+	}
 
-	struct nvnc_client* client = calloc(1, sizeof(*client));
-	if (!client)
-		return;
+	return false;
+}
 
-	client->ref = 1;
-	client->server = server;
+/* A shared frame is only worth it if another client can actually use it, i.e.
+ * one has already been encoded or another client is waiting on the same
+ * damage. Otherwise, the client's own encoder keeps its stream state.
+ */
+static bool client_has_peers(struct nvnc_client* client,
+		enum rfb_encodings encoding, enum tight_quality quality,
+		struct nvnc_fb* fb, struct pixman_region16* damage)
+{
+	if (!is_encoding_shareable(encoding))
+		return false;
 
-	int fd = accept(server->fd, NULL, 0);
-	if (fd < 0) {
-		log_debug("Failed to accept a connection\n");
-		goto accept_failure;
-	}
+	if (shared_frame_find(client->shard, &client->pixfmt, encoding,
+				quality, fb, damage))
+		return true;
 
-	client->net_stream = stream_new(fd, on_client_event, client);
-	if (!client->net_stream) {
-		log_debug("OOM\n");
-		goto stream_failure;
-	}
+	struct nvnc_client* node;
+	LIST_FOREACH(node, &client->shard->clients, link) {
+		if (node == client || node->state != VNC_CLIENT_STATE_READY ||
+				!node->has_pixfmt ||
+				node->net_stream->state == STREAM_STATE_CLOSED)
+			continue;
 
-	int rc = deflateInit2(&client->z_stream,
-	                      /* compression level: */ 1,
-	                      /*            method: */ Z_DEFLATED,
-	                      /*       window bits: */ 15,
-	                      /*         mem level: */ 9,
-	                      /*          strategy: */ Z_DEFAULT_STRATEGY);
+		if (choose_frame_encoding(node) != encoding)
+			continue;
 
-	if (rc != Z_OK) {
-		log_debug("OOM\n");
-		goto deflate_failure;
-	}
+		if (encoding == RFB_ENCODING_TIGHT &&
+				client_get_tight_quality(node) != quality)
+			continue;
 
-	if (!server->display->buffer) {
-		log_debug("No display buffer has been set\n");
-		goto buffer_failure;
-	}
+		if (node->is_updating || !pixman_region_equal(&node->damage,
+					damage))
+			continue;
 
-	int width = server->display->buffer->width;
-	int height = server->display->buffer->height;
-	if (tight_encoder_init(&client->tight_encoder, width, height) < 0) {
-		log_debug("OOM\n");
-		goto tight_failure;
+		if (pixfmt_equal(&node->pixfmt, &client->pixfmt))
+			return true;
 	}
 
-	pixman_region_init(&client->damage);
+	return false;
+}
 
-	struct rcbuf* payload = rcbuf_from_string(RFB_VERSION_MESSAGE);
-	if (!payload) {
-		log_debug("OOM\n");
-		goto payload_failure;
-	}
+static void shared_frame_unref(struct shared_frame* self)
+{
+	assert(self->ref > 0);
 
-	stream_send(client->net_stream, payload, NULL, NULL);
+	if (--self->ref > 0)
+		return;
 
-	LIST_INSERT_HEAD(&server->clients, client, link);
+	assert(!self->is_cached);
+	assert(self->waiters.len == 0);
 
-	client->state = VNC_CLIENT_STATE_WAITING_FOR_VERSION;
+	if (self->payload)
+		rcbuf_unref(self->payload);
 
-	log_debug("New client connection: %p (ref %d)\n", client, client->ref);
+	vec_destroy(&self->frame);
+	vec_destroy(&self->waiters);
+	pixman_region_fini(&self->damage);
+	pixman_region_fini(&self->stale);
+	if (self->fb) {
+		nvnc_fb_release(self->fb);
+		nvnc_fb_unref(self->fb);
+	}
+	free(self);
+}
 
-	return;
+static void shared_frame_uncache(struct shared_frame* self)
+{
+	if (!self->is_cached)
+		return;
 
-payload_failure:
-	tight_encoder_destroy(&client->tight_encoder);
-	pixman_region_fini(&client->damage);
-tight_failure:
-buffer_failure:
-	deflateEnd(&client->z_stream);
-deflate_failure:
-	stream_destroy(client->net_stream);
-stream_failure:
-	close(fd);
-accept_failure:
-	free(client);
+	LIST_REMOVE(self, link);
+	self->is_cached = false;
+	shared_frame_unref(self);
 }
 
-static int bind_address_tcp(const char* name, int port)
+static void shared_frames_invalidate(struct nvnc_shard* self)
 {
-	struct addrinfo hints = {
-		.ai_socktype = SOCK_STREAM,
-		.ai_flags = AI_PASSIVE,
-	};
+	while (!LIST_EMPTY(&self->shared_frames))
+		shared_frame_uncache(LIST_FIRST(&self->shared_frames));
+}
 
-	struct addrinfo* result;
+static uint64_t region_area(struct pixman_region16* region)
+{
+	int n_boxes = 0;
+	struct pixman_box16* boxes = pixman_region_rectangles(region, &n_boxes);
 
-	char service[256];
-	snprintf(service, sizeof(service), "%d", port);
+	uint64_t area = 0;
+	for (int i = 0; i < n_boxes; ++i)
+		area += (uint64_t)(boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1);
 
-	int rc = getaddrinfo(name, service, &hints, &result);
-	if (rc != 0)
-		return -1;
+	return area;
+}
 
-	int fd = -1;
+/* Frames are only valid until the framebuffer changes, except for keyframes,
+ * which keep track of what has changed. A keyframe that would leave more than
+ * half of the screen to be sent again is not worth keeping.
+ */
+static void shared_frames_age(struct nvnc_shard* self,
+		struct pixman_region16* damage)
+{
+	struct shared_frame* frame;
+	struct shared_frame* tmp;
 
-	for (struct addrinfo* p = result; p != NULL; p = p->ai_next) {
-		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (fd < 0)
+	LIST_FOREACH_SAFE (frame, &self->shared_frames, link, tmp) {
+		if (!frame->is_keyframe) {
+			shared_frame_uncache(frame);
 			continue;
+		}
 
-		int one = 1;
-		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) < 0)
-			goto failure;
-
-		if (bind(fd, p->ai_addr, p->ai_addrlen) == 0)
-			break;
+		pixman_region_union(&frame->stale, &frame->stale, damage);
 
-failure:
-		close(fd);
-		fd = -1;
+		uint64_t area = (uint64_t)frame->width * frame->height;
+		if (region_area(&frame->stale) > area / 2)
+			shared_frame_uncache(frame);
 	}
-
-	freeaddrinfo(result);
-	return fd;
 }
 
-static int bind_address_unix(const char* name)
+/* Each keyframe is a whole frame's worth of memory, so only the most recently
+ * used ones are kept.
+ */
+static void shared_keyframes_trim(struct nvnc_shard* self)
 {
-	struct sockaddr_un addr = {
-		.sun_family = AF_UNIX,
-	};
-
-	if (strlen(name) >= sizeof(addr.sun_path)) {
-		errno = ENAMETOOLONG;
-		return -1;
-	}
-	strcpy(addr.sun_path, name);
+	struct shared_frame* frame;
+	struct shared_frame* tmp;
+	int n_keyframes = 0;
 
-	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (fd < 0)
-		return -1;
+	LIST_FOREACH_SAFE (frame, &self->shared_frames, link, tmp)
+		if (frame->is_keyframe && ++n_keyframes > SHARED_MAX_KEYFRAMES)
+			shared_frame_uncache(frame);
+}
 
-	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
-		close(fd);
-		return -1;
-	}
+static struct shared_frame* shared_keyframe_find(struct nvnc_shard* shard,
+		const struct rfb_pixel_format* pixfmt,
+		const struct rfb_pixel_format* server_fmt,
+		enum rfb_encodings encoding, enum tight_quality quality,
+		struct nvnc_fb* fb)
+{
+	uint16_t width = nvnc_fb_get_logical_width(fb);
+	uint16_t height = nvnc_fb_get_logical_height(fb);
+
+	struct shared_frame* frame;
+	LIST_FOREACH(frame, &shard->shared_frames, link)
+		if (frame->is_keyframe && frame->encoding == encoding &&
+				frame->quality == quality &&
+				frame->width == width &&
+				frame->height == height &&
+				pixfmt_equal(&frame->pixfmt, pixfmt) &&
+				pixfmt_equal(&frame->server_fmt, server_fmt))
+			return frame;
 
-	return fd;
+	return NULL;
 }
 
-static int bind_address(const char* name, uint16_t port, enum addrtype type)
+static struct shared_frame* shared_frame_find(struct nvnc_shard* shard,
+		const struct rfb_pixel_format* pixfmt,
+		enum rfb_encodings encoding, enum tight_quality quality,
+		struct nvnc_fb* fb, struct pixman_region16* damage)
 {
-	switch (type) {
-	case ADDRTYPE_TCP:
-		return bind_address_tcp(name, port);
-	case ADDRTYPE_UNIX:
-		return bind_address_unix(name);
-	}
+	struct shared_frame* frame;
+	LIST_FOREACH(frame, &shard->shared_frames, link)
+		if (frame->fb == fb && frame->encoding == encoding &&
+				frame->quality == quality &&
+				pixfmt_equal(&frame->pixfmt, pixfmt) &&
+				pixman_region_equal(&frame->damage, damage))
+			return frame;
 
-	log_error("unknown socket address type");
-	abort();
+	return NULL;
 }
 
-static struct nvnc* open_common(const char* address, uint16_t port, enum addrtype type)
+static struct shared_frame* shared_frame_new(struct nvnc_shard* shard,
+		const struct rfb_pixel_format* pixfmt,
+		const struct rfb_pixel_format* server_fmt,
+		enum rfb_encodings encoding, enum tight_quality quality,
+		struct nvnc_fb* fb, struct pixman_region16* damage,
+		bool is_keyframe)
 {
-	aml_require_workers(aml_get_default(), -1);
-
-	struct nvnc* self = calloc(1, sizeof(*self));
+	struct shared_frame* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	strcpy(self->name, DEFAULT_NAME);
+	self->ref = 1;
+	self->shard = shard;
+	self->pixfmt = *pixfmt;
+	self->server_fmt = *server_fmt;
+	self->encoding = encoding;
+	self->quality = quality;
+	self->is_keyframe = is_keyframe;
+	self->width = nvnc_fb_get_logical_width(fb);
+	self->height = nvnc_fb_get_logical_height(fb);
+
+	pixman_region_init(&self->damage);
+	pixman_region_copy(&self->damage, damage);
+	pixman_region_init(&self->stale);
+
+	self->fb = fb;
+	nvnc_fb_ref(fb);
+	nvnc_fb_hold(fb);
 
-	LIST_INIT(&self->clients);
+	return self;
+}
 
-	self->fd = bind_address(address, port, type);
-	if (self->fd < 0)
-		goto bind_failure;
+static void shared_frame_deliver(struct shared_frame* self,
+		struct nvnc_client* client)
+{
+	assert(self->payload);
 
-	if (listen(self->fd, 16) < 0)
-		goto listen_failure;
+	bool is_lossy = self->quality != TIGHT_QUALITY_LOSSLESS;
 
-	self->poll_handle = aml_handler_new(self->fd, on_connection, self, NULL);
-	if (!self->poll_handle)
-		goto handle_failure;
+	/* The encoder is also what keeps track of JPEG tiles to refresh */
+	if (self->encoding == RFB_ENCODING_TIGHT && is_lossy)
+		client_ensure_tight_encoder(client, self->width, self->height);
 
-	if (aml_start(aml_get_default(), self->poll_handle) < 0)
-		goto poll_start_failure;
+	/* The client's tight decoder has been reset by this frame, so its
+	 * private encoder must be reset too.
+	 */
+	if (self->encoding == RFB_ENCODING_TIGHT)
+		client->has_shared_tight_frame = true;
 
-	return self;
+	if (self->encoding == RFB_ENCODING_TIGHT && client->has_tight_encoder) {
+		tight_encoder_request_reset(&client->tight_encoder);
+		tight_encoder_mark_sent(&client->tight_encoder, &self->damage,
+				is_lossy);
+	}
 
-poll_start_failure:
-	aml_unref(self->poll_handle);
-handle_failure:
-listen_failure:
-	close(self->fd);
-	if (type == ADDRTYPE_UNIX) {
-		unlink(address);
+	client_add_damage(client, &self->stale);
+
+	rcbuf_ref(self->payload);
+	finish_fb_update(client, self->payload);
+}
+
+static void shared_frame_finish(struct shared_frame* self,
+		struct rcbuf* payload)
+{
+	self->payload = payload;
+	self->is_done = true;
+
+	if (!payload)
+		shared_frame_uncache(self);
+
+	struct vec waiters = self->waiters;
+	vec_init(&self->waiters, 0);
+
+	struct nvnc_client** client;
+	vec_for(client, &waiters) {
+		if (payload)
+			shared_frame_deliver(self, *client);
+		else
+			client_fail_update(*client);
+
+		client_unref(*client);
 	}
-bind_failure:
-	free(self);
 
-	return NULL;
+	vec_destroy(&waiters);
+
+	/* The buffer can go back to the pool; the keyframe has what it needs */
+	if (self->is_keyframe && payload) {
+		nvnc_fb_release(self->fb);
+		nvnc_fb_unref(self->fb);
+		self->fb = NULL;
+	}
+
+	shared_frame_unref(self);
 }
 
-EXPORT
-struct nvnc* nvnc_open(const char* address, uint16_t port)
+static int shared_frame_attach(struct shared_frame* self,
+		struct nvnc_client* client)
 {
-	return open_common(address, port, ADDRTYPE_TCP);
+	if (self->is_done) {
+		shared_frame_deliver(self, client);
+		return 0;
+	}
+
+	if (vec_append(&self->waiters, &client, sizeof(client)) < 0)
+		return -1;
+
+	client_ref(client);
+	return 0;
 }
 
-EXPORT
-struct nvnc* nvnc_open_unix(const char* address)
+static void do_shared_frame_raw(void* work)
 {
-	return open_common(address, 0, ADDRTYPE_UNIX);
+	struct shared_frame* self = aml_get_userdata(work);
+	raw_encode_frame(&self->frame, &self->pixfmt, self->fb,
+			&self->server_fmt, &self->damage);
 }
 
-static void unlink_fd_path(int fd)
+static void on_shared_frame_raw_done(void* work)
 {
-	struct sockaddr_un addr;
-	socklen_t addr_len = sizeof(addr);
+	struct shared_frame* self = aml_get_userdata(work);
 
-	if (getsockname(fd, (struct sockaddr*)&addr, &addr_len) == 0) {
-		if (addr.sun_family == AF_UNIX) {
-			unlink(addr.sun_path);
-		}
-	}
+	struct rcbuf* payload = rcbuf_from_frame(self->shard, &self->frame);
+	memset(&self->frame, 0, sizeof(self->frame));
+
+	shared_frame_finish(self, payload);
 }
 
-EXPORT
-void nvnc_close(struct nvnc* self)
+static int shared_frame_encode_raw(struct shared_frame* self)
 {
-	struct nvnc_client* client;
-
-	nvnc_cleanup_fn cleanup = self->common.cleanup_fn;
-	if (cleanup)
-		cleanup(self->common.userdata);
+	struct nvnc_fb* fb = self->fb;
+	size_t size = nvnc_fb_get_logical_width(fb) *
+		nvnc_fb_get_logical_height(fb) * 3 / 2;
 
-	if (self->display)
-		nvnc_display_unref(self->display);
+	if (buf_pool_acquire(self->shard->frame_pool, &self->frame, size) < 0)
+		return -1;
 
-	struct nvnc_client* tmp;
-	LIST_FOREACH_SAFE (client, &self->clients, link, tmp)
-		client_unref(client);
+	struct aml_work* work = aml_work_new(do_shared_frame_raw,
+			on_shared_frame_raw_done, self, NULL);
+	if (!work)
+		return -1;
 
-	aml_stop(aml_get_default(), self->poll_handle);
-	unlink_fd_path(self->fd);
-	close(self->fd);
+	self->ref++;
 
-#ifdef ENABLE_TLS
-	if (self->tls_creds) {
-		gnutls_certificate_free_credentials(self->tls_creds);
-		gnutls_global_deinit();
-	}
-#endif
+	int rc = aml_start(nvnc__get_loop(), work);
+	aml_unref(work);
+	if (rc < 0)
+		self->ref--;
 
-	aml_unref(self->poll_handle);
-	free(self);
+	return rc;
 }
 
-static void on_write_frame_done(void* userdata, enum stream_req_status status)
+static void on_shared_tight_frame_done(struct vec* frame, void* userdata)
 {
-	struct nvnc_client* client = userdata;
-	client->is_updating = false;
-	assert(client->current_fb);
-	nvnc_fb_release(client->current_fb);
-	nvnc_fb_unref(client->current_fb);
-	client->current_fb = NULL;
-	process_fb_update_requests(client);
-	client_unref(client);
-}
+	struct shared_frame* self = userdata;
+	self->shard->is_shared_tight_busy = false;
 
-static enum rfb_encodings choose_frame_encoding(struct nvnc_client* client)
-{
-	for (size_t i = 0; i < client->n_encodings; ++i)
-		switch (client->encodings[i]) {
-		case RFB_ENCODING_RAW:
-		case RFB_ENCODING_TIGHT:
-		case RFB_ENCODING_ZRLE:
-			return client->encodings[i];
-		default:
-			break;
-		}
+	/* Whatever the frame is missing goes to every client that gets it */
+	tight_encoder_get_failed_region(&self->shard->shared_tight_encoder,
+			&self->stale);
 
-	return RFB_ENCODING_RAW;
+	shared_frame_finish(self, rcbuf_from_frame(self->shard, frame));
 }
 
-static enum tight_quality client_get_tight_quality(struct nvnc_client* client)
+static int shared_frame_encode_tight(struct shared_frame* self)
 {
-	if (client->pixfmt.bits_per_pixel != 16 &&
-	    client->pixfmt.bits_per_pixel != 32)
-		return TIGHT_QUALITY_LOSSLESS;
+	struct nvnc_shard* shard = self->shard;
+	struct tight_encoder* encoder = &shard->shared_tight_encoder;
+	uint32_t width = nvnc_fb_get_logical_width(self->fb);
+	uint32_t height = nvnc_fb_get_logical_height(self->fb);
 
-	for (size_t i = 0; i < client->n_encodings; ++i)
-		switch (client->encodings[i]) {
-		case RFB_ENCODING_JPEG_HIGHQ: return TIGHT_QUALITY_HIGH;
-		case RFB_ENCODING_JPEG_LOWQ: return TIGHT_QUALITY_LOW;
-		default:;
-		}
+	if (shard->is_shared_tight_busy)
+		return -1;
 
-	return TIGHT_QUALITY_LOSSLESS;
-}
+	if (!shard->has_shared_tight_encoder) {
+		if (tight_encoder_init(encoder, width, height,
+					shard->frame_pool) < 0)
+			return -1;
 
-static bool client_has_encoding(const struct nvnc_client* client,
-		enum rfb_encodings encoding)
-{
-	for (size_t i = 0; i < client->n_encodings; ++i)
-		if (client->encodings[i] == encoding)
-			return true;
+		tight_encoder_set_tile_cache(encoder, shard->tile_cache);
+		shard->has_shared_tight_encoder = true;
+	} else if (encoder->width != width || encoder->height != height) {
+		if (tight_encoder_resize(encoder, width, height) < 0)
+			return -1;
+	}
 
-	return false;
+	/* Every shared frame starts from fresh zlib streams so that it can be
+	 * sent to any client, regardless of what it has received before.
+	 */
+	tight_encoder_request_reset(encoder);
+
+	self->ref++;
+	shard->is_shared_tight_busy = true;
+
+	int rc = tight_encode_frame(encoder, &self->pixfmt, self->fb,
+			&self->server_fmt, &self->damage, NULL, self->quality,
+			on_shared_tight_frame_done, self);
+	if (rc < 0) {
+		shard->is_shared_tight_busy = false;
+		self->ref--;
+	}
+
+	return rc;
 }
 
-static void do_client_update_fb(void* work)
+static int schedule_shared_update(struct nvnc_client* client,
+		struct nvnc_fb* fb, const struct rfb_pixel_format* server_fmt,
+		struct pixman_region16* damage, enum rfb_encodings encoding,
+		enum tight_quality quality, bool is_keyframe)
 {
-	struct fb_update_work* update = aml_get_userdata(work);
-	struct nvnc_client* client = update->client;
-	struct nvnc_fb* fb = update->fb;
-
-	enum rfb_encodings encoding = choose_frame_encoding(client);
+	struct nvnc_shard* shard = client->shard;
+	struct shared_frame* frame = NULL;
+
+	if (is_keyframe)
+		frame = shared_keyframe_find(shard, &client->pixfmt, server_fmt,
+				encoding, quality, fb);
+	if (!frame)
+		frame = shared_frame_find(shard, &client->pixfmt, encoding,
+				quality, fb, damage);
+	if (frame)
+		return shared_frame_attach(frame, client);
+
+	frame = shared_frame_new(shard, &client->pixfmt, server_fmt, encoding,
+			quality, fb, damage, is_keyframe);
+	if (!frame)
+		return -1;
 
+	int rc = -1;
 	switch (encoding) {
 	case RFB_ENCODING_RAW:
-		raw_encode_frame(&update->frame, &client->pixfmt, fb,
-		                 &update->server_fmt, &update->region);
+		rc = shared_frame_encode_raw(frame);
 		break;
 	case RFB_ENCODING_TIGHT:
-		abort();
-		break;
-	case RFB_ENCODING_ZRLE:
-		zrle_encode_frame(&client->z_stream, &update->frame,
-		                  &client->pixfmt, fb, &update->server_fmt,
-		                  &update->region);
+		rc = shared_frame_encode_tight(frame);
 		break;
 	default:
 		break;
 	}
-}
 
-static void finish_fb_update(struct nvnc_client* client, struct vec* frame)
-{
-	client_ref(client);
+	if (rc < 0)
+		goto failure;
 
-	if (client->net_stream->state != STREAM_STATE_CLOSED) {
-		struct rcbuf* payload = rcbuf_new(frame->data, frame->len);
-		DTRACE_PROBE1(neatvnc, send_fb_start, client);
-		stream_send(client->net_stream, payload, on_write_frame_done,
-		            client);
-		DTRACE_PROBE1(neatvnc, send_fb_done, client);
-	} else {
-		client->is_updating = false;
-		assert(client->current_fb);
-		nvnc_fb_release(client->current_fb);
-		nvnc_fb_unref(client->current_fb);
-		client->current_fb = NULL;
-		vec_destroy(frame);
-		process_fb_update_requests(client);
-		client_unref(client);
-	}
+	LIST_INSERT_HEAD(&shard->shared_frames, frame, link);
+	frame->is_cached = true;
+	frame->ref++;
+	shared_keyframes_trim(shard);
 
-	client->n_pending_requests--;
+	rc = shared_frame_attach(frame, client);
 
-	DTRACE_PROBE1(neatvnc, update_fb_done, client);
+	/* The cache and the encoding job hold their own references */
+	shared_frame_unref(frame);
+	return rc;
+
+failure:
+	shared_frame_unref(frame);
+	return -1;
 }
 
-static void on_tight_encode_frame_done(struct vec* frame, void* userdata)
+static bool client_can_copy(const struct nvnc_client* client,
+		const struct nvnc_fb* fb)
 {
-	struct nvnc_client* client = userdata;
-	finish_fb_update(client, frame);
-	client_unref(client);
+#ifdef ENABLE_SHM
+	/* The shared buffer only gets the pixels that are damaged, so the
+	 * source of a copy would be missing from it.
+	 */
+	if (client->shm && client_can_use_shm(client))
+		return false;
+#endif
+
+	return client->has_full_frame &&
+		client_has_encoding(client, RFB_ENCODING_COPYRECT) &&
+		client->known_width == nvnc_fb_get_logical_width(fb) &&
+		client->known_height == nvnc_fb_get_logical_height(fb);
 }
 
-static void on_client_update_fb_done(void* work)
+/* Takes the part of the copy that the client can make out of the damage. That
+ * is wherever the source pixels are the same on the client as they were in the
+ * previous frame, i.e. not covered by damage that has not been sent yet.
+ */
+static bool client_take_copy(struct nvnc_client* client,
+		const struct damage_copy* copy, struct pixman_region16* damage)
 {
-	struct fb_update_work* update = aml_get_userdata(work);
-	struct nvnc_client* client = update->client;
-	struct vec* frame = &update->frame;
+	struct pixman_region16 dest;
+	pixman_region_init(&dest);
+	pixman_region_copy(&dest, &client->damage);
+	pixman_region_translate(&dest, copy->dx, copy->dy);
+	pixman_region_subtract(&dest, (struct pixman_region16*)&copy->region,
+			&dest);
+
+	bool ok = pixman_region_not_empty(&dest) &&
+		client_queue_copy(client, &dest, copy->dx, copy->dy) == 0;
+	if (ok) {
+		pixman_region_subtract(&client->damage, &client->damage, &dest);
+		pixman_region_subtract(damage, damage, &dest);
+
+		/* Tiles of earlier damage that the copy covers must not be
+		 * encoded again.
+		 */
+		tile_bitmap_clear(&client->damage_tiles);
+		tile_bitmap_add_region(&client->damage_tiles, &client->damage);
+	}
 
-	nvnc_fb_unref(update->fb);
+	pixman_region_fini(&dest);
+	return ok;
+}
 
-	finish_fb_update(client, frame);
+static void shard_damage_region(struct nvnc_shard* self,
+		const struct pixman_region16* damage,
+		const struct damage_copy* copy)
+{
+	struct nvnc_client* client;
+	uint64_t now = gettime_us();
 
-	pixman_region_fini(&update->region);
+	shared_frames_age(self, (struct pixman_region16*)damage);
 
-	client_unref(client);
-}
+	if (!pixman_region_not_empty((struct pixman_region16*)damage))
+		return;
 
-static int send_desktop_resize(struct nvnc_client* client, struct nvnc_fb* fb)
-{
-	if (!client_has_encoding(client, RFB_ENCODING_DESKTOPSIZE)) {
-		log_error("Client does not support desktop resizing. Closing connection...\n");
-		stream_close(client->net_stream);
-		client_unref(client);
-		return -1;
+	/* The damage is aligned to the tile grid once and then merged into
+	 * each client's tile map.
+	 */
+	struct nvnc_fb* fb = shard_get_fb(self);
+	bool have_tiles = fb && tile_bitmap_resize(&self->damage_tiles,
+			nvnc_fb_get_logical_width(fb),
+			nvnc_fb_get_logical_height(fb)) == 0;
+	if (have_tiles) {
+		tile_bitmap_clear(&self->damage_tiles);
+		tile_bitmap_add_region(&self->damage_tiles,
+				(struct pixman_region16*)damage);
 	}
 
-	client->known_width = fb->width;
-	client->known_height = fb->height;
+	LIST_FOREACH(client, &self->clients, link) {
+		if (client->net_stream->state == STREAM_STATE_CLOSED)
+			continue;
 
-	tight_encoder_resize(&client->tight_encoder, fb->width, fb->height);
+		/* Damage that lands on top of damage that has not been sent
+		 * yet means that the client never gets to see the frame
+		 * before this one.
+		 */
+		if (pixman_region_not_empty(&client->damage)) {
+			client->stats.frames_skipped++;
+			DTRACE_PROBE1(neatvnc, update_fb_skipped, client);
+		}
 
-	pixman_region_union_rect(&client->damage, &client->damage, 0, 0,
-			fb->width, fb->height);
+		client_mark_damaged(client, now);
+		client->last_damage_time = now;
+
+		if (copy && fb && client_can_copy(client, fb)) {
+			struct pixman_region16 remaining;
+			pixman_region_init(&remaining);
+			pixman_region_copy(&remaining,
+					(struct pixman_region16*)damage);
+
+			if (client_take_copy(client, copy, &remaining)) {
+				pixman_region_union(&client->damage,
+						&client->damage, &remaining);
+				tile_bitmap_add_region(&client->damage_tiles,
+						&remaining);
+				pixman_region_fini(&remaining);
+				continue;
+			}
+
+			pixman_region_fini(&remaining);
+		}
 
-	struct rfb_server_fb_update_msg head = {
-		.type = RFB_SERVER_TO_CLIENT_FRAMEBUFFER_UPDATE,
-		.n_rects = htons(1),
-	};
+		pixman_region_union(&client->damage, &client->damage,
+				    (struct pixman_region16*)damage);
 
-	struct rfb_server_fb_rect rect = {
-		.encoding = htonl(RFB_ENCODING_DESKTOPSIZE),
-		.width = htons(fb->width),
-		.height = htons(fb->height),
-	};
+		if (!have_tiles || tile_bitmap_or(&client->damage_tiles,
+					&self->damage_tiles) < 0)
+			tile_bitmap_add_region(&client->damage_tiles,
+					(struct pixman_region16*)damage);
+	}
 
-	stream_write(client->net_stream, &head, sizeof(head), NULL, NULL);
-	stream_write(client->net_stream, &rect, sizeof(rect), NULL, NULL);
-	return 0;
+	LIST_FOREACH(client, &self->clients, link)
+		process_fb_update_requests(client);
 }
 
-static int send_qemu_key_ext_frame(struct nvnc_client* client)
+static void server_set_buffer(struct nvnc* self, struct nvnc_fb* fb)
 {
-	struct rfb_server_fb_update_msg head = {
-		.type = RFB_SERVER_TO_CLIENT_FRAMEBUFFER_UPDATE,
-		.n_rects = htons(1),
-	};
+	if (fb) {
+		nvnc_fb_ref(fb);
+		nvnc_fb_hold(fb);
+	}
 
-	struct rfb_server_fb_rect rect = {
-		.encoding = htonl(RFB_ENCODING_QEMU_EXT_KEY_EVENT),
-	};
+	if (self->buffer) {
+		nvnc_fb_release(self->buffer);
+		nvnc_fb_unref(self->buffer);
+	}
 
-	stream_write(client->net_stream, &head, sizeof(head), NULL, NULL);
-	stream_write(client->net_stream, &rect, sizeof(rect), NULL, NULL);
-	return 0;
+	self->buffer = fb;
 }
 
-int schedule_client_update_fb(struct nvnc_client* client,
-		struct pixman_region16* damage)
+/* A single display at the origin is the whole desktop, so its buffer can be
+ * handed to the clients as it is.
+ */
+static struct nvnc_display* server_get_single_display(const struct nvnc* self)
 {
-	struct nvnc_fb* fb = client->server->display->buffer;
-	assert(fb);
-
-	struct fb_update_work* work = calloc(1, sizeof(*work));
-	if (!work)
-		return -1;
-
-	if (rfb_pixfmt_from_fourcc(&work->server_fmt, fb->fourcc_format) < 0)
-		goto pixfmt_failure;
+	const struct desktop_layout* layout = &self->layout;
+	if (layout->n_screens != 1 || layout->screens[0].x != 0 ||
+			layout->screens[0].y != 0)
+		return NULL;
 
-	work->client = client;
-	work->fb = fb;
-	work->region = *damage;
+	for (int i = 0; i < self->n_displays; ++i)
+		if (self->displays[i]->id == layout->screens[0].id)
+			return self->displays[i];
 
-	int rc = vec_init(&work->frame, fb->width * fb->height * 3 / 2);
-	if (rc < 0)
-		goto vec_failure;
+	return NULL;
+}
 
-	client_ref(client);
-	nvnc_fb_ref(fb);
+/* The damage and copy are in desktop coordinates */
+static void server_present(struct nvnc* self, struct pixman_region16* damage,
+		const struct damage_copy* copy)
+{
+	bool is_layout_changed = desktop_layout_update(&self->layout,
+			self->displays, self->n_displays, damage);
+
+	struct nvnc_fb* fb = NULL;
+	struct nvnc_display* single = server_get_single_display(self);
+	if (single) {
+		/* Buffers that were composed before are still brought up to
+		 * date if they come back into use.
+		 */
+		desktop_damage(self->desktop, damage);
+		server_set_buffer(self, single->buffer);
+		fb = single->buffer;
+	} else if (self->layout.n_screens > 0) {
+		fb = desktop_compose(self->desktop, &self->layout,
+				self->displays, self->n_displays, damage);
+		if (!fb) {
+			log_error("Failed to compose the desktop\n");
+			return;
+		}
 
-	struct aml_work* obj =
-		aml_work_new(do_client_update_fb, on_client_update_fb_done,
-		             work, free);
-	if (!obj) {
-		goto oom_failure;
+		server_set_buffer(self, fb);
+		nvnc_fb_unref(fb);
+	} else {
+		server_set_buffer(self, NULL);
 	}
 
-	rc = aml_start(aml_get_default(), obj);
-	aml_unref(obj);
-	if (rc < 0)
-		goto start_failure;
+	if (is_layout_changed)
+		log_debug("Desktop layout is now %dx%d with %d screen(s)\n",
+				self->layout.width, self->layout.height,
+				self->layout.n_screens);
 
-	work->work = obj;
+	self->fb_serial++;
+	self->main_shard.layout = self->layout;
 
-	return 0;
+	shard_damage_region(&self->main_shard, damage, copy);
 
-start_failure:
-	work = NULL; /* handled in unref */
-oom_failure:
-	nvnc_fb_unref(fb);
-	client_unref(client);
-	vec_destroy(&work->frame);
-vec_failure:
-pixfmt_failure:
-	free(work);
-	return -1;
+	if (!fb)
+		return;
+
+	for (int i = 0; i < self->n_shards; ++i)
+		shard_publish_frame(&self->shards[i], fb, damage, copy);
 }
 
-void nvnc__damage_region(struct nvnc* self, const struct pixman_region16* damage)
+void nvnc__damage_region(struct nvnc* self, struct nvnc_display* display,
+		const struct pixman_region16* damage,
+		const struct damage_copy* copy)
 {
-	struct nvnc_client* client;
+	struct pixman_region16 desktop_damage;
+	pixman_region_init(&desktop_damage);
+	pixman_region_copy(&desktop_damage, (struct pixman_region16*)damage);
+	pixman_region_translate(&desktop_damage, display->x_pos,
+			display->y_pos);
+
+	struct damage_copy desktop_copy = { 0 };
+	pixman_region_init(&desktop_copy.region);
+	if (copy) {
+		pixman_region_copy(&desktop_copy.region,
+				(struct pixman_region16*)&copy->region);
+		pixman_region_translate(&desktop_copy.region,
+				display->x_pos, display->y_pos);
+		desktop_copy.dx = copy->dx;
+		desktop_copy.dy = copy->dy;
+	}
 
-	LIST_FOREACH(client, &self->clients, link)
-		if (client->net_stream->state != STREAM_STATE_CLOSED)
-			pixman_region_union(&client->damage, &client->damage,
-					    (struct pixman_region16*)damage);
+	server_present(self, &desktop_damage, copy ? &desktop_copy : NULL);
 
-	LIST_FOREACH(client, &self->clients, link)
-		process_fb_update_requests(client);
+	pixman_region_fini(&desktop_copy.region);
+	pixman_region_fini(&desktop_damage);
 }
 
 EXPORT
@@ -1481,6 +4340,39 @@ void nvnc_set_pointer_fn(struct nvnc* self, nvnc_pointer_fn fn)
 	self->pointer_fn = fn;
 }
 
+EXPORT
+void nvnc_set_pointer_coalescing(struct nvnc* self, bool enable)
+{
+	self->is_pointer_coalescing = enable;
+}
+
+EXPORT
+void nvnc_set_compression_policy(struct nvnc* self,
+		const struct nvnc_compression_policy* policy)
+{
+	struct nvnc_compression_policy* dst = &self->compression_policy;
+	dst->is_adaptive = policy->is_adaptive;
+	dst->min_level = CLAMP(policy->min_level, 0, 9);
+	dst->max_level = CLAMP(policy->max_level, dst->min_level, 9);
+	dst->min_quality = CLAMP(policy->min_quality, 0, 9);
+	dst->max_quality = CLAMP(policy->max_quality, dst->min_quality, 9);
+}
+
+EXPORT
+int nvnc_set_recording_dir(struct nvnc* self, const char* path)
+{
+	char* dir = NULL;
+	if (path) {
+		dir = strdup(path);
+		if (!dir)
+			return -1;
+	}
+
+	free(self->recording_dir);
+	self->recording_dir = dir;
+	return 0;
+}
+
 EXPORT
 void nvnc_set_fb_req_fn(struct nvnc* self, nvnc_fb_req_fn fn)
 {
@@ -1508,24 +4400,90 @@ void nvnc_set_cut_text_receive_fn(struct nvnc* self, nvnc_cut_text_fn fn)
 EXPORT
 void nvnc_add_display(struct nvnc* self, struct nvnc_display* display)
 {
-	if (self->display) {
-		log_error("Multiple displays are not implemented. Aborting!\n");
+	if (self->n_displays >= DESKTOP_MAX_SCREENS) {
+		log_error("Too many displays. Aborting!\n");
 		abort();
 	}
 
 	display->server = self;
-	self->display = display;
+	display->id = self->next_display_id++;
+	self->displays[self->n_displays++] = display;
 	nvnc_display_ref(display);
+
+	/* The display joins the layout with its first frame */
+	if (display->buffer) {
+		struct pixman_region16 damage;
+		pixman_region_init(&damage);
+		server_present(self, &damage, NULL);
+		pixman_region_fini(&damage);
+	}
 }
 
 EXPORT
 void nvnc_remove_display(struct nvnc* self, struct nvnc_display* display)
 {
-	if (self->display != display)
+	int index = -1;
+	for (int i = 0; i < self->n_displays; ++i)
+		if (self->displays[i] == display)
+			index = i;
+
+	if (index < 0)
 		return;
 
+	memmove(&self->displays[index], &self->displays[index + 1],
+			(self->n_displays - index - 1) *
+			sizeof(self->displays[0]));
+	self->n_displays--;
+
+	display->server = NULL;
+
+	/* What the display covered is damaged by the change of layout */
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+	server_present(self, &damage, NULL);
+	pixman_region_fini(&damage);
+
 	nvnc_display_unref(display);
-	self->display = NULL;
+}
+
+EXPORT
+int nvnc_set_client_threads(struct nvnc* self, int n_threads)
+{
+	if (self->shards) {
+		log_error("Client threads have already been started\n");
+		return -1;
+	}
+
+	if (!LIST_EMPTY(&self->main_shard.clients)) {
+		log_error("Client threads must be started before any clients connect\n");
+		return -1;
+	}
+
+	if (n_threads < 0)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	n_threads = MIN(n_threads, MAX_CLIENT_THREADS);
+	if (n_threads <= 0)
+		return 0;
+
+	self->shards = calloc(n_threads, sizeof(*self->shards));
+	if (!self->shards)
+		return -1;
+
+	int i;
+	for (i = 0; i < n_threads; ++i)
+		if (shard_start_thread(&self->shards[i], self) < 0)
+			goto failure;
+
+	self->n_shards = n_threads;
+	return 0;
+
+failure:
+	while (i--)
+		shard_stop_thread(&self->shards[i]);
+	free(self->shards);
+	self->shards = NULL;
+	return -1;
 }
 
 EXPORT
@@ -1534,6 +4492,21 @@ struct nvnc* nvnc_client_get_server(const struct nvnc_client* client)
 	return client->server;
 }
 
+EXPORT
+void nvnc_client_get_stats(const struct nvnc_client* client,
+		struct nvnc_client_stats* stats)
+{
+	const struct stream* stream = client->net_stream;
+
+	*stats = client->stats;
+	stats->bytes_sent = stream->bytes_sent;
+	stats->bytes_received = stream->bytes_received;
+	stats->bytes_queued = MIN(stream->bytes_queued +
+			stream_get_kernel_queued(stream), UINT32_MAX);
+	stats->frame_allocs = stream->n_req_allocs +
+		buf_pool_get_n_allocs(client->shard->frame_pool);
+}
+
 EXPORT
 void nvnc_set_name(struct nvnc* self, const char* name)
 {
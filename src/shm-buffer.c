@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "shm-buffer.h"
+#include "neatvnc.h"
+#include "fb.h"
+#include "pixels.h"
+#include "transform-util.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pixman.h>
+#include <sys/mman.h>
+
+struct shm_buffer* shm_buffer_new(uint16_t width, uint16_t height,
+		uint32_t fourcc_format)
+{
+	pixman_format_code_t pixman_fmt = 0;
+	if (!fourcc_to_pixman_fmt(&pixman_fmt, fourcc_format))
+		return NULL;
+
+	int pixel_size = pixel_size_from_fourcc(fourcc_format);
+	if (pixel_size <= 0)
+		return NULL;
+
+	struct shm_buffer* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->width = width;
+	self->height = height;
+	self->fourcc_format = fourcc_format;
+	self->stride = ((uint32_t)width * pixel_size + 3) & ~3U;
+	self->size = (size_t)self->stride * height;
+
+	self->fd = memfd_create("neatvnc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (self->fd < 0)
+		goto memfd_failure;
+
+	if (ftruncate(self->fd, self->size) < 0)
+		goto truncate_failure;
+
+#ifdef F_ADD_SEALS
+	/* The client can map it without having to worry about it shrinking */
+	fcntl(self->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+	self->addr = mmap(NULL, self->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			self->fd, 0);
+	if (self->addr == MAP_FAILED)
+		goto truncate_failure;
+
+	return self;
+
+truncate_failure:
+	close(self->fd);
+memfd_failure:
+	free(self);
+	return NULL;
+}
+
+void shm_buffer_destroy(struct shm_buffer* self)
+{
+	if (!self)
+		return;
+
+	munmap(self->addr, self->size);
+	close(self->fd);
+	free(self);
+}
+
+int shm_buffer_copy(struct shm_buffer* self, struct nvnc_fb* src,
+		struct pixman_region16* region)
+{
+	if (nvnc_fb_map(src) < 0)
+		return -1;
+
+	pixman_format_code_t fmt = 0;
+	if (src->fourcc_format != self->fourcc_format ||
+			!fourcc_to_pixman_fmt(&fmt, self->fourcc_format))
+		return -1;
+
+	pixman_image_t* srcimg = pixman_image_create_bits_no_clear(fmt,
+			src->width, src->height, src->addr,
+			nvnc_fb_get_pixel_size(src) * src->stride);
+	if (!srcimg)
+		return -1;
+
+	pixman_image_t* dstimg = pixman_image_create_bits_no_clear(fmt,
+			self->width, self->height, self->addr, self->stride);
+	if (!dstimg) {
+		pixman_image_unref(srcimg);
+		return -1;
+	}
+
+	pixman_transform_t pxform;
+	nvnc_transform_to_pixman_transform(&pxform, src->transform,
+			src->width, src->height);
+	pixman_image_set_transform(srcimg, &pxform);
+
+	int n_rects = 0;
+	struct pixman_box16* box = pixman_region_rectangles(region, &n_rects);
+	for (int i = 0; i < n_rects; ++i)
+		pixman_image_composite(PIXMAN_OP_SRC, srcimg, NULL, dstimg,
+				box[i].x1, box[i].y1, 0, 0,
+				box[i].x1, box[i].y1,
+				box[i].x2 - box[i].x1, box[i].y2 - box[i].y1);
+
+	pixman_image_unref(dstimg);
+	pixman_image_unref(srcimg);
+	return 0;
+}
@@ -25,16 +25,46 @@
 #include <aml.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #ifdef ENABLE_TLS
 #include <gnutls/gnutls.h>
 #endif
 
+#ifdef ENABLE_ZEROCOPY
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
 #include "rcbuf.h"
 #include "stream.h"
+#include "event-loop.h"
+#include "fbs.h"
+#include "logging.h"
 #include "sys/queue.h"
 
+#define STREAM_IOV_MAX MIN(64, IOV_MAX)
+
+/* Zero-copy has a fixed cost for pinning pages and for the completion, so
+ * this only pays off for large payloads.
+ */
+#define STREAM_ZEROCOPY_MIN_SIZE (64 * 1024)
+
+/* Corked records are buffered by GnuTLS until they are written out, so this
+ * limits how much is copied there in one go.
+ */
+#define STREAM_TLS_CORK_MAX_SIZE (256 * 1024)
+
+/* Requests are recycled, as every write needs one */
+#define STREAM_MAX_SPARE_REQS 16
+
 static void stream__on_event(void* obj);
+static void stream__read_ws_request(struct stream* self);
+#ifdef ENABLE_ZEROCOPY
+static void stream__release_zerocopy(struct stream* self);
+#endif
 #ifdef ENABLE_TLS
 static int stream__try_tls_accept(struct stream* self);
 #endif
@@ -54,14 +84,57 @@ static inline void stream__poll_rw(struct stream* self)
 	aml_set_event_mask(self->handler, AML_EVENT_READ | AML_EVENT_WRITE);
 }
 
-static void stream_req__finish(struct stream_req* req,
+static inline size_t stream_req__size(const struct stream_req* req)
+{
+	return req->ws_head_len + req->payload->size;
+}
+
+static struct stream_req* stream__new_req(struct stream* self)
+{
+	struct stream_req* req = TAILQ_FIRST(&self->spare_reqs);
+	if (req) {
+		TAILQ_REMOVE(&self->spare_reqs, req, link);
+		self->n_spare_reqs--;
+		memset(req, 0, sizeof(*req));
+	} else {
+		req = calloc(1, sizeof(*req));
+		if (!req)
+			return NULL;
+		self->n_req_allocs++;
+	}
+
+	req->fd = -1;
+	return req;
+}
+
+static void stream__free_req(struct stream* self, struct stream_req* req)
+{
+	if (self->n_spare_reqs >= STREAM_MAX_SPARE_REQS) {
+		free(req);
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&self->spare_reqs, req, link);
+	self->n_spare_reqs++;
+}
+
+/* The request is recycled before on_done is called, so nothing is touched
+ * after that.
+ */
+static void stream_req__finish(struct stream* self, struct stream_req* req,
                                enum stream_req_status status)
 {
-	if (req->on_done)
-		req->on_done(req->userdata, status);
+	stream_req_fn on_done = req->on_done;
+	void* userdata = req->userdata;
+
+	if (req->fd >= 0)
+		close(req->fd);
 
 	rcbuf_unref(req->payload);
-	free(req);
+	stream__free_req(self, req);
+
+	if (on_done)
+		on_done(userdata, status);
 }
 
 int stream_close(struct stream* self)
@@ -70,21 +143,29 @@ int stream_close(struct stream* self)
 		return -1;
 
 	self->state = STREAM_STATE_CLOSED;
+	self->bytes_queued = 0;
 
 	while (!TAILQ_EMPTY(&self->send_queue)) {
 		struct stream_req* req = TAILQ_FIRST(&self->send_queue);
 		TAILQ_REMOVE(&self->send_queue, req, link);
-		stream_req__finish(req, STREAM_REQ_FAILED);
+		stream_req__finish(self, req, STREAM_REQ_FAILED);
 	}
 
+#ifdef ENABLE_ZEROCOPY
+	stream__release_zerocopy(self);
+#endif
+
 #ifdef ENABLE_TLS
 	if (self->tls_session)
 		gnutls_deinit(self->tls_session);
 	self->tls_session = NULL;
 #endif
 
+	free(self->ws_request);
+	self->ws_request = NULL;
+
 	// TODO: Maybe use explicit loop object instead of the default one?
-	aml_stop(aml_get_default(), self->handler);
+	aml_stop(nvnc__get_loop(), self->handler);
 	close(self->fd);
 	self->fd = -1;
 
@@ -94,6 +175,15 @@ int stream_close(struct stream* self)
 void stream_destroy(struct stream* self)
 {
 	stream_close(self);
+
+	while (!TAILQ_EMPTY(&self->spare_reqs)) {
+		struct stream_req* req = TAILQ_FIRST(&self->spare_reqs);
+		TAILQ_REMOVE(&self->spare_reqs, req, link);
+		free(req);
+	}
+
+	fbs_writer_close(self->recorder);
+
 	aml_unref(self->handler);
 }
 
@@ -105,25 +195,213 @@ static void stream__remote_closed(struct stream* self)
 		self->on_event(self, STREAM_EVENT_REMOTE_CLOSED);
 }
 
+#ifdef ENABLE_ZEROCOPY
+static void stream__enable_zerocopy(struct stream* self)
+{
+	int one = 1;
+
+	/* This fails for sockets that don't support it, e.g. unix sockets, in
+	 * which case we simply keep on copying.
+	 */
+	if (setsockopt(self->fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+				sizeof(one)) == 0)
+		self->has_zerocopy = true;
+}
+
+static inline bool stream__zc_is_done(uint32_t id, uint32_t n_done)
+{
+	return (int32_t)(id - n_done) < 0;
+}
+
+/* The kernel reports completed zero-copy sends as ranges of ids on the socket
+ * error queue. Only then may the payloads be released.
+ */
+static void stream__reap_zerocopy(struct stream* self)
+{
+	uint32_t n_done = 0;
+	bool have_done = false;
+
+	while (!TAILQ_EMPTY(&self->zc_queue)) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+
+		if (recvmsg(self->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		struct cmsghdr* cmsg;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP &&
+					cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 &&
+					cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			struct sock_extended_err* serr =
+				(void*)CMSG_DATA(cmsg);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			n_done = serr->ee_data + 1;
+			have_done = true;
+		}
+
+		if (!have_done)
+			continue;
+
+		while (!TAILQ_EMPTY(&self->zc_queue)) {
+			struct stream_req* req = TAILQ_FIRST(&self->zc_queue);
+			if (!stream__zc_is_done(req->zc_id, n_done))
+				break;
+
+			TAILQ_REMOVE(&self->zc_queue, req, link);
+			rcbuf_unref(req->payload);
+			stream__free_req(self, req);
+		}
+	}
+}
+
+static void stream__release_zerocopy(struct stream* self)
+{
+	while (!TAILQ_EMPTY(&self->zc_queue)) {
+		struct stream_req* req = TAILQ_FIRST(&self->zc_queue);
+		TAILQ_REMOVE(&self->zc_queue, req, link);
+		rcbuf_unref(req->payload);
+		stream__free_req(self, req);
+	}
+}
+#endif
+
+static void stream__finish_sent_req(struct stream* self, struct stream_req* req)
+{
+	TAILQ_REMOVE(&self->send_queue, req, link);
+
+#ifdef ENABLE_ZEROCOPY
+	if (req->zc_pending) {
+		/* The data is on its way as far as the caller is concerned, but
+		 * the kernel may still be reading from the payload.
+		 */
+		stream_req_fn on_done = req->on_done;
+		req->on_done = NULL;
+		TAILQ_INSERT_TAIL(&self->zc_queue, req, link);
+
+		if (on_done)
+			on_done(req->userdata, STREAM_REQ_DONE);
+		return;
+	}
+#endif
+
+	stream_req__finish(self, req, STREAM_REQ_DONE);
+}
+
+static ssize_t stream__send_fd(struct stream* self, struct iovec* iov,
+		size_t n_iov, int fd)
+{
+	char control[CMSG_SPACE(sizeof(fd))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = n_iov,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	return sendmsg(self->fd, &msg, MSG_NOSIGNAL);
+}
+
+static ssize_t stream__send_iov(struct stream* self, struct iovec* iov,
+		size_t n_iov, size_t n_reqs, size_t n_bytes)
+{
+	struct stream_req* first = TAILQ_FIRST(&self->send_queue);
+	if (first->fd >= 0)
+		return stream__send_fd(self, iov, n_iov, first->fd);
+
+#ifdef ENABLE_ZEROCOPY
+	if (self->has_zerocopy && n_bytes >= STREAM_ZEROCOPY_MIN_SIZE) {
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = n_iov,
+		};
+
+		ssize_t rc = sendmsg(self->fd, &msg,
+				MSG_ZEROCOPY | MSG_NOSIGNAL);
+		if (rc >= 0) {
+			uint32_t id = self->zc_next_id++;
+
+			struct stream_req* req;
+			size_t n = 0;
+			TAILQ_FOREACH(req, &self->send_queue, link) {
+				if (n++ >= n_reqs)
+					break;
+
+				req->zc_pending = true;
+				req->zc_id = id;
+			}
+
+			return rc;
+		}
+
+		// Try again without zero-copy if the kernel refuses
+		if (errno != ENOBUFS)
+			return rc;
+	}
+#endif
+
+	return writev(self->fd, iov, n_iov);
+}
+
 static int stream__flush_plain(struct stream* self)
 {
-	static struct iovec iov[IOV_MAX];
-	size_t n_msgs = 0;
+	struct iovec iov[STREAM_IOV_MAX];
+	size_t n_iov = 0;
+	size_t n_reqs = 0;
+	size_t n_bytes = 0;
 	ssize_t bytes_sent;
 
 	struct stream_req* req;
 	TAILQ_FOREACH(req, &self->send_queue, link) {
-		iov[n_msgs].iov_base = req->payload->payload;
-		iov[n_msgs].iov_len = req->payload->size;
+		if (n_iov + 2 > STREAM_IOV_MAX)
+			break;
 
-		if (++n_msgs >= IOV_MAX)
+		/* A file descriptor is attached to the first byte of its
+		 * request, so such a request must start a batch of its own.
+		 */
+		if (req->fd >= 0 && n_reqs > 0)
 			break;
+
+		/* A frame head goes in its own vector in front of the payload */
+		size_t offset = req->offset;
+		if (offset < req->ws_head_len) {
+			iov[n_iov].iov_base = req->ws_head + offset;
+			iov[n_iov].iov_len = req->ws_head_len - offset;
+			n_bytes += iov[n_iov++].iov_len;
+			offset = req->ws_head_len;
+		}
+
+		offset -= req->ws_head_len;
+
+		char* p = req->payload->payload;
+		iov[n_iov].iov_base = p + offset;
+		iov[n_iov].iov_len = req->payload->size - offset;
+		n_bytes += iov[n_iov++].iov_len;
+		n_reqs++;
 	}
 
-	if (n_msgs == 0)
+	if (n_reqs == 0)
 		return 0;
 
-	bytes_sent = writev(self->fd, iov, n_msgs);
+	bytes_sent = stream__send_iov(self, iov, n_iov, n_reqs, n_bytes);
 	if (bytes_sent < 0) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			stream__poll_rw(self);
@@ -137,45 +415,107 @@ static int stream__flush_plain(struct stream* self)
 	}
 
 	self->bytes_sent += bytes_sent;
+	self->bytes_queued -= bytes_sent;
 
-	ssize_t bytes_left = bytes_sent;
+	/* The receiving end has its own copy of the file descriptor now */
+	struct stream_req* first = TAILQ_FIRST(&self->send_queue);
+	if (first->fd >= 0 && bytes_sent > 0) {
+		close(first->fd);
+		first->fd = -1;
+	}
+
+	size_t bytes_left = bytes_sent;
 
 	struct stream_req* tmp;
 	TAILQ_FOREACH_SAFE(req, &self->send_queue, link, tmp) {
-		bytes_left -= req->payload->size;
-
-		if (bytes_left >= 0) {
-			TAILQ_REMOVE(&self->send_queue, req, link);
-			stream_req__finish(req, STREAM_REQ_DONE);
-		} else {
-			char* p = req->payload->payload;
-			size_t s = req->payload->size;
-			memmove(p, p + s + bytes_left, -bytes_left);
-			req->payload->size = -bytes_left;
-			stream__poll_rw(self);
+		size_t remaining = stream_req__size(req) - req->offset;
+
+		if (bytes_left < remaining) {
+			/* The payload may be shared with other streams, so
+			 * we keep track of how far we've come instead of
+			 * moving the rest of it to the front.
+			 */
+			req->offset += bytes_left;
+			bytes_left = 0;
+			break;
 		}
 
-		if (bytes_left <= 0)
+		bytes_left -= remaining;
+		stream__finish_sent_req(self, req);
+
+		if (bytes_left == 0)
 			break;
 	}
 
-	if (bytes_left == 0 && self->state != STREAM_STATE_CLOSED)
-		stream__poll_r(self);
+	assert(bytes_left == 0);
 
-	assert(bytes_left <= 0);
+	if (self->state == STREAM_STATE_CLOSED)
+		return bytes_sent;
+
+	/* There may be more in the queue than fit into one writev */
+	if (TAILQ_EMPTY(&self->send_queue))
+		stream__poll_r(self);
+	else
+		stream__poll_rw(self);
 
 	return bytes_sent;
 }
 
 #ifdef ENABLE_TLS
+static int stream__uncork_tls(struct stream* self)
+{
+	int rc = gnutls_record_uncork(self->tls_session, 0);
+	if (rc == GNUTLS_E_AGAIN || rc == GNUTLS_E_INTERRUPTED) {
+		self->is_tls_corked = true;
+		stream__poll_rw(self);
+		return 0;
+	}
+
+	self->is_tls_corked = false;
+
+	if (rc < 0) {
+		gnutls_record_discard_queued(self->tls_session);
+		if (gnutls_error_is_fatal(rc))
+			stream_close(self);
+		return -1;
+	}
+
+	self->bytes_sent += self->tls_corked_bytes;
+	self->bytes_queued -= self->tls_corked_bytes;
+	self->tls_corked_bytes = 0;
+	return 1;
+}
+
+/* Everything in the queue up to a limit is corked into as few records as
+ * possible. stream__send() flushes right away, so this only merges messages
+ * that have piled up behind a socket that would block, e.g. a slow client.
+ * A message sent while the queue is empty still gets records of its own.
+ */
 static int stream__flush_tls(struct stream* self)
 {
-	while (!TAILQ_EMPTY(&self->send_queue)) {
+	if (self->is_tls_corked) {
+		int rc = stream__uncork_tls(self);
+		if (rc <= 0)
+			return rc;
+	}
+
+	if (TAILQ_EMPTY(&self->send_queue)) {
+		stream__poll_r(self);
+		return 1;
+	}
+
+	gnutls_record_cork(self->tls_session);
+
+	while (!TAILQ_EMPTY(&self->send_queue) &&
+			self->tls_corked_bytes < STREAM_TLS_CORK_MAX_SIZE) {
 		struct stream_req* req = TAILQ_FIRST(&self->send_queue);
 
-		ssize_t rc = gnutls_record_send(
-			self->tls_session, req->payload->payload,
-			req->payload->size);
+		char* p = req->payload->payload;
+		size_t size = MIN(req->payload->size - req->offset,
+				STREAM_TLS_CORK_MAX_SIZE - self->tls_corked_bytes);
+
+		ssize_t rc = gnutls_record_send(self->tls_session,
+				p + req->offset, size);
 		if (rc < 0) {
 			gnutls_record_discard_queued(self->tls_session);
 			if (gnutls_error_is_fatal(rc))
@@ -183,27 +523,27 @@ static int stream__flush_tls(struct stream* self)
 			return -1;
 		}
 
-		self->bytes_sent += rc;
-
-		ssize_t remaining = req->payload->size - rc;
-
-		if (remaining > 0) {
-			char* p = req->payload->payload;
-			size_t s = req->payload->size;
-			memmove(p, p + s - remaining, remaining);
-			req->payload->size = remaining;
-			stream__poll_rw(self);
-			return 1;
-		}
+		self->tls_corked_bytes += rc;
+		req->offset += rc;
 
-		assert(remaining == 0);
+		if (req->offset < req->payload->size)
+			break;
 
 		TAILQ_REMOVE(&self->send_queue, req, link);
-		stream_req__finish(req, STREAM_REQ_DONE);
+		stream_req__finish(self, req, STREAM_REQ_DONE);
+
+		if (self->state == STREAM_STATE_CLOSED)
+			return -1;
 	}
 
-	if (TAILQ_EMPTY(&self->send_queue) && self->state != STREAM_STATE_CLOSED)
+	int rc = stream__uncork_tls(self);
+	if (rc <= 0)
+		return rc;
+
+	if (TAILQ_EMPTY(&self->send_queue))
 		stream__poll_r(self);
+	else
+		stream__poll_rw(self);
 
 	return 1;
 }
@@ -211,10 +551,15 @@ static int stream__flush_tls(struct stream* self)
 
 static int stream__flush(struct stream* self)
 {
+	if (self->is_websocket && !self->is_ws_ready)
+		return 0;
+
 	switch (self->state) {
 	case STREAM_STATE_NORMAL: return stream__flush_plain(self);
 #ifdef ENABLE_TLS
-	case STREAM_STATE_TLS_READY: return stream__flush_tls(self);
+	case STREAM_STATE_TLS_READY:
+		return self->has_ktls_send ? stream__flush_plain(self) :
+			stream__flush_tls(self);
 #endif
 	default:
 		break;
@@ -227,6 +572,10 @@ static void stream__on_readable(struct stream* self)
 {
 	switch (self->state) {
 	case STREAM_STATE_NORMAL:
+		if (self->is_websocket && !self->is_ws_ready) {
+			stream__read_ws_request(self);
+			break;
+		}
 		/* fallthrough */
 #ifdef ENABLE_TLS
 	case STREAM_STATE_TLS_READY:
@@ -269,6 +618,12 @@ static void stream__on_event(void* obj)
 	struct stream* self = aml_get_userdata(obj);
 	uint32_t events = aml_get_revents(obj);
 
+#ifdef ENABLE_ZEROCOPY
+	/* Completions are signalled with POLLERR, which is always reported */
+	if (!TAILQ_EMPTY(&self->zc_queue))
+		stream__reap_zerocopy(self);
+#endif
+
 	if (events & AML_EVENT_READ)
 		stream__on_readable(self);
 
@@ -287,6 +642,12 @@ struct stream* stream_new(int fd, stream_event_fn on_event, void* userdata)
 	self->userdata = userdata;
 
 	TAILQ_INIT(&self->send_queue);
+	TAILQ_INIT(&self->spare_reqs);
+
+#ifdef ENABLE_ZEROCOPY
+	TAILQ_INIT(&self->zc_queue);
+	stream__enable_zerocopy(self);
+#endif
 
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 
@@ -294,7 +655,7 @@ struct stream* stream_new(int fd, stream_event_fn on_event, void* userdata)
 	if (!self->handler)
 		goto failure;
 
-	if (aml_start(aml_get_default(), self->handler) < 0)
+	if (aml_start(nvnc__get_loop(), self->handler) < 0)
 		goto start_failure;
 
 	stream__poll_r(self);
@@ -309,25 +670,59 @@ failure:
 	return NULL;
 }
 
-int stream_send(struct stream* self, struct rcbuf* payload,
-                stream_req_fn on_done, void* userdata)
+static int stream__send(struct stream* self, struct rcbuf* payload, int fd,
+                        stream_req_fn on_done, void* userdata)
 {
-	if (self->state == STREAM_STATE_CLOSED)
-		return -1;
-
-	struct stream_req* req = calloc(1, sizeof(*req));
-	if (!req)
+	struct stream_req* req = stream__new_req(self);
+	if (!req) {
+		if (fd >= 0)
+			close(fd);
 		return -1;
+	}
 
 	req->payload = payload;
+	req->fd = fd;
 	req->on_done = on_done;
 	req->userdata = userdata;
 
+	if (self->recorder && fbs_writer_append(self->recorder,
+				payload->payload, payload->size) < 0) {
+		log_error("Failed to write to recording. Recording stopped.\n");
+		fbs_writer_close(self->recorder);
+		self->recorder = NULL;
+	}
+
+	if (self->is_websocket)
+		req->ws_head_len = ws_encode_frame_head(req->ws_head,
+				WS_OPCODE_BINARY, payload->size);
+
 	TAILQ_INSERT_TAIL(&self->send_queue, req, link);
+	self->bytes_queued += stream_req__size(req);
 
 	return stream__flush(self);
 }
 
+int stream_send(struct stream* self, struct rcbuf* payload,
+                stream_req_fn on_done, void* userdata)
+{
+	if (self->state == STREAM_STATE_CLOSED)
+		return -1;
+
+	return stream__send(self, payload, -1, on_done, userdata);
+}
+
+int stream_send_fd(struct stream* self, struct rcbuf* payload, int fd,
+                   stream_req_fn on_done, void* userdata)
+{
+	/* File descriptors can only be passed over plain unix sockets */
+	if (self->state != STREAM_STATE_NORMAL || self->is_websocket) {
+		close(fd);
+		return -1;
+	}
+
+	return stream__send(self, payload, fd, on_done, userdata);
+}
+
 int stream_write(struct stream* self, const void* payload, size_t len,
                  stream_req_fn on_done, void* userdata)
 {
@@ -335,6 +730,16 @@ int stream_write(struct stream* self, const void* payload, size_t len,
 	return buf ? stream_send(self, buf, on_done, userdata) : -1;
 }
 
+size_t stream_get_kernel_queued(const struct stream* self)
+{
+#ifdef TIOCOUTQ
+	int n = 0;
+	if (self->fd >= 0 && ioctl(self->fd, TIOCOUTQ, &n) == 0 && n > 0)
+		return n;
+#endif
+	return 0;
+}
+
 static ssize_t stream__read_plain(struct stream* self, void* dst, size_t size)
 {
 	ssize_t rc = read(self->fd, dst, size);
@@ -372,10 +777,134 @@ static ssize_t stream__read_tls(struct stream* self, void* dst, size_t size)
 }
 #endif
 
+static void stream__read_ws_request(struct stream* self)
+{
+	char* start = self->ws_request + self->ws_request_len;
+	size_t space = WS_HANDSHAKE_MAX_SIZE - self->ws_request_len;
+
+	ssize_t n_read = stream__read_plain(self, start, space);
+	if (n_read <= 0) {
+		if (n_read < 0 && errno != EAGAIN)
+			stream__remote_closed(self);
+		return;
+	}
+
+	self->ws_request_len += n_read;
+
+	char response[WS_RESPONSE_MAX_SIZE];
+	ssize_t len = ws_handshake(response, sizeof(response),
+			self->ws_request, self->ws_request_len);
+	if (len == 0)
+		return;
+
+	free(self->ws_request);
+	self->ws_request = NULL;
+
+	if (len < 0) {
+		stream__remote_closed(self);
+		return;
+	}
+
+	/* The response goes out as it is, ahead of everything that was queued
+	 * in the meantime.
+	 */
+	struct stream_req* req = stream__new_req(self);
+	if (!req) {
+		stream__remote_closed(self);
+		return;
+	}
+
+	req->payload = rcbuf_from_mem(response, len);
+	if (!req->payload) {
+		stream__free_req(self, req);
+		stream__remote_closed(self);
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&self->send_queue, req, link);
+	self->bytes_queued += stream_req__size(req);
+
+	self->is_ws_ready = true;
+	stream__flush(self);
+}
+
+int stream_upgrade_to_websocket(struct stream* self)
+{
+	self->ws_request = malloc(WS_HANDSHAKE_MAX_SIZE);
+	if (!self->ws_request)
+		return -1;
+
+	self->is_websocket = true;
+	return 0;
+}
+
+static int stream__on_ws_control(enum ws_opcode opcode,
+		const uint8_t* payload, size_t len, void* userdata)
+{
+	struct stream* self = userdata;
+
+	switch (opcode) {
+	case WS_OPCODE_PING: {
+		struct rcbuf* buf = rcbuf_from_mem(payload, len);
+		if (!buf)
+			return -1;
+
+		struct stream_req* req = stream__new_req(self);
+		if (!req) {
+			rcbuf_unref(buf);
+			return -1;
+		}
+
+		req->payload = buf;
+		req->ws_head_len = ws_encode_frame_head(req->ws_head,
+				WS_OPCODE_PONG, len);
+
+		TAILQ_INSERT_TAIL(&self->send_queue, req, link);
+		self->bytes_queued += stream_req__size(req);
+
+		stream__flush(self);
+		return self->state == STREAM_STATE_CLOSED ? -1 : 0;
+	}
+	case WS_OPCODE_CLOSE:
+		return -1;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/* Frames are decoded where they were read to. A read that only had frame
+ * heads or control frames in it looks like it would have blocked.
+ */
+static ssize_t stream__read_ws(struct stream* self, void* dst, size_t size)
+{
+	ssize_t rc = stream__read_plain(self, dst, size);
+	if (rc <= 0)
+		return rc;
+
+	ssize_t n = ws_decode(&self->ws_decoder, dst, rc,
+			stream__on_ws_control, self);
+	if (n < 0) {
+		if (self->state != STREAM_STATE_CLOSED)
+			stream__remote_closed(self);
+		return 0;
+	}
+
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return n;
+}
+
 ssize_t stream_read(struct stream* self, void* dst, size_t size)
 {
 	switch (self->state) {
-	case STREAM_STATE_NORMAL: return stream__read_plain(self, dst, size);
+	case STREAM_STATE_NORMAL:
+		return self->is_websocket ? stream__read_ws(self, dst, size) :
+			stream__read_plain(self, dst, size);
 #ifdef ENABLE_TLS
 	case STREAM_STATE_TLS_READY: return stream__read_tls(self, dst, size);
 #endif
@@ -387,6 +916,27 @@ ssize_t stream_read(struct stream* self, void* dst, size_t size)
 }
 
 #ifdef ENABLE_TLS
+#ifdef ENABLE_KTLS
+/* GnuTLS hands the keys to the kernel after the handshake if kTLS is enabled
+ * in its configuration. Records are still received through GnuTLS, as it
+ * needs to see the ones that aren't application data, but anything that is
+ * sent can be written to the socket as it is.
+ */
+static void stream__check_ktls(struct stream* self)
+{
+	if (!(gnutls_transport_is_ktls_enabled(self->tls_session) &
+				GNUTLS_KTLS_SEND))
+		return;
+
+	self->has_ktls_send = true;
+
+#ifdef ENABLE_ZEROCOPY
+	/* MSG_ZEROCOPY is not supported by the kernel's TLS sockets */
+	self->has_zerocopy = false;
+#endif
+}
+#endif
+
 static int stream__try_tls_accept(struct stream* self)
 {
 	int rc;
@@ -394,12 +944,15 @@ static int stream__try_tls_accept(struct stream* self)
 	rc = gnutls_handshake(self->tls_session);
 	if (rc == GNUTLS_E_SUCCESS) {
 		self->state = STREAM_STATE_TLS_READY;
+#ifdef ENABLE_KTLS
+		stream__check_ktls(self);
+#endif
 		stream__poll_r(self);
 		return 0;
 	}
 
 	if (gnutls_error_is_fatal(rc)) {
-		aml_stop(aml_get_default(), &self->handler);
+		aml_stop(nvnc__get_loop(), &self->handler);
 		return -1;
 	}
 
@@ -417,6 +970,10 @@ int stream_upgrade_to_tls(struct stream* self, void* context)
 {
 	int rc;
 
+	/* GnuTLS would bypass the framing */
+	if (self->is_websocket)
+		return -1;
+
 	rc = gnutls_init(&self->tls_session, GNUTLS_SERVER | GNUTLS_NONBLOCK);
 	if (rc != GNUTLS_E_SUCCESS)
 		return -1;
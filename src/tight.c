@@ -19,22 +19,29 @@
 #include "common.h"
 #include "pixels.h"
 #include "vec.h"
+#include "deflate.h"
 #include "logging.h"
 #include "tight.h"
 #include "config.h"
 #include "enc-util.h"
+#include "buf-pool.h"
+#include "tile-cache.h"
 #include "fb.h"
+#include "transform-util.h"
+#include "event-loop.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <zlib.h>
 #include <pixels.h>
 #include <pthread.h>
 #include <assert.h>
 #include <aml.h>
+#include <pixman.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
 #include <libdrm/drm_fourcc.h>
 #ifdef HAVE_JPEG
 #include <turbojpeg.h>
@@ -46,13 +53,40 @@
 #define TIGHT_JPEG 0x90
 #define TIGHT_PNG 0xA0
 #define TIGHT_BASIC 0x00
+#define TIGHT_EXPLICIT_FILTER 0x40
+
+#define TIGHT_FILTER_PALETTE 1
+
+/* Less than this is never compressed */
+#define TIGHT_MIN_TO_COMPRESS 12
 
 #define TIGHT_STREAM(n) ((n) << 4)
 #define TIGHT_RESET(n) (1 << (n))
 
-#define TSL 64 /* Tile Side Length */
+#define TSL TIGHT_TILE_SIZE /* Tile Side Length */
 
-#define MAX_TILE_SIZE (2 * TSL * TSL * 4)
+/* Progressive frames start out with this many tiles around the focus. Each
+ * pass after that is this many times larger than the one before, up to a
+ * limit that keeps the output of a pass down to a few megabytes.
+ */
+#define TIGHT_FIRST_PASS_TILES 16
+#define TIGHT_PASS_GROWTH 4
+#define TIGHT_MAX_PASS_TILES 256
+
+/* Worker arenas start out at this size and are trimmed back down when a frame
+ * uses much less than what they have grown to.
+ */
+#define TIGHT_ARENA_MIN_SIZE (64 * 1024)
+
+/* Tiles with up to this many colours are sent with a palette. Only flat
+ * content is taken out of JPEG, to keep the artifacts off of text and UI.
+ */
+#define TIGHT_MAX_COLOURS 64
+#define TIGHT_JPEG_MAX_COLOURS 16
+
+#define TIGHT_PALETTE_HASH_BITS 7
+#define TIGHT_PALETTE_HASH_SIZE (1 << TIGHT_PALETTE_HASH_BITS)
+#define TIGHT_PALETTE_EMPTY 0xff
 
 enum tight_tile_state {
 	TIGHT_TILE_READY = 0,
@@ -60,32 +94,45 @@ enum tight_tile_state {
 	TIGHT_TILE_ENCODED,
 };
 
+/* The encoded data lives in the arena of the worker that encoded the tile. It
+ * starts with head_size bytes, such as a palette, that go out in front of the
+ * compact length.
+ */
 struct tight_tile {
 	enum tight_tile_state state;
-	size_t size;
 	uint8_t type;
-	char buffer[MAX_TILE_SIZE];
+	uint8_t worker;
+	uint16_t head_size;
+	bool has_length;
+	uint32_t offset;
+	uint32_t size;
+};
+
+struct tight_palette {
+	uint32_t n_colours;
+	uint32_t colours[TIGHT_MAX_COLOURS];
+	uint8_t slots[TIGHT_PALETTE_HASH_SIZE];
 };
 
 struct tight_zs_worker_ctx {
 	struct tight_encoder* encoder;
 	int index;
+	struct vec arena;
+	uint32_t pixels[TSL * TSL];
+	uint8_t cpixels[TSL * TSL * 4];
+	uint8_t indices[TSL * TSL];
+	struct tight_palette palette;
+#ifdef HAVE_JPEG
+	tjhandle jpeg;
+#endif
 };
 
 static void do_tight_zs_work(void*);
 static void on_tight_zs_work_done(void*);
 static int schedule_tight_finish(struct tight_encoder* self);
-
-static int tight_encoder_init_stream(z_stream* zs)
-{
-	int rc = deflateInit2(zs,
-	                      /* compression level: */ 1,
-	                      /*            method: */ Z_DEFLATED,
-	                      /*       window bits: */ 15,
-	                      /*         mem level: */ 9,
-	                      /*          strategy: */ Z_DEFAULT_STRATEGY);
-	return rc == Z_OK ? 0 : -1;
-}
+static int tight_schedule_encoding_jobs(struct tight_encoder* self);
+static void do_tight_finish(void*);
+static void on_tight_finished(void*);
 
 static inline struct tight_tile* tight_tile(struct tight_encoder* self,
 		uint32_t x, uint32_t y)
@@ -105,6 +152,17 @@ static inline uint32_t tight_tile_height(struct tight_encoder* self,
 	return y + TSL > self->height ? self->height - y : TSL;
 }
 
+static void tight_zs_worker_ctx_free(void* userdata)
+{
+	struct tight_zs_worker_ctx* ctx = userdata;
+#ifdef HAVE_JPEG
+	if (ctx->jpeg)
+		tjDestroy(ctx->jpeg);
+#endif
+	vec_destroy(&ctx->arena);
+	free(ctx);
+}
+
 static int tight_init_zs_worker(struct tight_encoder* self, int index)
 {
 	struct tight_zs_worker_ctx* ctx = calloc(1, sizeof(*ctx));
@@ -114,167 +172,649 @@ static int tight_init_zs_worker(struct tight_encoder* self, int index)
 	ctx->encoder = self;
 	ctx->index = index;
 
-	self->zs_worker[index] =
-		aml_work_new(do_tight_zs_work, on_tight_zs_work_done, ctx, free);
+	if (vec_init(&ctx->arena, TIGHT_ARENA_MIN_SIZE) < 0)
+		goto arena_failure;
+
+	self->zs_worker[index] = aml_work_new(do_tight_zs_work,
+			on_tight_zs_work_done, ctx, tight_zs_worker_ctx_free);
 	if (!self->zs_worker[index])
 		goto failure;
 
 	return 0;
 
 failure:
+	vec_destroy(&ctx->arena);
+arena_failure:
 	free(ctx);
 	return -1;
 }
 
+static struct tight_zs_worker_ctx* tight_get_worker_ctx(
+		struct tight_encoder* self, int index)
+{
+	return aml_get_userdata(self->zs_worker[index]);
+}
+
+/* Called between frames, while no worker is running */
+static void tight_reset_arenas(struct tight_encoder* self)
+{
+	for (int i = 0; i < self->n_workers; ++i) {
+		struct vec* arena = &tight_get_worker_ctx(self, i)->arena;
+
+		if (arena->cap > TIGHT_ARENA_MIN_SIZE &&
+				arena->cap > arena->len * 4) {
+			size_t size = MAX(arena->len * 2, TIGHT_ARENA_MIN_SIZE);
+			void* data = realloc(arena->data, size);
+			if (data) {
+				arena->data = data;
+				arena->cap = size;
+			}
+		}
+
+		vec_clear(arena);
+	}
+}
+
 int tight_encoder_resize(struct tight_encoder* self, uint32_t width,
 		uint32_t height)
 {
 	self->width = width;
 	self->height = height;
 
-	self->grid_width = UDIV_UP(width, 64);
-	self->grid_height = UDIV_UP(height, 64);
+	self->grid_width = UDIV_UP(width, TSL);
+	self->grid_height = UDIV_UP(height, TSL);
+
+	tile_bitmap_destroy(&self->damage_tiles);
+	if (tile_bitmap_init(&self->damage_tiles, width, height, TSL) < 0)
+		return -1;
+
+	/* Everything is sent again after a resize */
+	tile_bitmap_destroy(&self->lossy_tiles);
+	if (tile_bitmap_init(&self->lossy_tiles, width, height, TSL) < 0)
+		return -1;
+
+	tile_bitmap_destroy(&self->failed_tiles);
+	if (tile_bitmap_init(&self->failed_tiles, width, height, TSL) < 0)
+		return -1;
 
 	if (self->grid)
 		free(self->grid);
 
 	self->grid = calloc(self->grid_width * self->grid_height,
 			sizeof(*self->grid));
-	return self->grid ? 0 : -1;
+	if (!self->grid)
+		return -1;
+
+	free(self->tile_queue);
+	self->tile_queue = calloc(self->grid_width * self->grid_height,
+			sizeof(*self->tile_queue));
+	return self->tile_queue ? 0 : -1;
+}
+
+static int tight_get_n_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return 1;
+
+	return MIN(n, TIGHT_MAX_WORKERS);
 }
 
 int tight_encoder_init(struct tight_encoder* self, uint32_t width,
-		uint32_t height)
+		uint32_t height, struct buf_pool* frame_pool)
 {
 	memset(self, 0, sizeof(*self));
+
+	self->frame_pool = frame_pool;
+	buf_pool_ref(frame_pool);
+	self->zs_level = TIGHT_DEFAULT_COMPRESSION_LEVEL;
+	self->compression_level = TIGHT_DEFAULT_COMPRESSION_LEVEL;
 	if (tight_encoder_resize(self, width, height) < 0)
-		return -1;
+		goto failure;
 
-	tight_encoder_init_stream(&self->zs[0]);
-	tight_encoder_init_stream(&self->zs[1]);
-	tight_encoder_init_stream(&self->zs[2]);
-	tight_encoder_init_stream(&self->zs[3]);
+	int n_workers = tight_get_n_workers();
+	int n_streams = MIN(n_workers, TIGHT_MAX_STREAMS);
 
-	tight_init_zs_worker(self, 0);
-	tight_init_zs_worker(self, 1);
-	tight_init_zs_worker(self, 2);
-	tight_init_zs_worker(self, 3);
+	for (self->n_streams = 0; self->n_streams < n_streams;
+			++self->n_streams) {
+		self->zs[self->n_streams] =
+			deflate_stream_new(TIGHT_DEFAULT_COMPRESSION_LEVEL);
+		if (!self->zs[self->n_streams])
+			goto failure;
+	}
 
-	aml_require_workers(aml_get_default(), 1);
+	for (self->n_workers = 0; self->n_workers < n_workers;
+			++self->n_workers)
+		if (tight_init_zs_worker(self, self->n_workers) < 0)
+			goto failure;
+
+	self->finisher = aml_work_new(do_tight_finish, on_tight_finished,
+			self, NULL);
+	if (!self->finisher)
+		goto failure;
+
+	aml_require_workers(nvnc__get_loop(), self->n_workers);
 
 	return 0;
+
+failure:
+	tight_encoder_destroy(self);
+	return -1;
 }
 
 void tight_encoder_destroy(struct tight_encoder* self)
 {
-	aml_unref(self->zs_worker[3]);
-	aml_unref(self->zs_worker[2]);
-	aml_unref(self->zs_worker[1]);
-	aml_unref(self->zs_worker[0]);
+	if (self->finisher)
+		aml_unref(self->finisher);
 
-	deflateEnd(&self->zs[3]);
-	deflateEnd(&self->zs[2]);
-	deflateEnd(&self->zs[1]);
-	deflateEnd(&self->zs[0]);
+	for (int i = self->n_workers - 1; i >= 0; --i)
+		aml_unref(self->zs_worker[i]);
 
+	for (int i = self->n_streams - 1; i >= 0; --i)
+		deflate_stream_destroy(self->zs[i]);
+
+	tile_bitmap_destroy(&self->damage_tiles);
+	tile_bitmap_destroy(&self->lossy_tiles);
+	tile_bitmap_destroy(&self->failed_tiles);
+	free(self->tile_queue);
 	free(self->grid);
+	buf_pool_unref(self->frame_pool);
+	if (self->tile_cache)
+		tile_cache_unref(self->tile_cache);
+}
+
+void tight_encoder_request_reset(struct tight_encoder* self)
+{
+	for (int i = 0; i < self->n_streams; ++i)
+		self->zs_reset[i] = true;
+}
+
+void tight_encoder_mark_sent(struct tight_encoder* self,
+		struct pixman_region16* region, bool is_lossy)
+{
+	struct tile_bitmap* lossy = &self->lossy_tiles;
+
+	int n_boxes = 0;
+	struct pixman_box16* boxes = pixman_region_rectangles(region, &n_boxes);
+
+	for (int i = 0; i < n_boxes; ++i) {
+		const struct pixman_box16* box = &boxes[i];
+		uint32_t x_end = MIN(UDIV_UP(box->x2, TSL), self->grid_width);
+		uint32_t y_end = MIN(UDIV_UP(box->y2, TSL), self->grid_height);
+
+		for (uint32_t y = box->y1 / TSL; y < y_end; ++y)
+			for (uint32_t x = box->x1 / TSL; x < x_end; ++x)
+				if (is_lossy)
+					tile_bitmap_set(lossy, x, y);
+				else
+					tile_bitmap_unset(lossy, x, y);
+	}
+}
+
+void tight_encoder_get_failed_region(const struct tight_encoder* self,
+		struct pixman_region16* dst)
+{
+	if (tile_bitmap_is_empty(&self->failed_tiles))
+		return;
+
+	struct pixman_region16 failed;
+	pixman_region_init(&failed);
+	tile_bitmap_to_region(&self->failed_tiles, &failed);
+
+	/* Tiles on the edges reach past the end of the screen */
+	pixman_region_intersect_rect(&failed, &failed, 0, 0, self->width,
+			self->height);
+	pixman_region_union(dst, dst, &failed);
+	pixman_region_fini(&failed);
+}
+
+void tight_encoder_set_compression_level(struct tight_encoder* self,
+		int level)
+{
+	self->compression_level = level;
+}
+
+void tight_encoder_set_progressive(struct tight_encoder* self,
+		tight_done_fn on_chunk)
+{
+	self->on_chunk = on_chunk;
+}
+
+void tight_encoder_set_tile_cache(struct tight_encoder* self,
+		struct tile_cache* cache)
+{
+	if (cache)
+		tile_cache_ref(cache);
+	if (self->tile_cache)
+		tile_cache_unref(self->tile_cache);
+	self->tile_cache = cache;
+}
+
+void tight_encoder_set_focus(struct tight_encoder* self, uint16_t x,
+		uint16_t y)
+{
+	self->focus_x = x;
+	self->focus_y = y;
+	self->has_focus = true;
+}
+
+/* Every tile ends with a sync flush, so there is never any pending input that
+ * would have to be compressed with the old level.
+ */
+static void tight_apply_compression_level(struct tight_encoder* self)
+{
+	if (self->zs_level == self->compression_level)
+		return;
+
+	for (int i = 0; i < self->n_streams; ++i)
+		if (deflate_stream_set_level(self->zs[i],
+					self->compression_level) < 0)
+			log_debug("Failed to change the level of zlib stream %d\n",
+					i);
+
+	self->zs_level = self->compression_level;
 }
 
 static int tight_apply_damage(struct tight_encoder* self,
-		struct pixman_region16* damage)
-{
-	int n_damaged = 0;
-
-	/* Align damage to tile grid */
-	for (uint32_t y = 0; y < self->grid_height; ++y)
-		for (uint32_t x = 0; x < self->grid_width; ++x) {
-			struct pixman_box16 box = {
-				.x1 = x * TSL,
-				.y1 = y * TSL,
-				.x2 = ((x + 1) * TSL) - 1,
-				.y2 = ((y + 1) * TSL) - 1,
-			};
-
-			pixman_region_overlap_t overlap
-				= pixman_region_contains_rectangle(damage, &box);
-
-			if (overlap != PIXMAN_REGION_OUT) {
-				++n_damaged;
-				tight_tile(self, x, y)->state = TIGHT_TILE_DAMAGED;
-			} else {
-				tight_tile(self, x, y)->state = TIGHT_TILE_READY;
-			}
+		struct pixman_region16* damage,
+		const struct tile_bitmap* damage_tiles)
+{
+	/* Fall back to aligning the damage region to the tile grid if we
+	 * haven't been given a usable tile map.
+	 */
+	if (!damage_tiles || damage_tiles->tile_size != TSL ||
+			damage_tiles->width != self->grid_width ||
+			damage_tiles->height != self->grid_height) {
+		tile_bitmap_clear(&self->damage_tiles);
+		tile_bitmap_add_region(&self->damage_tiles, damage);
+		damage_tiles = &self->damage_tiles;
+	}
+
+	self->tile_queue_len = 0;
+	atomic_store(&self->tile_queue_head, 0);
+
+	uint32_t x = 0, y = 0;
+	for (; tile_bitmap_next(damage_tiles, &x, &y); ++x) {
+		tight_tile(self, x, y)->state = TIGHT_TILE_DAMAGED;
+		self->tile_queue[self->tile_queue_len++] =
+			x + y * self->grid_width;
+	}
+
+	return self->tile_queue_len;
+}
+
+static bool tight_is_progressive(const struct tight_encoder* self)
+{
+	return self->on_chunk &&
+		self->tile_queue_len > TIGHT_FIRST_PASS_TILES * 2;
+}
+
+static void tight_queue_tile_if_damaged(struct tight_encoder* self,
+		int32_t x, int32_t y, uint32_t* len)
+{
+	if (x < 0 || y < 0 || x >= (int32_t)self->grid_width ||
+			y >= (int32_t)self->grid_height)
+		return;
+
+	if (tight_tile(self, x, y)->state == TIGHT_TILE_DAMAGED)
+		self->tile_queue[(*len)++] = x + y * self->grid_width;
+}
+
+/* Puts the damaged tiles in order of how far they are from the focus, going
+ * around it in ever larger squares. It doesn't matter to the zlib streams in
+ * which order the tiles are encoded, as long as they go out in that order.
+ */
+static void tight_order_by_focus(struct tight_encoder* self)
+{
+	int32_t fx = self->has_focus ? self->focus_x / TSL :
+		self->grid_width / 2;
+	int32_t fy = self->has_focus ? self->focus_y / TSL :
+		self->grid_height / 2;
+	fx = MIN(fx, (int32_t)self->grid_width - 1);
+	fy = MIN(fy, (int32_t)self->grid_height - 1);
+
+	int32_t max_radius = MAX(MAX(fx, (int32_t)self->grid_width - 1 - fx),
+			MAX(fy, (int32_t)self->grid_height - 1 - fy));
+
+	uint32_t len = 0;
+	tight_queue_tile_if_damaged(self, fx, fy, &len);
+
+	for (int32_t r = 1; r <= max_radius; ++r) {
+		for (int32_t x = fx - r; x <= fx + r; ++x)
+			tight_queue_tile_if_damaged(self, x, fy - r, &len);
+
+		for (int32_t y = fy - r + 1; y < fy + r; ++y) {
+			tight_queue_tile_if_damaged(self, fx - r, y, &len);
+			tight_queue_tile_if_damaged(self, fx + r, y, &len);
 		}
 
-	return n_damaged;
+		for (int32_t x = fx - r; x <= fx + r; ++x)
+			tight_queue_tile_if_damaged(self, x, fy + r, &len);
+	}
+
+	assert(len == self->tile_queue_len);
+}
+
+static uint32_t tight_next_pass_end(const struct tight_encoder* self)
+{
+	if (!tight_is_progressive(self))
+		return self->tile_queue_len;
+
+	uint32_t pass_len = self->pass_end == 0 ? TIGHT_FIRST_PASS_TILES :
+		(self->pass_end - self->pass_start) * TIGHT_PASS_GROWTH;
+	pass_len = MIN(pass_len, TIGHT_MAX_PASS_TILES);
+	uint32_t end = self->pass_end + pass_len;
+
+	/* The last pass takes up whatever would be too little for a pass of
+	 * its own.
+	 */
+	if (end + pass_len > self->tile_queue_len)
+		end = self->tile_queue_len;
+
+	return end;
+}
+
+/* Called while no worker is running */
+/* Tiles that won't be sent are left ready for the next frame and reported back
+ * as failed, like those that could not be encoded.
+ */
+static void tight_fail_unsent_tiles(struct tight_encoder* self)
+{
+	for (uint32_t i = self->pass_start; i < self->tile_queue_len; ++i) {
+		uint32_t x = self->tile_queue[i] % self->grid_width;
+		uint32_t y = self->tile_queue[i] / self->grid_width;
+
+		tight_tile(self, x, y)->state = TIGHT_TILE_READY;
+		tile_bitmap_set(&self->failed_tiles, x, y);
+	}
+}
+
+static int tight_start_pass(struct tight_encoder* self)
+{
+	uint32_t end = tight_next_pass_end(self);
+	self->pass_start = self->pass_end;
+	self->pass_end = end;
+	atomic_store(&self->tile_queue_head, self->pass_start);
+
+	if (buf_pool_acquire(self->frame_pool, &self->dst, 0) < 0)
+		goto failure;
+
+	self->n_rects = self->pass_end - self->pass_start;
+	encode_rect_count(&self->dst, self->n_rects);
+
+	tight_reset_arenas(self);
+
+	if (tight_schedule_encoding_jobs(self) < 0) {
+		vec_destroy(&self->dst);
+		goto failure;
+	}
+
+	return 0;
+
+failure:
+	tight_fail_unsent_tiles(self);
+	return -1;
 }
 
-static void tight_encode_size(struct vec* dst, size_t size)
+/* Frame buffers come out of the pool with no room to spare, so the length is
+ * put together first and appended in one go.
+ */
+static int tight_encode_size(struct vec* dst, size_t size)
 {
-	vec_fast_append_8(dst, (size & 0x7f) | ((size >= 128) << 7));
+	uint8_t length[3];
+	size_t n = 0;
+
+	length[n++] = (size & 0x7f) | ((size >= 128) << 7);
 	if (size >= 128)
-		vec_fast_append_8(dst, ((size >> 7) & 0x7f) | ((size >= 16384) << 7));
+		length[n++] = ((size >> 7) & 0x7f) | ((size >= 16384) << 7);
 	if (size >= 16384)
-		vec_fast_append_8(dst, (size >> 14) & 0xff);
+		length[n++] = (size >> 14) & 0xff;
+
+	return vec_append(dst, length, n);
 }
 
-static int tight_deflate(struct tight_tile* tile, void* src,
-			 size_t len, z_stream* zs, bool flush)
+/* Transformed buffers are read through the transform into the worker's
+ * scratch buffer, so that the encoders only ever see upright pixels.
+ */
+static const uint32_t* tight_get_tile_pixels(struct tight_encoder* self,
+		struct tight_zs_worker_ctx* ctx, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, int32_t* stride)
 {
-	zs->next_in = src;
-	zs->avail_in = len;
+	if (nvnc_fb_get_transform(self->fb) == NVNC_TRANSFORM_NORMAL) {
+		uint32_t* addr = nvnc_fb_get_addr(self->fb);
+		*stride = nvnc_fb_get_stride(self->fb);
+		return addr + x + y * *stride;
+	}
 
-	do {
-		if (tile->size >= MAX_TILE_SIZE)
-			return -1;
+	nvnc_transform_read_rect(ctx->pixels, TSL, self->fb, x, y, width,
+			height);
+	*stride = TSL;
+	return ctx->pixels;
+}
 
-		zs->next_out = ((Bytef*)tile->buffer) + tile->size;
-		zs->avail_out = MAX_TILE_SIZE - tile->size;
+static bool tight_uses_zlib(const struct tight_encoder* self)
+{
+#ifdef HAVE_JPEG
+	return self->quality == TIGHT_QUALITY_LOSSLESS;
+#else
+	return true;
+#endif
+}
 
-		int r = deflate(zs, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
-		if (r == Z_STREAM_ERROR)
-			return -1;
+static void tight_get_cpixel_format(const struct tight_encoder* self,
+		struct rfb_pixel_format* cfmt, int* bytes_per_cpixel)
+{
+	*bytes_per_cpixel = calc_bytes_per_cpixel(&self->dfmt);
+	assert(*bytes_per_cpixel <= 4);
 
-		tile->size = zs->next_out - (Bytef*)tile->buffer;
-	} while (zs->avail_out == 0);
+	/* 24 bit colours are sent as R, G, B */
+	if (*bytes_per_cpixel == 3)
+		rfb_pixfmt_from_fourcc(cfmt, DRM_FORMAT_XBGR8888);
+	else
+		memcpy(cfmt, &self->dfmt, sizeof(*cfmt));
+}
 
-	assert(zs->avail_in == 0);
+static int tight_append_cpixels(struct tight_encoder* self, struct vec* dst,
+		const uint32_t* src, size_t len)
+{
+	struct rfb_pixel_format cfmt;
+	int bytes_per_cpixel;
+	tight_get_cpixel_format(self, &cfmt, &bytes_per_cpixel);
+
+	if (vec_reserve(dst, dst->len + len * bytes_per_cpixel) < 0)
+		return -1;
 
+	pixel32_to_cpixel((uint8_t*)dst->data + dst->len, &cfmt, src,
+			&self->sfmt, bytes_per_cpixel, len);
+	dst->len += len * bytes_per_cpixel;
 	return 0;
 }
 
-static void tight_encode_tile_basic(struct tight_encoder* self,
-		struct tight_tile* tile, uint32_t x, uint32_t y_start,
-		uint32_t width, uint32_t height, int zs_index)
+/* Everything but JPEG goes through the worker's zlib stream, unless it is too
+ * small to be worth compressing. Such data is sent as it is and without a
+ * length, as required by the protocol.
+ */
+static int tight_encode_data(struct tight_encoder* self,
+		struct tight_zs_worker_ctx* ctx, struct tight_tile* tile,
+		const void* data, size_t len)
 {
-	z_stream* zs = &self->zs[zs_index];
-	tile->type = TIGHT_BASIC | TIGHT_STREAM(zs_index);
+	if (len < TIGHT_MIN_TO_COMPRESS) {
+		tile->has_length = false;
+		return vec_append(&ctx->arena, data, len);
+	}
 
-	int bytes_per_cpixel = calc_bytes_per_cpixel(&self->dfmt);
-	assert(bytes_per_cpixel <= 4);
-	uint8_t row[TSL * 4];
+	int zs_index = ctx->index;
+	assert(zs_index < self->n_streams);
+
+	struct deflate_stream* zs = self->zs[zs_index];
+	tile->type |= TIGHT_STREAM(zs_index);
+	tile->has_length = true;
+
+	/* Each stream is only ever touched by one worker and tiles are emitted
+	 * in the same order as they are encoded, so the first tile that uses
+	 * a stream within the frame is the one that carries the reset.
+	 */
+	if (self->zs_reset[zs_index]) {
+		deflate_stream_reset(zs);
+		tile->type |= TIGHT_RESET(zs_index);
+		self->zs_reset[zs_index] = false;
+	}
 
-	struct rfb_pixel_format cfmt = { 0 };
-	if (bytes_per_cpixel == 3)
-		rfb_pixfmt_from_fourcc(&cfmt, DRM_FORMAT_XBGR8888);
-	else
-		memcpy(&cfmt, &self->dfmt, sizeof(cfmt));
+	if (deflate_stream_compress(zs, &ctx->arena, data, len, true) < 0) {
+		/* The client never sees this tile, so the stream has to start
+		 * over with the next tile that uses it.
+		 */
+		log_error("Failed to compress tight tile\n");
+		self->zs_reset[zs_index] = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tight_palette_index(struct tight_palette* self, uint32_t colour,
+		uint32_t max_colours)
+{
+	uint32_t slot = (colour * 2654435761u) >>
+		(32 - TIGHT_PALETTE_HASH_BITS);
 
-	uint32_t* addr = nvnc_fb_get_addr(self->fb);
-	int32_t stride = nvnc_fb_get_stride(self->fb);
+	for (;; slot = (slot + 1) % TIGHT_PALETTE_HASH_SIZE) {
+		uint8_t index = self->slots[slot];
+		if (index == TIGHT_PALETTE_EMPTY)
+			break;
 
-	// TODO: Limit width and hight to the sides
-	for (uint32_t y = y_start; y < y_start + height; ++y) {
-		void* img = addr + x + y * stride;
-		pixel32_to_cpixel(row, &cfmt, img, &self->sfmt,
-				bytes_per_cpixel, width);
+		if (self->colours[index] == colour)
+			return index;
+	}
+
+	if (self->n_colours == max_colours)
+		return -1;
+
+	self->colours[self->n_colours] = colour;
+	self->slots[slot] = self->n_colours;
+	return self->n_colours++;
+}
+
+/* Maps the pixels of the tile onto a palette, giving up as soon as there are
+ * more than max_colours. Returns the number of colours, or 0 if there were too
+ * many.
+ */
+static uint32_t tight_classify_tile(struct tight_encoder* self,
+		struct tight_zs_worker_ctx* ctx, const uint32_t* pixels,
+		int32_t stride, uint32_t width, uint32_t height,
+		uint32_t max_colours)
+{
+	struct tight_palette* palette = &ctx->palette;
+	uint8_t* indices = ctx->indices;
+	uint32_t mask = self->colour_mask;
+
+	memset(palette->slots, TIGHT_PALETTE_EMPTY, sizeof(palette->slots));
+	palette->n_colours = 0;
+
+	uint32_t last = pixels[0] & mask;
+	int index = tight_palette_index(palette, last, max_colours);
+
+	for (uint32_t y = 0; y < height; ++y)
+		for (uint32_t x = 0; x < width; ++x) {
+			uint32_t colour = pixels[x + y * stride] & mask;
+
+			/* Runs of the same colour are very common */
+			if (colour != last) {
+				index = tight_palette_index(palette, colour,
+						max_colours);
+				if (index < 0)
+					return 0;
+
+				last = colour;
+			}
+
+			*indices++ = index;
+		}
+
+	return palette->n_colours;
+}
+
+static int tight_encode_tile_fill(struct tight_encoder* self,
+		struct tight_zs_worker_ctx* ctx, struct tight_tile* tile)
+{
+	tile->type = TIGHT_FILL;
+	tile->has_length = false;
+
+	size_t start = ctx->arena.len;
+	if (tight_append_cpixels(self, &ctx->arena, ctx->palette.colours,
+				1) < 0)
+		return -1;
+
+	tile->head_size = ctx->arena.len - start;
+	return 0;
+}
+
+static int tight_encode_tile_palette(struct tight_encoder* self,
+		struct tight_zs_worker_ctx* ctx, struct tight_tile* tile,
+		uint32_t width, uint32_t height)
+{
+	struct tight_palette* palette = &ctx->palette;
+	struct vec* arena = &ctx->arena;
+
+	tile->type = TIGHT_BASIC | TIGHT_EXPLICIT_FILTER;
+
+	size_t start = arena->len;
+	uint8_t head[] = { TIGHT_FILTER_PALETTE, palette->n_colours - 1 };
+	if (vec_append(arena, head, sizeof(head)) < 0 ||
+			tight_append_cpixels(self, arena, palette->colours,
+				palette->n_colours) < 0)
+		return -1;
+
+	tile->head_size = arena->len - start;
+
+	uint8_t* indices = ctx->indices;
+	size_t len = width * height;
+
+	/* Two colours are sent as a bitmap, with each row padded to a whole
+	 * byte. The bitmap is packed in place, as it never catches up with the
+	 * indices that it is made from.
+	 */
+	if (palette->n_colours == 2) {
+		uint8_t* dst = indices;
 
-		// TODO What to do if the buffer fills up?
-		if (tight_deflate(tile, row, bytes_per_cpixel * width,
-				zs, y == y_start + height - 1) < 0)
-			abort();
+		for (uint32_t y = 0; y < height; ++y) {
+			const uint8_t* row = indices + y * width;
+
+			for (uint32_t x = 0; x < width; x += 8) {
+				uint8_t byte = 0;
+				uint32_t n = MIN(8, width - x);
+				for (uint32_t i = 0; i < n; ++i)
+					byte |= row[x + i] << (7 - i);
+				*dst++ = byte;
+			}
+		}
+
+		len = dst - indices;
 	}
 
+	return tight_encode_data(self, ctx, tile, indices, len);
+}
+
+static int tight_encode_tile_basic(struct tight_encoder* self,
+		struct tight_zs_worker_ctx* ctx, struct tight_tile* tile,
+		const uint32_t* pixels, int32_t stride, uint32_t width,
+		uint32_t height)
+{
+	tile->type = TIGHT_BASIC;
+
+	struct rfb_pixel_format cfmt;
+	int bytes_per_cpixel;
+	tight_get_cpixel_format(self, &cfmt, &bytes_per_cpixel);
+
+	uint8_t* dst = ctx->cpixels;
+	for (uint32_t y = 0; y < height; ++y) {
+		pixel32_to_cpixel(dst, &cfmt, pixels + y * stride, &self->sfmt,
+				bytes_per_cpixel, width);
+		dst += bytes_per_cpixel * width;
+	}
+
+	return tight_encode_data(self, ctx, tile, ctx->cpixels,
+			dst - ctx->cpixels);
 }
 
 #ifdef HAVE_JPEG
@@ -299,62 +839,77 @@ static enum TJPF tight_get_jpeg_pixfmt(uint32_t fourcc)
 }
 
 static int tight_encode_tile_jpeg(struct tight_encoder* self,
-		struct tight_tile* tile, uint32_t x, uint32_t y, uint32_t width,
+		struct tight_zs_worker_ctx* ctx, struct tight_tile* tile,
+		const uint32_t* img, int32_t stride, uint32_t width,
 		uint32_t height)
 {
 	tile->type = TIGHT_JPEG;
+	tile->has_length = true;
 
-	unsigned char* buffer = NULL;
-	unsigned long size = 0;
+	/* This is the mapping that TigerVNC uses for the ten levels */
+	static const int jpeg_quality[] = {
+		15, 29, 41, 42, 62, 77, 79, 86, 92, 100,
+	};
 
-	int quality; /* 1 - 100 */
-
-	switch (self->quality) {
-	case TIGHT_QUALITY_HIGH: quality = 66; break;
-	case TIGHT_QUALITY_LOW: quality = 33; break;
-	default: abort();
-	}
+	assert(self->quality >= TIGHT_QUALITY_JPEG_0 &&
+			self->quality <= TIGHT_QUALITY_JPEG_9);
+	int quality = jpeg_quality[self->quality - TIGHT_QUALITY_JPEG_0];
 
 	uint32_t fourcc = nvnc_fb_get_fourcc_format(self->fb);
 	enum TJPF tjfmt = tight_get_jpeg_pixfmt(fourcc);
 	if (tjfmt == TJPF_UNKNOWN)
 		return -1;
 
-	tjhandle handle = tjInitCompress();
-	if (!handle)
+	/* The payload only depends on the pixels and the settings, so
+	 * content that has been seen before can be copied from the cache.
+	 */
+	struct tile_cache_key key = {
+		.fourcc = fourcc,
+		.width = width,
+		.height = height,
+		.variant = quality,
+	};
+	if (self->tile_cache) {
+		key.hash = tile_cache_hash(img, stride, width, height);
+		if (tile_cache_lookup(self->tile_cache, &key, &ctx->arena) >= 0)
+			return 0;
+	}
+
+	if (!ctx->jpeg) {
+		ctx->jpeg = tjInitCompress();
+		if (!ctx->jpeg)
+			return -1;
+	}
+
+	/* Room is made for the worst case, so turbojpeg can write straight
+	 * into the arena.
+	 */
+	struct vec* arena = &ctx->arena;
+	unsigned long size = tjBufSize(width, height, TJSAMP_422);
+	if (vec_reserve(arena, arena->len + size) < 0)
 		return -1;
 
-	uint32_t* addr = nvnc_fb_get_addr(self->fb);
-	int32_t stride = nvnc_fb_get_stride(self->fb);
-	void* img = (uint32_t*)addr + x + y * stride;
+	unsigned char* buffer = (unsigned char*)arena->data + arena->len;
 
-	int rc = -1;
-	rc = tjCompress2(handle, img, width, stride * 4, height, tjfmt, &buffer,
-			&size, TJSAMP_422, quality, TJFLAG_FASTDCT);
+	int rc = tjCompress2(ctx->jpeg, (unsigned char*)img, width,
+			stride * 4, height, tjfmt, &buffer, &size, TJSAMP_422,
+			quality, TJFLAG_FASTDCT | TJFLAG_NOREALLOC);
 	if (rc < 0) {
 		log_error("Failed to encode tight JPEG box: %s\n", tjGetErrorStr());
-		goto failure;
-	}
-
-	if (size > MAX_TILE_SIZE) {
-		log_error("Whoops, encoded JPEG was too big for the buffer\n");
-		goto failure;
+		return -1;
 	}
 
-	memcpy(tile->buffer, buffer, size);
-	tile->size = size;
+	arena->len += size;
 
-	rc = 0;
-	tjFree(buffer);
-failure:
-	tjDestroy(handle);
+	if (self->tile_cache)
+		tile_cache_insert(self->tile_cache, &key, buffer, size);
 
-	return rc;
+	return 0;
 }
 #endif /* HAVE_JPEG */
 
 static void tight_encode_tile(struct tight_encoder* self,
-		uint32_t gx, uint32_t gy)
+		struct tight_zs_worker_ctx* ctx, uint32_t gx, uint32_t gy)
 {
 	struct tight_tile* tile = tight_tile(self, gx, gy);
 
@@ -364,25 +919,48 @@ static void tight_encode_tile(struct tight_encoder* self,
 	uint32_t width = tight_tile_width(self, x);
 	uint32_t height = tight_tile_height(self, y);
 
-	tile->size = 0;
-
+	tile->worker = ctx->index;
+	tile->offset = ctx->arena.len;
+	tile->head_size = 0;
+
+	int32_t stride;
+	const uint32_t* pixels = tight_get_tile_pixels(self, ctx, x, y, width,
+			height, &stride);
+
+	/* Palettes need a zlib stream, so workers without one can only tell
+	 * whether a tile is solid.
+	 */
+	uint32_t max_colours = 1;
+	if (ctx->index < self->n_streams)
+		max_colours = tight_uses_zlib(self) ?
+			TIGHT_MAX_COLOURS : TIGHT_JPEG_MAX_COLOURS;
+
+	uint32_t n_colours = tight_classify_tile(self, ctx, pixels, stride,
+			width, height, max_colours);
+
+	int rc;
+	if (n_colours == 1)
+		rc = tight_encode_tile_fill(self, ctx, tile);
+	else if (n_colours > 1)
+		rc = tight_encode_tile_palette(self, ctx, tile, width, height);
 #ifdef HAVE_JPEG
-	switch (self->quality) {
-	case TIGHT_QUALITY_LOSSLESS:
-		tight_encode_tile_basic(self, tile, x, y, width, height, gx % 4);
-		break;
-	case TIGHT_QUALITY_HIGH:
-	case TIGHT_QUALITY_LOW:
-		// TODO: Use more workers for jpeg
-		tight_encode_tile_jpeg(self, tile, x, y, width, height);
-		break;
-	case TIGHT_QUALITY_UNSPEC:
-		abort();
-	}
-#else
-	tight_encode_tile_basic(self, tile, x, y, width, height, gx % 4);
+	else if (!tight_uses_zlib(self))
+		rc = tight_encode_tile_jpeg(self, ctx, tile, pixels, stride,
+				width, height);
 #endif
+	else
+		rc = tight_encode_tile_basic(self, ctx, tile, pixels, stride,
+				width, height);
 
+	/* Tiles that failed are left out of the frame and reported back once
+	 * it is finished
+	 */
+	if (rc < 0) {
+		ctx->arena.len = tile->offset;
+		return;
+	}
+
+	tile->size = ctx->arena.len - tile->offset - tile->head_size;
 	tile->state = TIGHT_TILE_ENCODED;
 }
 
@@ -390,12 +968,20 @@ static void do_tight_zs_work(void* obj)
 {
 	struct tight_zs_worker_ctx* ctx = aml_get_userdata(obj);
 	struct tight_encoder* self = ctx->encoder;
-	int index = ctx->index;
 
-	for (uint32_t y = 0; y < self->grid_height; ++y)
-		for (uint32_t x = index; x < self->grid_width; x += 4)
-			if (tight_tile(self, x, y)->state == TIGHT_TILE_DAMAGED)
-				tight_encode_tile(self, x, y);
+	/* Each worker sees its tiles in the same order as they are written out
+	 * by tight_finish(). This keeps the zlib stream owned by this worker in
+	 * sync with the client.
+	 */
+	for (;;) {
+		uint32_t i = atomic_fetch_add(&self->tile_queue_head, 1);
+		if (i >= self->pass_end)
+			break;
+
+		uint32_t tile_index = self->tile_queue[i];
+		tight_encode_tile(self, ctx, tile_index % self->grid_width,
+				tile_index / self->grid_width);
+	}
 }
 
 static void on_tight_zs_work_done(void* obj)
@@ -403,15 +989,19 @@ static void on_tight_zs_work_done(void* obj)
 	struct tight_zs_worker_ctx* ctx = aml_get_userdata(obj);
 	struct tight_encoder* self = ctx->encoder;
 
-	if (--self->n_jobs == 0) {
+	if (--self->n_jobs > 0)
+		return;
+
+	/* The buffer is held on to until all passes have been encoded */
+	if (self->pass_end == self->tile_queue_len)
 		nvnc_fb_unref(self->fb);
-		schedule_tight_finish(self);
-	}
+
+	schedule_tight_finish(self);
 }
 
 static int tight_schedule_zs_work(struct tight_encoder* self, int index)
 {
-	int rc = aml_start(aml_get_default(), self->zs_worker[index]);
+	int rc = aml_start(nvnc__get_loop(), self->zs_worker[index]);
 	if (rc >= 0)
 		++self->n_jobs;
 
@@ -420,11 +1010,22 @@ static int tight_schedule_zs_work(struct tight_encoder* self, int index)
 
 static int tight_schedule_encoding_jobs(struct tight_encoder* self)
 {
-	for (int i = 0; i < 4; ++i)
+	/* Lossless tiles need a zlib stream, but JPEG tiles can be encoded by
+	 * any worker. There's no point in waking up more workers than there
+	 * are tiles.
+	 */
+	uint32_t n_jobs = tight_uses_zlib(self) ?
+		self->n_streams : self->n_workers;
+	n_jobs = MIN(n_jobs, self->pass_end - self->pass_start);
+
+	/* The workers take tiles from a common queue, so the ones that did
+	 * start get through all of them.
+	 */
+	for (uint32_t i = 0; i < n_jobs; ++i)
 		if (tight_schedule_zs_work(self, i) < 0)
-			return -1;
+			break;
 
-	return 0;
+	return self->n_jobs > 0 ? 0 : -1;
 }
 
 static void tight_finish_tile(struct tight_encoder* self,
@@ -438,21 +1039,48 @@ static void tight_finish_tile(struct tight_encoder* self,
 	uint32_t width = tight_tile_width(self, x);
 	uint32_t height = tight_tile_height(self, y);
 
+	struct vec* arena = &tight_get_worker_ctx(self, tile->worker)->arena;
+
+	const char* data = (const char*)arena->data + tile->offset;
+
 	encode_rect_head(&self->dst, RFB_ENCODING_TIGHT, x, y, width, height);
 
 	vec_append(&self->dst, &tile->type, sizeof(tile->type));
-	tight_encode_size(&self->dst, tile->size);
-	vec_append(&self->dst, tile->buffer, tile->size);
-
-	tile->state = TIGHT_TILE_READY;
+	vec_append(&self->dst, data, tile->head_size);
+	if (tile->has_length)
+		tight_encode_size(&self->dst, tile->size);
+	vec_append(&self->dst, data + tile->head_size, tile->size);
 }
 
 static void tight_finish(struct tight_encoder* self)
 {
-	for (uint32_t y = 0; y < self->grid_height; ++y)
-		for (uint32_t x = 0; x < self->grid_width; ++x)
-			if (tight_tile(self, x, y)->state == TIGHT_TILE_ENCODED)
-				tight_finish_tile(self, x, y);
+	uint32_t n_rects = 0;
+
+	for (uint32_t i = self->pass_start; i < self->pass_end; ++i) {
+		uint32_t x = self->tile_queue[i] % self->grid_width;
+		uint32_t y = self->tile_queue[i] / self->grid_width;
+		struct tight_tile* tile = tight_tile(self, x, y);
+
+		if (tile->state == TIGHT_TILE_ENCODED) {
+			tight_finish_tile(self, x, y);
+			++n_rects;
+
+			if (tile->type == TIGHT_JPEG)
+				tile_bitmap_set(&self->lossy_tiles, x, y);
+			else
+				tile_bitmap_unset(&self->lossy_tiles, x, y);
+		} else {
+			tile_bitmap_set(&self->failed_tiles, x, y);
+		}
+
+		tile->state = TIGHT_TILE_READY;
+	}
+
+	/* The count in the header was a guess made before encoding started */
+	if (n_rects != self->n_rects) {
+		struct rfb_server_fb_update_msg* msg = self->dst.data;
+		msg->n_rects = htons(n_rects);
+	}
 }
 
 static void do_tight_finish(void* obj)
@@ -465,19 +1093,23 @@ static void do_tight_finish(void* obj)
 static void on_tight_finished(void* obj)
 {
 	struct tight_encoder* self = aml_get_userdata(obj);
-	self->on_frame_done(&self->dst, self->userdata);
+
+	if (self->pass_end == self->tile_queue_len) {
+		self->on_frame_done(&self->dst, self->userdata);
+		return;
+	}
+
+	self->on_chunk(&self->dst, self->userdata);
+
+	if (tight_start_pass(self) < 0) {
+		nvnc_fb_unref(self->fb);
+		self->on_frame_done(NULL, self->userdata);
+	}
 }
 
 static int schedule_tight_finish(struct tight_encoder* self)
 {
-	struct aml_work* work = aml_work_new(do_tight_finish, on_tight_finished,
-			self, NULL);
-	if (!work)
-		return -1;
-
-	int rc = aml_start(aml_get_default(), work);
-	aml_unref(work);
-	return rc;
+	return aml_start(nvnc__get_loop(), self->finisher);
 }
 
 int tight_encode_frame(struct tight_encoder* self,
@@ -485,11 +1117,15 @@ int tight_encode_frame(struct tight_encoder* self,
 		struct nvnc_fb* src,
 		const struct rfb_pixel_format* sfmt,
 		struct pixman_region16* damage,
+		const struct tile_bitmap* damage_tiles,
 		enum tight_quality quality,
 		tight_done_fn on_done, void* userdata)
 {
 	memcpy(&self->dfmt, dfmt, sizeof(self->dfmt));
 	memcpy(&self->sfmt, sfmt, sizeof(self->sfmt));
+	self->colour_mask = (sfmt->red_max << sfmt->red_shift) |
+		(sfmt->green_max << sfmt->green_shift) |
+		(sfmt->blue_max << sfmt->blue_shift);
 	self->fb = src;
 	self->quality = quality;
 	self->on_frame_done = on_done;
@@ -499,22 +1135,23 @@ int tight_encode_frame(struct tight_encoder* self,
 	if (rc < 0)
 		return -1;
 
-	uint32_t width = nvnc_fb_get_width(src);
-	uint32_t height = nvnc_fb_get_height(src);
-	rc = vec_init(&self->dst, width * height * 4);
-	if (rc < 0)
-		return -1;
+	rc = tight_apply_damage(self, damage, damage_tiles);
+	assert(rc > 0);
 
-	self->n_rects = tight_apply_damage(self, damage);
-	assert(self->n_rects > 0);
+	tile_bitmap_clear(&self->failed_tiles);
 
-	encode_rect_count(&self->dst, self->n_rects);
+	if (tight_is_progressive(self))
+		tight_order_by_focus(self);
+
+	self->pass_start = 0;
+	self->pass_end = 0;
+
+	tight_apply_compression_level(self);
 
 	nvnc_fb_ref(self->fb);
 
-	if (tight_schedule_encoding_jobs(self) < 0) {
+	if (tight_start_pass(self) < 0) {
 		nvnc_fb_unref(self->fb);
-		vec_destroy(&self->dst);
 		return -1;
 	}
 
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "tile-bitmap.h"
+#include "vec.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pixman.h>
+#include <sys/param.h>
+
+#define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
+
+int tile_bitmap_init(struct tile_bitmap* self, uint32_t width, uint32_t height,
+		uint32_t tile_size)
+{
+	memset(self, 0, sizeof(*self));
+	self->tile_size = tile_size;
+	return tile_bitmap_resize(self, width, height);
+}
+
+int tile_bitmap_resize(struct tile_bitmap* self, uint32_t width,
+		uint32_t height)
+{
+	uint32_t twidth = UDIV_UP(width, self->tile_size);
+	uint32_t theight = UDIV_UP(height, self->tile_size);
+
+	if (self->words && twidth == self->width && theight == self->height)
+		return 0;
+
+	uint32_t words_per_row = UDIV_UP(twidth, 64);
+
+	/* Always allocate at least one word so that words is never NULL */
+	uint64_t* words = calloc(MAX(1, words_per_row * theight),
+			sizeof(*words));
+	if (!words)
+		return -1;
+
+	free(self->words);
+	self->words = words;
+	self->width = twidth;
+	self->height = theight;
+	self->words_per_row = words_per_row;
+	return 0;
+}
+
+void tile_bitmap_destroy(struct tile_bitmap* self)
+{
+	free(self->words);
+	self->words = NULL;
+}
+
+static inline size_t tile_bitmap__n_words(const struct tile_bitmap* self)
+{
+	return self->words_per_row * self->height;
+}
+
+void tile_bitmap_clear(struct tile_bitmap* self)
+{
+	memset(self->words, 0, tile_bitmap__n_words(self) * sizeof(uint64_t));
+}
+
+void tile_bitmap_set_all(struct tile_bitmap* self)
+{
+	tile_bitmap_add_rect(self, 0, 0, self->width * self->tile_size,
+			self->height * self->tile_size);
+}
+
+bool tile_bitmap_is_empty(const struct tile_bitmap* self)
+{
+	size_t n = tile_bitmap__n_words(self);
+	for (size_t i = 0; i < n; ++i)
+		if (self->words[i])
+			return false;
+
+	return true;
+}
+
+uint32_t tile_bitmap_count(const struct tile_bitmap* self)
+{
+	uint32_t count = 0;
+	size_t n = tile_bitmap__n_words(self);
+	for (size_t i = 0; i < n; ++i)
+		count += __builtin_popcountll(self->words[i]);
+
+	return count;
+}
+
+/* Sets bits x1 up to, but not including, x2 in a row */
+static void tile_bitmap__set_span(struct tile_bitmap* self, uint32_t y,
+		uint32_t x1, uint32_t x2)
+{
+	uint64_t* row = &self->words[y * self->words_per_row];
+
+	while (x1 < x2) {
+		uint32_t bit = x1 % 64;
+		uint32_t n = MIN(64 - bit, x2 - x1);
+		uint64_t mask = n == 64 ? ~UINT64_C(0) :
+			((UINT64_C(1) << n) - 1) << bit;
+
+		row[x1 / 64] |= mask;
+		x1 += n;
+	}
+}
+
+void tile_bitmap_add_rect(struct tile_bitmap* self, int x, int y, int width,
+		int height)
+{
+	if (width <= 0 || height <= 0)
+		return;
+
+	uint32_t x1 = MAX(x, 0) / self->tile_size;
+	uint32_t y1 = MAX(y, 0) / self->tile_size;
+	uint32_t x2 = MIN(UDIV_UP((uint32_t)MAX(x + width, 0), self->tile_size),
+			self->width);
+	uint32_t y2 = MIN(UDIV_UP((uint32_t)MAX(y + height, 0),
+				self->tile_size), self->height);
+
+	for (uint32_t ty = y1; ty < y2; ++ty)
+		tile_bitmap__set_span(self, ty, x1, x2);
+}
+
+bool tile_bitmap_test_rect(const struct tile_bitmap* self, int x, int y,
+		int width, int height)
+{
+	if (width <= 0 || height <= 0)
+		return false;
+
+	uint32_t x1 = MAX(x, 0) / self->tile_size;
+	uint32_t y1 = MAX(y, 0) / self->tile_size;
+	uint32_t x2 = MIN(UDIV_UP((uint32_t)MAX(x + width, 0), self->tile_size),
+			self->width);
+	uint32_t y2 = MIN(UDIV_UP((uint32_t)MAX(y + height, 0),
+				self->tile_size), self->height);
+
+	for (uint32_t ty = y1; ty < y2; ++ty)
+		for (uint32_t tx = x1; tx < x2; ++tx)
+			if (tile_bitmap_test(self, tx, ty))
+				return true;
+
+	return false;
+}
+
+void tile_bitmap_add_region(struct tile_bitmap* self,
+		struct pixman_region16* region)
+{
+	int n_rects = 0;
+	struct pixman_box16* rects = pixman_region_rectangles(region, &n_rects);
+
+	for (int i = 0; i < n_rects; ++i)
+		tile_bitmap_add_rect(self, rects[i].x1, rects[i].y1,
+				rects[i].x2 - rects[i].x1,
+				rects[i].y2 - rects[i].y1);
+}
+
+int tile_bitmap_or(struct tile_bitmap* dst, const struct tile_bitmap* src)
+{
+	if (dst->width != src->width || dst->height != src->height ||
+			dst->tile_size != src->tile_size)
+		return -1;
+
+	size_t n = tile_bitmap__n_words(dst);
+	for (size_t i = 0; i < n; ++i)
+		dst->words[i] |= src->words[i];
+
+	return 0;
+}
+
+bool tile_bitmap_next(const struct tile_bitmap* self, uint32_t* x,
+		uint32_t* y)
+{
+	uint32_t tx = *x;
+	uint32_t ty = *y;
+
+	for (; ty < self->height; ++ty, tx = 0) {
+		for (uint32_t i = tx / 64; i < self->words_per_row; ++i) {
+			uint64_t word = self->words[ty * self->words_per_row + i];
+
+			/* Mask off the bits before the starting point */
+			if (i == tx / 64)
+				word &= ~UINT64_C(0) << (tx % 64);
+
+			if (word) {
+				uint32_t next = i * 64 + __builtin_ctzll(word);
+				if (next >= self->width)
+					break;
+
+				*x = next;
+				*y = ty;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void tile_bitmap_to_region(const struct tile_bitmap* self,
+		struct pixman_region16* dst)
+{
+	struct vec boxes;
+	if (vec_init(&boxes, 64 * sizeof(struct pixman_box16)) < 0)
+		return;
+
+	uint32_t ts = self->tile_size;
+
+	/* Each row of tiles becomes a band of horizontal runs, which is what
+	 * pixman wants anyway, so the region is built in one go.
+	 */
+	uint32_t x = 0, y = 0;
+	while (tile_bitmap_next(self, &x, &y)) {
+		uint32_t start = x;
+		while (x < self->width && tile_bitmap_test(self, x, y))
+			++x;
+
+		struct pixman_box16 box = {
+			.x1 = start * ts,
+			.y1 = y * ts,
+			.x2 = x * ts,
+			.y2 = (y + 1) * ts,
+		};
+		vec_append(&boxes, &box, sizeof(box));
+	}
+
+	struct pixman_region16 region;
+	pixman_region_init_rects(&region, boxes.data,
+			boxes.len / sizeof(struct pixman_box16));
+	pixman_region_union(dst, dst, &region);
+	pixman_region_fini(&region);
+
+	vec_destroy(&boxes);
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "tile-cache.h"
+#include "murmurhash.h"
+#include "vec.h"
+
+#include "sys/queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define TILE_CACHE_HASH_BITS 12
+#define TILE_CACHE_N_BUCKETS (1 << TILE_CACHE_HASH_BITS)
+
+/* Two independent 32 bit hashes make up the content hash. A 32 bit hash alone
+ * would collide far too often for a cache that may hold thousands of tiles.
+ */
+#define TILE_CACHE_SEED_LO 0x9e3779b9
+#define TILE_CACHE_SEED_HI 0x85ebca6b
+
+struct tile_cache_entry {
+	struct tile_cache_key key;
+	LIST_ENTRY(tile_cache_entry) bucket_link;
+	TAILQ_ENTRY(tile_cache_entry) lru_link;
+	size_t size;
+	uint8_t data[];
+};
+
+LIST_HEAD(tile_cache_bucket, tile_cache_entry);
+TAILQ_HEAD(tile_cache_lru, tile_cache_entry);
+
+struct tile_cache {
+	int ref;
+	pthread_mutex_t mutex;
+
+	struct tile_cache_bucket buckets[TILE_CACHE_N_BUCKETS];
+
+	/* Most recently used first */
+	struct tile_cache_lru lru;
+
+	size_t size;
+	size_t max_size;
+};
+
+struct tile_cache* tile_cache_new(size_t max_size)
+{
+	struct tile_cache* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->ref = 1;
+	self->max_size = max_size;
+
+	for (int i = 0; i < TILE_CACHE_N_BUCKETS; ++i)
+		LIST_INIT(&self->buckets[i]);
+	TAILQ_INIT(&self->lru);
+
+	pthread_mutex_init(&self->mutex, NULL);
+
+	return self;
+}
+
+static void tile_cache__destroy(struct tile_cache* self)
+{
+	while (!TAILQ_EMPTY(&self->lru)) {
+		struct tile_cache_entry* entry = TAILQ_FIRST(&self->lru);
+		TAILQ_REMOVE(&self->lru, entry, lru_link);
+		free(entry);
+	}
+
+	pthread_mutex_destroy(&self->mutex);
+	free(self);
+}
+
+void tile_cache_ref(struct tile_cache* self)
+{
+	self->ref++;
+}
+
+void tile_cache_unref(struct tile_cache* self)
+{
+	assert(self->ref > 0);
+
+	if (--self->ref == 0)
+		tile_cache__destroy(self);
+}
+
+uint64_t tile_cache_hash(const uint32_t* pixels, int32_t stride,
+		uint32_t width, uint32_t height)
+{
+	uint32_t lo = TILE_CACHE_SEED_LO;
+	uint32_t hi = TILE_CACHE_SEED_HI;
+
+	for (uint32_t y = 0; y < height; ++y) {
+		const char* row = (const char*)(pixels + y * stride);
+		lo = murmurhash(row, width * 4, lo);
+		hi = murmurhash(row, width * 4, hi);
+	}
+
+	return (uint64_t)hi << 32 | lo;
+}
+
+static bool tile_cache_key_equal(const struct tile_cache_key* a,
+		const struct tile_cache_key* b)
+{
+	return a->hash == b->hash && a->fourcc == b->fourcc &&
+		a->width == b->width && a->height == b->height &&
+		a->variant == b->variant;
+}
+
+static struct tile_cache_bucket* tile_cache_bucket(struct tile_cache* self,
+		const struct tile_cache_key* key)
+{
+	uint32_t index = (key->hash ^ key->variant) &
+		(TILE_CACHE_N_BUCKETS - 1);
+	return &self->buckets[index];
+}
+
+static struct tile_cache_entry* tile_cache_find(struct tile_cache* self,
+		const struct tile_cache_key* key)
+{
+	struct tile_cache_entry* entry;
+	LIST_FOREACH(entry, tile_cache_bucket(self, key), bucket_link)
+		if (tile_cache_key_equal(&entry->key, key))
+			return entry;
+
+	return NULL;
+}
+
+static void tile_cache_remove(struct tile_cache* self,
+		struct tile_cache_entry* entry)
+{
+	LIST_REMOVE(entry, bucket_link);
+	TAILQ_REMOVE(&self->lru, entry, lru_link);
+	self->size -= entry->size;
+	free(entry);
+}
+
+ssize_t tile_cache_lookup(struct tile_cache* self,
+		const struct tile_cache_key* key, struct vec* dst)
+{
+	ssize_t rc = -1;
+
+	pthread_mutex_lock(&self->mutex);
+
+	struct tile_cache_entry* entry = tile_cache_find(self, key);
+	if (!entry)
+		goto done;
+
+	if (vec_append(dst, entry->data, entry->size) < 0)
+		goto done;
+
+	TAILQ_REMOVE(&self->lru, entry, lru_link);
+	TAILQ_INSERT_HEAD(&self->lru, entry, lru_link);
+	rc = entry->size;
+
+done:
+	pthread_mutex_unlock(&self->mutex);
+	return rc;
+}
+
+int tile_cache_insert(struct tile_cache* self,
+		const struct tile_cache_key* key, const void* data, size_t size)
+{
+	if (size > self->max_size)
+		return -1;
+
+	struct tile_cache_entry* entry = malloc(sizeof(*entry) + size);
+	if (!entry)
+		return -1;
+
+	entry->key = *key;
+	entry->size = size;
+	memcpy(entry->data, data, size);
+
+	pthread_mutex_lock(&self->mutex);
+
+	/* Another worker may have encoded the same tile in the meantime */
+	struct tile_cache_entry* old = tile_cache_find(self, key);
+	if (old)
+		tile_cache_remove(self, old);
+
+	while (self->size + size > self->max_size)
+		tile_cache_remove(self, TAILQ_LAST(&self->lru, tile_cache_lru));
+
+	LIST_INSERT_HEAD(tile_cache_bucket(self, key), entry, bucket_link);
+	TAILQ_INSERT_HEAD(&self->lru, entry, lru_link);
+	self->size += size;
+
+	pthread_mutex_unlock(&self->mutex);
+	return 0;
+}
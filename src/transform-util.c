@@ -38,9 +38,15 @@
 
 #include "transform-util.h"
 #include "neatvnc.h"
+#include "fb.h"
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <pixman.h>
+#include <sys/param.h>
+
+#define READ_BLOCK_SIZE 16
 
 /* Note: This function yields the inverse pixman transform of the
  * nvnc_transform.
@@ -136,7 +142,7 @@ void nvnc_transform_to_pixman_transform(pixman_transform_t* dst,
 	abort();
 }
 
-static bool is_transform_90_degrees(enum nvnc_transform transform)
+bool nvnc_transform_is_90_degrees(enum nvnc_transform transform)
 {
 	switch (transform) {
 	case NVNC_TRANSFORM_90:
@@ -154,7 +160,7 @@ static bool is_transform_90_degrees(enum nvnc_transform transform)
 void nvnc_transform_dimensions(enum nvnc_transform transform, uint32_t* width,
 		uint32_t* height)
 {
-	if (is_transform_90_degrees(transform)) {
+	if (nvnc_transform_is_90_degrees(transform)) {
 		uint32_t tmp = *width;
 		*width = *height;
 		*height = tmp;
@@ -236,3 +242,107 @@ void nvnc_transform_region(struct pixman_region16* dst,
 	pixman_region_init_rects(dst, dst_rects, nrects);
 	free(dst_rects);
 }
+
+/* Walking the output rectangle one row at a time moves through the source
+ * buffer with a fixed step per output pixel (dx) and per output row (dy).
+ * This is the same mapping as in nvnc_transform_to_pixman_transform().
+ */
+static void transform_steps(const struct nvnc_fb* fb, ptrdiff_t* origin,
+		ptrdiff_t* dx, ptrdiff_t* dy)
+{
+	ptrdiff_t stride = fb->stride;
+	ptrdiff_t right = fb->width - 1;
+	ptrdiff_t bottom = (ptrdiff_t)(fb->height - 1) * stride;
+
+	switch (fb->transform) {
+	case NVNC_TRANSFORM_NORMAL:
+		*origin = 0;
+		*dx = 1;
+		*dy = stride;
+		return;
+	case NVNC_TRANSFORM_90:
+		*origin = bottom;
+		*dx = -stride;
+		*dy = 1;
+		return;
+	case NVNC_TRANSFORM_180:
+		*origin = right + bottom;
+		*dx = -1;
+		*dy = -stride;
+		return;
+	case NVNC_TRANSFORM_270:
+		*origin = right;
+		*dx = stride;
+		*dy = -1;
+		return;
+	case NVNC_TRANSFORM_FLIPPED:
+		*origin = right;
+		*dx = -1;
+		*dy = stride;
+		return;
+	case NVNC_TRANSFORM_FLIPPED_90:
+		*origin = 0;
+		*dx = stride;
+		*dy = 1;
+		return;
+	case NVNC_TRANSFORM_FLIPPED_180:
+		*origin = bottom;
+		*dx = 1;
+		*dy = -stride;
+		return;
+	case NVNC_TRANSFORM_FLIPPED_270:
+		*origin = right + bottom;
+		*dx = -stride;
+		*dy = -1;
+		return;
+	}
+
+	abort();
+}
+
+/* Copies a rectangle, given in output coordinates, out of a transformed buffer
+ * into dst. For rotated buffers, output rows are source columns, so the copy
+ * is done in small square blocks to keep both sides in the cache.
+ */
+void nvnc_transform_read_rect(uint32_t* dst, int dst_stride,
+		const struct nvnc_fb* fb, int x, int y, int width, int height)
+{
+	const uint32_t* src = fb->addr;
+	ptrdiff_t origin, dx, dy;
+	transform_steps(fb, &origin, &dx, &dy);
+
+	const uint32_t* start = src + origin + x * dx + y * dy;
+
+	if (dx == 1) {
+		for (int j = 0; j < height; ++j)
+			memcpy(dst + j * dst_stride, start + j * dy,
+					width * sizeof(*dst));
+		return;
+	}
+
+	if (dx == -1) {
+		for (int j = 0; j < height; ++j) {
+			const uint32_t* row = start + j * dy;
+			uint32_t* out = dst + j * dst_stride;
+			for (int i = 0; i < width; ++i)
+				out[i] = row[-i];
+		}
+		return;
+	}
+
+	for (int by = 0; by < height; by += READ_BLOCK_SIZE) {
+		int bh = MIN(READ_BLOCK_SIZE, height - by);
+
+		for (int bx = 0; bx < width; bx += READ_BLOCK_SIZE) {
+			int bw = MIN(READ_BLOCK_SIZE, width - bx);
+
+			// Each output column is a contiguous source row
+			for (int i = bx; i < bx + bw; ++i) {
+				const uint32_t* col = start + i * dx + by * dy;
+				uint32_t* out = dst + by * dst_stride + i;
+				for (int j = 0; j < bh; ++j)
+					out[j * dst_stride] = col[j * dy];
+			}
+		}
+	}
+}
@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2021 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "websocket.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/param.h>
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_KEY_SIZE 64
+
+#define SHA1_DIGEST_SIZE 20
+
+struct sha1 {
+	uint32_t h[5];
+	uint8_t block[64];
+	size_t block_len;
+	uint64_t len;
+};
+
+static inline uint32_t rol32(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_init(struct sha1* self)
+{
+	*self = (struct sha1){
+		.h = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+			0xc3d2e1f0 },
+	};
+}
+
+static void sha1_process_block(struct sha1* self)
+{
+	uint32_t w[80];
+
+	for (int i = 0; i < 16; ++i)
+		w[i] = (uint32_t)self->block[i * 4] << 24 |
+			(uint32_t)self->block[i * 4 + 1] << 16 |
+			(uint32_t)self->block[i * 4 + 2] << 8 |
+			(uint32_t)self->block[i * 4 + 3];
+
+	for (int i = 16; i < 80; ++i)
+		w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	uint32_t a = self->h[0], b = self->h[1], c = self->h[2],
+		 d = self->h[3], e = self->h[4];
+
+	for (int i = 0; i < 80; ++i) {
+		uint32_t f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		uint32_t tmp = rol32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol32(b, 30);
+		b = a;
+		a = tmp;
+	}
+
+	self->h[0] += a;
+	self->h[1] += b;
+	self->h[2] += c;
+	self->h[3] += d;
+	self->h[4] += e;
+}
+
+static void sha1_update(struct sha1* self, const void* data, size_t len)
+{
+	const uint8_t* p = data;
+	self->len += len;
+
+	while (len > 0) {
+		size_t n = MIN(len, sizeof(self->block) - self->block_len);
+		memcpy(self->block + self->block_len, p, n);
+		self->block_len += n;
+		p += n;
+		len -= n;
+
+		if (self->block_len == sizeof(self->block)) {
+			sha1_process_block(self);
+			self->block_len = 0;
+		}
+	}
+}
+
+static void sha1_final(struct sha1* self, uint8_t* digest)
+{
+	uint64_t bit_len = self->len * 8;
+
+	uint8_t pad = 0x80;
+	sha1_update(self, &pad, 1);
+
+	pad = 0;
+	while (self->block_len != 56)
+		sha1_update(self, &pad, 1);
+
+	uint8_t len_be[8];
+	for (int i = 0; i < 8; ++i)
+		len_be[i] = bit_len >> (56 - i * 8);
+	sha1_update(self, len_be, sizeof(len_be));
+
+	for (int i = 0; i < 5; ++i) {
+		digest[i * 4] = self->h[i] >> 24;
+		digest[i * 4 + 1] = self->h[i] >> 16;
+		digest[i * 4 + 2] = self->h[i] >> 8;
+		digest[i * 4 + 3] = self->h[i];
+	}
+}
+
+static void base64_encode(char* dst, const uint8_t* src, size_t len)
+{
+	static const char table[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	size_t i;
+	for (i = 0; i + 2 < len; i += 3) {
+		uint32_t v = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+		*dst++ = table[(v >> 18) & 0x3f];
+		*dst++ = table[(v >> 12) & 0x3f];
+		*dst++ = table[(v >> 6) & 0x3f];
+		*dst++ = table[v & 0x3f];
+	}
+
+	if (i < len) {
+		uint32_t v = src[i] << 16 | (i + 1 < len ? src[i + 1] << 8 : 0);
+		*dst++ = table[(v >> 18) & 0x3f];
+		*dst++ = table[(v >> 12) & 0x3f];
+		*dst++ = i + 1 < len ? table[(v >> 6) & 0x3f] : '=';
+		*dst++ = '=';
+	}
+
+	*dst = '\0';
+}
+
+static char* trim(char* str)
+{
+	while (isspace((unsigned char)*str))
+		++str;
+
+	char* end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+
+	return str;
+}
+
+static bool has_token(const char* list, const char* token)
+{
+	size_t len = strlen(token);
+
+	for (const char* p = list; *p; ) {
+		while (*p == ' ' || *p == ',')
+			++p;
+
+		const char* end = p + strcspn(p, ", ");
+		if ((size_t)(end - p) == len && strncasecmp(p, token, len) == 0)
+			return true;
+
+		p = end;
+	}
+
+	return false;
+}
+
+ssize_t ws_handshake(char* dst, size_t dst_size, const char* request,
+		size_t len)
+{
+	if (len > WS_HANDSHAKE_MAX_SIZE)
+		return -1;
+
+	const char* end = memmem(request, len, "\r\n\r\n", 4);
+	if (!end)
+		return len == WS_HANDSHAKE_MAX_SIZE ? -1 : 0;
+
+	char copy[WS_HANDSHAKE_MAX_SIZE + 1];
+	memcpy(copy, request, end - request);
+	copy[end - request] = '\0';
+
+	char* saveptr = NULL;
+	char* line = strtok_r(copy, "\r\n", &saveptr);
+	if (!line || strncmp(line, "GET ", 4) != 0)
+		return -1;
+
+	bool is_upgrade = false;
+	bool has_binary = false;
+	bool is_version_13 = false;
+	const char* key = NULL;
+
+	while ((line = strtok_r(NULL, "\r\n", &saveptr))) {
+		char* value = strchr(line, ':');
+		if (!value)
+			continue;
+
+		*value++ = '\0';
+		value = trim(value);
+		const char* name = trim(line);
+
+		if (strcasecmp(name, "Upgrade") == 0)
+			is_upgrade = has_token(value, "websocket");
+		else if (strcasecmp(name, "Sec-WebSocket-Key") == 0)
+			key = value;
+		else if (strcasecmp(name, "Sec-WebSocket-Protocol") == 0)
+			has_binary = has_token(value, "binary");
+		else if (strcasecmp(name, "Sec-WebSocket-Version") == 0)
+			is_version_13 = strcmp(value, "13") == 0;
+	}
+
+	if (!is_upgrade || !is_version_13 || !key ||
+			strlen(key) > WS_MAX_KEY_SIZE)
+		return -1;
+
+	struct sha1 sha1;
+	sha1_init(&sha1);
+	sha1_update(&sha1, key, strlen(key));
+	sha1_update(&sha1, WS_GUID, strlen(WS_GUID));
+
+	uint8_t digest[SHA1_DIGEST_SIZE];
+	sha1_final(&sha1, digest);
+
+	char accept[32];
+	base64_encode(accept, digest, sizeof(digest));
+
+	int rc = snprintf(dst, dst_size,
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n"
+			"%s"
+			"\r\n",
+			accept,
+			has_binary ? "Sec-WebSocket-Protocol: binary\r\n" : "");
+
+	return rc > 0 && (size_t)rc < dst_size ? rc : -1;
+}
+
+size_t ws_encode_frame_head(uint8_t* dst, enum ws_opcode opcode,
+		uint64_t payload_len)
+{
+	dst[0] = 0x80 | opcode;
+
+	if (payload_len < 126) {
+		dst[1] = payload_len;
+		return 2;
+	}
+
+	if (payload_len <= UINT16_MAX) {
+		dst[1] = 126;
+		dst[2] = payload_len >> 8;
+		dst[3] = payload_len;
+		return 4;
+	}
+
+	dst[1] = 127;
+	for (int i = 0; i < 8; ++i)
+		dst[2 + i] = payload_len >> (56 - i * 8);
+	return 10;
+}
+
+/* The mask is applied a word at a time, which matters for large frames */
+static void ws_unmask(uint8_t* dst, const uint8_t* src, size_t len,
+		const uint8_t* mask, size_t mask_index)
+{
+	size_t i = 0;
+
+	for (; i < len && ((mask_index + i) & 3); ++i)
+		dst[i] = src[i] ^ mask[(mask_index + i) & 3];
+
+	uint32_t mask32;
+	memcpy(&mask32, mask, sizeof(mask32));
+	uint64_t mask64 = (uint64_t)mask32 << 32 | mask32;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, src + i, sizeof(v));
+		v ^= mask64;
+		memcpy(dst + i, &v, sizeof(v));
+	}
+
+	for (; i < len; ++i)
+		dst[i] = src[i] ^ mask[(mask_index + i) & 3];
+}
+
+static size_t ws_decoder_head_size(const struct ws_decoder* self)
+{
+	if (self->head_len < 2)
+		return 2;
+
+	size_t size = 2 + 4;
+	switch (self->head[1] & 0x7f) {
+	case 126: return size + 2;
+	case 127: return size + 8;
+	}
+
+	return size;
+}
+
+static int ws_decoder_parse_head(struct ws_decoder* self)
+{
+	self->opcode = self->head[0] & 0x0f;
+
+	uint64_t len = self->head[1] & 0x7f;
+	const uint8_t* p = self->head + 2;
+
+	if (len == 126) {
+		len = (uint64_t)p[0] << 8 | p[1];
+		p += 2;
+	} else if (len == 127) {
+		len = 0;
+		for (int i = 0; i < 8; ++i)
+			len = len << 8 | p[i];
+		p += 8;
+	}
+
+	/* No extensions are negotiated, so the reserved bits must be clear */
+	if (self->head[0] & 0x70)
+		return -1;
+
+	/* Control frames must not be fragmented */
+	if (self->opcode >= WS_OPCODE_CLOSE && !(self->head[0] & 0x80))
+		return -1;
+
+	if (self->opcode >= WS_OPCODE_CLOSE && len > WS_MAX_CONTROL_PAYLOAD)
+		return -1;
+
+	memcpy(self->mask, p, sizeof(self->mask));
+	self->mask_index = 0;
+	self->payload_left = len;
+	self->control_len = 0;
+	return 0;
+}
+
+ssize_t ws_decode(struct ws_decoder* self, uint8_t* buffer, size_t len,
+		ws_control_fn on_control, void* userdata)
+{
+	size_t in = 0, out = 0;
+
+	while (in < len) {
+		bool is_control = self->opcode >= WS_OPCODE_CLOSE;
+
+		if (self->head_len < ws_decoder_head_size(self)) {
+			self->head[self->head_len++] = buffer[in++];
+
+			/* Frames from clients must be masked */
+			if (self->head_len == 2 && !(self->head[1] & 0x80))
+				return -1;
+
+			if (self->head_len < ws_decoder_head_size(self))
+				continue;
+
+			if (ws_decoder_parse_head(self) < 0)
+				return -1;
+
+			is_control = self->opcode >= WS_OPCODE_CLOSE;
+			if (self->payload_left > 0)
+				continue;
+		} else {
+			size_t n = MIN(len - in, self->payload_left);
+			if (is_control) {
+				ws_unmask(self->control + self->control_len,
+						buffer + in, n, self->mask,
+						self->mask_index);
+				self->control_len += n;
+			} else {
+				ws_unmask(buffer + out, buffer + in, n,
+						self->mask, self->mask_index);
+				out += n;
+			}
+
+			in += n;
+			self->mask_index += n;
+			self->payload_left -= n;
+
+			if (self->payload_left != 0)
+				break;
+		}
+
+		/* The frame is complete */
+		self->head_len = 0;
+
+		if (is_control && on_control(self->opcode, self->control,
+					self->control_len, userdata) < 0)
+			return -1;
+	}
+
+	return out;
+}
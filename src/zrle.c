@@ -16,11 +16,17 @@
 
 #include "rfb-proto.h"
 #include "vec.h"
+#include "deflate.h"
 #include "zrle.h"
 #include "neatvnc.h"
 #include "pixels.h"
 #include "fb.h"
+#include "transform-util.h"
 #include "enc-util.h"
+#include "buf-pool.h"
+#include "event-loop.h"
+#include "logging.h"
+#include "region-simplify.h"
 
 #include <stdint.h>
 #include <unistd.h>
@@ -28,42 +34,146 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <pixman.h>
-#include <zlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <aml.h>
 
 #define TILE_LENGTH 64
 
 #define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
 
-static inline int find_colour_in_palette(uint32_t* palette, int len,
-                                         uint32_t colour)
+#define ZRLE_MAX_PALETTE 127
+#define ZRLE_MAX_PACKED_PALETTE 16
+#define ZRLE_PALETTE_HASH_SIZE 256
+
+/* Every rectangle carries its own header and partial tiles along its edges,
+ * while pixels in between are mostly unchanged and compress to well under a
+ * byte each. This allows for a gap of up to 256 pixels.
+ */
+static const struct region_cost zrle_merge_cost = {
+	.rect = 256,
+	.pixel = 1,
+};
+
+/* Maps colours to palette indices. Only the first pixel of every run is looked
+ * up, so the table is hit once per run rather than once per pixel.
+ */
+struct zrle_palette {
+	uint32_t colours[ZRLE_MAX_PALETTE];
+	int size;
+
+	uint32_t slot_colour[ZRLE_PALETTE_HASH_SIZE];
+	/* Palette index + 1, 0 means empty */
+	uint8_t slot_index[ZRLE_PALETTE_HASH_SIZE];
+};
+
+struct zrle_tile_stats {
+	/* Number of runs of identical pixels and how many of those are only
+	 * one pixel long
+	 */
+	size_t n_runs;
+	size_t n_single_runs;
+
+	/* Total number of run length bytes for runs longer than one pixel */
+	size_t run_length_bytes;
+};
+
+static inline uint32_t zrle_palette_hash(uint32_t colour)
+{
+	return (colour * 2654435761u) >> 24;
+}
+
+static void zrle_palette_clear(struct zrle_palette* palette)
+{
+	palette->size = 0;
+	memset(palette->slot_index, 0, sizeof(palette->slot_index));
+}
+
+static int zrle_palette_lookup(const struct zrle_palette* palette,
+		uint32_t colour)
 {
-	for (int i = 0; i < len; ++i)
-		if (palette[i] == colour)
-			return i;
+	uint32_t slot = zrle_palette_hash(colour);
+
+	while (palette->slot_index[slot]) {
+		if (palette->slot_colour[slot] == colour)
+			return palette->slot_index[slot] - 1;
+
+		slot = (slot + 1) % ZRLE_PALETTE_HASH_SIZE;
+	}
 
 	return -1;
 }
 
-static int zrle_get_tile_palette(uint32_t* palette, const uint32_t* src,
-                                 size_t length)
+/* Returns -1 if the palette is full */
+static int zrle_palette_insert(struct zrle_palette* palette, uint32_t colour)
 {
-	int n = 0;
+	uint32_t slot = zrle_palette_hash(colour);
 
-	/* TODO: Maybe ignore the alpha channel */
-	palette[n++] = src[0];
+	while (palette->slot_index[slot]) {
+		if (palette->slot_colour[slot] == colour)
+			return 0;
+
+		slot = (slot + 1) % ZRLE_PALETTE_HASH_SIZE;
+	}
 
-	for (size_t i = 0; i < length; ++i) {
-		uint32_t colour = src[i];
+	if (palette->size >= ZRLE_MAX_PALETTE)
+		return -1;
+
+	palette->colours[palette->size++] = colour;
+	palette->slot_colour[slot] = colour;
+	palette->slot_index[slot] = palette->size;
+
+	return 0;
+}
+
+static inline size_t run_length_size(size_t run_length)
+{
+	return (run_length - 1) / 255 + 1;
+}
 
-		if (find_colour_in_palette(palette, n, colour) < 0) {
-			if (n >= 16)
-				return -1;
+static void zrle_account_run(struct zrle_tile_stats* stats, size_t run_length)
+{
+	stats->n_runs++;
+
+	if (run_length == 1)
+		stats->n_single_runs++;
+	else
+		stats->run_length_bytes += run_length_size(run_length);
+}
+
+/* Collects the run statistics and the palette in a single pass. The palette
+ * size is set to -1 if the tile has too many colours for a palette.
+ */
+static void zrle_analyze_tile(struct zrle_palette* palette,
+                              struct zrle_tile_stats* stats,
+                              const uint32_t* src, size_t length)
+{
+	memset(stats, 0, sizeof(*stats));
+	zrle_palette_clear(palette);
+
+	/* TODO: Maybe ignore the alpha channel */
+	uint32_t colour = src[0];
+	size_t run_length = 1;
 
-			palette[n++] = colour;
+	zrle_palette_insert(palette, colour);
+
+	for (size_t i = 1; i < length; ++i) {
+		if (src[i] == colour) {
+			run_length++;
+			continue;
 		}
+
+		zrle_account_run(stats, run_length);
+
+		colour = src[i];
+		run_length = 1;
+
+		if (palette->size >= 0 &&
+				zrle_palette_insert(palette, colour) < 0)
+			palette->size = -1;
 	}
 
-	return n;
+	zrle_account_run(stats, run_length);
 }
 
 static void zrle_encode_unichrome_tile(struct vec* dst,
@@ -98,72 +208,199 @@ static void encode_run_length(struct vec* dst, uint8_t index, int run_length)
 	vec_fast_append_8(dst, run_length - 1);
 }
 
-static void zrle_encode_packed_tile(struct vec* dst,
-                                    const struct rfb_pixel_format* dst_fmt,
-                                    const uint32_t* src,
-                                    const struct rfb_pixel_format* src_fmt,
-                                    size_t length, uint32_t* palette,
-                                    int palette_size)
+static void zrle_encode_palette(struct vec* dst,
+                                const struct rfb_pixel_format* dst_fmt,
+                                const struct rfb_pixel_format* src_fmt,
+                                const struct zrle_palette* palette,
+                                uint8_t subencoding)
 {
 	int bytes_per_cpixel = calc_bytes_per_cpixel(dst_fmt);
 
-	uint8_t cpalette[16 * 3];
-	pixel32_to_cpixel((uint8_t*)cpalette, dst_fmt, palette, src_fmt,
-	                  bytes_per_cpixel, palette_size);
+	vec_fast_append_8(dst, subencoding);
 
-	vec_fast_append_8(dst, 128 | palette_size);
+	pixel32_to_cpixel(((uint8_t*)dst->data) + dst->len, dst_fmt,
+	                  palette->colours, src_fmt, bytes_per_cpixel,
+	                  palette->size);
 
-	vec_append(dst, cpalette, palette_size * bytes_per_cpixel);
+	dst->len += palette->size * bytes_per_cpixel;
+}
 
-	int index;
+static void zrle_encode_packed_tile(struct vec* dst,
+                                    const struct rfb_pixel_format* dst_fmt,
+                                    const uint32_t* src,
+                                    const struct rfb_pixel_format* src_fmt,
+                                    size_t length,
+                                    const struct zrle_palette* palette)
+{
+	zrle_encode_palette(dst, dst_fmt, src_fmt, palette,
+	                    128 | palette->size);
+
+	uint32_t colour = src[0];
+	int index = zrle_palette_lookup(palette, colour);
 	int run_length = 1;
 
 	for (size_t i = 1; i < length; ++i) {
-		if (src[i] == src[i - 1]) {
+		if (src[i] == colour) {
 			run_length++;
 			continue;
 		}
 
-		index = find_colour_in_palette(palette, palette_size, src[i - 1]);
 		encode_run_length(dst, index, run_length);
+
+		colour = src[i];
+		index = zrle_palette_lookup(palette, colour);
 		run_length = 1;
 	}
 
-	if (run_length > 0) {
-		index = find_colour_in_palette(palette, palette_size,
-		                               src[length - 1]);
-		encode_run_length(dst, index, run_length);
+	encode_run_length(dst, index, run_length);
+}
+
+static inline int zrle_packed_palette_bits(int palette_size)
+{
+	return palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : 4;
+}
+
+static void zrle_encode_packed_palette_tile(struct vec* dst,
+		const struct rfb_pixel_format* dst_fmt, const uint32_t* src,
+		const struct rfb_pixel_format* src_fmt, int width, int height,
+		const struct zrle_palette* palette)
+{
+	zrle_encode_palette(dst, dst_fmt, src_fmt, palette, palette->size);
+
+	int bits = zrle_packed_palette_bits(palette->size);
+
+	uint32_t colour = src[0];
+	int index = zrle_palette_lookup(palette, colour);
+
+	/* Every row starts on a byte boundary */
+	for (int y = 0; y < height; ++y) {
+		uint8_t byte = 0;
+		int n_bits = 0;
+
+		for (int x = 0; x < width; ++x) {
+			if (*src != colour) {
+				colour = *src;
+				index = zrle_palette_lookup(palette, colour);
+			}
+			src++;
+
+			byte = (byte << bits) | index;
+			n_bits += bits;
+
+			if (n_bits == 8) {
+				vec_fast_append_8(dst, byte);
+				byte = 0;
+				n_bits = 0;
+			}
+		}
+
+		if (n_bits > 0)
+			vec_fast_append_8(dst, byte << (8 - n_bits));
 	}
 }
 
-static void zrle_copy_tile(uint32_t* dst, const uint32_t* src, int stride,
-                           int width, int height)
+static void zrle_encode_plain_rle_tile(struct vec* dst,
+                                       const struct rfb_pixel_format* dst_fmt,
+                                       const uint32_t* src,
+                                       const struct rfb_pixel_format* src_fmt,
+                                       size_t length)
 {
-	for (int y = 0; y < height; ++y)
-		memcpy(dst + y * width, src + y * stride, width * 4);
+	int bytes_per_cpixel = calc_bytes_per_cpixel(dst_fmt);
+
+	/* Converting the whole tile in one go is a lot cheaper than doing it
+	 * one run at a time.
+	 */
+	uint8_t cpixels[TILE_LENGTH * TILE_LENGTH * 4];
+	pixel32_to_cpixel(cpixels, dst_fmt, src, src_fmt, bytes_per_cpixel,
+	                  length);
+
+	vec_fast_append_8(dst, 128);
+
+	size_t start = 0;
+
+	for (size_t i = 1; i <= length; ++i) {
+		if (i < length && src[i] == src[start])
+			continue;
+
+		memcpy((uint8_t*)dst->data + dst->len,
+		       cpixels + start * bytes_per_cpixel, bytes_per_cpixel);
+		dst->len += bytes_per_cpixel;
+
+		size_t run_length = i - start;
+		while (run_length > 255) {
+			vec_fast_append_8(dst, 255);
+			run_length -= 255;
+		}
+
+		vec_fast_append_8(dst, run_length - 1);
+
+		start = i;
+	}
 }
 
+/* Picks whichever subencoding yields the smallest tile. The result is never
+ * larger than a raw tile, i.e. 1 + bytes_per_cpixel * width * height.
+ */
 static void zrle_encode_tile(struct vec* dst,
                              const struct rfb_pixel_format* dst_fmt,
                              const uint32_t* src,
                              const struct rfb_pixel_format* src_fmt,
-                             size_t length)
+                             int width, int height)
 {
-	int bytes_per_cpixel = calc_bytes_per_cpixel(dst_fmt);
+	size_t bytes_per_cpixel = calc_bytes_per_cpixel(dst_fmt);
+	size_t length = width * height;
 
 	vec_clear(dst);
 
-	uint32_t palette[16];
-	int palette_size = zrle_get_tile_palette(palette, src, length);
+	struct zrle_palette palette;
+	struct zrle_tile_stats stats;
+	zrle_analyze_tile(&palette, &stats, src, length);
+
+	if (palette.size == 1) {
+		zrle_encode_unichrome_tile(dst, dst_fmt, palette.colours[0],
+		                           src_fmt);
+		return;
+	}
+
+	size_t raw_size = 1 + bytes_per_cpixel * length;
+	size_t plain_rle_size = 1 + stats.n_runs * bytes_per_cpixel +
+		stats.n_single_runs + stats.run_length_bytes;
+
+	size_t best_size = MIN(raw_size, plain_rle_size);
 
-	if (palette_size == 1) {
-		zrle_encode_unichrome_tile(dst, dst_fmt, palette[0], src_fmt);
+	size_t palette_rle_size = SIZE_MAX;
+	size_t packed_palette_size = SIZE_MAX;
+
+	if (palette.size > 1) {
+		size_t palette_bytes = 1 + palette.size * bytes_per_cpixel;
+
+		palette_rle_size = palette_bytes + stats.n_runs +
+			stats.run_length_bytes;
+
+		if (palette.size <= ZRLE_MAX_PACKED_PALETTE) {
+			int bits = zrle_packed_palette_bits(palette.size);
+			packed_palette_size = palette_bytes +
+				height * UDIV_UP(width * bits, 8);
+		}
+
+		best_size = MIN(best_size,
+				MIN(palette_rle_size, packed_palette_size));
+	}
+
+	if (best_size == packed_palette_size) {
+		zrle_encode_packed_palette_tile(dst, dst_fmt, src, src_fmt,
+		                                width, height, &palette);
 		return;
 	}
 
-	if (palette_size > 1) {
+	if (best_size == palette_rle_size) {
 		zrle_encode_packed_tile(dst, dst_fmt, src, src_fmt, length,
-		                        palette, palette_size);
+		                        &palette);
+		return;
+	}
+
+	if (best_size == plain_rle_size) {
+		zrle_encode_plain_rle_tile(dst, dst_fmt, src, src_fmt, length);
 		return;
 	}
 
@@ -175,36 +412,17 @@ static void zrle_encode_tile(struct vec* dst,
 	dst->len += bytes_per_cpixel * length;
 }
 
-static int zrle_deflate(struct vec* dst, const struct vec* src, z_stream* zs,
-                        bool flush)
+static int zrle_deflate(struct vec* dst, const struct vec* src,
+                        struct deflate_stream* zs, bool flush)
 {
-	zs->next_in = src->data;
-	zs->avail_in = src->len;
-
-	do {
-		if (dst->len == dst->cap && vec_reserve(dst, dst->cap * 2) < 0)
-			return -1;
-
-		zs->next_out = ((Bytef*)dst->data) + dst->len;
-		zs->avail_out = dst->cap - dst->len;
-
-		int r = deflate(zs, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
-		if (r == Z_STREAM_ERROR)
-			return -1;
-
-		dst->len = zs->next_out - (Bytef*)dst->data;
-	} while (zs->avail_out == 0);
-
-	assert(zs->avail_in == 0);
-
-	return 0;
+	return deflate_stream_compress(zs, dst, src->data, src->len, flush);
 }
 
 static int zrle_encode_box(struct vec* out,
                            const struct rfb_pixel_format* dst_fmt,
                            const struct nvnc_fb* fb,
                            const struct rfb_pixel_format* src_fmt, int x, int y,
-                           int stride, int width, int height, z_stream* zs)
+                           int width, int height, struct deflate_stream* zs)
 {
 	int r = -1;
 	int bytes_per_cpixel = calc_bytes_per_cpixel(dst_fmt);
@@ -239,12 +457,11 @@ static int zrle_encode_box(struct vec* out,
 
 		int y_off = y + tile_y;
 
-		zrle_copy_tile(tile,
-		               ((uint32_t*)fb->addr) + x + tile_x + y_off * stride,
-		               stride, tile_width, tile_height);
+		nvnc_transform_read_rect(tile, tile_width, fb, x + tile_x,
+		                         y_off, tile_width, tile_height);
 
-		zrle_encode_tile(&in, dst_fmt, tile, src_fmt,
-		                 tile_width * tile_height);
+		zrle_encode_tile(&in, dst_fmt, tile, src_fmt, tile_width,
+		                 tile_height);
 
 		r = zrle_deflate(out, &in, zs, i == n_tiles - 1);
 		if (r < 0)
@@ -261,7 +478,7 @@ failure:
 #undef CHUNK
 }
 
-int zrle_encode_frame(z_stream* zs, struct vec* dst,
+int zrle_encode_frame(struct deflate_stream* zs, struct vec* dst,
                       const struct rfb_pixel_format* dst_fmt,
                       struct nvnc_fb* src,
                       const struct rfb_pixel_format* src_fmt,
@@ -269,31 +486,392 @@ int zrle_encode_frame(z_stream* zs, struct vec* dst,
 {
 	int rc = -1;
 
-	int n_rects = 0;
-	struct pixman_box16* box = pixman_region_rectangles(region, &n_rects);
-	if (n_rects > UINT16_MAX) {
-		box = pixman_region_extents(region);
-		n_rects = 1;
-	}
+	struct region_boxes boxes;
+	if (region_simplify(&boxes, region, &zrle_merge_cost) < 0)
+		return -1;
 
 	rc = nvnc_fb_map(src);
 	if (rc < 0)
-		return -1;
+		goto failure;
 
-	rc = encode_rect_count(dst, n_rects);
+	rc = encode_rect_count(dst, boxes.n_boxes);
 	if (rc < 0)
-		return -1;
+		goto failure;
 
-	for (int i = 0; i < n_rects; ++i) {
-		int x = box[i].x1;
-		int y = box[i].y1;
-		int box_width = box[i].x2 - x;
-		int box_height = box[i].y2 - y;
+	for (int i = 0; i < boxes.n_boxes; ++i) {
+		struct pixman_box16* box = &boxes.boxes[i];
+		int x = box->x1;
+		int y = box->y1;
+		int box_width = box->x2 - x;
+		int box_height = box->y2 - y;
 
 		rc = zrle_encode_box(dst, dst_fmt, src, src_fmt, x, y,
-		                     src->stride, box_width, box_height, zs);
+		                     box_width, box_height, zs);
 		if (rc < 0)
-			return -1;
+			goto failure;
+	}
+
+	region_boxes_finish(&boxes);
+	return 0;
+
+failure:
+	region_boxes_finish(&boxes);
+	return -1;
+}
+
+struct zrle_tile {
+	uint16_t x;
+	uint16_t y;
+	uint16_t width;
+	uint16_t height;
+
+	/* The rectangle that this tile belongs to. Its header is written out
+	 * along with the first tile and its size is filled in after the last
+	 * one.
+	 */
+	struct pixman_box16 box;
+	bool is_first;
+	bool is_last;
+
+	atomic_bool is_ready;
+	struct vec payload;
+};
+
+struct zrle_worker_ctx {
+	struct zrle_encoder* encoder;
+	uint32_t* pixels;
+};
+
+static void do_zrle_work(void*);
+static void on_zrle_work_done(void*);
+
+static void zrle_worker_ctx_free(void* userdata)
+{
+	struct zrle_worker_ctx* ctx = userdata;
+	free(ctx->pixels);
+	free(ctx);
+}
+
+static int zrle_init_worker(struct zrle_encoder* self, int index)
+{
+	struct zrle_worker_ctx* ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return -1;
+
+	ctx->encoder = self;
+
+	ctx->pixels = malloc(TILE_LENGTH * TILE_LENGTH * 4);
+	if (!ctx->pixels)
+		goto failure;
+
+	self->worker[index] = aml_work_new(do_zrle_work, on_zrle_work_done,
+			ctx, zrle_worker_ctx_free);
+	if (!self->worker[index])
+		goto failure;
+
+	return 0;
+
+failure:
+	free(ctx->pixels);
+	free(ctx);
+	return -1;
+}
+
+static int zrle_get_n_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return 1;
+
+	return MIN(n, ZRLE_MAX_WORKERS);
+}
+
+int zrle_encoder_init(struct zrle_encoder* self, struct buf_pool* frame_pool)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->zs_level = ZRLE_DEFAULT_COMPRESSION_LEVEL;
+	self->compression_level = ZRLE_DEFAULT_COMPRESSION_LEVEL;
+
+	self->zs = deflate_stream_new(ZRLE_DEFAULT_COMPRESSION_LEVEL);
+	if (!self->zs)
+		return -1;
+
+	int n_workers = zrle_get_n_workers();
+
+	for (self->n_workers = 0; self->n_workers < n_workers;
+			++self->n_workers)
+		if (zrle_init_worker(self, self->n_workers) < 0)
+			goto worker_failure;
+
+	aml_require_workers(nvnc__get_loop(), self->n_workers);
+
+	self->frame_pool = frame_pool;
+	buf_pool_ref(frame_pool);
+
+	return 0;
+
+worker_failure:
+	for (int i = self->n_workers - 1; i >= 0; --i)
+		aml_unref(self->worker[i]);
+	deflate_stream_destroy(self->zs);
+	return -1;
+}
+
+void zrle_encoder_destroy(struct zrle_encoder* self)
+{
+	for (int i = self->n_workers - 1; i >= 0; --i)
+		aml_unref(self->worker[i]);
+
+	for (uint32_t i = 0; i < self->tiles_cap; ++i)
+		vec_destroy(&self->tiles[i].payload);
+	free(self->tiles);
+
+	deflate_stream_destroy(self->zs);
+	buf_pool_unref(self->frame_pool);
+}
+
+void zrle_encoder_set_compression_level(struct zrle_encoder* self, int level)
+{
+	self->compression_level = level;
+}
+
+/* Each rectangle ends with a sync flush, so nothing is left over to be
+ * compressed with the old level.
+ */
+static void zrle_encoder_apply_compression_level(struct zrle_encoder* self)
+{
+	if (self->zs_level == self->compression_level)
+		return;
+
+	if (deflate_stream_set_level(self->zs, self->compression_level) < 0)
+		log_debug("Failed to change the zlib level\n");
+
+	self->zs_level = self->compression_level;
+}
+
+static int zrle_encoder_reserve_tiles(struct zrle_encoder* self, uint32_t n)
+{
+	if (n <= self->tiles_cap)
+		return 0;
+
+	struct zrle_tile* tiles = realloc(self->tiles, n * sizeof(*tiles));
+	if (!tiles)
+		return -1;
+
+	memset(tiles + self->tiles_cap, 0,
+			(n - self->tiles_cap) * sizeof(*tiles));
+
+	self->tiles = tiles;
+	self->tiles_cap = n;
+	return 0;
+}
+
+static int zrle_encoder_add_box(struct zrle_encoder* self,
+		const struct pixman_box16* box)
+{
+	int width = box->x2 - box->x1;
+	int height = box->y2 - box->y1;
+	int grid_width = UDIV_UP(width, TILE_LENGTH);
+	int n_tiles = grid_width * UDIV_UP(height, TILE_LENGTH);
+
+	if (zrle_encoder_reserve_tiles(self, self->n_tiles + n_tiles) < 0)
+		return -1;
+
+	for (int i = 0; i < n_tiles; ++i) {
+		struct zrle_tile* tile = &self->tiles[self->n_tiles++];
+
+		int tile_x = (i % grid_width) * TILE_LENGTH;
+		int tile_y = (i / grid_width) * TILE_LENGTH;
+
+		tile->x = box->x1 + tile_x;
+		tile->y = box->y1 + tile_y;
+		tile->width = MIN(width - tile_x, TILE_LENGTH);
+		tile->height = MIN(height - tile_y, TILE_LENGTH);
+		tile->box = *box;
+		tile->is_first = i == 0;
+		tile->is_last = i == n_tiles - 1;
+		atomic_init(&tile->is_ready, false);
+	}
+
+	return 0;
+}
+
+static void zrle_encoder_pack_tile(struct zrle_encoder* self,
+		struct zrle_tile* tile, uint32_t* pixels)
+{
+	const struct nvnc_fb* fb = self->fb;
+	int bytes_per_cpixel = calc_bytes_per_cpixel(&self->dfmt);
+	size_t length = tile->width * tile->height;
+
+	if (vec_reserve(&tile->payload, 1 + bytes_per_cpixel * length) < 0) {
+		vec_clear(&tile->payload);
+		atomic_store(&self->failed, true);
+		return;
+	}
+
+	nvnc_transform_read_rect(pixels, tile->width, fb, tile->x, tile->y,
+	                         tile->width, tile->height);
+
+	zrle_encode_tile(&tile->payload, &self->dfmt, pixels, &self->sfmt,
+	                 tile->width, tile->height);
+}
+
+static void zrle_encoder_deflate_tile(struct zrle_encoder* self,
+		struct zrle_tile* tile)
+{
+	if (atomic_load(&self->failed))
+		return;
+
+	if (tile->is_first) {
+		const struct pixman_box16* box = &tile->box;
+		encode_rect_head(&self->dst, RFB_ENCODING_ZRLE, box->x1,
+				box->y1, box->x2 - box->x1, box->y2 - box->y1);
+
+		/* Reserve space for size */
+		self->size_index = self->dst.len;
+		vec_append_zero(&self->dst, 4);
+	}
+
+	if (zrle_deflate(&self->dst, &tile->payload, self->zs,
+				tile->is_last) < 0) {
+		atomic_store(&self->failed, true);
+		return;
+	}
+
+	if (tile->is_last) {
+		uint32_t out_size = htonl(self->dst.len - self->size_index - 4);
+		memcpy(((uint8_t*)self->dst.data) + self->size_index, &out_size,
+				sizeof(out_size));
+	}
+}
+
+/* Feeds every consecutive ready tile into the zlib stream. Each worker counts
+ * its tile into drain_requests after marking it as ready. The one that finds
+ * the counter at zero becomes the drainer and keeps going until it has taken
+ * back every request that was made in the meantime. Because all of this goes
+ * through a single atomic counter, a tile can never be marked as ready without
+ * somebody looking at it afterwards.
+ */
+static void zrle_encoder_drain(struct zrle_encoder* self)
+{
+	if (atomic_fetch_add(&self->drain_requests, 1) != 0)
+		return;
+
+	uint32_t n_requests;
+	do {
+		n_requests = atomic_load(&self->drain_requests);
+
+		uint32_t next = self->next_deflate;
+		while (next < self->n_tiles && atomic_load_explicit(
+					&self->tiles[next].is_ready,
+					memory_order_acquire))
+			zrle_encoder_deflate_tile(self, &self->tiles[next++]);
+		self->next_deflate = next;
+	} while (atomic_fetch_sub(&self->drain_requests, n_requests) !=
+			n_requests);
+}
+
+static void do_zrle_work(void* obj)
+{
+	struct zrle_worker_ctx* ctx = aml_get_userdata(obj);
+	struct zrle_encoder* self = ctx->encoder;
+
+	for (;;) {
+		uint32_t i = atomic_fetch_add(&self->tile_queue_head, 1);
+		if (i >= self->n_tiles)
+			break;
+
+		struct zrle_tile* tile = &self->tiles[i];
+		zrle_encoder_pack_tile(self, tile, ctx->pixels);
+		atomic_store_explicit(&tile->is_ready, true,
+				memory_order_release);
+
+		zrle_encoder_drain(self);
+	}
+}
+
+static void on_zrle_work_done(void* obj)
+{
+	struct zrle_worker_ctx* ctx = aml_get_userdata(obj);
+	struct zrle_encoder* self = ctx->encoder;
+
+	if (--self->n_jobs != 0)
+		return;
+
+	bool failed = atomic_load(&self->failed);
+	assert(failed || self->next_deflate == self->n_tiles);
+
+	nvnc_fb_unref(self->fb);
+
+	if (failed) {
+		vec_destroy(&self->dst);
+		self->on_frame_done(NULL, self->userdata);
+		return;
+	}
+
+	self->on_frame_done(&self->dst, self->userdata);
+}
+
+int zrle_encoder_encode_frame(struct zrle_encoder* self,
+		const struct rfb_pixel_format* dst_fmt,
+		struct nvnc_fb* src,
+		const struct rfb_pixel_format* src_fmt,
+		struct pixman_region16* region,
+		zrle_done_fn on_done, void* userdata)
+{
+	memcpy(&self->dfmt, dst_fmt, sizeof(self->dfmt));
+	memcpy(&self->sfmt, src_fmt, sizeof(self->sfmt));
+	self->fb = src;
+	self->on_frame_done = on_done;
+	self->userdata = userdata;
+
+	zrle_encoder_apply_compression_level(self);
+
+	self->n_tiles = 0;
+	self->next_deflate = 0;
+	atomic_store(&self->drain_requests, 0);
+	atomic_store(&self->failed, false);
+	atomic_store(&self->tile_queue_head, 0);
+
+	struct region_boxes boxes;
+	if (region_simplify(&boxes, region, &zrle_merge_cost) < 0)
+		return -1;
+
+	int n_rects = boxes.n_boxes;
+	int rc = n_rects > 0 ? 0 : -1;
+
+	for (int i = 0; i < n_rects && rc == 0; ++i)
+		rc = zrle_encoder_add_box(self, &boxes.boxes[i]);
+
+	region_boxes_finish(&boxes);
+	if (rc < 0)
+		return -1;
+
+	if (nvnc_fb_map(src) < 0)
+		return -1;
+
+	if (buf_pool_acquire(self->frame_pool, &self->dst, 0) < 0)
+		return -1;
+
+	encode_rect_count(&self->dst, n_rects);
+
+	nvnc_fb_ref(self->fb);
+
+	/* There's no point in waking up more workers than there are tiles */
+	uint32_t n_jobs = MIN((uint32_t)self->n_workers, self->n_tiles);
+
+	for (uint32_t i = 0; i < n_jobs; ++i) {
+		if (aml_start(nvnc__get_loop(), self->worker[i]) < 0)
+			break;
+
+		++self->n_jobs;
+	}
+
+	if (self->n_jobs == 0) {
+		nvnc_fb_unref(self->fb);
+		vec_destroy(&self->dst);
+		return -1;
 	}
 
 	return 0;